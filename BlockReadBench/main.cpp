@@ -0,0 +1,291 @@
+/* BlockReadBench/main.cpp
+ * testbed measuring read throughput through BlockReader with many threads reading at once
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Windows.h>
+#include "../WinBtrfsLib/block_reader.h"
+
+using namespace WinBtrfsLib;
+
+/* the thread counts tried, in order; a device that scales keeps going up with them */
+const int THREAD_COUNTS[] = { 1, 2, 4, 8, 16, 32 };
+const int NUM_THREAD_COUNTS = sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]);
+const int MAX_THREADS = 32;
+
+/* how many reads each thread keeps in flight in the beginRead runs, the way prefetchNodes does */
+const unsigned int QUEUE_DEPTH = 8;
+
+/* blocks compared against a plain ReadFile before anything is timed */
+const int VERIFY_READS = 256;
+
+struct Run
+{
+	bool				queued;		// beginRead/finishRead QUEUE_DEPTH deep rather than directRead
+	unsigned int		seed;
+	unsigned __int64	reads;
+	unsigned __int64	failures;
+	double				seconds;
+};
+
+BlockReader *reader;
+unsigned __int64 imageSize;
+DWORD readLen;
+double runSeconds;
+LARGE_INTEGER freq;
+
+double secondsSince(const LARGE_INTEGER *start)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return (double)(now.QuadPart - start->QuadPart) / (double)freq.QuadPart;
+}
+
+/* a random offset, aligned to readLen, with a whole read's worth of image after it */
+unsigned __int64 randomAddr(unsigned int *seed)
+{
+	unsigned __int64 blocks = imageSize / readLen, r;
+
+	*seed = *seed * 1103515245 + 12345;
+	r = *seed >> 8;
+	*seed = *seed * 1103515245 + 12345;
+	r = (r << 24) | (*seed >> 8);
+
+	return (r % blocks) * readLen;
+}
+
+/* reads random blocks until the time is up */
+DWORD WINAPI readThread(LPVOID param)
+{
+	Run *run = (Run *)param;
+	unsigned char *buffers = (unsigned char *)malloc(QUEUE_DEPTH * readLen);
+	PendingRead pending[QUEUE_DEPTH];
+	LARGE_INTEGER start;
+
+	run->reads = run->failures = 0;
+	QueryPerformanceCounter(&start);
+
+	do
+	{
+		if (run->queued)
+		{
+			unsigned int started = 0;
+
+			for (unsigned int i = 0; i < QUEUE_DEPTH; i++)
+			{
+				unsigned __int64 addr = randomAddr(&run->seed);
+
+				if (reader->beginRead(addr, readLen, buffers + i * readLen, i, &pending[started]) == 0)
+					started++;
+				else
+					run->failures++;
+			}
+
+			for (unsigned int i = 0; i < started; i++)
+			{
+				if (reader->finishRead(&pending[i]) != 0)
+					run->failures++;
+			}
+
+			run->reads += QUEUE_DEPTH;
+		}
+		else
+		{
+			if (reader->directRead(randomAddr(&run->seed), readLen, buffers) != 0)
+				run->failures++;
+
+			run->reads++;
+		}
+
+		run->seconds = secondsSince(&start);
+	}
+	while (run->seconds < runSeconds);
+
+	free(buffers);
+
+	return 0;
+}
+
+/* returns false if any read failed */
+bool measure(int numThreads, bool queued)
+{
+	HANDLE threads[MAX_THREADS];
+	Run runs[MAX_THREADS];
+	unsigned __int64 reads = 0, failures = 0;
+	double seconds = 0.0, rate = 0.0;
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		runs[i].queued = queued;
+		runs[i].seed = 0x2468ace0 + i * 7919;
+		threads[i] = CreateThread(NULL, 0, &readThread, &runs[i], 0, NULL);
+	}
+
+	WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		CloseHandle(threads[i]);
+		reads += runs[i].reads;
+		failures += runs[i].failures;
+		seconds += runs[i].seconds;
+		rate += (double)runs[i].reads * readLen / runs[i].seconds;
+	}
+
+	/* the time per read is each thread's time over its reads, so with reads queued it's less than a read takes */
+	printf("%-12s %2d thread%s %9.1f MB/s %9.1f MB/s per thread %9.1f us per read",
+		(queued ? "beginRead" : "directRead"), numThreads, (numThreads == 1 ? " " : "s"), rate / 1000000.0,
+		rate / numThreads / 1000000.0, seconds * 1000000.0 / (double)reads);
+
+	if (failures != 0)
+		printf(" (%I64u of %I64u reads failed)", failures, reads);
+
+	printf("\n");
+
+	return (failures == 0);
+}
+
+/* the same blocks read through BlockReader and through a plain handle have to match, or the offsets are wrong */
+bool verify(const wchar_t *path)
+{
+	HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	unsigned char *mine = (unsigned char *)malloc(readLen), *theirs = (unsigned char *)malloc(readLen);
+	unsigned int seed = 0x13579bdf;
+	int bad = 0;
+
+	for (int i = 0; i < VERIFY_READS; i++)
+	{
+		unsigned __int64 addr = randomAddr(&seed);
+		LARGE_INTEGER offset;
+		PendingRead pending;
+		DWORD bytesRead;
+
+		offset.QuadPart = addr;
+
+		if (SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN) == 0 ||
+			ReadFile(hFile, theirs, readLen, &bytesRead, NULL) == 0 || bytesRead != readLen)
+		{
+			printf("verify: ReadFile at %I64u failed (%u)\n", addr, GetLastError());
+			bad++;
+			continue;
+		}
+
+		/* alternate between the two ways in, so both are checked */
+		memset(mine, 0xcc, readLen);
+
+		if (i % 2 == 0)
+		{
+			if (reader->directRead(addr, readLen, mine) != 0)
+				bad++;
+		}
+		else if (reader->beginRead(addr, readLen, mine, 0, &pending) != 0 || reader->finishRead(&pending) != 0)
+			bad++;
+
+		if (memcmp(mine, theirs, readLen) != 0)
+		{
+			printf("verify: %s at %I64u returned the wrong data\n", (i % 2 == 0 ? "directRead" : "beginRead"), addr);
+			bad++;
+		}
+	}
+
+	free(mine);
+	free(theirs);
+	CloseHandle(hFile);
+
+	return (bad == 0);
+}
+
+/* the image can be anything, though an unmounted btrfs image or raw partition is the realistic case. reads go
+	through the system cache, as the driver's do, so an image smaller than memory is measured from the cache
+	after its first run; use one bigger than memory, or a raw device, to measure the disk */
+int wmain(int argc, wchar_t **argv)
+{
+	HANDLE hFile;
+	LARGE_INTEGER size;
+	SYSTEM_INFO sysInfo;
+	bool ok;
+
+	if (argc < 2)
+	{
+		printf("usage: BlockReadBench <image or device> [read size in KiB, default 16] [seconds per run, default 5]\n");
+		return 1;
+	}
+
+	readLen = (argc >= 3 ? _wtoi(argv[2]) : 16) * 1024;
+	runSeconds = (argc >= 4 ? _wtoi(argv[3]) : 5);
+
+	hFile = CreateFile(argv[1], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		printf("can't open %S (%u)\n", argv[1], GetLastError());
+		return 1;
+	}
+
+	/* raw devices don't have a file size, so those go by the partition length instead */
+	if (GetFileSizeEx(hFile, &size) == 0)
+	{
+		GET_LENGTH_INFORMATION lengthInfo;
+		DWORD bytesReturned;
+
+		if (DeviceIoControl(hFile, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof(lengthInfo),
+			&bytesReturned, NULL) == 0)
+		{
+			printf("can't get the size of %S (%u)\n", argv[1], GetLastError());
+			CloseHandle(hFile);
+			return 1;
+		}
+
+		size = lengthInfo.Length;
+	}
+
+	CloseHandle(hFile);
+
+	imageSize = size.QuadPart;
+
+	if (readLen == 0 || imageSize < readLen * QUEUE_DEPTH)
+	{
+		printf("%S is too small for %u byte reads\n", argv[1], readLen);
+		return 1;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	GetSystemInfo(&sysInfo);
+
+	reader = new BlockReader(argv[1]);
+
+	printf("%S: %I64u bytes, %u byte reads at random, %u processors\n\n", argv[1], imageSize, readLen,
+		sysInfo.dwNumberOfProcessors);
+
+	if (!verify(argv[1]))
+	{
+		delete reader;
+		return 1;
+	}
+
+	ok = true;
+
+	for (int i = 0; i < NUM_THREAD_COUNTS; i++)
+		ok = measure(THREAD_COUNTS[i], false) && ok;
+
+	printf("\n");
+
+	for (int i = 0; i < NUM_THREAD_COUNTS; i++)
+		ok = measure(THREAD_COUNTS[i], true) && ok;
+
+	delete reader;
+
+	return (ok ? 0 : 1);
+}
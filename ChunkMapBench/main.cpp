@@ -0,0 +1,422 @@
+/* ChunkMapBench/main.cpp
+ * testbed measuring logical address lookups on volumes with many chunks
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <Windows.h>
+#include "../WinBtrfsLib/chunk_map.h"
+
+using namespace WinBtrfsLib;
+
+/* a 16K chunk tree leaf holds about this many single-stripe chunk items */
+const unsigned int LEAF_CHUNKS = 120;
+
+/* lookups go to addresses picked ahead of time, so picking them isn't timed */
+const unsigned int NUM_ADDRS = 1 << 20;
+
+/* each measurement runs for about this long */
+const double BENCH_SECONDS = 2.0;
+
+/* the multithreaded runs use one thread per processor, up to this many */
+const int MAX_THREADS = 8;
+
+enum MapKind
+{
+	MAP_VECTOR,		// user-004: one sorted vector, built at mount and never changed, so no lock
+	MAP_LOCKED,		// user-023 as first written: the same vector, grown by leaves under a critical section
+	MAP_CHUNKMAP	// ChunkMap: immutable per-leaf segments behind a pointer swap
+};
+
+const char *const mapNames[] = { "sorted vector, no lock", "sorted vector, locked", "ChunkMap" };
+
+struct Run
+{
+	MapKind				kind;
+	unsigned int		first;		// where in addrs this thread starts
+	unsigned __int64	lookups;
+	unsigned __int64	misses;
+	double				seconds;
+};
+
+std::vector<ChunkMapping> chunks;		// every chunk, sorted
+std::vector<ChunkMapping> vectorMap;	// MAP_VECTOR and MAP_LOCKED
+CRITICAL_SECTION vectorLock;
+ChunkMap *chunkMap;
+LogiAddr *addrs;
+LARGE_INTEGER freq;
+volatile LONG loading = 0;
+
+bool chunkMappingLess(const ChunkMapping &a, const ChunkMapping &b)
+{
+	return a.logiStart < b.logiStart;
+}
+
+double secondsSince(const LARGE_INTEGER *start)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return (double)(now.QuadPart - start->QuadPart) / (double)freq.QuadPart;
+}
+
+/* mostly 1 GiB data chunks with a 256 MiB metadata chunk every so often and the odd hole where one was
+	removed, the way a big volume ends up after a few balances */
+void makeChunks(unsigned int numChunks)
+{
+	unsigned int state = 0x12345678;
+	LogiAddr addr = 0x1400000;
+
+	for (unsigned int i = 0; i < numChunks; i++)
+	{
+		ChunkMapping mapping;
+
+		state = state * 1103515245 + 12345;
+
+		if ((state >> 24) < 8)
+			addr += 1 << 30;
+
+		mapping.logiStart = addr;
+		mapping.size = ((state >> 16) % 8 == 0 ? 256 << 20 : 1 << 30);
+		mapping.chunkItem = (const BtrfsChunkItem *)(size_t)(i + 1);
+
+		chunks.push_back(mapping);
+		addr += mapping.size;
+	}
+
+	/* the lookups are spread over every chunk, at random offsets within them */
+	addrs = (LogiAddr *)malloc(NUM_ADDRS * sizeof(LogiAddr));
+
+	for (unsigned int i = 0; i < NUM_ADDRS; i++)
+	{
+		const ChunkMapping *chunk;
+
+		state = state * 1103515245 + 12345;
+		chunk = &chunks[(state >> 8) % numChunks];
+		state = state * 1103515245 + 12345;
+		addrs[i] = chunk->logiStart + ((LogiAddr)state << 4) % chunk->size;
+	}
+}
+
+/* the leaves in the order a mount would come across them, which is no order at all */
+std::vector<unsigned int> shuffledLeaves()
+{
+	std::vector<unsigned int> leaves;
+	unsigned int state = 0x9abcdef0;
+
+	for (unsigned int first = 0; first < chunks.size(); first += LEAF_CHUNKS)
+		leaves.push_back(first);
+
+	for (size_t i = leaves.size() - 1; i > 0; i--)
+	{
+		state = state * 1103515245 + 12345;
+		std::swap(leaves[i], leaves[(state >> 8) % (i + 1)]);
+	}
+
+	return leaves;
+}
+
+/* what loadChunkMappings did in user-023 as first written: an insert per chunk, under the lock */
+void addLeafLocked(unsigned int first)
+{
+	EnterCriticalSection(&vectorLock);
+
+	for (unsigned int i = first; i < first + LEAF_CHUNKS && i < chunks.size(); i++)
+	{
+		std::vector<ChunkMapping>::iterator pos = std::upper_bound(vectorMap.begin(), vectorMap.end(), chunks[i],
+			&chunkMappingLess);
+
+		vectorMap.insert(pos, chunks[i]);
+	}
+
+	LeaveCriticalSection(&vectorLock);
+}
+
+void addLeafChunkMap(unsigned int first)
+{
+	unsigned int count = (first + LEAF_CHUNKS < chunks.size() ? LEAF_CHUNKS : (unsigned int)chunks.size() - first);
+
+	chunkMap->addSegment(&chunks[first], count);
+}
+
+/* returns false if the address isn't mapped */
+bool lookup(MapKind kind, LogiAddr logiAddr, ChunkMapping *mapping)
+{
+	switch (kind)
+	{
+	case MAP_VECTOR:
+	case MAP_LOCKED:
+	{
+		ChunkMapping key;
+		bool found;
+
+		key.logiStart = logiAddr;
+
+		if (kind == MAP_LOCKED)
+			EnterCriticalSection(&vectorLock);
+
+		std::vector<ChunkMapping>::iterator it = std::upper_bound(vectorMap.begin(), vectorMap.end(), key,
+			&chunkMappingLess);
+
+		found = (it != vectorMap.begin() && logiAddr < (it - 1)->logiStart + (it - 1)->size);
+
+		if (found)
+			*mapping = *(it - 1);
+
+		if (kind == MAP_LOCKED)
+			LeaveCriticalSection(&vectorLock);
+
+		return found;
+	}
+	case MAP_CHUNKMAP:
+	{
+		const ChunkMapping *found = chunkMap->find(logiAddr);
+
+		if (found == NULL)
+			return false;
+
+		*mapping = *found;
+		return true;
+	}
+	}
+
+	return false;
+}
+
+/* returns the number of addresses that came back wrong */
+unsigned int verify(MapKind kind)
+{
+	unsigned int failures = 0;
+
+	for (unsigned int i = 0; i < NUM_ADDRS; i++)
+	{
+		ChunkMapping mapping, key;
+
+		key.logiStart = addrs[i];
+		const ChunkMapping *want = std::upper_bound(&chunks[0], &chunks[0] + chunks.size(), key,
+			&chunkMappingLess) - 1;
+
+		if (!lookup(kind, addrs[i], &mapping) || mapping.chunkItem != want->chunkItem)
+			failures++;
+	}
+
+	/* and the holes have to miss */
+	for (size_t i = 1; i < chunks.size(); i++)
+	{
+		ChunkMapping mapping;
+
+		if (chunks[i - 1].logiStart + chunks[i - 1].size < chunks[i].logiStart &&
+			lookup(kind, chunks[i - 1].logiStart + chunks[i - 1].size, &mapping))
+			failures++;
+	}
+
+	return failures;
+}
+
+/* looks addresses up until the time is up, or until the loader is done if one is running */
+DWORD WINAPI lookupThread(LPVOID param)
+{
+	Run *run = (Run *)param;
+	LARGE_INTEGER start;
+	unsigned int i = run->first;
+
+	run->lookups = run->misses = 0;
+	QueryPerformanceCounter(&start);
+
+	do
+	{
+		/* check the clock only every so often, so it doesn't cost more than what it's timing */
+		for (int j = 0; j < 1024; j++)
+		{
+			ChunkMapping mapping;
+
+			if (!lookup(run->kind, addrs[i], &mapping))
+				run->misses++;
+
+			i = (i + 1) % NUM_ADDRS;
+		}
+
+		run->lookups += 1024;
+		run->seconds = secondsSince(&start);
+	}
+	while (loading ? true : run->seconds < BENCH_SECONDS);
+
+	return 0;
+}
+
+/* runs lookups on numThreads threads at once; prints the time per lookup on each and the total rate */
+void measure(MapKind kind, int numThreads, const char *note)
+{
+	HANDLE threads[MAX_THREADS];
+	Run runs[MAX_THREADS];
+	unsigned __int64 lookups = 0, misses = 0;
+	double seconds = 0.0, rate = 0.0;
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		runs[i].kind = kind;
+		runs[i].first = i * (NUM_ADDRS / MAX_THREADS);
+		threads[i] = CreateThread(NULL, 0, &lookupThread, &runs[i], 0, NULL);
+	}
+
+	WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		CloseHandle(threads[i]);
+		lookups += runs[i].lookups;
+		misses += runs[i].misses;
+		seconds += runs[i].seconds;
+		rate += (double)runs[i].lookups / runs[i].seconds;
+	}
+
+	printf("%-24s %-14s %d thread%s %8.1f ns/lookup %8.1f M/s", mapNames[kind], note, numThreads,
+		(numThreads == 1 ? " " : "s"), seconds * 1000000000.0 / (double)lookups, rate / 1000000.0);
+
+	if (misses != 0)
+		printf(" (%I64u misses)", misses);
+
+	printf("\n");
+}
+
+/* loads the second half of the leaves on this thread while lookups run on the others */
+void measureWhileLoading(MapKind kind, int numThreads, const std::vector<unsigned int> &leaves)
+{
+	HANDLE threads[MAX_THREADS];
+	Run runs[MAX_THREADS];
+	LARGE_INTEGER start;
+	unsigned __int64 lookups = 0;
+	double seconds = 0.0, loadSeconds;
+
+	loading = 1;
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		runs[i].kind = kind;
+		runs[i].first = i * (NUM_ADDRS / MAX_THREADS);
+		threads[i] = CreateThread(NULL, 0, &lookupThread, &runs[i], 0, NULL);
+	}
+
+	QueryPerformanceCounter(&start);
+
+	for (size_t i = leaves.size() / 2; i < leaves.size(); i++)
+	{
+		if (kind == MAP_LOCKED)
+			addLeafLocked(leaves[i]);
+		else
+			addLeafChunkMap(leaves[i]);
+	}
+
+	loadSeconds = secondsSince(&start);
+	loading = 0;
+
+	WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		CloseHandle(threads[i]);
+		lookups += runs[i].lookups;
+		seconds += runs[i].seconds;
+	}
+
+	printf("%-24s %-14s %d thread%s %8.1f ns/lookup, %u leaves loaded in %.1f ms\n", mapNames[kind], "while loading",
+		numThreads, (numThreads == 1 ? " " : "s"), seconds * 1000000000.0 / (double)lookups,
+		(unsigned int)(leaves.size() - leaves.size() / 2), loadSeconds * 1000.0);
+}
+
+/* the number of chunks can be given; the default is what a volume of about 50 TB ends up with */
+int main(int argc, char **argv)
+{
+	unsigned int numChunks = (argc > 1 ? (unsigned int)atoi(argv[1]) : 50000);
+	std::vector<unsigned int> leaves;
+	SYSTEM_INFO sysInfo;
+	LARGE_INTEGER start;
+	ChunkMapStats stats;
+	unsigned int failures = 0;
+	int numThreads;
+
+	if (numChunks < LEAF_CHUNKS * 2)
+	{
+		printf("need at least %u chunks\n", LEAF_CHUNKS * 2);
+		return 1;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	GetSystemInfo(&sysInfo);
+	InitializeCriticalSection(&vectorLock);
+
+	numThreads = ((int)sysInfo.dwNumberOfProcessors < MAX_THREADS ? (int)sysInfo.dwNumberOfProcessors : MAX_THREADS);
+
+	makeChunks(numChunks);
+	leaves = shuffledLeaves();
+
+	printf("%u chunks in %u leaves of %u, %u addresses\n\n", numChunks, (unsigned int)leaves.size(), LEAF_CHUNKS,
+		NUM_ADDRS);
+
+	/* building each map the way a mount would, a leaf at a time as addresses in them come up */
+	QueryPerformanceCounter(&start);
+	for (size_t i = 0; i < leaves.size(); i++)
+		addLeafLocked(leaves[i]);
+	printf("%-24s built in %8.1f ms\n", mapNames[MAP_LOCKED], secondsSince(&start) * 1000.0);
+
+	chunkMap = new ChunkMap;
+	QueryPerformanceCounter(&start);
+	for (size_t i = 0; i < leaves.size(); i++)
+		addLeafChunkMap(leaves[i]);
+	printf("%-24s built in %8.1f ms\n\n", mapNames[MAP_CHUNKMAP], secondsSince(&start) * 1000.0);
+
+	for (int kind = MAP_VECTOR; kind <= MAP_CHUNKMAP; kind++)
+	{
+		unsigned int kindFailures = verify((MapKind)kind);
+
+		if (kindFailures != 0)
+			printf("%s: %u lookups came back wrong!\n", mapNames[kind], kindFailures);
+
+		failures += kindFailures;
+	}
+
+	if (failures != 0)
+		return 1;
+
+	for (int kind = MAP_VECTOR; kind <= MAP_CHUNKMAP; kind++)
+	{
+		measure((MapKind)kind, 1, "full map");
+		if (numThreads > 1)
+			measure((MapKind)kind, numThreads, "full map");
+	}
+
+	/* again from half full, with one thread loading the rest while the others look up addresses, about half of
+		which miss until their leaves come in */
+	printf("\n");
+
+	vectorMap.clear();
+	for (size_t i = 0; i < leaves.size() / 2; i++)
+		addLeafLocked(leaves[i]);
+	measureWhileLoading(MAP_LOCKED, numThreads, leaves);
+
+	delete chunkMap;
+	chunkMap = new ChunkMap;
+	for (size_t i = 0; i < leaves.size() / 2; i++)
+		addLeafChunkMap(leaves[i]);
+	measureWhileLoading(MAP_CHUNKMAP, numThreads, leaves);
+
+	chunkMap->getStats(&stats);
+	printf("\nChunkMap: %I64u chunks, %I64u segments, %I64u index versions kept\n", stats.chunks, stats.segments,
+		stats.snapshots);
+
+	delete chunkMap;
+	free(addrs);
+
+	return 0;
+}
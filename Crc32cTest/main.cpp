@@ -0,0 +1,211 @@
+/* Crc32cTest/main.cpp
+ * testbed checking every crc32c implementation against a bitwise reference
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Windows.h>
+#include "../WinBtrfsLib/crc32c.h"
+
+/* past three long interleaved blocks (3 * 4096), so every lane split and tail gets hit */
+const unsigned int MAX_LENGTH = 13000;
+const unsigned int ALIGNMENTS = 8;
+
+const unsigned int sectorSizes[] = { 512, 1024, 2048, 4096, 8192, 16384, 65536 };
+const unsigned int sectorCounts[] = { 1, 2, 3, 4, 5, 7, 8, 33 };
+
+/* the benchmarks checksum this much, as one buffer and as 4 KiB sectors, per path */
+const unsigned int BENCH_SIZE = 64 * 1024;
+const unsigned int BENCH_SECTOR = 4096;
+const unsigned int BENCH_PASSES = 16384;
+
+struct Path
+{
+	Crc32cPath		path;
+	const char		*name;
+};
+
+const Path paths[] =
+{
+	{ CRC32C_BYTEWISE,		"bytewise" },
+	{ CRC32C_SLICE8,		"slice-by-8" },
+	{ CRC32C_SSE42,			"sse4.2" },
+	{ CRC32C_SSE42_3WAY,	"sse4.2 3-way" },
+	{ CRC32C_AUTO,			"auto" }
+};
+
+unsigned char *buffer;
+unsigned int *expected, *sums;
+
+/* one bit at a time, straight from the polynomial; slow, but too simple to be wrong */
+unsigned int crc32cReference(unsigned int crc, const unsigned char *data, unsigned int length)
+{
+	while (length--)
+	{
+		crc ^= *data++;
+
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+	}
+
+	return crc;
+}
+
+/* the same bytes every run, so a failure can be reproduced */
+void fillBuffer(unsigned char *data, size_t length)
+{
+	unsigned int state = 0x12345678;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		state = state * 1103515245 + 12345;
+		data[i] = (unsigned char)(state >> 16);
+	}
+}
+
+/* returns the number of mismatches, printing the first few */
+unsigned int checkPath(const Path *path)
+{
+	unsigned int failures = 0;
+
+	for (unsigned int align = 0; align < ALIGNMENTS; align++)
+	{
+		const unsigned char *data = buffer + align;
+		unsigned int ref = ~0U;
+
+		/* expected[n] is the crc of the first n bytes, built up incrementally */
+		expected[0] = ref;
+		for (unsigned int n = 0; n < MAX_LENGTH; n++)
+			expected[n + 1] = ref = crc32cReference(ref, data + n, 1);
+
+		for (unsigned int n = 0; n <= MAX_LENGTH; n++)
+		{
+			unsigned int whole = crc32c(~0U, data, n);
+
+			/* chaining has to give the same answer as one call, wherever the split lands */
+			unsigned int split = n / 3 + align;
+			unsigned int chained = crc32c(crc32c(~0U, data, split <= n ? split : n),
+				data + (split <= n ? split : n), n - (split <= n ? split : n));
+
+			if ((whole != expected[n] || chained != expected[n]) && failures++ < 10)
+				printf("%s: length %u at alignment %u: got 0x%08x/0x%08x, expected 0x%08x\n",
+					path->name, n, align, whole, chained, expected[n]);
+		}
+
+		for (int i = 0; i < sizeof(sectorSizes) / sizeof(sectorSizes[0]); i++)
+		{
+			for (int j = 0; j < sizeof(sectorCounts) / sizeof(sectorCounts[0]); j++)
+			{
+				unsigned int size = sectorSizes[i], count = sectorCounts[j];
+
+				if ((unsigned __int64)size * count > MAX_LENGTH * 64)
+					continue;
+
+				crc32cSectors(data, size, count, sums);
+
+				for (unsigned int k = 0; k < count; k++)
+				{
+					unsigned int want = ~crc32cReference(~0U, data + k * size, size);
+
+					if (sums[k] != want && failures++ < 10)
+						printf("%s: sector %u of %u x %u at alignment %u: got 0x%08x, expected 0x%08x\n",
+							path->name, k, count, size, align, sums[k], want);
+				}
+			}
+		}
+	}
+
+	return failures;
+}
+
+double secondsSince(const LARGE_INTEGER *start, const LARGE_INTEGER *freq)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return (double)(now.QuadPart - start->QuadPart) / (double)freq->QuadPart;
+}
+
+void benchPath(const Path *path, const LARGE_INTEGER *freq)
+{
+	LARGE_INTEGER start;
+	unsigned int passes = (path->path == CRC32C_BYTEWISE ? BENCH_PASSES / 8 : BENCH_PASSES);
+	double megabytes = (double)BENCH_SIZE * passes / (1024.0 * 1024.0);
+	volatile unsigned int sink = 0;
+	double buf, sec;
+
+	QueryPerformanceCounter(&start);
+	for (unsigned int i = 0; i < passes; i++)
+		sink ^= crc32c(~0U, buffer, BENCH_SIZE);
+	buf = megabytes / secondsSince(&start, freq);
+
+	QueryPerformanceCounter(&start);
+	for (unsigned int i = 0; i < passes; i++)
+	{
+		crc32cSectors(buffer, BENCH_SECTOR, BENCH_SIZE / BENCH_SECTOR, sums);
+		sink ^= sums[0];
+	}
+	sec = megabytes / secondsSince(&start, freq);
+
+	printf("%-16s %10.1f MB/s %10.1f MB/s\n", path->name, buf, sec);
+}
+
+int main(int argc, char **argv)
+{
+	LARGE_INTEGER freq;
+	bool bench = (argc < 2 || strcmp(argv[1], "--check") != 0);
+	unsigned int failures = 0;
+
+	/* big enough for the longest run of sectors above at any alignment */
+	buffer = (unsigned char *)malloc(MAX_LENGTH * 64 + ALIGNMENTS);
+	expected = (unsigned int *)malloc((MAX_LENGTH + 1) * sizeof(unsigned int));
+	sums = (unsigned int *)malloc(MAX_LENGTH * sizeof(unsigned int));
+
+	fillBuffer(buffer, MAX_LENGTH * 64 + ALIGNMENTS);
+	QueryPerformanceFrequency(&freq);
+
+	for (int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+	{
+		unsigned int pathFailures;
+
+		if (!crc32cUsePath(paths[i].path))
+		{
+			printf("%s: not supported on this CPU; skipped\n", paths[i].name);
+			continue;
+		}
+
+		pathFailures = checkPath(&paths[i]);
+		printf("%s: %s\n", paths[i].name, (pathFailures == 0 ? "OK" : "FAILED"));
+
+		failures += pathFailures;
+	}
+
+	if (bench)
+	{
+		printf("\n%-16s %15s %15s\n", "path", "64 KiB buffer", "4 KiB sectors");
+
+		for (int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+		{
+			if (crc32cUsePath(paths[i].path))
+				benchPath(&paths[i], &freq);
+		}
+	}
+
+	crc32cUsePath(CRC32C_AUTO);
+
+	free(buffer);
+	free(expected);
+	free(sums);
+
+	return (failures == 0 ? 0 : 1);
+}
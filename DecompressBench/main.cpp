@@ -0,0 +1,327 @@
+/* DecompressBench/main.cpp
+ * testbed measuring how fast compressed extents decode
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Windows.h>
+#include "../WinBtrfsLib/compression.h"
+#include "../minilzo/minilzo.h"
+#include "../zlib/zlib.h"
+#ifdef WINBTRFS_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace WinBtrfsLib;
+
+/* btrfs never compresses more than this much of a file into one extent */
+const unsigned int EXTENT_SIZE = 128 * 1024;
+
+/* a small read from the start of an extent, which is what Explorer's previews and most small files amount to;
+	the same read from the end shows what a codec has to get through before it can start */
+const unsigned int SMALL_READ = 4096;
+
+/* btrfs compresses LZO extents one page at a time */
+const unsigned int LZO_PAGE_SIZE = 4096;
+const unsigned int LZO_LEN = 4;
+
+/* each measurement runs for about this long, however slow the decoder */
+const double BENCH_SECONDS = 2.0;
+
+struct Extent
+{
+	unsigned char	*compressed;
+	unsigned int	cSize;
+};
+
+/* compresses one extent's worth of src into dest, the way btrfs lays it out; returns the compressed size */
+typedef unsigned int (*CompressFunc)(const unsigned char *src, unsigned char *dest);
+
+struct Codec
+{
+	const char		*name;
+	CompressionType	type;
+	CompressFunc	compress;
+	Extent			*extents;
+};
+
+unsigned char *data, *decoded;
+unsigned int dataSize, numExtents;
+LARGE_INTEGER freq;
+
+/* text-like data that compresses about as well as source code or logs: words from a small vocabulary
+	with numbers mixed in, the same every run */
+void makeData(unsigned int size)
+{
+	static const char *const words[] = { "btrfs", "extent", "inode", "the", "of", "chunk", "stripe", "device",
+		"subvolume", "snapshot", "root", "tree", "node", "leaf", "key", "item", "offset", "length", "=", ";\n" };
+	unsigned int state = 0x12345678, pos = 0;
+
+	dataSize = size;
+	data = (unsigned char *)malloc(size);
+
+	while (pos < size)
+	{
+		char word[32];
+		int len;
+
+		state = state * 1103515245 + 12345;
+
+		if ((state >> 28) == 0)
+			len = sprintf(word, "%u ", (state >> 8) & 0xffff);
+		else
+			len = sprintf(word, "%s ", words[(state >> 16) % (sizeof(words) / sizeof(words[0]))]);
+
+		for (int i = 0; i < len && pos < size; i++)
+			data[pos++] = (unsigned char)word[i];
+	}
+}
+
+/* returns false if the file can't be read */
+bool loadData(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	long size;
+
+	if (file == NULL)
+		return false;
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	/* whole extents only, so every extent decodes to EXTENT_SIZE */
+	dataSize = (unsigned int)(size - size % EXTENT_SIZE);
+	data = (unsigned char *)malloc(dataSize);
+
+	if (dataSize == 0 || fread(data, 1, dataSize, file) != dataSize)
+	{
+		fclose(file);
+		return false;
+	}
+
+	fclose(file);
+	return true;
+}
+
+/* one complete zlib stream per extent, at the default level */
+unsigned int zlibCompress(const unsigned char *src, unsigned char *dest)
+{
+	uLongf cSize = compressBound(EXTENT_SIZE);
+
+	compress2(dest, &cSize, src, EXTENT_SIZE, Z_DEFAULT_COMPRESSION);
+
+	return (unsigned int)cSize;
+}
+
+/* a 32-bit total length, then each page as a 32-bit length and its LZO1X-1 form; a length never straddles a
+	4K page of the output, so when fewer than four bytes are left in one, they're zeroed and skipped */
+unsigned int lzoCompress(const unsigned char *src, unsigned char *dest)
+{
+	static unsigned char workMem[LZO1X_1_MEM_COMPRESS];
+	unsigned int pos = LZO_LEN;
+
+	for (unsigned int page = 0; page < EXTENT_SIZE; page += LZO_PAGE_SIZE)
+	{
+		lzo_uint segLen;
+
+		if (LZO_PAGE_SIZE - pos % LZO_PAGE_SIZE < LZO_LEN)
+		{
+			memset(dest + pos, 0, LZO_PAGE_SIZE - pos % LZO_PAGE_SIZE);
+			pos += LZO_PAGE_SIZE - pos % LZO_PAGE_SIZE;
+		}
+
+		lzo1x_1_compress(src + page, LZO_PAGE_SIZE, dest + pos + LZO_LEN, &segLen, workMem);
+		*(unsigned int *)(dest + pos) = (unsigned int)segLen;
+		pos += LZO_LEN + (unsigned int)segLen;
+	}
+
+	*(unsigned int *)dest = pos;
+
+	return pos;
+}
+
+#ifdef WINBTRFS_ZSTD
+/* one zstd frame per extent, at btrfs's default level */
+unsigned int zstdCompress(const unsigned char *src, unsigned char *dest)
+{
+	return (unsigned int)ZSTD_compress(dest, ZSTD_compressBound(EXTENT_SIZE), src, EXTENT_SIZE, 3);
+}
+#endif
+
+Codec codecs[] =
+{
+	{ "zlib",	COMPRESSION_ZLIB,	&zlibCompress,	NULL },
+	{ "lzo",	COMPRESSION_LZO,	&lzoCompress,	NULL },
+#ifdef WINBTRFS_ZSTD
+	{ "zstd",	COMPRESSION_ZSTD,	&zstdCompress,	NULL },
+#endif
+};
+
+const int NUM_CODECS = sizeof(codecs) / sizeof(codecs[0]);
+
+void compressExtents(Codec *codec)
+{
+	unsigned __int64 total = 0;
+
+	codec->extents = (Extent *)malloc(numExtents * sizeof(Extent));
+
+	for (unsigned int i = 0; i < numExtents; i++)
+	{
+		/* more than enough for the worst case of any of them */
+		codec->extents[i].compressed = (unsigned char *)malloc(2 * EXTENT_SIZE);
+		codec->extents[i].cSize = codec->compress(data + i * EXTENT_SIZE, codec->extents[i].compressed);
+
+		total += codec->extents[i].cSize;
+	}
+
+	printf("%-6s %u extents of %u KiB, compressed to %.1f%%\n", codec->name, numExtents, EXTENT_SIZE / 1024,
+		100.0 * (double)total / ((double)numExtents * EXTENT_SIZE));
+}
+
+/* what zlibDecompress used to do: a fresh z_stream for every extent, and one byte in and one byte out for
+	every call to inflate */
+int inflateBytewise(const unsigned char *compressed, unsigned __int64 cSize, unsigned __int64 from, size_t len,
+	unsigned char *dest)
+{
+	unsigned char *whole = (unsigned char *)malloc(EXTENT_SIZE);
+	unsigned __int64 dSize = from + len;
+	z_stream zStream;
+	int error;
+
+	zStream.zalloc = NULL;
+	zStream.zfree = NULL;
+	zStream.opaque = NULL;
+	zStream.next_in = const_cast<unsigned char *>(compressed);
+	zStream.avail_in = 0;
+	zStream.next_out = whole;
+
+	if ((error = inflateInit(&zStream)) == Z_OK)
+	{
+		while (zStream.total_in < cSize && zStream.total_out < dSize)
+		{
+			zStream.avail_in = zStream.avail_out = 1;
+
+			if ((error = inflate(&zStream, Z_NO_FLUSH)) != Z_OK)
+				break;
+		}
+
+		inflateEnd(&zStream);
+		memcpy(dest, whole + from, len);
+	}
+
+	free(whole);
+
+	return (error == Z_OK || error == Z_STREAM_END ? 0 : error);
+}
+
+/* returns false if any extent decoded wrong */
+bool verify(const Codec *codec, unsigned int from, unsigned int len)
+{
+	for (unsigned int i = 0; i < numExtents; i++)
+	{
+		const Extent *extent = &codec->extents[i];
+
+		if (decompressRange(codec->type, extent->compressed, extent->cSize, from, len, decoded) != 0 ||
+			memcmp(decoded, data + i * EXTENT_SIZE + from, len) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* decodes bytes [from, from + len) of extent after extent; prints MB/s decoded and microseconds per extent */
+void bench(const char *name, DecodeRangeFunc decode, const Codec *codec, unsigned int from, unsigned int len)
+{
+	LARGE_INTEGER start, end;
+	unsigned __int64 calls = 0, bytes = 0;
+	double seconds = 0.0;
+	char read[32];
+
+	QueryPerformanceCounter(&start);
+
+	while (seconds < BENCH_SECONDS)
+	{
+		const Extent *extent = &codec->extents[calls % numExtents];
+
+		if (decode != NULL)
+			decode(extent->compressed, extent->cSize, from, len, decoded);
+		else
+			decompressRange(codec->type, extent->compressed, extent->cSize, from, len, decoded);
+
+		calls++;
+		bytes += len;
+
+		QueryPerformanceCounter(&end);
+		seconds = (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+	}
+
+	if (len == EXTENT_SIZE)
+		sprintf(read, "all %u KiB", len / 1024);
+	else
+		sprintf(read, "%u KiB at %u KiB", len / 1024, from / 1024);
+
+	printf("%-28s %16s %10.1f MB/s %10.1f us/extent\n", name, read,
+		(double)bytes / (1024.0 * 1024.0) / seconds, seconds * 1000000.0 / (double)calls);
+}
+
+/* with a file argument, its contents are compressed and decoded instead of generated text. zstd is only measured
+	when this project is built with WINBTRFS_ZSTD and libzstd, the same way the README describes for WinBtrfsLib */
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+	{
+		if (!loadData(argv[1]))
+		{
+			printf("couldn't read at least %u KiB from '%s'\n", EXTENT_SIZE / 1024, argv[1]);
+			return 1;
+		}
+	}
+	else
+		makeData(64 * EXTENT_SIZE);
+
+	decoded = (unsigned char *)malloc(EXTENT_SIZE);
+	numExtents = dataSize / EXTENT_SIZE;
+	QueryPerformanceFrequency(&freq);
+
+	if (lzo_init() != LZO_E_OK)
+	{
+		printf("lzo_init failed!\n");
+		return 1;
+	}
+
+	for (int i = 0; i < NUM_CODECS; i++)
+	{
+		compressExtents(&codecs[i]);
+
+		if (!verify(&codecs[i], 0, EXTENT_SIZE) || !verify(&codecs[i], 0, SMALL_READ) ||
+			!verify(&codecs[i], EXTENT_SIZE - SMALL_READ, SMALL_READ))
+		{
+			printf("%s: extents don't decode to what was compressed!\n", codecs[i].name);
+			return 1;
+		}
+	}
+
+	printf("\n%-28s %16s %15s %20s\n", "decoder", "read", "throughput", "latency");
+
+	bench("zlib, one byte per call", &inflateBytewise, &codecs[0], 0, EXTENT_SIZE);
+	bench("zlib, one byte per call", &inflateBytewise, &codecs[0], 0, SMALL_READ);
+
+	for (int i = 0; i < NUM_CODECS; i++)
+	{
+		bench(codecs[i].name, NULL, &codecs[i], 0, EXTENT_SIZE);
+		bench(codecs[i].name, NULL, &codecs[i], 0, SMALL_READ);
+		bench(codecs[i].name, NULL, &codecs[i], EXTENT_SIZE - SMALL_READ, SMALL_READ);
+	}
+
+	return 0;
+}
@@ -0,0 +1,613 @@
+/* ImageTest/main.cpp
+ * testbed exercising a mounted btrfs volume through the Windows file APIs
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <string>
+#include <vector>
+#include <Windows.h>
+
+/* the walk stops after this many entries, so a huge volume doesn't take forever to index */
+const size_t MAX_ENTRIES = 200000;
+
+/* WaitForMultipleObjects can't wait on more than this */
+const int MAX_THREADS = MAXIMUM_WAIT_OBJECTS;
+
+/* reads are unbuffered, so they have to be multiples of the sector size; this covers every sector size there is */
+const DWORD READ_ALIGN = 4096;
+const DWORD MAX_READ = 1024 * 1024;
+
+/* how long a mount gets to show up, and then to go away again, before the run is given up on */
+const DWORD MOUNT_TIMEOUT = 30 * 60 * 1000;
+const DWORD UNMOUNT_TIMEOUT = 60 * 1000;
+
+struct Entry
+{
+	std::wstring			path;
+	bool					dir;
+	unsigned __int64		size;		// files only
+	unsigned __int64		hash;		// files: crc32 of the contents; directories: sum of the names' crc32s
+	unsigned int			children;	// directories only
+};
+
+struct Worker
+{
+	HANDLE					hThread;
+	unsigned int			seed;
+	unsigned __int64		dirOps, fileOps, bytes, failures;
+	double					maxLatency;	// in ms
+};
+
+std::vector<Entry> entries;
+volatile LONG stopping = 0;
+LARGE_INTEGER freq;
+
+unsigned int crcTable[256];
+
+/* the CRC-32 of zlib and Python's zlib.crc32, so that mkimages.sh can write the manifest that verify checks */
+void initCRC()
+{
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		unsigned int crc = i;
+
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+
+		crcTable[i] = crc;
+	}
+}
+
+/* continues the crc of whatever came before; start from zero */
+unsigned int crc32(unsigned int crc, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	crc = ~crc;
+
+	while (len--)
+		crc = (crc >> 8) ^ crcTable[(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
+
+unsigned int nextRandom(unsigned int *state)
+{
+	*state = *state * 1103515245 + 12345;
+
+	return *state >> 8;
+}
+
+/* lists a directory, summing a hash of each name so that the order they come back in doesn't matter; returns
+	false if it can't be listed */
+bool listDir(const std::wstring &path, unsigned __int64 *hash, unsigned int *children,
+	std::vector<Entry> *found)
+{
+	WIN32_FIND_DATAW findData;
+	HANDLE hFind;
+
+	*hash = 0;
+	*children = 0;
+
+	if ((hFind = FindFirstFileW((path + L"\\*").c_str(), &findData)) == INVALID_HANDLE_VALUE)
+		return false;
+
+	do
+	{
+		if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
+			continue;
+
+		*hash += crc32(0, findData.cFileName, wcslen(findData.cFileName) * sizeof(wchar_t));
+		(*children)++;
+
+		if (found != NULL)
+		{
+			Entry entry;
+
+			entry.path = path + L"\\" + findData.cFileName;
+			entry.dir = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			entry.size = ((unsigned __int64)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+			entry.hash = 0;
+			entry.children = 0;
+
+			found->push_back(entry);
+		}
+	} while (FindNextFileW(hFind, &findData));
+
+	FindClose(hFind);
+
+	return true;
+}
+
+/* reads a whole file unbuffered (so every read reaches the callbacks), in chunks of random size if state is
+	given; returns false if anything fails */
+bool readFile(const std::wstring &path, unsigned char *buffer, unsigned int *state, unsigned __int64 *size,
+	unsigned __int64 *hash)
+{
+	BY_HANDLE_FILE_INFORMATION fileInfo;
+	HANDLE hFile;
+	DWORD bytesRead;
+	bool ok = true;
+
+	*hash = 0;
+	*size = 0;
+
+	if ((hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING,
+		NULL)) == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!GetFileInformationByHandle(hFile, &fileInfo))
+		ok = false;
+
+	while (ok)
+	{
+		DWORD len = (state != NULL ? (nextRandom(state) % (MAX_READ / READ_ALIGN) + 1) * READ_ALIGN : MAX_READ);
+
+		if (!ReadFile(hFile, buffer, len, &bytesRead, NULL))
+			ok = false;
+		else if (bytesRead == 0)
+			break;
+		else
+		{
+			*hash = crc32((unsigned int)*hash, buffer, bytesRead);
+			*size += bytesRead;
+		}
+	}
+
+	CloseHandle(hFile);
+
+	if (ok && *size != (((unsigned __int64)fileInfo.nFileSizeHigh << 32) | fileInfo.nFileSizeLow))
+		ok = false;
+
+	return ok;
+}
+
+/* records what every directory and file should look like, one thread at a time */
+bool indexVolume(const wchar_t *root)
+{
+	unsigned char *buffer = (unsigned char *)VirtualAlloc(NULL, MAX_READ, MEM_COMMIT, PAGE_READWRITE);
+	Entry rootEntry;
+
+	rootEntry.path = root;
+	rootEntry.dir = true;
+	rootEntry.size = 0;
+	entries.push_back(rootEntry);
+
+	/* entries grows as directories are listed, so this is a breadth-first walk */
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		Entry *entry = &entries[i];
+		bool ok;
+
+		if (entry->dir)
+		{
+			std::vector<Entry> found;
+
+			ok = listDir(entry->path, &entry->hash, &entry->children,
+				(entries.size() < MAX_ENTRIES ? &found : NULL));
+			entries.insert(entries.end(), found.begin(), found.end());
+		}
+		else
+			ok = readFile(entry->path, buffer, NULL, &entry->size, &entry->hash);
+
+		if (!ok)
+		{
+			wprintf(L"indexVolume: couldn't read '%s' (error %u)\n", entries[i].path.c_str(), GetLastError());
+			VirtualFree(buffer, 0, MEM_RELEASE);
+			return false;
+		}
+	}
+
+	VirtualFree(buffer, 0, MEM_RELEASE);
+	return true;
+}
+
+/* picks entries at random until told to stop, checking each against the index */
+DWORD WINAPI stressWorker(LPVOID param)
+{
+	Worker *worker = (Worker *)param;
+	unsigned char *buffer = (unsigned char *)VirtualAlloc(NULL, MAX_READ, MEM_COMMIT, PAGE_READWRITE);
+
+	while (stopping == 0)
+	{
+		const Entry *entry = &entries[nextRandom(&worker->seed) % entries.size()];
+		LARGE_INTEGER start, end;
+		unsigned __int64 size = 0, hash;
+		unsigned int children = 0;
+		double latency;
+		bool ok;
+
+		QueryPerformanceCounter(&start);
+
+		if (entry->dir)
+			ok = listDir(entry->path, &hash, &children, NULL) && hash == entry->hash &&
+				children == entry->children;
+		else
+			ok = readFile(entry->path, buffer, &worker->seed, &size, &hash) && size == entry->size &&
+				hash == entry->hash;
+
+		QueryPerformanceCounter(&end);
+		latency = (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)freq.QuadPart;
+
+		if (!ok && worker->failures++ < 10)
+			wprintf(L"stressWorker: '%s' doesn't match the index (error %u)\n", entry->path.c_str(), GetLastError());
+
+		if (entry->dir)
+			worker->dirOps++;
+		else
+		{
+			worker->fileOps++;
+			worker->bytes += size;
+		}
+
+		if (latency > worker->maxLatency)
+			worker->maxLatency = latency;
+	}
+
+	VirtualFree(buffer, 0, MEM_RELEASE);
+
+	return 0;
+}
+
+/* hammers the volume at root from numThreads threads for the given time; returns the number of mismatches */
+unsigned __int64 stress(const wchar_t *root, int numThreads, DWORD seconds)
+{
+	Worker workers[MAX_THREADS];
+	HANDLE handles[MAX_THREADS];
+	unsigned __int64 dirOps = 0, fileOps = 0, bytes = 0, failures = 0;
+	double maxLatency = 0.0;
+
+	printf("indexing...\n");
+
+	if (!indexVolume(root))
+		return 1;
+
+	printf("%u entries; stressing with %d threads for %u seconds...\n", (unsigned int)entries.size(), numThreads,
+		(unsigned int)seconds);
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		memset(&workers[i], 0, sizeof(Worker));
+		workers[i].seed = 0x12345678 + i;
+
+		workers[i].hThread = CreateThread(NULL, 0, &stressWorker, &workers[i], 0, NULL);
+		assert(workers[i].hThread != NULL);
+		handles[i] = workers[i].hThread;
+	}
+
+	Sleep(seconds * 1000);
+	InterlockedExchange(&stopping, 1);
+	WaitForMultipleObjects(numThreads, handles, TRUE, INFINITE);
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		CloseHandle(workers[i].hThread);
+
+		dirOps += workers[i].dirOps;
+		fileOps += workers[i].fileOps;
+		bytes += workers[i].bytes;
+		failures += workers[i].failures;
+
+		if (workers[i].maxLatency > maxLatency)
+			maxLatency = workers[i].maxLatency;
+	}
+
+	printf("%.1f listings/s, %.1f files/s, %.1f MB/s, slowest %.1f ms, %I64u mismatches\n",
+		(double)dirOps / seconds, (double)fileOps / seconds, (double)bytes / (1024.0 * 1024.0) / seconds,
+		maxLatency, failures);
+
+	return failures;
+}
+
+/* checks each file listed in the manifest that mkimages.sh leaves at the root of the volume; the first pass reads
+	in 1 MiB chunks, so each read covers many stripes, and later passes read in random chunk sizes, so reads start
+	and end all over the stripes. returns the number of mismatches */
+unsigned int verify(const wchar_t *root, int passes)
+{
+	unsigned char *buffer = (unsigned char *)VirtualAlloc(NULL, MAX_READ, MEM_COMMIT, PAGE_READWRITE);
+	unsigned int seed = 0x12345678, failures = 0;
+	char line[MAX_PATH + 64];
+	FILE *manifest;
+
+	if ((manifest = _wfopen((std::wstring(root) + L"\\manifest.txt").c_str(), L"r")) == NULL)
+	{
+		wprintf(L"verify: couldn't open '%s\\manifest.txt'\n", root);
+		VirtualFree(buffer, 0, MEM_RELEASE);
+		return 1;
+	}
+
+	for (int pass = 0; pass < passes; pass++)
+	{
+		LARGE_INTEGER start, end;
+		unsigned __int64 bytes = 0;
+		unsigned int files = 0, passFailures = 0;
+		double seconds;
+
+		fseek(manifest, 0, SEEK_SET);
+		QueryPerformanceCounter(&start);
+
+		/* each line is the crc32, the size and the path, relative to the root of the volume */
+		while (fgets(line, sizeof(line), manifest) != NULL)
+		{
+			unsigned __int64 wantSize, size, hash;
+			unsigned int wantCRC;
+			char name[MAX_PATH];
+			std::wstring path = root;
+
+			if (sscanf(line, "%x %I64u %259[^\n]", &wantCRC, &wantSize, name) != 3)
+				continue;
+
+			path += L'\\';
+			for (const char *c = name; *c != '\0'; c++)
+				path += (*c == '/' ? L'\\' : (wchar_t)(unsigned char)*c);
+
+			if (!readFile(path, buffer, (pass == 0 ? NULL : &seed), &size, &hash) || size != wantSize ||
+				(unsigned int)hash != wantCRC)
+			{
+				if (passFailures++ < 10)
+					wprintf(L"verify: '%s' doesn't match the manifest (error %u)\n", path.c_str(), GetLastError());
+			}
+
+			files++;
+			bytes += size;
+		}
+
+		QueryPerformanceCounter(&end);
+		seconds = (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+
+		printf("pass %d (%s reads): %u files, %.1f MB/s, %u mismatches\n", pass + 1, (pass == 0 ? "1 MiB" : "random"),
+			files, (double)bytes / (1024.0 * 1024.0) / seconds, passFailures);
+
+		failures += passFailures;
+	}
+
+	fclose(manifest);
+	VirtualFree(buffer, 0, MEM_RELEASE);
+
+	return failures;
+}
+
+/* quotes an argument for CreateProcess; a backslash right before the closing quote would escape it, so that one
+	is doubled */
+void appendArg(std::wstring *cmdLine, const wchar_t *arg)
+{
+	size_t len = wcslen(arg);
+
+	if (!cmdLine->empty())
+		*cmdLine += L' ';
+
+	*cmdLine += L'"';
+	*cmdLine += arg;
+
+	if (len > 0 && arg[len - 1] == L'\\')
+		*cmdLine += L'\\';
+
+	*cmdLine += L'"';
+}
+
+double millisecondsSince(const LARGE_INTEGER *start)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return (double)(now.QuadPart - start->QuadPart) * 1000.0 / (double)freq.QuadPart;
+}
+
+/* true once a Btrfs volume answers at root; a directory mount point exists before the mount does, so the file
+	system name is what tells them apart */
+bool isMounted(const std::wstring &root)
+{
+	wchar_t fsName[MAX_PATH + 1];
+
+	return GetVolumeInformationW((root + L"\\").c_str(), NULL, 0, NULL, NULL, NULL, fsName, MAX_PATH + 1) &&
+		wcscmp(fsName, L"Btrfs") == 0;
+}
+
+/* starts WinBtrfsCLI with args (its path, then its own arguments) runs times. each run times how long the
+	volume takes to show up and how long until its root directory can be listed, then unmounts it the way Ctrl+C
+	would. returns false if any run fails */
+bool mountLatency(int runs, int argc, wchar_t **args)
+{
+	std::wstring cmdLine, root;
+	double bestVisible = 0.0, bestListed = 0.0, totalVisible = 0.0, totalListed = 0.0;
+
+	for (int i = 0; i < argc; i++)
+	{
+		appendArg(&cmdLine, args[i]);
+
+		/* the first argument that isn't an option is the mount point */
+		if (i > 0 && root.empty() && wcsncmp(args[i], L"--", 2) != 0)
+		{
+			root = args[i];
+
+			if (root[root.size() - 1] == L'\\' || root[root.size() - 1] == L'/')
+				root.erase(root.size() - 1);
+		}
+	}
+
+	if (root.empty())
+	{
+		printf("mountLatency: there's no mount point among WinBtrfsCLI's arguments\n");
+		return false;
+	}
+
+	if (isMounted(root))
+	{
+		wprintf(L"mountLatency: something is already mounted at '%s'\n", root.c_str());
+		return false;
+	}
+
+	for (int run = 0; run < runs; run++)
+	{
+		STARTUPINFOW startupInfo;
+		PROCESS_INFORMATION procInfo;
+		WIN32_FIND_DATAW findData;
+		std::vector<wchar_t> cmdBuffer(cmdLine.begin(), cmdLine.end());
+		LARGE_INTEGER start;
+		HANDLE hFind;
+		double visible, listed;
+
+		/* CreateProcessW may write to the command line */
+		cmdBuffer.push_back(L'\0');
+
+		memset(&startupInfo, 0, sizeof(startupInfo));
+		startupInfo.cb = sizeof(startupInfo);
+
+		QueryPerformanceCounter(&start);
+
+		/* a process group of its own, so that Ctrl+Break can be sent to it alone */
+		if (!CreateProcessW(NULL, &cmdBuffer[0], NULL, NULL, FALSE, CREATE_NEW_PROCESS_GROUP, NULL, NULL,
+			&startupInfo, &procInfo))
+		{
+			printf("mountLatency: couldn't start WinBtrfsCLI (error %u)\n", GetLastError());
+			return false;
+		}
+
+		/* polled rather than waited on, since nothing signals a Dokan mount; a millisecond is well under what
+			mounting takes */
+		while (!isMounted(root))
+		{
+			if (WaitForSingleObject(procInfo.hProcess, 1) == WAIT_OBJECT_0 || millisecondsSince(&start) > MOUNT_TIMEOUT)
+			{
+				printf("mountLatency: run %d: WinBtrfsCLI exited or timed out before the volume showed up\n", run + 1);
+				TerminateProcess(procInfo.hProcess, 1);
+				CloseHandle(procInfo.hProcess);
+				CloseHandle(procInfo.hThread);
+				return false;
+			}
+		}
+
+		visible = millisecondsSince(&start);
+
+		if ((hFind = FindFirstFileW((root + L"\\*").c_str(), &findData)) != INVALID_HANDLE_VALUE)
+			FindClose(hFind);
+
+		listed = millisecondsSince(&start);
+
+		GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, procInfo.dwProcessId);
+
+		if (WaitForSingleObject(procInfo.hProcess, UNMOUNT_TIMEOUT) != WAIT_OBJECT_0)
+		{
+			printf("mountLatency: run %d: WinBtrfsCLI didn't exit; killed it, so run unmount.cmd\n", run + 1);
+			TerminateProcess(procInfo.hProcess, 1);
+		}
+
+		CloseHandle(procInfo.hProcess);
+		CloseHandle(procInfo.hThread);
+
+		if (hFind == INVALID_HANDLE_VALUE)
+		{
+			printf("mountLatency: run %d: the root directory couldn't be listed (error %u)\n", run + 1,
+				GetLastError());
+			return false;
+		}
+
+		printf("run %d: volume visible after %.1f ms, root listed after %.1f ms\n", run + 1, visible, listed);
+
+		if (run == 0 || visible < bestVisible)
+			bestVisible = visible;
+		if (run == 0 || listed < bestListed)
+			bestListed = listed;
+
+		totalVisible += visible;
+		totalListed += listed;
+
+		/* Dokan takes a moment to let go of the mount point after the process is gone */
+		while (isMounted(root))
+			Sleep(100);
+	}
+
+	printf("%d runs: volume visible after %.1f ms on average (best %.1f), root listed after %.1f ms (best %.1f)\n",
+		runs, totalVisible / runs, bestVisible, totalListed / runs, bestListed);
+
+	return true;
+}
+
+void usage()
+{
+	printf("usage: ImageTest stress <mount point> [threads] [seconds]\n"
+		"  indexes the mounted volume from one thread, then lists directories and reads files at random\n"
+		"  from many (8 for 60 seconds by default), checking that every answer matches the index; mount with\n"
+		"  WinBtrfsCLI --threads=<n> to vary how many threads service them\n"
+		"usage: ImageTest verify <mount point> [passes]\n"
+		"  checks every file in an image made by mkimages.sh against its manifest, reporting the throughput of\n"
+		"  each pass (3 by default)\n"
+		"usage: ImageTest mount <runs> <path to WinBtrfsCLI.exe> [options] <mount point> <device(s)>\n"
+		"  mounts the volume the given number of times, timing how long it takes to become visible and\n"
+		"  for its root directory to list, and unmounting it after each run; the images mkimages.sh\n"
+		"  --large makes are big enough to show the difference\n");
+}
+
+int wmain(int argc, wchar_t **argv)
+{
+	std::wstring root;
+
+	if (argc < 3)
+	{
+		usage();
+		return 1;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	initCRC();
+
+	if (wcscmp(argv[1], L"mount") == 0)
+	{
+		int runs = _wtoi(argv[2]);
+
+		if (argc < 6 || runs < 1)
+		{
+			usage();
+			return 1;
+		}
+
+		return (mountLatency(runs, argc - 3, argv + 3) ? 0 : 1);
+	}
+
+	/* the separator gets added back wherever a path is built */
+	root = argv[2];
+	if (!root.empty() && (root[root.size() - 1] == L'\\' || root[root.size() - 1] == L'/'))
+		root.erase(root.size() - 1);
+
+	if (wcscmp(argv[1], L"stress") == 0)
+	{
+		int numThreads = (argc >= 4 ? _wtoi(argv[3]) : 8);
+		int seconds = (argc >= 5 ? _wtoi(argv[4]) : 60);
+
+		if (numThreads < 1 || numThreads > MAX_THREADS || seconds < 1)
+		{
+			usage();
+			return 1;
+		}
+
+		return (stress(root.c_str(), numThreads, (DWORD)seconds) == 0 ? 0 : 1);
+	}
+	else if (wcscmp(argv[1], L"verify") == 0)
+	{
+		int passes = (argc >= 4 ? _wtoi(argv[3]) : 3);
+
+		if (passes < 1)
+		{
+			usage();
+			return 1;
+		}
+
+		return (verify(root.c_str(), passes) == 0 ? 0 : 1);
+	}
+
+	usage();
+	return 1;
+}
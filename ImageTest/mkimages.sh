@@ -0,0 +1,163 @@
+#!/bin/sh
+# ImageTest/mkimages.sh
+# builds striped btrfs images on loop devices for ImageTest verify
+#
+# WinBtrfs
+# Copyright (c) 2011 Justin Gottula
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# Run as root on Linux, with btrfs-progs and python3 installed:
+#   ./mkimages.sh [--large] [output directory] [device size]
+# This makes raid0-2, raid0-3 and raid10-4: a RAID0 volume on two and on three
+# devices and a RAID10 volume on four, data and metadata alike, each a set of
+# sparse image files (raid0-2.0.img, raid0-2.1.img...). Each volume gets files
+# of sizes chosen to land on, just short of and just past the 64 KiB stripe
+# boundaries, filled from a seeded generator, and a manifest.txt at its root
+# listing each file's crc32, size and path. Mount all of a volume's images
+# with WinBtrfsCLI, then run: ImageTest verify <mount point>
+#
+# With --large, this makes large-4 instead: four sparse devices (4T each by
+# default) with RAID0 data and RAID1 metadata, most of the space preallocated
+# so that the chunk tree maps over a thousand chunks, and a subvolume "base" of
+# 10000 small files with 2000 snapshots of it (SNAPSHOTS=n to change that), so
+# that the root tree runs to thousands of items. Preallocated space is never
+# written, so the image files stay small. Time mounting it with:
+#   ImageTest mount <runs> WinBtrfsCLI.exe --no-dump <mount point> <images>
+# adding --subvol=snap1999 to time a subvolume lookup as well.
+
+set -e
+
+LARGE=0
+if [ "$1" = "--large" ]; then
+	LARGE=1
+	shift
+fi
+
+OUT=${1:-images}
+SIZE=${2:-$([ $LARGE = 1 ] && echo 4T || echo 2G)}
+SNAPSHOTS=${SNAPSHOTS:-2000}
+MNT=$(mktemp -d)
+
+mkdir -p "$OUT"
+
+# name, number of devices; leaves their loop devices in DEVS
+mkdevices()
+{
+	DEVS=""
+
+	for i in $(seq 0 $(($2 - 1))); do
+		rm -f "$OUT/$1.$i.img"
+		truncate -s "$SIZE" "$OUT/$1.$i.img"
+		DEVS="$DEVS $(losetup -f --show "$OUT/$1.$i.img")"
+	done
+}
+
+# name; detaches the loop devices in DEVS
+rmdevices()
+{
+	for dev in $DEVS; do
+		losetup -d "$dev"
+	done
+
+	echo "$1: $(ls "$OUT"/$1.*.img | tr '\n' ' ')"
+}
+
+# name, profile, number of devices
+mkvolume()
+{
+	mkdevices "$1" "$3"
+
+	mkfs.btrfs -q -f -L "$1" -d "$2" -m "$2" $DEVS
+	btrfs device scan $DEVS > /dev/null
+
+	# no compression, so that every byte of every file goes through the striped read path
+	mount -o compress=no ${DEVS%% *} "$MNT" 2> /dev/null || mount ${DEVS%% *} "$MNT"
+
+	python3 - "$MNT" "$1" << 'EOF'
+import os, random, sys, zlib
+
+root, seed = sys.argv[1], sys.argv[2]
+gen = random.Random(seed)
+stripe = 64 * 1024
+
+sizes = [0, 1, 100, 4095, 4096, 4097, stripe - 1, stripe, stripe + 1, 2 * stripe - 4096, 3 * stripe + 12345,
+	1024 * 1024, 1024 * 1024 + 1, 8 * 1024 * 1024 - 1, 64 * 1024 * 1024 + 4096 * 3 + 17]
+sizes += [gen.randrange(1, 16 * 1024 * 1024) for i in range(40)]
+
+manifest = []
+
+for n, size in enumerate(sizes):
+	rel = 'dir%d/file%03d.bin' % (n % 4, n)
+	path = os.path.join(root, rel)
+	os.makedirs(os.path.dirname(path), exist_ok=True)
+
+	data = bytes(gen.getrandbits(8) for i in range(min(size, 4096)))
+	data = (data * (size // 4096 + 1))[:size] if size > 4096 else data
+
+	# a repeating 4 KiB pattern would let a read from the wrong stripe go unnoticed, so stamp every 4 KiB block
+	# with its own offset
+	buf = bytearray(data)
+	for off in range(0, size - 8 + 1, 4096):
+		buf[off:off + 8] = off.to_bytes(8, 'little')
+
+	with open(path, 'wb') as f:
+		f.write(buf)
+
+	manifest.append('%08x %d %s\n' % (zlib.crc32(buf) & 0xffffffff, size, rel))
+
+with open(os.path.join(root, 'manifest.txt'), 'w') as f:
+	f.writelines(manifest)
+EOF
+
+	umount "$MNT"
+	rmdevices "$1"
+}
+
+# name, number of devices
+mklarge()
+{
+	mkdevices "$1" "$2"
+
+	mkfs.btrfs -q -f -L "$1" -d raid0 -m raid1 $DEVS
+	btrfs device scan $DEVS > /dev/null
+	mount ${DEVS%% *} "$MNT"
+
+	btrfs subvolume create "$MNT/base" > /dev/null
+
+	for d in $(seq 0 99); do
+		mkdir "$MNT/base/dir$d"
+
+		for f in $(seq 0 99); do
+			echo "dir $d file $f" > "$MNT/base/dir$d/file$f.txt"
+		done
+	done
+
+	# fallocate allocates data chunks without writing anything to the devices
+	FREE=$(df -B1G --output=avail "$MNT" | tail -n 1)
+	mkdir "$MNT/prealloc"
+
+	for i in $(seq 1 $((FREE * 3 / 4 / 64))); do
+		fallocate -l 64G "$MNT/prealloc/$i"
+	done
+
+	for i in $(seq 0 $((SNAPSHOTS - 1))); do
+		btrfs subvolume snapshot "$MNT/base" "$MNT/snap$i" > /dev/null
+	done
+
+	umount "$MNT"
+	rmdevices "$1"
+}
+
+if [ $LARGE = 1 ]; then
+	mklarge large-4 4
+else
+	mkvolume raid0-2 raid0 2
+	mkvolume raid0-3 raid0 3
+	mkvolume raid10-4 raid10 4
+fi
+
+rmdir "$MNT"
@@ -0,0 +1,198 @@
+/* TraceBench/main.cpp
+ * testbed measuring what tracing costs the thread that traces
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cstdio>
+#include <Windows.h>
+#include "../WinBtrfsLib/trace.h"
+
+using namespace WinBtrfsLib;
+
+/* calls per measurement where the calls are cheap enough to run flat out */
+const int FAST_CALLS = 10000000;
+
+/* a ring holds 1024 records, so bursts this size always fit; each is timed on its own and followed by enough
+	of a pause for the drain (every 100 ms) to empty the ring again */
+const int BURST_CALLS = 512;
+const int BURSTS = 40;
+const DWORD BURST_PAUSE = 150;
+
+/* printf is slow enough that this many says all there is to say; run from a console window to see what the
+	console itself costs, since redirected output is much cheaper */
+const int PRINTF_CALLS = 20000;
+
+/* the multithreaded runs use one thread per processor, up to this many; more would time the scheduler */
+const int MAX_THREADS = 8;
+
+LARGE_INTEGER freq;
+
+struct Run
+{
+	int				calls;
+	double			seconds;
+};
+
+double secondsSince(const LARGE_INTEGER *start)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return (double)(now.QuadPart - start->QuadPart) / (double)freq.QuadPart;
+}
+
+/* the kind of message btrfsReadFile traces for every request */
+DWORD WINAPI traceFlatOut(LPVOID param)
+{
+	Run *run = (Run *)param;
+	LARGE_INTEGER start;
+
+	QueryPerformanceCounter(&start);
+
+	for (int i = 0; i < run->calls; i++)
+		TRACE(TRACE_READ, TRACE_DEBUG, "read %u bytes at offset %I64u of inode 0x%I64x", 4096U,
+			(unsigned __int64)i * 4096, 0x101ULL);
+
+	run->seconds = secondsSince(&start);
+
+	return 0;
+}
+
+DWORD WINAPI scopeFlatOut(LPVOID param)
+{
+	Run *run = (Run *)param;
+	LARGE_INTEGER start;
+
+	QueryPerformanceCounter(&start);
+
+	for (int i = 0; i < run->calls; i++)
+		TraceScope scope(TRACE_READ, __FUNCTION__);
+
+	run->seconds = secondsSince(&start);
+
+	return 0;
+}
+
+/* times only the bursts, not the pauses between them */
+DWORD WINAPI traceBursts(LPVOID param)
+{
+	Run *run = (Run *)param;
+
+	run->seconds = 0.0;
+
+	for (int burst = 0; burst < BURSTS; burst++)
+	{
+		LARGE_INTEGER start;
+
+		QueryPerformanceCounter(&start);
+
+		for (int i = 0; i < BURST_CALLS; i++)
+			TRACE(TRACE_READ, TRACE_DEBUG, "read %u bytes at offset %I64u of inode 0x%I64x", 4096U,
+				(unsigned __int64)i * 4096, 0x101ULL);
+
+		run->seconds += secondsSince(&start);
+
+		Sleep(BURST_PAUSE);
+	}
+
+	return 0;
+}
+
+/* what every one of those messages used to cost */
+void printfFlatOut(Run *run)
+{
+	LARGE_INTEGER start;
+
+	QueryPerformanceCounter(&start);
+
+	for (int i = 0; i < run->calls; i++)
+		printf("btrfsReadFile: read %u bytes at offset %I64u of inode 0x%I64x\n", 4096U, (unsigned __int64)i * 4096,
+			0x101ULL);
+
+	run->seconds = secondsSince(&start);
+}
+
+/* runs proc on numThreads threads at once and prints the average time per call on each */
+void measure(const char *name, LPTHREAD_START_ROUTINE proc, int numThreads, int calls)
+{
+	HANDLE threads[MAX_THREADS];
+	Run runs[MAX_THREADS];
+	double seconds = 0.0;
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		runs[i].calls = calls;
+		threads[i] = CreateThread(NULL, 0, proc, &runs[i], 0, NULL);
+	}
+
+	WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		CloseHandle(threads[i]);
+		seconds += runs[i].seconds;
+	}
+
+	printf("%-36s %d thread%s %10.1f ns/call\n", name, numThreads, (numThreads == 1 ? " " : "s"),
+		seconds * 1000000000.0 / ((double)calls * numThreads));
+}
+
+/* the trace goes to the file given, or TraceBench.json */
+int main(int argc, char **argv)
+{
+	const char *path = (argc > 1 ? argv[1] : "TraceBench.json");
+	SYSTEM_INFO sysInfo;
+	TraceStats stats;
+	int numThreads;
+	Run run;
+
+	QueryPerformanceFrequency(&freq);
+	GetSystemInfo(&sysInfo);
+
+	numThreads = ((int)sysInfo.dwNumberOfProcessors < MAX_THREADS ? (int)sysInfo.dwNumberOfProcessors : MAX_THREADS);
+
+	/* printf first, so its own output doesn't land in the middle of the results */
+	run.calls = PRINTF_CALLS;
+	printfFlatOut(&run);
+
+	printf("\n");
+	printf("%-36s %d thread  %10.1f ns/call\n", "printf to stdout", 1,
+		run.seconds * 1000000000.0 / (double)run.calls);
+
+	/* nothing set up yet, so the threshold leaves debug messages out */
+	measure("TRACE, level not wanted", &traceFlatOut, 1, FAST_CALLS);
+	if (numThreads > 1)
+		measure("TRACE, level not wanted", &traceFlatOut, numThreads, FAST_CALLS);
+
+	setupTrace(path, TRACE_DEBUG);
+
+	measure("TRACE, recorded", &traceBursts, 1, BURST_CALLS * BURSTS);
+	if (numThreads > 1)
+		measure("TRACE, recorded", &traceBursts, numThreads, BURST_CALLS * BURSTS);
+
+	/* the drain can't keep up with these, so nearly all of them are dropped */
+	measure("TRACE, ring full", &traceFlatOut, 1, FAST_CALLS);
+	if (numThreads > 1)
+		measure("TRACE, ring full", &traceFlatOut, numThreads, FAST_CALLS);
+
+	measure("TraceScope, ring full", &scopeFlatOut, 1, FAST_CALLS);
+	if (numThreads > 1)
+		measure("TraceScope, ring full", &scopeFlatOut, numThreads, FAST_CALLS);
+
+	stopTrace();
+	getTraceStats(&stats);
+
+	printf("\n%I64u records written to %s from %I64u threads, %I64u dropped\n", stats.events, path, stats.threads,
+		stats.dropped);
+	printf("a category compiled out with TRACE_CATEGORIES costs nothing at all\n");
+
+	return 0;
+}
@@ -33,7 +33,14 @@ namespace WinBtrfsCLI
 			"--no-dump         don't dump trees at startup\n"
 			"--dump-only       only dump trees, don't actually mount the volume\n"
 			"--subvol=<name>   mount the subvolume with the given name\n"
-			"--subvol-id=<ID>  mount the subvolume with the given object ID\n");
+			"--subvol-id=<ID>  mount the subvolume with the given object ID\n"
+			"--node-cache=<MiB> memory to use for caching metadata nodes (default: 64)\n"
+			"--extent-cache=<MiB> memory to use for caching file data and readahead (default: 64)\n"
+			"--dentry-cache=<n> number of path lookups to remember (default: 65536)\n"
+			"--threads=<n>     number of threads servicing filesystem requests (default: 5)\n"
+			"--verify-data     check file data against the checksum tree as it's read\n"
+			"--trace=<file>    write a Chrome trace (chrome://tracing) of what the driver does to the file\n"
+			"--trace-level=<n> 0 for errors, 1 for warnings, 2 for request timings, 3 for everything (default: 1)\n");
 
 		exit(1);
 	}
@@ -58,6 +65,13 @@ namespace WinBtrfsCLI
 		volumeInfo.dumpOnly = false;
 		volumeInfo.useSubvolID = false;
 		volumeInfo.useSubvolName = false;
+		volumeInfo.verifyData = false;
+		volumeInfo.nodeCacheSize = 64 * 1024 * 1024;
+		volumeInfo.extentCacheSize = 64 * 1024 * 1024;
+		volumeInfo.dentryCacheSize = 65536;
+		volumeInfo.threadCount = 5;
+		volumeInfo.traceLevel = 1;
+		volumeInfo.traceFile = NULL;
 
 		for (int i = 1; i < argc; i++)
 		{
@@ -65,6 +79,8 @@ namespace WinBtrfsCLI
 			{
 				if (strcmp(argv[i], "--no-dump") == 0)
 					volumeInfo.noDump = true;
+				else if (strcmp(argv[i], "--verify-data") == 0)
+					volumeInfo.verifyData = true;
 				else if (strcmp(argv[i], "--dump-only") == 0)
 					volumeInfo.dumpOnly = true;
 				else if (strncmp(argv[i], "--subvol-id=", 12) == 0)
@@ -99,6 +115,59 @@ namespace WinBtrfsCLI
 					else
 						usageError("You didn't specify a subvolume name!\n\n");
 				}
+				else if (strncmp(argv[i], "--node-cache=", 13) == 0)
+				{
+					unsigned __int64 cacheMiB;
+
+					if (strlen(argv[i]) > 13 && sscanf(argv[i] + 13, "%I64u ", &cacheMiB) == 1)
+						volumeInfo.nodeCacheSize = cacheMiB * 1024 * 1024;
+					else
+						usageError("You entered an indecipherable node cache size!\n\n");
+				}
+				else if (strncmp(argv[i], "--extent-cache=", 15) == 0)
+				{
+					unsigned __int64 cacheMiB;
+
+					if (strlen(argv[i]) > 15 && sscanf(argv[i] + 15, "%I64u ", &cacheMiB) == 1)
+						volumeInfo.extentCacheSize = cacheMiB * 1024 * 1024;
+					else
+						usageError("You entered an indecipherable extent cache size!\n\n");
+				}
+				else if (strncmp(argv[i], "--dentry-cache=", 15) == 0)
+				{
+					unsigned __int64 entries;
+
+					if (strlen(argv[i]) > 15 && sscanf(argv[i] + 15, "%I64u ", &entries) == 1)
+						volumeInfo.dentryCacheSize = entries;
+					else
+						usageError("You entered an indecipherable dentry cache size!\n\n");
+				}
+				else if (strncmp(argv[i], "--threads=", 10) == 0)
+				{
+					unsigned int threads;
+
+					if (strlen(argv[i]) > 10 && sscanf(argv[i] + 10, "%u ", &threads) == 1 &&
+						threads >= 1 && threads <= 64)
+						volumeInfo.threadCount = (unsigned short)threads;
+					else
+						usageError("The thread count must be a number from 1 to 64!\n\n");
+				}
+				else if (strncmp(argv[i], "--trace-level=", 14) == 0)
+				{
+					unsigned int level;
+
+					if (strlen(argv[i]) > 14 && sscanf(argv[i] + 14, "%u ", &level) == 1 && level <= 3)
+						volumeInfo.traceLevel = (unsigned short)level;
+					else
+						usageError("The trace level must be a number from 0 to 3!\n\n");
+				}
+				else if (strncmp(argv[i], "--trace=", 8) == 0)
+				{
+					if (strlen(argv[i]) > 8)
+						volumeInfo.traceFile = argv[i] + 8;
+					else
+						usageError("You didn't specify a trace file!\n\n");
+				}
 				else
 					usageError("'%s' is not a recognized command-line option!\n\n", argv[i]);
 			}
@@ -27,9 +27,15 @@ namespace WinBtrfsLib
 {
 	struct VolumeInfo
 	{
-		bool noDump, dumpOnly, useSubvolID, useSubvolName;
+		bool noDump, dumpOnly, useSubvolID, useSubvolName, verifyData;
 		BtrfsObjID subvolID;
+		unsigned __int64 nodeCacheSize;
+		unsigned __int64 extentCacheSize;
+		unsigned __int64 dentryCacheSize;
+		unsigned short threadCount;
+		unsigned short traceLevel;
 		char *subvolName;
+		char *traceFile;
 		wchar_t mountPoint[MAX_PATH];
 		std::vector<const wchar_t *> devicePaths;
 	};
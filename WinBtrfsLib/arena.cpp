@@ -0,0 +1,165 @@
+/* WinBtrfsLib/arena.cpp
+ * bump allocator for allocations that share a lifetime
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "arena.h"
+#include <cassert>
+#include <cstdlib>
+#include <Windows.h>
+
+namespace WinBtrfsLib
+{
+	/* big enough for a whole compressed extent plus the odd path, so a request rarely spills into a second block */
+	const size_t SCRATCH_BLOCK_SIZE = 256 * 1024;
+
+	/* blocks malloc'd by every arena together; in steady state this shouldn't move */
+	volatile LONGLONG arenaHeapAllocs = 0, scratchThreads = 0;
+
+	Arena::Arena(size_t blockSize)
+	{
+		head = NULL;
+		spare = NULL;
+		this->blockSize = blockSize;
+	}
+
+	Arena::~Arena()
+	{
+		reset();
+	}
+
+	/* returns 8-byte aligned memory that stays valid until the arena is reset or rewound past it */
+	void *Arena::allocate(size_t size)
+	{
+		size = (size + 7) & ~(size_t)7;
+
+		if (head == NULL || head->size - head->used < size)
+		{
+			Block *block;
+
+			if (size <= blockSize && spare != NULL)
+			{
+				block = spare;
+				spare = NULL;
+			}
+			else
+			{
+				/* something too big for a normal block gets a block all to itself */
+				size_t newSize = (size > blockSize ? size : blockSize);
+
+				block = (Block *)malloc(sizeof(Block) + newSize);
+				assert(block != NULL);
+
+				block->size = newSize;
+				InterlockedIncrement64(&arenaHeapAllocs);
+			}
+
+			block->used = 0;
+			block->next = head;
+			head = block;
+		}
+
+		void *ptr = (unsigned char *)head->data + head->used;
+		head->used += size;
+
+		return ptr;
+	}
+
+	Arena::Mark Arena::mark()
+	{
+		Mark mark;
+
+		mark.block = head;
+		mark.used = (head != NULL ? head->used : 0);
+
+		return mark;
+	}
+
+	void Arena::rewind(const Mark &mark)
+	{
+		while (head != mark.block)
+		{
+			Block *block = head;
+
+			assert(block != NULL);
+			head = block->next;
+
+			if (spare == NULL && block->size == blockSize)
+				spare = block;
+			else
+				free(block);
+		}
+
+		if (head != NULL)
+			head->used = mark.used;
+	}
+
+	void Arena::reset()
+	{
+		Mark empty = { NULL, 0 };
+
+		rewind(empty);
+
+		free(spare);
+		spare = NULL;
+	}
+
+	ArenaScope::ArenaScope(Arena *arena)
+	{
+		this->arena = arena;
+		start = arena->mark();
+	}
+
+	ArenaScope::~ArenaScope()
+	{
+		arena->rewind(start);
+	}
+
+	static void WINAPI freeThreadArena(PVOID arena)
+	{
+		delete (Arena *)arena;
+	}
+
+	/* returns this thread's scratch arena, for memory that only has to last until the current request is done;
+		callers put an ArenaScope around their use of it. this uses fiber local storage rather than TLS because
+		its destructor callback frees the arena when a thread pool thread exits */
+	Arena *getThreadArena()
+	{
+		static volatile DWORD flsArenaIdx = FLS_OUT_OF_INDEXES;
+		Arena *arena;
+
+		if (flsArenaIdx == FLS_OUT_OF_INDEXES)
+		{
+			DWORD idx = FlsAlloc(&freeThreadArena);
+			assert(idx != FLS_OUT_OF_INDEXES);
+
+			/* another thread may have gotten here first */
+			if (InterlockedCompareExchange((volatile LONG *)&flsArenaIdx, (LONG)idx, (LONG)FLS_OUT_OF_INDEXES) !=
+				(LONG)FLS_OUT_OF_INDEXES)
+				FlsFree(idx);
+		}
+
+		if ((arena = (Arena *)FlsGetValue(flsArenaIdx)) == NULL)
+		{
+			arena = new Arena(SCRATCH_BLOCK_SIZE);
+
+			FlsSetValue(flsArenaIdx, arena);
+			InterlockedIncrement64(&scratchThreads);
+		}
+
+		return arena;
+	}
+
+	void getScratchStats(ScratchStats *stats)
+	{
+		stats->threads = (unsigned __int64)scratchThreads;
+		stats->heapAllocs = (unsigned __int64)arenaHeapAllocs;
+	}
+}
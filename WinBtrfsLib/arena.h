@@ -0,0 +1,80 @@
+/* WinBtrfsLib/arena.h
+ * bump allocator for allocations that share a lifetime
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cstddef>
+
+#ifndef WINBTRFSLIB_ARENA_H
+#define WINBTRFSLIB_ARENA_H
+
+namespace WinBtrfsLib
+{
+	struct ScratchStats
+	{
+		unsigned __int64		threads;		// threads that have used their scratch arena
+		unsigned __int64		heapAllocs;		// blocks any arena has had to malloc
+	};
+
+	/* hands out memory from large blocks, a bump of a pointer at a time; nothing is freed individually, only
+		everything at once by reset or destruction, or everything since a mark by rewind. not thread-safe; each
+		arena belongs to one owner */
+	class Arena
+	{
+	private:
+		struct Block;
+
+	public:
+		/* a position to rewind to; everything allocated after it was taken goes away together */
+		struct Mark
+		{
+			Block					*block;
+			size_t					used;
+		};
+
+		explicit Arena(size_t blockSize);
+		~Arena();
+
+		void *allocate(size_t size);
+		Mark mark();
+		void rewind(const Mark &mark);
+		void reset();
+
+	private:
+		struct Block
+		{
+			Block					*next;
+			size_t					size;
+			size_t					used;
+			unsigned __int64		data		[0x0];	// for alignment
+		};
+
+		Block *head;
+		Block *spare;	// a normal-sized block kept back by rewind, so the next one doesn't have to malloc
+		size_t blockSize;
+	};
+
+	/* rewinds an arena to wherever it was when the scope was entered */
+	class ArenaScope
+	{
+	public:
+		explicit ArenaScope(Arena *arena);
+		~ArenaScope();
+
+	private:
+		Arena *arena;
+		Arena::Mark start;
+	};
+
+	Arena *getThreadArena();
+	void getScratchStats(ScratchStats *stats);
+}
+
+#endif
@@ -16,51 +16,202 @@
 
 namespace WinBtrfsLib
 {
+	/* largest single ReadFile we'll issue; bigger reads are split up */
+	const DWORD MAX_READ_LEN = 0x40000000;
+
+	DWORD BlockReader::flsEventIdx = FLS_OUT_OF_INDEXES;
+	LONGLONG BlockReader::ticksPerSec = 0;
+
+	static void WINAPI freeThreadEvents(PVOID param)
+	{
+		HANDLE *events = (HANDLE *)param;
+
+		for (unsigned int i = 0; i < MAX_PENDING_READS; i++)
+		{
+			if (events[i] != NULL)
+				CloseHandle(events[i]);
+		}
+
+		free(events);
+	}
+
 	BlockReader::BlockReader(const wchar_t *devicePath)
 	{
-		hPhysical = CreateFile(devicePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		/* block readers are all created by allocateBlockReaders before any other threads exist */
+		if (flsEventIdx == FLS_OUT_OF_INDEXES)
+		{
+			flsEventIdx = FlsAlloc(&freeThreadEvents);
+			assert(flsEventIdx != FLS_OUT_OF_INDEXES);
+
+			LARGE_INTEGER freq;
+			QueryPerformanceFrequency(&freq);
+			ticksPerSec = freq.QuadPart;
+		}
+
+		outstanding = 0;
+		latencyUs = 0;
+		numReads = 0;
+
+		/* the handle is opened for overlapped I/O so that every read carries its own offset; there is no
+			shared file pointer, so any number of threads can read from the device at the same time */
+		hPhysical = CreateFile(devicePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			FILE_FLAG_OVERLAPPED, NULL);
 		/* this is NOT fatal; return an error based on GetLastError (file not found is most common) */
 		assert(hPhysical != INVALID_HANDLE_VALUE);
-		hReadMutex = CreateMutex(NULL, FALSE, NULL);
-		assert(hReadMutex != INVALID_HANDLE_VALUE);
 	}
 
 	BlockReader::~BlockReader()
 	{
 		CloseHandle(hPhysical);
-		CloseHandle(hReadMutex);
 	}
 
-	DWORD BlockReader::directRead(unsigned __int64 addr, unsigned __int64 len, unsigned char *dest)
+	/* slot n is for the nth read a thread has in flight; slot 0 is the one directRead uses */
+	HANDLE BlockReader::getThreadEvent(unsigned int slot)
 	{
-		LARGE_INTEGER li;
-		DWORD bytesRead;
+		HANDLE *events = (HANDLE *)FlsGetValue(flsEventIdx);
 
-		/* because Win32 uses a signed (??) 64-bit value for the address from which to read,
-			our address space is cut in half from what Btrfs technically allows */
-		li.QuadPart = (LONGLONG)addr;
+		assert(slot < MAX_PENDING_READS);
 
-		/* using SetFilePointerEx and then ReadFile is clearly not threadsafe, so for now
-			I'm using a mutex here; in the future, this should be fully threaded
-			(perhaps a separate read handle per thread? this would require a CreateFile on each
-			callor perhaps declare a static local that would retain value per thread?) */
-		if (WaitForSingleObject(hReadMutex, 10000) != WAIT_OBJECT_0)
-			return GetLastError();
+		/* each thread gets a set of manual-reset events the first time it reads; they live as long as the thread
+			does. readahead and prefetches read on thread pool threads, which come and go, so this is fiber local
+			storage rather than TLS: its destructor callback closes the events when the thread exits */
+		if (events == NULL)
+		{
+			events = (HANDLE *)calloc(MAX_PENDING_READS, sizeof(HANDLE));
+			assert(events != NULL);
+
+			FlsSetValue(flsEventIdx, events);
+		}
 
-		if (SetFilePointerEx(hPhysical, li, NULL, 0) == 0)
+		if (events[slot] == NULL)
 		{
-			ReleaseMutex(hReadMutex);
-			return GetLastError();
+			events[slot] = CreateEvent(NULL, TRUE, FALSE, NULL);
+			assert(events[slot] != NULL);
 		}
 
-		if (ReadFile(hPhysical, dest, (DWORD)len, &bytesRead, NULL) == 0 || bytesRead != len)
+		return events[slot];
+	}
+
+	LONGLONG BlockReader::startIO()
+	{
+		LARGE_INTEGER now;
+
+		InterlockedIncrement(&outstanding);
+		QueryPerformanceCounter(&now);
+
+		return now.QuadPart;
+	}
+
+	void BlockReader::endIO(LONGLONG startTicks)
+	{
+		LARGE_INTEGER now;
+
+		QueryPerformanceCounter(&now);
+
+		LONG sample = (LONG)((now.QuadPart - startTicks) * 1000000 / ticksPerSec), old = latencyUs;
+
+		/* each sample moves the average 1/8 of the way; a lost update between racing threads doesn't matter */
+		InterlockedExchange(&latencyUs, (old == 0 ? sample : old + (sample - old) / 8));
+		InterlockedIncrement64(&numReads);
+		InterlockedDecrement(&outstanding);
+	}
+
+	/* a rough cost of sending another read to this device now; lower is better */
+	unsigned __int64 BlockReader::getLoad()
+	{
+		return (unsigned __int64)(outstanding + 1) * (latencyUs + 1);
+	}
+
+	void BlockReader::getStats(BlockReaderStats *stats)
+	{
+		stats->reads = numReads;
+		stats->latencyUs = latencyUs;
+	}
+
+	DWORD BlockReader::directRead(unsigned __int64 addr, unsigned __int64 len, unsigned char *dest)
+	{
+		HANDLE hEvent = getThreadEvent(0);
+		LONGLONG startTicks = startIO();
+		DWORD error = 0;
+
+		while (len > 0)
 		{
-			ReleaseMutex(hReadMutex);
-			return GetLastError();
+			OVERLAPPED overlapped;
+			DWORD chunkLen = (len > MAX_READ_LEN ? MAX_READ_LEN : (DWORD)len), bytesRead;
+
+			/* because Win32 uses a signed (??) 64-bit value for the address from which to read,
+				our address space is cut in half from what Btrfs technically allows */
+			memset(&overlapped, 0, sizeof(OVERLAPPED));
+			overlapped.Offset = (DWORD)addr;
+			overlapped.OffsetHigh = (DWORD)(addr >> 32);
+			overlapped.hEvent = hEvent;
+
+			if (ReadFile(hPhysical, dest, chunkLen, NULL, &overlapped) == 0 && GetLastError() != ERROR_IO_PENDING)
+			{
+				error = GetLastError();
+				break;
+			}
+
+			if (GetOverlappedResult(hPhysical, &overlapped, &bytesRead, TRUE) == 0)
+			{
+				error = GetLastError();
+				break;
+			}
+
+			if (bytesRead != chunkLen)
+			{
+				error = ERROR_HANDLE_EOF;
+				break;
+			}
+
+			addr += chunkLen;
+			len -= chunkLen;
+			dest += chunkLen;
 		}
 
-		ReleaseMutex(hReadMutex);
+		endIO(startTicks);
+
+		return error;
+	}
+
+	/* starts a read without waiting for it; slot picks which of the calling thread's events to signal and must
+		not be shared with another of its reads still in flight. if this succeeds, finishRead must be called */
+	DWORD BlockReader::beginRead(unsigned __int64 addr, DWORD len, unsigned char *dest, unsigned int slot,
+		PendingRead *pending)
+	{
+		assert(len <= MAX_READ_LEN);
+
+		memset(&pending->overlapped, 0, sizeof(OVERLAPPED));
+		pending->overlapped.Offset = (DWORD)addr;
+		pending->overlapped.OffsetHigh = (DWORD)(addr >> 32);
+		pending->overlapped.hEvent = getThreadEvent(slot);
+		pending->reader = this;
+		pending->len = len;
+		pending->startTicks = startIO();
+
+		if (ReadFile(hPhysical, dest, len, NULL, &pending->overlapped) == 0 && GetLastError() != ERROR_IO_PENDING)
+		{
+			DWORD error = GetLastError();
+
+			endIO(pending->startTicks);
+			return error;
+		}
 
 		return 0;
 	}
+
+	/* waits for a read started with beginRead */
+	DWORD BlockReader::finishRead(PendingRead *pending)
+	{
+		DWORD bytesRead, error = 0;
+
+		if (GetOverlappedResult(hPhysical, &pending->overlapped, &bytesRead, TRUE) == 0)
+			error = GetLastError();
+		else if (bytesRead != pending->len)
+			error = ERROR_HANDLE_EOF;
+
+		endIO(pending->startTicks);
+
+		return error;
+	}
 }
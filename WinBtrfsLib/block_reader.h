@@ -18,6 +18,26 @@
 
 namespace WinBtrfsLib
 {
+	class BlockReader;
+
+	/* how many reads one thread may have in flight at once through beginRead */
+	const unsigned int MAX_PENDING_READS = 64;
+
+	/* a read started with beginRead; it must stay put in memory until finishRead has been called on it */
+	struct PendingRead
+	{
+		OVERLAPPED				overlapped;
+		BlockReader				*reader;
+		DWORD					len;
+		LONGLONG				startTicks;
+	};
+
+	struct BlockReaderStats
+	{
+		unsigned __int64		reads;
+		unsigned int			latencyUs;		// moving average
+	};
+
 	class BlockReader
 	{
 	public:
@@ -25,9 +45,22 @@ namespace WinBtrfsLib
 		~BlockReader();
 		
 		DWORD directRead(unsigned __int64 addr, unsigned __int64 len, unsigned char *dest);
+		DWORD beginRead(unsigned __int64 addr, DWORD len, unsigned char *dest, unsigned int slot, PendingRead *pending);
+		DWORD finishRead(PendingRead *pending);
+		unsigned __int64 getLoad();
+		void getStats(BlockReaderStats *stats);
 
 	private:
-		HANDLE hPhysical, hReadMutex;
+		static HANDLE getThreadEvent(unsigned int slot);
+		LONGLONG startIO();
+		void endIO(LONGLONG startTicks);
+
+		static DWORD flsEventIdx;
+		static LONGLONG ticksPerSec;
+		HANDLE hPhysical;
+		volatile LONG outstanding;		// reads issued but not yet completed
+		volatile LONG latencyUs;		// exponentially weighted moving average of read latency
+		volatile LONGLONG numReads;
 	};
 }
 
@@ -13,12 +13,15 @@
 #include "btrfs_operations.h"
 #include <Windows.h>
 #include "crc32c.h"
+#include "dentry_cache.h"
 #include "fstree_parser.h"
 
 namespace WinBtrfsLib
 {
 	extern BtrfsObjID mountedSubvol;
 
+	DentryCache dentryCache;
+
 	void validatePath(const char *input, char *output)
 	{
 		size_t c = 0, len = strlen(input);
@@ -49,11 +52,13 @@ namespace WinBtrfsLib
 		output[c] = 0;
 	}
 
-	/* path MUST be validated for this to work properly */
-	unsigned int componentizePath(const char *path, char ***output)
+	/* path MUST be validated for this to work properly; the components and the array pointing to them are
+		allocated from the given arena, and go away with it */
+	unsigned int componentizePath(const char *path, Arena *arena, char ***output)
 	{
-		size_t len = strlen(path), compLen = 0;
-		int numComponents = 0, compIdx = 0, compC = 0;
+		size_t len = strlen(path);
+		unsigned int numComponents = 0, compIdx = 0;
+		char *names;
 
 		if (len == 1 && path[0] == '\\')
 			return 0;
@@ -64,49 +69,36 @@ namespace WinBtrfsLib
 				numComponents++;
 		}
 
-		/* allocate the array of pointers */
-		*output = (char **)malloc(sizeof(char *) * numComponents);
-
-		for (size_t i = 1; i < len; i++) // skip the first backslash
-		{
-			if (path[i] != '\\')
-				compLen++;
-			else
-			{
-				/* allocate this individual pointer in the array */
-				(*output)[compIdx++] = (char *)malloc(compLen + 1);
-				compLen = 0;
-			}
-		}
+		*output = (char **)arena->allocate(sizeof(char *) * numComponents);
 
-		/* get the last one */
-		(*output)[numComponents - 1] = (char *)malloc(compLen + 1);
+		/* one copy of the path (minus the first backslash) holds all the names, with each separator replaced by
+			the null that terminates the name before it */
+		names = (char *)arena->allocate(len);
+		memcpy(names, path + 1, len);
 
-		compIdx = 0;
+		(*output)[compIdx++] = names;
 
-		for (size_t i = 1; i < len; i++) // again, skip the first backslash
+		for (size_t i = 0; i < len - 1; i++)
 		{
-			if (path[i] != '\\')
-			{
-				/* fill in the component name, char by char */
-				(*output)[compIdx][compC++] = path[i];
-			}
-			else
+			if (names[i] == '\\')
 			{
-				/* null terminate */
-				(*output)[compIdx++][compC] = 0;
-				compC = 0;
+				names[i] = 0;
+				(*output)[compIdx++] = names + i + 1;
 			}
 		}
 
-		/* get the last one */
-		(*output)[numComponents - 1][compC] = 0;
-
 		return numComponents;
 	}
 
+	void setupDentryCache(unsigned __int64 maxEntries)
+	{
+		dentryCache.setup(maxEntries);
+	}
+
 	int getPathID(const char *path, FileID *output, FileID *parent)
 	{
+		Arena *scratch = getThreadArena();
+		ArenaScope scope(scratch);
 		char vPath[MAX_PATH], **components;
 		FileID fileID, childID;
 		unsigned int numComponents;
@@ -114,7 +106,7 @@ namespace WinBtrfsLib
 		bool isSubvolume;
 
 		validatePath(path, vPath);
-		numComponents = componentizePath(path, &components);
+		numComponents = componentizePath(vPath, scratch, &components);
 
 		/* start at the root directory of the currently mounted subvolume */
 		fileID.treeID = childID.treeID = mountedSubvol;
@@ -126,10 +118,24 @@ namespace WinBtrfsLib
 			memcpy(&fileID, &childID, sizeof(FileID));
 
 			hash = crc32c((unsigned int)~1, (const unsigned char *)(components[i]), strlen(components[i]));
+
+			/* the cache already knows about subvolume crossings, so a hit needs no further adjustment */
+			switch (dentryCache.lookup(&fileID, hash, components[i], &childID))
+			{
+			case DENTRY_FOUND:
+				continue;
+			case DENTRY_NEGATIVE:
+				return 1;
+			default:
+				break;
+			}
 		
 			if (parseFSTree(fileID.treeID, FSOP_NAME_TO_ID, &fileID.objectID, &hash, components[i],
 				&childID.objectID, &isSubvolume) != 0)
+			{
+				dentryCache.insert(&fileID, hash, components[i], NULL);
 				return 1;
+			}
 
 			if (isSubvolume)
 			{
@@ -137,6 +143,8 @@ namespace WinBtrfsLib
 				childID.treeID = childID.objectID;
 				childID.objectID = OBJID_ROOT_DIR;
 			}
+
+			dentryCache.insert(&fileID, hash, components[i], &childID);
 		}
 
 		memcpy(output, &childID, sizeof(FileID));
@@ -10,11 +10,13 @@
  * any later version.
  */
 
+#include "arena.h"
 #include "types.h"
 
 namespace WinBtrfsLib
 {
 	void validatePath(const char *input, char *output);
-	unsigned int componentizePath(const char *path, char ***output);
+	unsigned int componentizePath(const char *path, Arena *arena, char ***output);
+	void setupDentryCache(unsigned __int64 maxEntries);
 	int getPathID(const char *path, FileID *output, FileID *parent);
 }
@@ -10,23 +10,42 @@
  * any later version.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
+#include "arena.h"
 #include "btrfs_system.h"
+#include "buffer_pool.h"
+#include "chunk_map.h"
+#include "compression.h"
 #include "constants.h"
 #include "crc32c.h"
+#include "data_csum.h"
+#include "dentry_cache.h"
 #include "endian.h"
+#include "node_view.h"
+#include "readahead.h"
 #include "roottree_parser.h"
+#include "trace.h"
+#include "tree_search.h"
 #include "util.h"
 
 namespace WinBtrfsLib
 {
 	extern std::vector<const wchar_t *> *devicePaths;
-	extern std::vector<KeyedItem> chunkTree, rootTree;
+	extern DentryCache dentryCache;
 
 	std::vector<BlockReader *> blockReaders;
 	std::vector<BtrfsSuperblock> supers;
 	std::vector<BtrfsSBChunk *> sbChunks; // using an array of ptrs because BtrfsSBChunk is variably sized
+	ChunkMap chunkMap; // grows a chunk tree leaf at a time as addresses in new chunks come up
+	CRITICAL_SECTION chunkLoadLock; // held only while adding to the chunk map, never for lookups
+	Arena chunkItemArena(64 * 1024); // the chunk items in the map, which stay until the volume is unmounted
+	NodeCache nodeCache;
+	ExtentCache extentCache;
+	BufferPool sectorPool;
+	volatile LONG prefetchJobs = 0, prefetchStopping = 0;
+	HANDLE prefetchIdle = NULL; // set by whichever background prefetch brings prefetchJobs back to zero
 	BtrfsObjID mountedSubvol = (BtrfsObjID)0;
 
 	void allocateBlockReaders()
@@ -43,7 +62,87 @@ namespace WinBtrfsLib
 
 	void cleanUp()
 	{
+		NodeCacheStats stats;
+		ChunkMapStats chunkStats;
+		ExtentCacheStats extentStats;
+		DentryCacheStats dentryStats;
+		ReadaheadStats readaheadStats;
+		ScratchStats scratchStats;
+		DataCsumStats csumStats;
+		TraceStats traceStats;
+
 		printf("cleanUp: warning, this function may be very thread-unsafe\n");
+
+		/* background jobs read through the caches and devices that are about to go away; readahead goes
+			first, since its tree lookups can queue node prefetches */
+		stopReadahead();
+		stopPrefetch();
+
+		/* so whatever is still sitting in the trace rings comes out ahead of the stats */
+		stopTrace();
+
+		nodeCache.getStats(&stats);
+		printf("cleanUp: node cache: %I64u hits, %I64u misses, %I64u evictions, %I64u bytes cached\n"
+			"cleanUp: node cache: %I64u buffers allocated, %I64u reused\n",
+			stats.hits, stats.misses, stats.evictions, stats.bytesCached, stats.bufferAllocs, stats.bufferReuses);
+
+		chunkMap.getStats(&chunkStats);
+		printf("cleanUp: chunk map: %I64u chunks from %I64u chunk tree leaves, %I64u index versions\n",
+			chunkStats.chunks, chunkStats.segments, chunkStats.snapshots);
+
+		extentCache.getStats(&extentStats);
+		printf("cleanUp: extent cache: %I64u hits, %I64u misses, %I64u evictions, %I64u bytes cached\n"
+			"cleanUp: extent cache: %I64u chunk buffers allocated, %I64u reused\n",
+			extentStats.hits, extentStats.misses, extentStats.evictions, extentStats.bytesCached,
+			extentStats.bufferAllocs, extentStats.bufferReuses);
+
+		if (dataCsumsEnabled())
+		{
+			getDataCsumStats(&csumStats);
+			printf("cleanUp: data csums: %I64u bytes verified, %I64u sectors unsummed, %I64u failures\n"
+				"cleanUp: data csums: %I64u range hits, %I64u misses, %I64u evictions, %I64u bytes cached\n"
+				"cleanUp: data csums: %I64u us looking up, %I64u us checksumming (%I64u us per GiB)\n",
+				csumStats.bytesVerified, csumStats.sectorsUnsummed, csumStats.failures, csumStats.hits,
+				csumStats.misses, csumStats.evictions, csumStats.bytesCached, csumStats.lookupMicroseconds,
+				csumStats.crcMicroseconds, (csumStats.bytesVerified != 0 ? (csumStats.lookupMicroseconds +
+				csumStats.crcMicroseconds) * 1024 * 1024 * 1024 / csumStats.bytesVerified : 0));
+		}
+
+		getScratchStats(&scratchStats);
+		printf("cleanUp: scratch: %I64u threads, %I64u arena blocks allocated\n",
+			scratchStats.threads, scratchStats.heapAllocs);
+
+		for (unsigned int type = COMPRESSION_NONE + 1; type <= 0xff; type++)
+		{
+			DecompressorStats decompStats;
+
+			if (getDecompressorStats((CompressionType)type, &decompStats) && decompStats.calls > 0)
+				printf("cleanUp: %s: %I64u decodes, %I64u bytes in, %I64u bytes out, %I64u us (%I64u KiB/s)\n",
+					decompStats.name, decompStats.calls, decompStats.bytesIn, decompStats.bytesOut,
+					decompStats.microseconds, (decompStats.microseconds != 0 ?
+					decompStats.bytesOut * 1000000 / 1024 / decompStats.microseconds : 0));
+		}
+
+		dentryCache.getStats(&dentryStats);
+		printf("cleanUp: dentry cache: %I64u hits, %I64u negative hits, %I64u misses, %I64u evictions, %I64u entries\n",
+			dentryStats.hits, dentryStats.negativeHits, dentryStats.misses, dentryStats.evictions, dentryStats.entries);
+
+		getReadaheadStats(&readaheadStats);
+		printf("cleanUp: readahead: %I64u prefetches (%I64u bytes), %I64u skipped, %I64u job records allocated\n",
+			readaheadStats.requests, readaheadStats.bytes, readaheadStats.skipped, readaheadStats.jobAllocs);
+
+		getTraceStats(&traceStats);
+		printf("cleanUp: trace: %I64u events from %I64u threads, %I64u dropped\n",
+			traceStats.events, traceStats.threads, traceStats.dropped);
+
+		for (size_t i = 0; i < blockReaders.size(); i++)
+		{
+			BlockReaderStats readerStats;
+
+			blockReaders[i]->getStats(&readerStats);
+			printf("cleanUp: device %u: %I64u reads, %u us average latency\n", (unsigned int)i,
+				readerStats.reads, readerStats.latencyUs);
+		}
 	
 		/* iterate backwards thru the block readers and destroy them */
 		for (size_t i = blockReaders.size(); i > 0; --i)
@@ -53,55 +152,122 @@ namespace WinBtrfsLib
 		}
 	}
 
-	PhysAddr *logiToPhys(LogiAddr logiAddr, unsigned __int64 len)
+	/* seeds the chunk map with the system chunks from the superblock, which hold the chunk tree; everything
+		else is looked up in the chunk tree the first time an address in it comes up */
+	void buildChunkMap()
 	{
-		/* try superblock chunks first */
-		size_t size = sbChunks.size();
-		for (size_t i = 0; i < size; i++)
+		std::vector<ChunkMapping> mappings;
+		ChunkMapping mapping;
+
+		InitializeCriticalSection(&chunkLoadLock);
+
+		std::vector<BtrfsSBChunk *>::iterator it = sbChunks.begin(), end = sbChunks.end();
+		for ( ; it != end; ++it)
 		{
-			BtrfsSBChunk *chunk = sbChunks.at(i);
-		
-			if (logiAddr >= chunk->key.offset && logiAddr + len <= chunk->key.offset + chunk->chunkItem.chunkSize)
-			{
-				PhysAddr *physAddr = (PhysAddr *)malloc(sizeof(PhysAddr) +
-					(chunk->chunkItem.numStripes * sizeof(BtrfsChunkItemStripe)));
-			
-				physAddr->offset = logiAddr - chunk->key.offset;
-				physAddr->len = len;
-				memcpy(&physAddr->chunkItem, &chunk->chunkItem, sizeof(BtrfsChunkItem) +
-					(chunk->chunkItem.numStripes * sizeof(BtrfsChunkItemStripe)));
+			mapping.logiStart = endian64((*it)->key.offset);
+			mapping.size = endian64((*it)->chunkItem.chunkSize);
+			mapping.chunkItem = &(*it)->chunkItem;
 
-				return physAddr;
-			}
+			mappings.push_back(mapping);
 		}
 
-		/* next try the chunk tree */
-		size = chunkTree.size();
-		for (size_t i = 0; i < size; i++)
+		chunkMap.setSystemChunks(&mappings[0], mappings.size());
+	}
+
+	/* looks up the chunk containing logiAddr in the chunk tree and adds it to the map, along with every other
+		chunk in the same leaf, since those are likely to come up before long. the chunk tree lives in the system
+		chunks, which are mapped from the start, so reading it never comes back here */
+	static void loadChunkMappings(LogiAddr logiAddr)
+	{
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+
+		/* all chunk items belong to the first chunk tree, object ID 0x100 */
+		key.objectID = (BtrfsObjID)endian64(0x100);
+		key.type = TYPE_CHUNK_ITEM;
+		key.offset = endian64(logiAddr);
+
+		if (searchTreeAtOrBefore(endian64(supers[0].ctRoot), &key, &cursor))
 		{
-			KeyedItem& kItem = chunkTree.at(i);
+			LeafView leaf(cursor.nodes[0]);
+			std::vector<ChunkMapping> mappings;
+			bool loaded;
 
-			if (kItem.key.type == TYPE_CHUNK_ITEM)
+			EnterCriticalSection(&chunkLoadLock);
+
+			/* another thread may have loaded this leaf while this one was reading it */
+			loaded = (chunkMap.find(logiAddr) != NULL);
+
+			for (unsigned int i = 0; i < leaf.size() && !loaded; i++)
 			{
-				BtrfsChunkItem *chunkItem = (BtrfsChunkItem *)kItem.data;
+				const BtrfsItem *item = leaf.item(i);
+				ChunkMapping mapping;
 
-				if (logiAddr >= kItem.key.offset && logiAddr + len <= kItem.key.offset + chunkItem->chunkSize)
-				{
-					PhysAddr *physAddr = (PhysAddr *)malloc(sizeof(PhysAddr) +
-						(chunkItem->numStripes * sizeof(BtrfsChunkItemStripe)));
-			
-					physAddr->offset = logiAddr - kItem.key.offset;
-					physAddr->len = len;
-					memcpy(&physAddr->chunkItem, chunkItem, sizeof(BtrfsChunkItem) +
-						(chunkItem->numStripes * sizeof(BtrfsChunkItemStripe)));
+				if (item->key.type != TYPE_CHUNK_ITEM)
+					continue;
 
-					return physAddr;
-				}
+				const BtrfsChunkItem *chunkItem = leaf.data<BtrfsChunkItem>(i);
+
+				/* check the ACTUAL size now that we have the number of stripes */
+				assert(leaf.dataSize(i) == sizeof(BtrfsChunkItem) +
+					(endian16(chunkItem->numStripes) * sizeof(BtrfsChunkItemStripe)));
+
+				BtrfsChunkItem *copy = (BtrfsChunkItem *)chunkItemArena.allocate(leaf.dataSize(i));
+				memcpy(copy, chunkItem, leaf.dataSize(i));
+
+				mapping.logiStart = endian64(item->key.offset);
+				mapping.size = endian64(chunkItem->chunkSize);
+				mapping.chunkItem = copy;
+
+				mappings.push_back(mapping);
 			}
+
+			/* the system chunks are in here too, which does no harm; they're found apart from the rest */
+			if (!mappings.empty())
+				chunkMap.addSegment(&mappings[0], mappings.size());
+
+			LeaveCriticalSection(&chunkLoadLock);
+		}
+
+		releaseCursor(&cursor);
+	}
+
+	/* finds the chunk containing the given logical range, loading it from the chunk tree if need be; returns
+		false if no one chunk does */
+	static bool findChunkMapping(LogiAddr logiAddr, unsigned __int64 len, ChunkMapping *mapping)
+	{
+		const ChunkMapping *found;
+
+		if ((found = chunkMap.find(logiAddr)) == NULL)
+		{
+			loadChunkMappings(logiAddr);
+
+			if ((found = chunkMap.find(logiAddr)) == NULL)
+				return false;
+		}
+
+		*mapping = *found;
+
+		return (logiAddr + len <= mapping->logiStart + mapping->size);
+	}
+
+	/* finds the chunk containing the given logical range; the chunk item in the result is borrowed */
+	bool logiToPhys(LogiAddr logiAddr, unsigned __int64 len, PhysAddr *physAddr)
+	{
+		ChunkMapping mapping;
+
+		if (findChunkMapping(logiAddr, len, &mapping))
+		{
+			physAddr->offset = logiAddr - mapping.logiStart;
+			physAddr->len = len;
+			physAddr->chunkItem = mapping.chunkItem;
+
+			return true;
 		}
 
 		/* if flow gets here, it means we failed to find an appropriate chunk */
 		assert(0);
+		return false;
 	}
 
 	int loadSBs(bool dump)
@@ -281,31 +447,655 @@ namespace WinBtrfsLib
 		}
 	}
 
-	unsigned char *loadNode(LogiAddr addr, BtrfsHeader **header)
+	void setupNodeCache(unsigned __int64 budget)
 	{
 		/* seems to be a safe assumption that all devices share the same node size */
-		unsigned int blockSize = endian32(supers[0].nodeSize);
-		unsigned char *nodeBlock = (unsigned char *)malloc(blockSize);
-	
-		/* this might not always be fatal, so in the future an assertion may be inappropriate */
-		assert(readLogical(addr, blockSize, nodeBlock) == 0);
+		nodeCache.setup(endian32(supers[0].nodeSize), budget);
 
-		*header = (BtrfsHeader *)nodeBlock;
+		prefetchIdle = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
 
-		/* also possibly nonfatal */
-		assert(~crc32c((unsigned int)~0, nodeBlock + sizeof(BtrfsChecksum),
-			blockSize - sizeof(BtrfsChecksum)) == endian32((*header)->csum.crc32c));
+	unsigned int getNodeSize()
+	{
+		/* seems to be a safe assumption that all devices share the same node size */
+		return endian32(supers[0].nodeSize);
+	}
+
+	/* the returned node is pinned in the node cache; pass it to releaseNode when done with it. returns NULL if no
+		copy of the node could be read and pass its checksum */
+	unsigned char *loadNode(LogiAddr addr, BtrfsHeader **header)
+	{
+		unsigned char *nodeBlock;
+
+		/* nodes that come out of the cache have already been checksummed */
+		if ((nodeBlock = nodeCache.acquire(addr)) == NULL)
+		{
+			TraceScope traceScope(TRACE_META, __FUNCTION__);
+
+			/* seems to be a safe assumption that all devices share the same node size */
+			unsigned int blockSize = endian32(supers[0].nodeSize);
+
+			unsigned int preferred, numMirrors = getMirrors(addr, &preferred);
+			bool good = false;
+
+			nodeBlock = nodeCache.allocate();
+
+			/* a copy that can't be read or fails its checksum is passed over for the next one */
+			for (unsigned int i = 0; i < numMirrors && !good; i++)
+			{
+				unsigned int mirror = (preferred + i) % numMirrors;
+				DWORD result;
+
+				if ((result = readLogicalMirror(addr, blockSize, nodeBlock, mirror)) != 0)
+					TRACE(TRACE_META, TRACE_WARNING, "reading copy %u of node 0x%I64x failed! (%u)", mirror, addr,
+						result);
+				else if (~crc32c((unsigned int)~0, nodeBlock + sizeof(BtrfsChecksum),
+					blockSize - sizeof(BtrfsChecksum)) != endian32(((BtrfsHeader *)nodeBlock)->csum.crc32c))
+					TRACE(TRACE_META, TRACE_WARNING, "copy %u of node 0x%I64x has a bad checksum!", mirror, addr);
+				else if (!checkNode(nodeBlock, blockSize))
+					TRACE(TRACE_META, TRACE_WARNING, "copy %u of node 0x%I64x has items that don't fit!", mirror, addr);
+				else
+					good = true;
+			}
+
+			/* a bad node must never reach the cache, where every later lookup would take it as verified */
+			if (!good)
+			{
+				TRACE(TRACE_META, TRACE_ERROR, "no good copy of node 0x%I64x among %u!", addr, numMirrors);
+
+				nodeCache.discard(nodeBlock);
+				*header = NULL;
+				return NULL;
+			}
+
+			nodeBlock = nodeCache.publish(addr, nodeBlock);
+		}
+
+		*header = (BtrfsHeader *)nodeBlock;
 
 		return nodeBlock;
 	}
 
+	void releaseNode(unsigned char *nodeBlock)
+	{
+		nodeCache.release(nodeBlock);
+	}
+
+	/* the most nodes a single prefetch read will cover */
+	const unsigned int MAX_PREFETCH_RUN = 16;
+
+	/* background prefetches beyond this many are dropped rather than queued */
+	const LONG MAX_PREFETCH_JOBS = 4;
+
+	/* a run of logically adjacent nodes within one chunk, read with a single I/O */
+	struct PrefetchRun
+	{
+		LogiAddr				addr;
+		unsigned int			numNodes;
+		unsigned char			*buffer;
+		PendingRead				pending;
+		bool					striped;	// read synchronously instead of through pending
+		DWORD					error;
+	};
+
+	struct PrefetchJob
+	{
+		size_t					count;
+		LogiAddr				addrs		[0x0];
+	};
+
+	/* checks and caches the nodes of a completed prefetch run; a copy that fails its checksum or checkNode is
+		simply left out, and loadNode will go to the other mirrors for it if it's ever actually needed */
+	static void publishPrefetchRun(const PrefetchRun *run, unsigned int nodeSize)
+	{
+		for (unsigned int i = 0; i < run->numNodes; i++)
+		{
+			const unsigned char *src = run->buffer + (size_t)i * nodeSize;
+			unsigned char *nodeBlock;
+
+			if (~crc32c((unsigned int)~0, src + sizeof(BtrfsChecksum), nodeSize - sizeof(BtrfsChecksum)) !=
+				endian32(((const BtrfsHeader *)src)->csum.crc32c) || !checkNode(src, nodeSize))
+				continue;
+
+			nodeBlock = nodeCache.allocate();
+			memcpy(nodeBlock, src, nodeSize);
+
+			nodeCache.release(nodeCache.publish(run->addr + (LogiAddr)i * nodeSize, nodeBlock));
+		}
+	}
+
+	/* brings a set of nodes into the node cache with as much of the I/O in flight at once as possible; nodes
+		that are already cached are skipped, and adjacent ones are read together. failures are ignored here,
+		since loadNode will run into them properly later */
+	void prefetchNodes(const LogiAddr *addrs, size_t count)
+	{
+		unsigned int nodeSize = endian32(supers[0].nodeSize);
+		std::vector<LogiAddr> missing;
+		std::vector<PrefetchRun> runs;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!nodeCache.contains(addrs[i]))
+				missing.push_back(addrs[i]);
+		}
+
+		/* prefetching more than a fraction of the cache would just evict nodes before anyone gets to them */
+		if (missing.size() > nodeCache.capacity() / 4)
+			missing.resize(nodeCache.capacity() / 4);
+
+		if (missing.empty())
+			return;
+
+		std::sort(missing.begin(), missing.end());
+		missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+		/* nodes that are logically adjacent within a chunk are physically adjacent too (striped profiles aside,
+			and readStriped takes care of those) */
+		for (size_t i = 0; i < missing.size(); )
+		{
+			ChunkMapping mapping;
+			PrefetchRun run;
+
+			if (!findChunkMapping(missing[i], nodeSize, &mapping))
+			{
+				i++;
+				continue;
+			}
+
+			run.addr = missing[i];
+			run.numNodes = 1;
+			run.buffer = NULL;
+			run.striped = false;
+			run.error = 0;
+
+			while (i + run.numNodes < missing.size() && run.numNodes < MAX_PREFETCH_RUN &&
+				missing[i + run.numNodes] == run.addr + (LogiAddr)run.numNodes * nodeSize &&
+				run.addr + (LogiAddr)(run.numNodes + 1) * nodeSize <= mapping.logiStart + mapping.size)
+				run.numNodes++;
+
+			i += run.numNodes;
+			runs.push_back(run);
+		}
+
+		/* runs on unstriped chunks go out together, a thread's worth of pending reads at a time; striped runs
+			are read afterward, since readStriped needs those same per-thread slots for its own I/O */
+		for (size_t first = 0; first < runs.size(); first += MAX_PENDING_READS)
+		{
+			size_t last = (first + MAX_PENDING_READS < runs.size() ? first + MAX_PENDING_READS : runs.size());
+
+			for (size_t i = first; i < last; i++)
+			{
+				PrefetchRun *run = &runs[i];
+				DWORD len = run->numNodes * nodeSize;
+				PhysAddr physAddr;
+				unsigned int preferred;
+
+				getMirrors(run->addr, &preferred);
+				logiToPhys(run->addr, len, &physAddr);
+
+				run->buffer = (unsigned char *)malloc(len);
+
+				switch (endian64(physAddr.chunkItem->type) &
+					(BGFLAG_RAID0 | BGFLAG_RAID1 | BGFLAG_DUPLICATE | BGFLAG_RAID10))
+				{
+				case BGFLAG_SINGLE:
+				case BGFLAG_RAID1:
+				case BGFLAG_DUPLICATE:
+				{
+					const BtrfsChunkItemStripe *stripe = &physAddr.chunkItem->stripes[preferred];
+
+					run->error = getBlockReader(stripe->devID)->beginRead(endian64(stripe->offset) + physAddr.offset,
+						len, run->buffer, (unsigned int)(i - first), &run->pending);
+					break;
+				}
+				default:
+					run->striped = true;
+					break;
+				}
+			}
+
+			for (size_t i = first; i < last; i++)
+			{
+				if (!runs[i].striped && runs[i].error == 0)
+					runs[i].error = runs[i].pending.reader->finishRead(&runs[i].pending);
+			}
+
+			for (size_t i = first; i < last; i++)
+			{
+				unsigned int preferred;
+
+				if (!runs[i].striped)
+					continue;
+
+				getMirrors(runs[i].addr, &preferred);
+				runs[i].error = readLogicalMirror(runs[i].addr, runs[i].numNodes * nodeSize, runs[i].buffer, preferred);
+			}
+
+			for (size_t i = first; i < last; i++)
+			{
+				if (runs[i].error == 0)
+					publishPrefetchRun(&runs[i], nodeSize);
+
+				free(runs[i].buffer);
+			}
+		}
+	}
+
+	static void finishPrefetchJob()
+	{
+		if (InterlockedDecrement(&prefetchJobs) == 0 && prefetchIdle != NULL)
+			SetEvent(prefetchIdle);
+	}
+
+	static DWORD WINAPI prefetchWorker(LPVOID param)
+	{
+		PrefetchJob *job = (PrefetchJob *)param;
+
+		prefetchNodes(job->addrs, job->count);
+
+		free(job);
+
+		/* cleanUp may be closing the devices as soon as this is done */
+		finishPrefetchJob();
+
+		return 0;
+	}
+
+	/* like prefetchNodes, but on the thread pool, so the caller can carry on with what it already has */
+	void prefetchNodesAsync(const LogiAddr *addrs, size_t count)
+	{
+		PrefetchJob *job;
+
+		if (count == 0 || prefetchStopping)
+			return;
+
+		/* stopPrefetch may have read prefetchJobs before it went up, in which case it's counting on this seeing
+			the flag */
+		if (InterlockedIncrement(&prefetchJobs) > MAX_PREFETCH_JOBS || prefetchStopping)
+		{
+			finishPrefetchJob();
+			return;
+		}
+
+		job = (PrefetchJob *)malloc(sizeof(PrefetchJob) + count * sizeof(LogiAddr));
+		job->count = count;
+		memcpy(job->addrs, addrs, count * sizeof(LogiAddr));
+
+		if (!QueueUserWorkItem(&prefetchWorker, job, WT_EXECUTEDEFAULT))
+		{
+			free(job);
+			finishPrefetchJob();
+		}
+	}
+
+	/* queues no more background prefetches, and returns once the ones already queued are done */
+	void stopPrefetch()
+	{
+		InterlockedExchange(&prefetchStopping, 1);
+
+		while (prefetchJobs != 0)
+			WaitForSingleObject(prefetchIdle, INFINITE);
+	}
+
+	/* reads in all the children of an internal node in one batch, for walks that are about to visit every one */
+	void prefetchChildren(const unsigned char *nodeBlock)
+	{
+		const BtrfsHeader *header = (const BtrfsHeader *)nodeBlock;
+		const BtrfsKeyPtr *keyPtrs = (const BtrfsKeyPtr *)(nodeBlock + sizeof(BtrfsHeader));
+		unsigned int nrItems = endian32(header->nrItems);
+		std::vector<LogiAddr> addrs(nrItems);
+
+		if (header->level == 0)
+			return;
+
+		for (unsigned int i = 0; i < nrItems; i++)
+			addrs[i] = endian64(keyPtrs[i].blockNum);
+
+		if (!addrs.empty())
+			prefetchNodes(&addrs[0], addrs.size());
+	}
+
+	/* partial sectors at either end of a direct read each need one of these at a time, per reading thread */
+	const size_t SECTOR_POOL_IDLE = 32;
+
+	void setupExtentCache(unsigned __int64 budget)
+	{
+		extentCache.setup(budget);
+		sectorPool.setup(endian32(supers[0].sectorSize), SECTOR_POOL_IDLE);
+	}
+
+	/* reads file data the way readLogical does, except that with verification on, a copy whose sectors don't
+		match the checksum tree is passed over for the next one just like a copy that couldn't be read */
+	static DWORD readData(LogiAddr addr, unsigned __int64 len, unsigned char *dest)
+	{
+		unsigned int preferred, numMirrors;
+		DWORD error = 0;
+		TraceScope traceScope(TRACE_DISK, __FUNCTION__);
+
+		if (!dataCsumsEnabled())
+			return readLogical(addr, len, dest);
+
+		numMirrors = getMirrors(addr, &preferred);
+
+		for (unsigned int i = 0; i < numMirrors; i++)
+		{
+			unsigned int mirror = (preferred + i) % numMirrors;
+
+			if ((error = readLogicalMirror(addr, len, dest, mirror)) != 0)
+				TRACE(TRACE_DISK, TRACE_WARNING, "reading copy %u of 0x%I64x failed! (%u)", mirror, addr, error);
+			else if ((error = verifyData(addr, len, dest)) != 0)
+				TRACE(TRACE_READ, TRACE_WARNING, "copy %u of 0x%I64x failed verification!", mirror, addr);
+			else
+				break;
+		}
+
+		return error;
+	}
+
+	/* returns the compressed bytes of an extent as they are on disk, pinned in the extent cache. they're keyed
+		as the first uncompressed chunk at that address, which is exactly what they are; compressed extents
+		are never bigger than a chunk */
+	static unsigned char *loadRawExtent(const ExtentMapping *mapping, DWORD *error)
+	{
+		ExtentCacheKey key;
+		unsigned char *raw;
+		size_t size;
+
+		assert(mapping->diskSize <= EXTENT_CHUNK_SIZE);
+
+		key.addr = mapping->diskAddr;
+		key.offset = 0;
+		key.compression = COMPRESSION_NONE;
+
+		if ((raw = extentCache.acquire(&key, &size)) != NULL)
+		{
+			assert(size == mapping->diskSize);
+			return raw;
+		}
+
+		raw = extentCache.allocate((size_t)mapping->diskSize);
+
+		if ((*error = readData(mapping->diskAddr, mapping->diskSize, raw)) != ERROR_SUCCESS)
+		{
+			extentCache.discard(raw);
+			return NULL;
+		}
+
+		return extentCache.publish(&key, raw);
+	}
+
+	/* returns the whole of a compressed extent, decompressed and pinned in the extent cache (pass it to
+		releaseExtent when done with it), or NULL on failure with the reason in *error */
+	unsigned char *loadExtent(const ExtentMapping *mapping, DWORD *error)
+	{
+		Arena *scratch = getThreadArena();
+		ArenaScope scope(scratch);
+		ExtentCacheKey key, rawKey;
+		unsigned char *compressed, *decompressed, *raw;
+		size_t size;
+		int result;
+
+		key.addr = mapping->diskAddr;
+		key.offset = 0;
+		key.compression = mapping->compression;
+
+		if ((decompressed = extentCache.acquire(&key, &size)) != NULL)
+		{
+			assert(size == mapping->decodedSize);
+			return decompressed;
+		}
+
+		if (getDecompressor(mapping->compression) == NULL)
+		{
+			*error = ERROR_UNSUPPORTED_COMPRESSION;
+			return NULL;
+		}
+
+		/* the read of the compressed form shows up inside this */
+		TraceScope traceScope(TRACE_READ, __FUNCTION__);
+
+		/* random readers may have left the compressed form in the cache; otherwise, it's only needed until
+			it's been decoded */
+		rawKey.addr = mapping->diskAddr;
+		rawKey.offset = 0;
+		rawKey.compression = COMPRESSION_NONE;
+
+		if ((raw = extentCache.acquire(&rawKey, &size)) != NULL)
+			compressed = raw;
+		else
+		{
+			compressed = (unsigned char *)scratch->allocate((size_t)mapping->diskSize);
+
+			if ((*error = readData(mapping->diskAddr, mapping->diskSize, compressed)) != ERROR_SUCCESS)
+				return NULL;
+		}
+
+		decompressed = extentCache.allocate(mapping->decodedSize);
+
+		result = decompressRange(mapping->compression, compressed, mapping->diskSize, 0,
+			(size_t)mapping->decodedSize, decompressed);
+
+		if (raw != NULL)
+			extentCache.release(raw);
+
+		if (result != 0)
+		{
+			TRACE(TRACE_READ, TRACE_ERROR, "decompression of the extent at 0x%I64x failed! (%d)", mapping->diskAddr,
+				result);
+			extentCache.discard(decompressed);
+			*error = PLA_E_CABAPI_FAILURE; // appopriate error code?
+			return NULL;
+		}
+
+		return extentCache.publish(&key, decompressed);
+	}
+
+	/* returns the EXTENT_CHUNK_SIZE-aligned piece of an uncompressed extent starting at chunkOffset (relative to
+		the start of the disk extent), pinned in the extent cache; the last piece of an extent may be short */
+	unsigned char *loadExtentChunk(const ExtentMapping *mapping, unsigned __int64 chunkOffset, size_t *size,
+		DWORD *error)
+	{
+		ExtentCacheKey key;
+		unsigned char *chunk;
+
+		assert(mapping->compression == COMPRESSION_NONE && chunkOffset % EXTENT_CHUNK_SIZE == 0 &&
+			chunkOffset < mapping->diskSize);
+
+		key.addr = mapping->diskAddr;
+		key.offset = chunkOffset;
+		key.compression = COMPRESSION_NONE;
+
+		if ((chunk = extentCache.acquire(&key, size)) != NULL)
+			return chunk;
+
+		*size = (size_t)(mapping->diskSize - chunkOffset < EXTENT_CHUNK_SIZE ? mapping->diskSize - chunkOffset :
+			EXTENT_CHUNK_SIZE);
+		chunk = extentCache.allocate(*size);
+
+		if ((*error = readData(mapping->diskAddr + chunkOffset, *size, chunk)) != ERROR_SUCCESS)
+		{
+			extentCache.discard(chunk);
+			return NULL;
+		}
+
+		return extentCache.publish(&key, chunk);
+	}
+
+	/* reads an arbitrary range of the disk into dest. devices only read whole sectors, so the sectors that are
+		whole in the range are read straight into dest and any partial one at either end goes through a pooled
+		sector buffer */
+	static DWORD readUnaligned(LogiAddr addr, unsigned __int64 len, unsigned char *dest)
+	{
+		unsigned int sectorSize = endian32(supers[0].sectorSize);
+		unsigned char *sector = NULL;
+		DWORD error = ERROR_SUCCESS;
+
+		while (len > 0 && error == ERROR_SUCCESS)
+		{
+			unsigned int skip = (unsigned int)(addr % sectorSize);
+
+			if (skip != 0 || len < sectorSize)
+			{
+				/* a partial sector */
+				size_t piece = (size_t)(sectorSize - skip < len ? sectorSize - skip : len);
+
+				if (sector == NULL)
+					sector = (unsigned char *)sectorPool.get();
+
+				if ((error = readData(addr - skip, sectorSize, sector)) == ERROR_SUCCESS)
+					memcpy(dest, sector + skip, piece);
+
+				addr += piece;
+				dest += piece;
+				len -= piece;
+			}
+			else
+			{
+				/* all the whole sectors at once */
+				unsigned __int64 whole = len - len % sectorSize;
+
+				error = readData(addr, whole, dest);
+
+				addr += whole;
+				dest += whole;
+				len -= whole;
+			}
+		}
+
+		if (sector != NULL)
+			sectorPool.put(sector);
+
+		return error;
+	}
+
+	/* copies bytes [from, from + len) of an uncompressed extent into dest, for readers that don't look like
+		they'll be back for the rest of it. pieces that happen to be in the extent cache already (thanks to an
+		earlier sequential reader, say) come from there; everything else is read from the disk directly into
+		dest, without going through or filling the cache, so the I/O is only as big as the range */
+	DWORD readExtentDirect(const ExtentMapping *mapping, unsigned __int64 from, size_t len, unsigned char *dest)
+	{
+		ExtentCacheKey key;
+		unsigned __int64 runStart = from, runEnd = from;
+		DWORD error;
+
+		assert(mapping->compression == COMPRESSION_NONE && from + len <= mapping->diskSize);
+
+		key.addr = mapping->diskAddr;
+		key.compression = COMPRESSION_NONE;
+
+		/* uncached stretches are collected into runs so that each is one read, however many chunks it spans */
+		while (len > 0)
+		{
+			unsigned __int64 chunkOffset = from - from % EXTENT_CHUNK_SIZE;
+			size_t size, skip = (size_t)(from - chunkOffset), piece = (len < EXTENT_CHUNK_SIZE - skip ? len :
+				EXTENT_CHUNK_SIZE - skip);
+			unsigned char *chunk;
+
+			key.offset = chunkOffset;
+
+			if ((chunk = extentCache.acquire(&key, &size)) != NULL)
+			{
+				if (runEnd > runStart && (error = readUnaligned(mapping->diskAddr + runStart, runEnd - runStart,
+					dest - (size_t)(runEnd - runStart))) != ERROR_SUCCESS)
+				{
+					releaseExtent(chunk);
+					return error;
+				}
+
+				memcpy(dest, chunk + skip, piece);
+				releaseExtent(chunk);
+
+				runStart = runEnd = from + piece;
+			}
+			else
+				runEnd = from + piece;
+
+			from += piece;
+			dest += piece;
+			len -= piece;
+		}
+
+		if (runEnd > runStart)
+			return readUnaligned(mapping->diskAddr + runStart, runEnd - runStart, dest - (size_t)(runEnd - runStart));
+
+		return ERROR_SUCCESS;
+	}
+
+	/* copies bytes [from, from + len) of a compressed extent's decoded data into dest, for readers that don't
+		look like they'll be back for the rest of it. extents whose decoder is seekable (LZO) are decoded only
+		as far as the range needs and straight into dest, with just the compressed form going into the cache;
+		zlib and zstd streams can't be entered partway, so those are decoded and cached whole through
+		loadExtent, where at least the next read of the same extent gets them for free */
+	DWORD readExtentRange(const ExtentMapping *mapping, unsigned __int64 from, size_t len, unsigned char *dest)
+	{
+		const Decompressor *decompressor = getDecompressor(mapping->compression);
+		ExtentCacheKey key;
+		unsigned char *data;
+		size_t size;
+		DWORD error;
+		int result;
+
+		assert(from + len <= mapping->decodedSize);
+
+		if (decompressor == NULL)
+			return ERROR_UNSUPPORTED_COMPRESSION;
+
+		key.addr = mapping->diskAddr;
+		key.offset = 0;
+		key.compression = mapping->compression;
+
+		/* a copy that's decoded already beats decoding any of it again */
+		if (!decompressor->seekable)
+		{
+			if ((data = loadExtent(mapping, &error)) == NULL)
+				return error;
+		}
+		else
+			data = extentCache.acquire(&key, &size);
+
+		if (data != NULL)
+		{
+			memcpy(dest, data + from, len);
+			releaseExtent(data);
+
+			return ERROR_SUCCESS;
+		}
+
+		if ((data = loadRawExtent(mapping, &error)) == NULL)
+			return error;
+
+		result = decompressRange(mapping->compression, data, mapping->diskSize, from, len, dest);
+		releaseExtent(data);
+
+		if (result != 0)
+		{
+			TRACE(TRACE_READ, TRACE_ERROR, "decompression of the extent at 0x%I64x failed! (%d)", mapping->diskAddr,
+				result);
+			return PLA_E_CABAPI_FAILURE;
+		}
+
+		return ERROR_SUCCESS;
+	}
+
+	void releaseExtent(unsigned char *extent)
+	{
+		extentCache.release(extent);
+	}
+
+	/* every tree asked for here was named by the volume itself, so one that isn't in the index means the volume
+		is damaged; the lookup stays outside the assertion so that it still happens in release builds */
 	LogiAddr getTreeRootAddr(BtrfsObjID tree)
 	{
-		LogiAddr addr;
+		const RootInfo *root = findRoot(tree);
 
-		assert(parseRootTree(RTOP_GET_ADDR, &tree, &addr) == 0);
+		if (root == NULL)
+		{
+			printf("getTreeRootAddr: there is no ROOT_ITEM for tree 0x%I64x!\n", (unsigned __int64)tree);
+			assert(0);
+			return 0;
+		}
 
-		return addr;
+		return root->addr;
 	}
 
 	int verifyDevices()
@@ -399,63 +1189,177 @@ namespace WinBtrfsLib
 		assert(0);
 	}
 
-	DWORD readLogical(LogiAddr addr, unsigned __int64 len, unsigned char *dest)
+	/* reads from a raid0 or raid10 chunk: the range is cut at stripe boundaries and each piece is read from its
+		own device straight into dest, with up to MAX_PENDING_READS pieces in flight so all devices work at once */
+	DWORD readStriped(const PhysAddr *physAddr, unsigned __int64 len, unsigned char *dest, bool raid10, unsigned int mirror)
 	{
-		PhysAddr *physAddr;
+		const BtrfsChunkItem *chunkItem = physAddr->chunkItem;
+		unsigned __int64 stripeLen = endian64(chunkItem->stripeLen), offset = physAddr->offset;
+		unsigned int subStripes = (raid10 ? endian16(chunkItem->subStripes) : 1);
+		unsigned int factor = endian16(chunkItem->numStripes) / subStripes;
+		PendingRead pending[MAX_PENDING_READS];
+		unsigned int numPending = 0;
+		DWORD error = 0;
+
+		assert(stripeLen != 0 && subStripes != 0 && factor != 0);
+
+		while (len > 0)
+		{
+			/* stripe units go round-robin across the devices (or mirror pairs, for raid10) */
+			unsigned __int64 stripeNr = offset / stripeLen, stripeOffset = offset % stripeLen;
+			unsigned int stripeIndex = (unsigned int)(stripeNr % factor) * subStripes;
+			DWORD pieceLen = (DWORD)(stripeLen - stripeOffset < len ? stripeLen - stripeOffset : len);
+
+			stripeNr /= factor;
+
+			/* for raid10, every piece comes from the same copy of its pair */
+			const BtrfsChunkItemStripe *stripe = &chunkItem->stripes[stripeIndex + mirror];
+
+			if (numPending == MAX_PENDING_READS)
+			{
+				for (unsigned int i = 0; i < numPending; i++)
+				{
+					DWORD result = pending[i].reader->finishRead(&pending[i]);
+					if (error == 0)
+						error = result;
+				}
+
+				numPending = 0;
+
+				if (error != 0)
+					return error;
+			}
+
+			if ((error = getBlockReader(stripe->devID)->beginRead(endian64(stripe->offset) + stripeNr * stripeLen +
+				stripeOffset, pieceLen, dest, numPending, &pending[numPending])) != 0)
+				break;
+
+			numPending++;
+			offset += pieceLen;
+			dest += pieceLen;
+			len -= pieceLen;
+		}
+
+		/* everything that was started has to be waited for, even after an error, since it's writing into dest */
+		for (unsigned int i = 0; i < numPending; i++)
+		{
+			DWORD result = pending[i].reader->finishRead(&pending[i]);
+			if (error == 0)
+				error = result;
+		}
+
+		return error;
+	}
+
+	/* how many copies of the data at addr there are; *preferred is set to the copy that looks cheapest to read
+		right now, going by the outstanding reads and recent latency of the devices involved */
+	unsigned int getMirrors(LogiAddr addr, unsigned int *preferred)
+	{
+		PhysAddr physAddr;
+		unsigned int first = 0, numMirrors;
+
+		*preferred = 0;
+
+		if (!logiToPhys(addr, 1, &physAddr))
+			return 1;
+
+		switch (endian64(physAddr.chunkItem->type) & (BGFLAG_RAID0 | BGFLAG_RAID1 | BGFLAG_DUPLICATE | BGFLAG_RAID10))
+		{
+		case BGFLAG_RAID1:
+		case BGFLAG_DUPLICATE:
+			numMirrors = endian16(physAddr.chunkItem->numStripes);
+			break;
+		case BGFLAG_RAID10:
+		{
+			/* judge by the pair holding the first stripe unit; the rest of the read tends to follow suit */
+			unsigned __int64 stripeNr = physAddr.offset / endian64(physAddr.chunkItem->stripeLen);
+
+			numMirrors = endian16(physAddr.chunkItem->subStripes);
+			first = (unsigned int)(stripeNr % (endian16(physAddr.chunkItem->numStripes) / numMirrors)) * numMirrors;
+			break;
+		}
+		default:
+			return 1;
+		}
+
+		unsigned __int64 bestLoad = (unsigned __int64)-1;
+
+		for (unsigned int i = 0; i < numMirrors; i++)
+		{
+			unsigned __int64 load = getBlockReader(physAddr.chunkItem->stripes[first + i].devID)->getLoad();
+
+			if (load < bestLoad)
+			{
+				bestLoad = load;
+				*preferred = i;
+			}
+		}
+
+		return numMirrors;
+	}
+
+	/* reads one particular copy of a range; mirror must be less than what getMirrors returns for addr */
+	DWORD readLogicalMirror(LogiAddr addr, unsigned __int64 len, unsigned char *dest, unsigned int mirror)
+	{
+		PhysAddr physAddr;
 		BlockReader *blockReader;
 
-		physAddr = logiToPhys(addr, len);
+		if (!logiToPhys(addr, len, &physAddr))
+			return ERROR_INVALID_ADDRESS;
 
 		/* isolate the flags having to do with striping levels */
-		switch (physAddr->chunkItem.type & (BGFLAG_RAID0 | BGFLAG_RAID1 | BGFLAG_DUPLICATE | BGFLAG_RAID10))
+		switch (endian64(physAddr.chunkItem->type) & (BGFLAG_RAID0 | BGFLAG_RAID1 | BGFLAG_DUPLICATE | BGFLAG_RAID10))
 		{
 		case BGFLAG_SINGLE:
-	single_fallback: // remove this label
-		{
-			assert(physAddr->chunkItem.numStripes >= 1);
+			assert(endian16(physAddr.chunkItem->numStripes) >= 1);
+			assert(mirror == 0);
 
 			/* there should only be one stripe, so we'll always use stripe 0 */
-			blockReader = getBlockReader(physAddr->chunkItem.stripes[0].devID);
-			DWORD rtnVal = blockReader->directRead(physAddr->offset +
-				physAddr->chunkItem.stripes[0].offset, len, dest);
-
-			free(physAddr);
-			return rtnVal;
-		}
+			blockReader = getBlockReader(physAddr.chunkItem->stripes[0].devID);
+			return blockReader->directRead(physAddr.offset + endian64(physAddr.chunkItem->stripes[0].offset), len, dest);
 		case BGFLAG_RAID0:
-			assert(physAddr->chunkItem.numStripes >= 2);
-		
-			printf("readLogical: reading from raid0 chunks isn't yet supported!\n"
-				"addr: %I64x len: %I64x\n", addr, len);
+			assert(endian16(physAddr.chunkItem->numStripes) >= 2);
+			assert(mirror == 0);
 		
-			free(physAddr);
-			return ERROR_UNSUPPORTED_TYPE;
+			return readStriped(&physAddr, len, dest, false, 0);
 		case BGFLAG_RAID1:
-			assert(physAddr->chunkItem.numStripes >= 2);
-		
-			printf("readLogical: warning, treating raid1 chunk as non-mirrored\n");
-		
-			goto single_fallback;
 		case BGFLAG_DUPLICATE:
-			assert(physAddr->chunkItem.numStripes >= 2);
-		
-			printf("readLogical: warning, treating duplicate chunk as non-mirrored\n");
-		
-			goto single_fallback;
+			assert(endian16(physAddr.chunkItem->numStripes) >= 2);
+			assert(mirror < endian16(physAddr.chunkItem->numStripes));
+
+			/* every stripe is a complete copy of the chunk */
+			blockReader = getBlockReader(physAddr.chunkItem->stripes[mirror].devID);
+			return blockReader->directRead(physAddr.offset + endian64(physAddr.chunkItem->stripes[mirror].offset),
+				len, dest);
 		case BGFLAG_RAID10:
-			assert(physAddr->chunkItem.numStripes >= 4);
-		
-			printf("readLogical: reading from raid10 chunks isn't yet supported!\n"
-				"addr: %I64x len: %I64x\n", addr, len);
+			assert(endian16(physAddr.chunkItem->numStripes) >= 4);
+			assert(mirror < endian16(physAddr.chunkItem->subStripes));
 		
-			free(physAddr);
-			return ERROR_UNSUPPORTED_TYPE;
+			return readStriped(&physAddr, len, dest, true, mirror);
 		default: // two or more flags set; this shouldn't happen
-			printf("readLogical: multiple striping levels given for this chunk!\n"
-				"addr: %I64x len: %I64x\n", addr, len);
+			TRACE(TRACE_DISK, TRACE_ERROR, "multiple striping levels given for the chunk at 0x%I64x! (len 0x%I64x)",
+				addr, len);
 
-			free(physAddr);
 			return ERROR_INVALID_DATA;
 		}
 	}
+
+	/* reads from whichever copy is least busy, falling back on the others if that fails */
+	DWORD readLogical(LogiAddr addr, unsigned __int64 len, unsigned char *dest)
+	{
+		unsigned int preferred, numMirrors = getMirrors(addr, &preferred);
+		DWORD error = 0;
+
+		for (unsigned int i = 0; i < numMirrors; i++)
+		{
+			unsigned int mirror = (preferred + i) % numMirrors;
+
+			if ((error = readLogicalMirror(addr, len, dest, mirror)) == 0)
+				break;
+
+			TRACE(TRACE_DISK, TRACE_WARNING, "reading copy %u of 0x%I64x failed! (%u)", mirror, addr, error);
+		}
+
+		return error;
+	}
 }
@@ -12,19 +12,38 @@
 
 #include <Windows.h>
 #include "block_reader.h"
+#include "extent_cache.h"
+#include "node_cache.h"
 #include "types.h"
 
 namespace WinBtrfsLib
 {
 	void allocateBlockReaders();
 	void cleanUp();
-	PhysAddr *logiToPhys(LogiAddr logiAddr, unsigned __int64 len);
+	void buildChunkMap();
+	bool logiToPhys(LogiAddr logiAddr, unsigned __int64 len, PhysAddr *physAddr);
 	int loadSBs(bool dump);
 	int validateSB(BtrfsSuperblock *s);
 	void loadSBChunks(bool dump);
+	void setupNodeCache(unsigned __int64 budget);
+	unsigned int getNodeSize();
 	unsigned char *loadNode(LogiAddr addr, BtrfsHeader **header);
+	void releaseNode(unsigned char *nodeBlock);
+	void prefetchNodes(const LogiAddr *addrs, size_t count);
+	void prefetchNodesAsync(const LogiAddr *addrs, size_t count);
+	void prefetchChildren(const unsigned char *nodeBlock);
+	void stopPrefetch();
+	void setupExtentCache(unsigned __int64 budget);
+	unsigned char *loadExtent(const ExtentMapping *mapping, DWORD *error);
+	unsigned char *loadExtentChunk(const ExtentMapping *mapping, unsigned __int64 chunkOffset, size_t *size,
+		DWORD *error);
+	DWORD readExtentDirect(const ExtentMapping *mapping, unsigned __int64 from, size_t len, unsigned char *dest);
+	DWORD readExtentRange(const ExtentMapping *mapping, unsigned __int64 from, size_t len, unsigned char *dest);
+	void releaseExtent(unsigned char *extent);
 	LogiAddr getTreeRootAddr(BtrfsObjID tree);
 	int verifyDevices();
 	BlockReader *getBlockReader(unsigned __int64 devID);
+	unsigned int getMirrors(LogiAddr addr, unsigned int *preferred);
+	DWORD readLogicalMirror(LogiAddr addr, unsigned __int64 len, unsigned char *dest, unsigned int mirror);
 	DWORD readLogical(LogiAddr addr, unsigned __int64 len, unsigned char *dest);
 }
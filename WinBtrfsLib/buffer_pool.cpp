@@ -0,0 +1,112 @@
+/* WinBtrfsLib/buffer_pool.cpp
+ * recycling allocator for fixed-size buffers
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "buffer_pool.h"
+#include <cassert>
+#include <cstdlib>
+
+namespace WinBtrfsLib
+{
+	BufferPool::BufferPool()
+	{
+		InitializeCriticalSection(&lock);
+
+		freeList = NULL;
+		numIdle = 0;
+		bufferSize = 0;
+		maxIdle = 0;
+		heapAllocs = reuses = 0;
+	}
+
+	BufferPool::~BufferPool()
+	{
+		while (freeList != NULL)
+		{
+			FreeBuffer *next = freeList->next;
+
+			free(freeList);
+			freeList = next;
+		}
+
+		DeleteCriticalSection(&lock);
+	}
+
+	/* must be called before the first get, and not again afterward */
+	void BufferPool::setup(size_t bufferSize, size_t maxIdle)
+	{
+		assert(freeList == NULL && bufferSize >= sizeof(FreeBuffer));
+
+		this->bufferSize = bufferSize;
+		this->maxIdle = maxIdle;
+	}
+
+	size_t BufferPool::getBufferSize()
+	{
+		return bufferSize;
+	}
+
+	void *BufferPool::get()
+	{
+		FreeBuffer *buffer;
+
+		EnterCriticalSection(&lock);
+
+		if ((buffer = freeList) != NULL)
+		{
+			freeList = buffer->next;
+			numIdle--;
+			reuses++;
+		}
+		else
+			heapAllocs++;
+
+		LeaveCriticalSection(&lock);
+
+		if (buffer == NULL)
+		{
+			buffer = (FreeBuffer *)malloc(bufferSize);
+			assert(buffer != NULL);
+		}
+
+		return buffer;
+	}
+
+	void BufferPool::put(void *buffer)
+	{
+		EnterCriticalSection(&lock);
+
+		if (numIdle < maxIdle)
+		{
+			((FreeBuffer *)buffer)->next = freeList;
+			freeList = (FreeBuffer *)buffer;
+			numIdle++;
+
+			buffer = NULL;
+		}
+
+		LeaveCriticalSection(&lock);
+
+		/* the list is full; this one really goes */
+		free(buffer);
+	}
+
+	void BufferPool::getStats(BufferPoolStats *stats)
+	{
+		EnterCriticalSection(&lock);
+
+		stats->heapAllocs = heapAllocs;
+		stats->reuses = reuses;
+		stats->idle = numIdle;
+
+		LeaveCriticalSection(&lock);
+	}
+}
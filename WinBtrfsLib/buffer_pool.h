@@ -0,0 +1,58 @@
+/* WinBtrfsLib/buffer_pool.h
+ * recycling allocator for fixed-size buffers
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cstddef>
+#include <Windows.h>
+
+#ifndef WINBTRFSLIB_BUFFER_POOL_H
+#define WINBTRFSLIB_BUFFER_POOL_H
+
+namespace WinBtrfsLib
+{
+	struct BufferPoolStats
+	{
+		unsigned __int64		heapAllocs;		// buffers that had to be malloc'd
+		unsigned __int64		reuses;			// buffers handed out again from the free list
+		unsigned __int64		idle;			// buffers sitting on the free list right now
+	};
+
+	/* buffers of one size, kept on a free list when they're put back instead of going back to the heap; once
+		the list holds maxIdle of them, further ones are freed for real */
+	class BufferPool
+	{
+	public:
+		BufferPool();
+		~BufferPool();
+
+		void setup(size_t bufferSize, size_t maxIdle);
+		size_t getBufferSize();
+		void *get();
+		void put(void *buffer);
+		void getStats(BufferPoolStats *stats);
+
+	private:
+		struct FreeBuffer
+		{
+			FreeBuffer				*next;
+		};
+
+		CRITICAL_SECTION lock;
+		FreeBuffer *freeList;
+		size_t numIdle;
+		size_t bufferSize;
+		size_t maxIdle;
+		unsigned __int64 heapAllocs;
+		unsigned __int64 reuses;
+	};
+}
+
+#endif
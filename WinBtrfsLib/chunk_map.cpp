@@ -0,0 +1,181 @@
+/* WinBtrfsLib/chunk_map.cpp
+ * logical to physical chunk index
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "chunk_map.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace WinBtrfsLib
+{
+	static bool chunkMappingLess(const ChunkMapping &a, const ChunkMapping &b)
+	{
+		return a.logiStart < b.logiStart;
+	}
+
+	static bool segmentLess(const ChunkMap::Segment &a, const ChunkMap::Segment &b)
+	{
+		return a.logiStart < b.logiStart;
+	}
+
+	ChunkMap::ChunkMap()
+	{
+		InitializeCriticalSection(&writeLock);
+
+		current = new Snapshot;
+		current->older = NULL;
+		systemChunks = NULL;
+		numSystemChunks = 0;
+		numChunks = 0;
+		numSnapshots = 1;
+	}
+
+	ChunkMap::~ChunkMap()
+	{
+		Snapshot *snapshot = current;
+
+		/* only the newest snapshot lists every segment */
+		for (size_t i = 0; i < snapshot->segments.size(); i++)
+			delete[] snapshot->segments[i].mappings;
+
+		while (snapshot != NULL)
+		{
+			Snapshot *older = snapshot->older;
+
+			delete snapshot;
+			snapshot = older;
+		}
+
+		delete[] systemChunks;
+
+		DeleteCriticalSection(&writeLock);
+	}
+
+	/* the superblock's copies of the chunks holding the chunk tree; must be called before any lookups */
+	void ChunkMap::setSystemChunks(const ChunkMapping *mappings, size_t count)
+	{
+		ChunkMapping *copy = new ChunkMapping[count];
+
+		assert(systemChunks == NULL);
+
+		std::copy(mappings, mappings + count, copy);
+		std::sort(copy, copy + count, &chunkMappingLess);
+
+		systemChunks = copy;
+		numSystemChunks = count;
+		numChunks += count;
+	}
+
+	/* adds the chunks from one chunk tree leaf, in any order; returns false, leaving the map as it was, if that
+		leaf is already in it (another thread may have loaded it at the same time) */
+	bool ChunkMap::addSegment(const ChunkMapping *mappings, size_t count)
+	{
+		ChunkMapping *copy;
+		Snapshot *snapshot;
+		Segment segment;
+
+		if (count == 0)
+			return false;
+
+		copy = new ChunkMapping[count];
+		std::copy(mappings, mappings + count, copy);
+		std::sort(copy, copy + count, &chunkMappingLess);
+
+		segment.logiStart = copy[0].logiStart;
+		segment.mappings = copy;
+		segment.count = count;
+
+		EnterCriticalSection(&writeLock);
+
+		std::vector<Segment>::iterator pos = std::lower_bound(current->segments.begin(),
+			current->segments.end(), segment, &segmentLess);
+
+		if (pos != current->segments.end() && pos->logiStart == segment.logiStart)
+		{
+			LeaveCriticalSection(&writeLock);
+			delete[] copy;
+			return false;
+		}
+
+		snapshot = new Snapshot;
+		snapshot->segments.reserve(current->segments.size() + 1);
+		snapshot->segments.insert(snapshot->segments.end(), current->segments.begin(), pos);
+		snapshot->segments.push_back(segment);
+		snapshot->segments.insert(snapshot->segments.end(), pos, current->segments.end());
+		snapshot->older = current;
+
+		numChunks += count;
+		numSnapshots++;
+
+		/* a lookup sees either the old index or the new one, both complete */
+		InterlockedExchangePointer((PVOID volatile *)&current, snapshot);
+
+		LeaveCriticalSection(&writeLock);
+
+		return true;
+	}
+
+	/* the chunk in a sorted run that contains logiAddr, or NULL */
+	const ChunkMapping *ChunkMap::findIn(const ChunkMapping *mappings, size_t count, LogiAddr logiAddr)
+	{
+		ChunkMapping key;
+
+		key.logiStart = logiAddr;
+
+		/* find the first chunk starting after logiAddr; the one before it is the only candidate */
+		const ChunkMapping *it = std::upper_bound(mappings, mappings + count, key, &chunkMappingLess);
+
+		if (it == mappings || logiAddr >= (it - 1)->logiStart + (it - 1)->size)
+			return NULL;
+
+		return it - 1;
+	}
+
+	/* returns NULL if no chunk mapped so far contains logiAddr; the mapping stays put until the map is destroyed */
+	const ChunkMapping *ChunkMap::find(LogiAddr logiAddr) const
+	{
+		const Snapshot *snapshot = current;
+		const ChunkMapping *mapping;
+
+		if ((mapping = findIn(systemChunks, numSystemChunks, logiAddr)) != NULL)
+			return mapping;
+
+		/* the last segment starting at or before logiAddr is the only one that can hold it */
+		size_t lo = 0, hi = snapshot->segments.size();
+
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (snapshot->segments[mid].logiStart <= logiAddr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == 0)
+			return NULL;
+
+		return findIn(snapshot->segments[lo - 1].mappings, snapshot->segments[lo - 1].count, logiAddr);
+	}
+
+	void ChunkMap::getStats(ChunkMapStats *stats)
+	{
+		EnterCriticalSection(&writeLock);
+
+		stats->chunks = numChunks;
+		stats->segments = current->segments.size();
+		stats->snapshots = numSnapshots;
+
+		LeaveCriticalSection(&writeLock);
+	}
+}
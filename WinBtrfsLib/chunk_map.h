@@ -0,0 +1,71 @@
+/* WinBtrfsLib/chunk_map.h
+ * logical to physical chunk index
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cstddef>
+#include <vector>
+#include <Windows.h>
+#include "types.h"
+
+#ifndef WINBTRFSLIB_CHUNK_MAP_H
+#define WINBTRFSLIB_CHUNK_MAP_H
+
+namespace WinBtrfsLib
+{
+	struct ChunkMapStats
+	{
+		unsigned __int64		chunks;			// mappings added, system chunks included
+		unsigned __int64		segments;		// chunk tree leaves they came from
+		unsigned __int64		snapshots;		// versions of the segment index published
+	};
+
+	/* the chunks mapped so far, added a chunk tree leaf at a time as addresses in them come up. lookups take no
+		lock and allocate nothing: each leaf's chunks go into a sorted segment that never changes once added, and
+		the sorted index of segments is replaced as a whole and published with a pointer swap. replaced indexes
+		are kept until the map is destroyed, since a lookup may still be reading one; there is one per leaf
+		loaded, each a few words per segment, so this stays small even with tens of thousands of chunks */
+	class ChunkMap
+	{
+	public:
+		ChunkMap();
+		~ChunkMap();
+
+		void setSystemChunks(const ChunkMapping *mappings, size_t count);
+		bool addSegment(const ChunkMapping *mappings, size_t count);
+		const ChunkMapping *find(LogiAddr logiAddr) const;
+		void getStats(ChunkMapStats *stats);
+
+		struct Segment
+		{
+			LogiAddr				logiStart;		// the first chunk's; segments never overlap
+			const ChunkMapping		*mappings;		// sorted by logiStart
+			size_t					count;
+		};
+
+	private:
+		struct Snapshot
+		{
+			std::vector<Segment>	segments;		// sorted by logiStart
+			Snapshot				*older;
+		};
+
+		static const ChunkMapping *findIn(const ChunkMapping *mappings, size_t count, LogiAddr logiAddr);
+
+		CRITICAL_SECTION writeLock;					// serializes adds; lookups never take it
+		Snapshot *volatile current;
+		const ChunkMapping *systemChunks;			// scattered across the address space, so kept apart
+		size_t numSystemChunks;
+		unsigned __int64 numChunks;
+		unsigned __int64 numSnapshots;
+	};
+}
+
+#endif
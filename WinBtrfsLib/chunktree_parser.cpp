@@ -15,27 +15,29 @@
 #include <vector>
 #include "btrfs_system.h"
 #include "endian.h"
+#include "node_view.h"
 #include "util.h"
 
 namespace WinBtrfsLib
 {
 	extern std::vector<BtrfsSuperblock> supers;
 
-	std::vector<KeyedItem> chunkTree;
-
 	void parseChunkTreeRec(LogiAddr addr, CTOperation operation)
 	{
-		unsigned char *nodeBlock, *nodePtr;
+		unsigned char *nodeBlock;
 		BtrfsHeader *header;
-		BtrfsItem *item;
-		KeyedItem kItem;
-		unsigned short *temp;
 	
 		nodeBlock = loadNode(addr, &header);
 
+		/* loadNode has already reported it; the walk carries on without this subtree */
+		if (nodeBlock == NULL)
+		{
+			if (operation == CTOP_DUMP_TREE)
+				printf("\n[Node] addr = 0x%I64x is unreadable\n", addr);
+			return;
+		}
+
 		assert(header->tree == OBJID_CHUNK_TREE);
-	
-		nodePtr = nodeBlock + sizeof(BtrfsHeader);
 
 		if (operation == CTOP_DUMP_TREE)
 			printf("\n[Node] tree = 0x%I64x addr = 0x%I64x level = 0x%02x nrItems = 0x%08x\n", endian64(header->tree),
@@ -43,49 +45,19 @@ namespace WinBtrfsLib
 
 		if (header->level == 0) // leaf node
 		{
-			for (unsigned int i = 0; i < endian32(header->nrItems); i++)
-			{
-				item = (BtrfsItem *)nodePtr;
+			LeafView leaf(nodeBlock);
 
-				if (operation == CTOP_LOAD)
-				{
-					switch (item->key.type)
-					{
-					case TYPE_DEV_ITEM:
-						assert(endian32(item->size) == sizeof(BtrfsDevItem)); // ensure proper size
-
-						memcpy(&kItem.key, &item->key, sizeof(BtrfsDiskKey));
-						kItem.data = malloc(endian32(item->size));
-						memcpy(kItem.data, nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset), endian32(item->size));
-
-						chunkTree.push_back(kItem);
-						break;
-					case TYPE_CHUNK_ITEM:
-						assert((endian32(item->size) - sizeof(BtrfsChunkItem)) % sizeof(BtrfsChunkItemStripe) == 0); // ensure proper 30+20n size
-
-						temp = (unsigned short *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset) + 0x2c);
-
-						/* check the ACTUAL size now that we have it */
-						assert(endian32(item->size) == sizeof(BtrfsChunkItem) + (*temp * sizeof(BtrfsChunkItemStripe)));
-
-						memcpy(&kItem.key, &item->key, sizeof(BtrfsDiskKey));
-						kItem.data = malloc(endian32(item->size));
-						memcpy(kItem.data, nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset), endian32(item->size));
+			for (unsigned int i = 0; i < leaf.size(); i++)
+			{
+				const BtrfsItem *item = leaf.item(i);
 
-						chunkTree.push_back(kItem);
-						break;
-					default:
-						printf("parseChunkTreeRec: don't know how to load item of type 0x%02x!\n", item->key.type);
-						break;
-					}
-				}
-				else if (operation == RTOP_DUMP_TREE)
+				if (operation == CTOP_DUMP_TREE)
 				{
 					switch (item->key.type)
 					{
 					case TYPE_DEV_ITEM:
 					{
-						BtrfsDevItem *devItem = (BtrfsDevItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
+						const BtrfsDevItem *devItem = leaf.data<BtrfsDevItem>(i);
 						char uuid[1024];
 
 						uuidToStr(devItem->devUUID, uuid);
@@ -97,13 +69,13 @@ namespace WinBtrfsLib
 					}
 					case TYPE_CHUNK_ITEM:
 					{
-						BtrfsChunkItem *chunkItem = (BtrfsChunkItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
+						const BtrfsChunkItem *chunkItem = leaf.data<BtrfsChunkItem>(i);
 						char type[32];
 					
 						bgFlagsToStr((BlockGroupFlags)endian64(chunkItem->type), type);
 						printf("  [%02x] CHUNK_ITEM size: 0x%I64x logi: 0x%I64x type: %s\n", i, endian64(chunkItem->chunkSize),
 							endian64(item->key.offset), type);
-						for (int j = 0; j < chunkItem->numStripes; j++)
+						for (int j = 0; j < endian16(chunkItem->numStripes); j++)
 							printf("         + STRIPE devID: 0x%I64x offset: 0x%I64x\n", endian64(chunkItem->stripes[j].devID),
 								endian64(chunkItem->stripes[j].offset));
 						break;
@@ -116,17 +88,17 @@ namespace WinBtrfsLib
 				}
 				else
 					printf("parseChunkTreeRec: unknown operation (0x%02x)!\n", operation);
-
-				nodePtr += sizeof(BtrfsItem);
 			}
 		}
 		else // non-leaf node
 		{
+			KeyPtrView keyPtrs(nodeBlock);
+
 			if (operation == CTOP_DUMP_TREE)
 			{
-				for (unsigned int i = 0; i < endian32(header->nrItems); i++)
+				for (unsigned int i = 0; i < keyPtrs.size(); i++)
 				{
-					BtrfsKeyPtr *keyPtr = (BtrfsKeyPtr *)(nodePtr + (sizeof(BtrfsKeyPtr) * i));
+					const BtrfsKeyPtr *keyPtr = keyPtrs.keyPtr(i);
 
 					printf("  [%02x] {%I64x|%I64x} KeyPtr: block 0x%016I64x generation 0x%016I64x\n",
 						i, endian64(keyPtr->key.objectID), endian64(keyPtr->key.offset),
@@ -134,18 +106,15 @@ namespace WinBtrfsLib
 				}
 			}
 
-			for (unsigned int i = 0; i < endian32(header->nrItems); i++)
-			{
-				BtrfsKeyPtr *keyPtr = (BtrfsKeyPtr *)nodePtr;
-
-				/* recurse down one level of the tree */
-				parseChunkTreeRec(endian64(keyPtr->blockNum), operation);
+			/* every child is going to be visited, so read them all in one batch first */
+			prefetchChildren(nodeBlock);
 
-				nodePtr += sizeof(BtrfsKeyPtr);
-			}
+			/* recurse down one level of the tree */
+			for (unsigned int i = 0; i < keyPtrs.size(); i++)
+				parseChunkTreeRec(endian64(keyPtrs.keyPtr(i)->blockNum), operation);
 		}
 
-		free(nodeBlock);
+		releaseNode(nodeBlock);
 	}
 
 	void parseChunkTree(CTOperation operation)
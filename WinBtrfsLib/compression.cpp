@@ -10,73 +10,421 @@
  * any later version.
  */
 
+#include "compression.h"
 #include <cassert>
+#include <Windows.h>
 #include "../minilzo/minilzo.h"
 #include "../zlib/zlib.h"
+#ifdef WINBTRFS_ZSTD
+#include <zstd.h>
+#endif
 #include "endian.h"
 
 namespace WinBtrfsLib
 {
-	int lzoDecompress(const unsigned char *compressed, unsigned char *decompressed,
-		unsigned __int64 cSize, unsigned __int64 dSize)
+	/* the partial decoders that have to decode their way up to a range throw that part away this much at a time */
+	const size_t DISCARD_SIZE = 4096;
+
+	/* btrfs frames an LZO extent as a 32-bit total length followed by segments, each of which is a 32-bit length
+		and then the compressed form of one 4K page of the file; every segment but the last decodes to a full
+		page. a segment header is never split across a 4K page of the compressed stream: if fewer than four
+		bytes are left in the page, they're padding and the next header starts on the next page */
+	const unsigned int LZO_PAGE_SIZE = 4096;
+	const unsigned int LZO_LEN = 4;
+
+	struct LzoSegmentWalk
+	{
+		const unsigned char		*compressed;
+		size_t					pos;		// offset of the next segment header
+		size_t					end;		// the smaller of the total length and the buffer size
+	};
+
+	static int lzoBeginWalk(LzoSegmentWalk *walk, const unsigned char *compressed, unsigned __int64 cSize)
 	{
-		int error;
-		lzo_uint lzoTotLen, lzoInLen, lzoOutLen, lzoBytesRead = 0, lzoBytesWritten = 0;
-	
 		/* must at least contain the 32-bit total size header */
-		if (cSize < 4)
+		if (cSize < LZO_LEN)
 			return 1;
 
-		/* total number of compressed bytes in the extent */
-		lzoTotLen = endian32(*((unsigned int *)compressed));
-		compressed += 4;
+		walk->compressed = compressed;
+		walk->pos = LZO_LEN;
+		walk->end = endian32(*((const unsigned int *)compressed));
 
-		while (lzoBytesRead < lzoTotLen - 4)
-		{
-			lzoInLen = endian32(*((unsigned int *)compressed));
-			compressed += 4;
+		if (walk->end > cSize)
+			return 1;
+
+		return 0;
+	}
+
+	/* finds the next segment; returns 0 with its data and length, -1 once there are none left, or 1 if the
+		framing runs off the end of the extent */
+	static int lzoNextSegment(LzoSegmentWalk *walk, const unsigned char **segment, lzo_uint *segLen)
+	{
+		if (walk->pos >= walk->end)
+			return -1;
+
+		if (walk->end - walk->pos < LZO_LEN)
+			return 1;
+
+		*segLen = endian32(*((const unsigned int *)(walk->compressed + walk->pos)));
+		walk->pos += LZO_LEN;
+
+		if (walk->end - walk->pos < *segLen)
+			return 1;
 
-			if ((error = lzo1x_decompress_safe(compressed, lzoInLen,
-				decompressed, &lzoOutLen, NULL)) != LZO_E_OK)
+		*segment = walk->compressed + walk->pos;
+		walk->pos += *segLen;
+
+		/* skip the padding at the end of a page that's too short to hold another header */
+		if (LZO_PAGE_SIZE - walk->pos % LZO_PAGE_SIZE < LZO_LEN)
+			walk->pos += LZO_PAGE_SIZE - walk->pos % LZO_PAGE_SIZE;
+
+		return 0;
+	}
+
+	/* decodes bytes [from, from + len) of an LZO extent into dest. segments before the range are stepped over
+		by their headers alone and decoding stops after the last one the range touches, so the cost follows the
+		size of the range rather than that of the extent. segments wholly inside the range are decoded straight
+		into dest; only the ones cut by either end go through a page on the stack. anything the extent doesn't
+		cover reads as zeroes */
+	static int lzoDecompressRange(const unsigned char *compressed, unsigned __int64 cSize, unsigned __int64 from,
+		size_t len, unsigned char *dest)
+	{
+		LzoSegmentWalk walk;
+		const unsigned char *segment;
+		lzo_uint segLen;
+		unsigned __int64 segStart = 0, to = from + len;
+		int error;
+
+		if (lzoBeginWalk(&walk, compressed, cSize) != 0)
+			return 1;
+
+		while (segStart < to)
+		{
+			if ((error = lzoNextSegment(&walk, &segment, &segLen)) < 0)
+				break;
+			else if (error > 0)
 				return error;
 
-			lzoBytesRead += lzoInLen + 4;
-			lzoBytesWritten += lzoOutLen;
+			if (segStart + LZO_PAGE_SIZE > from)
+			{
+				lzo_uint outLen = LZO_PAGE_SIZE;
+
+				if (segStart >= from && segStart + LZO_PAGE_SIZE <= to)
+				{
+					if ((error = lzo1x_decompress_safe(segment, segLen, dest + (size_t)(segStart - from),
+						&outLen, NULL)) != LZO_E_OK)
+						return error;
+
+					/* a short segment can only be the last one */
+					if (outLen < LZO_PAGE_SIZE)
+					{
+						memset(dest + (size_t)(segStart - from) + outLen, 0, LZO_PAGE_SIZE - outLen);
+						segStart += LZO_PAGE_SIZE;
+						break;
+					}
+				}
+				else
+				{
+					unsigned char page[LZO_PAGE_SIZE];
+					size_t skip = (size_t)(from > segStart ? from - segStart : 0);
+					size_t pieceEnd = (size_t)(to < segStart + LZO_PAGE_SIZE ? to - segStart : LZO_PAGE_SIZE);
+
+					if ((error = lzo1x_decompress_safe(segment, segLen, page, &outLen, NULL)) != LZO_E_OK)
+						return error;
+
+					memset(page + outLen, 0, LZO_PAGE_SIZE - outLen);
+					memcpy(dest + (size_t)(segStart + skip - from), page + skip, pieceEnd - skip);
+				}
+			}
 
-			compressed += lzoInLen;
-			decompressed += lzoOutLen;
+			segStart += LZO_PAGE_SIZE;
 		}
 
-		return (lzoBytesWritten <= dSize ? 0 : 2);
+		/* the extent ran out before the range did */
+		if (segStart < to)
+		{
+			size_t zeroFrom = (size_t)(segStart > from ? segStart - from : 0);
+
+			memset(dest + zeroFrom, 0, len - zeroFrom);
+		}
+
+		return 0;
 	}
 
-	int zlibDecompress(const unsigned char *compressed, unsigned char *decompressed,
-		unsigned __int64 cSize, unsigned __int64 dSize)
+	static void WINAPI freeThreadZStream(PVOID zStream)
 	{
-		int error;
-		z_stream zStream;
+		inflateEnd((z_stream *)zStream);
+		free(zStream);
+	}
+
+	/* returns this thread's inflate stream, setting it up the first time the thread asks for one; streams are
+		reset and reused for every extent rather than being torn down and rebuilt each time. readahead decodes
+		on thread pool threads, which come and go, so like the scratch arena this is in fiber local storage,
+		whose destructor callback frees the stream when the thread exits */
+	static z_stream *getThreadZStream()
+	{
+		static volatile DWORD flsZStreamIdx = FLS_OUT_OF_INDEXES;
+		z_stream *zStream;
 
-		zStream.zalloc = NULL;
-		zStream.zfree = NULL;
-		zStream.opaque = NULL;
-		zStream.next_in = const_cast<unsigned char *>(compressed); // why does zlib want mutable input?
-		zStream.avail_in = 0;
-		zStream.next_out = decompressed;
+		if (flsZStreamIdx == FLS_OUT_OF_INDEXES)
+		{
+			DWORD idx = FlsAlloc(&freeThreadZStream);
+			assert(idx != FLS_OUT_OF_INDEXES);
+
+			/* another thread may have gotten here first */
+			if (InterlockedCompareExchange((volatile LONG *)&flsZStreamIdx, (LONG)idx, (LONG)FLS_OUT_OF_INDEXES) !=
+				(LONG)FLS_OUT_OF_INDEXES)
+				FlsFree(idx);
+		}
+
+		if ((zStream = (z_stream *)FlsGetValue(flsZStreamIdx)) == NULL)
+		{
+			zStream = (z_stream *)malloc(sizeof(z_stream));
+			assert(zStream != NULL);
+
+			zStream->zalloc = NULL;
+			zStream->zfree = NULL;
+			zStream->opaque = NULL;
+			zStream->next_in = NULL;
+			zStream->avail_in = 0;
 
-		if ((error = inflateInit(&zStream)) != Z_OK)
+			if (inflateInit(zStream) != Z_OK)
+			{
+				free(zStream);
+				return NULL;
+			}
+
+			FlsSetValue(flsZStreamIdx, zStream);
+		}
+
+		return zStream;
+	}
+
+	/* decodes bytes [from, from + len) of a zlib extent into dest. a deflate stream can only be entered at its
+		start, so whatever comes before the range is decoded into a throwaway page; decoding stops as soon as
+		the range is complete, though, so nothing past it is paid for */
+	static int zlibDecompressRange(const unsigned char *compressed, unsigned __int64 cSize, unsigned __int64 from,
+		size_t len, unsigned char *dest)
+	{
+		unsigned char discard[DISCARD_SIZE];
+		unsigned __int64 skip = from;
+		int error = Z_OK;
+		z_stream *zStream;
+
+		if ((zStream = getThreadZStream()) == NULL)
+			return Z_MEM_ERROR;
+
+		if ((error = inflateReset(zStream)) != Z_OK)
 			return error;
 
-		while (zStream.total_in < cSize && zStream.total_out < dSize)
+		/* extents are at most 128K, so these always fit in a uInt */
+		zStream->next_in = const_cast<unsigned char *>(compressed); // why does zlib want mutable input?
+		zStream->avail_in = (uInt)cSize;
+
+		while (skip > 0 && error != Z_STREAM_END)
 		{
-			/* one byte at a time */
-			zStream.avail_in = zStream.avail_out = 1;
+			zStream->next_out = discard;
+			zStream->avail_out = (uInt)(skip < DISCARD_SIZE ? skip : DISCARD_SIZE);
 
-			if ((error = inflate(&zStream, Z_NO_FLUSH)) == Z_STREAM_END)
-				break;
-			else if (error != Z_OK)
+			error = inflate(zStream, Z_SYNC_FLUSH);
+
+			if (error != Z_OK && error != Z_BUF_ERROR && error != Z_STREAM_END)
+				return error;
+			else if (zStream->avail_out > 0 && zStream->avail_in == 0 && error != Z_STREAM_END)
+				return Z_DATA_ERROR; // ran out of input before producing what was asked for
+
+			skip -= (DISCARD_SIZE < skip ? DISCARD_SIZE : skip) - zStream->avail_out;
+		}
+
+		zStream->next_out = dest;
+		zStream->avail_out = (uInt)len;
+
+		while (zStream->avail_out > 0 && error != Z_STREAM_END)
+		{
+			error = inflate(zStream, Z_SYNC_FLUSH);
+
+			if (error != Z_OK && error != Z_BUF_ERROR && error != Z_STREAM_END)
 				return error;
+			else if (zStream->avail_out > 0 && zStream->avail_in == 0 && error != Z_STREAM_END)
+				return Z_DATA_ERROR;
+		}
+
+		/* a stream that ends short of the requested size is followed by zeroes */
+		if (zStream->avail_out > 0)
+			memset(zStream->next_out, 0, zStream->avail_out);
+
+		return 0;
+	}
+
+#ifdef WINBTRFS_ZSTD
+	static void WINAPI freeThreadZstdContext(PVOID dctx)
+	{
+		ZSTD_freeDCtx((ZSTD_DCtx *)dctx);
+	}
+
+	/* like the inflate streams, each thread keeps one decompression context, resets it for every extent, and
+		frees it on exit */
+	static ZSTD_DCtx *getThreadZstdContext()
+	{
+		static volatile DWORD flsZstdIdx = FLS_OUT_OF_INDEXES;
+		ZSTD_DCtx *dctx;
+
+		if (flsZstdIdx == FLS_OUT_OF_INDEXES)
+		{
+			DWORD idx = FlsAlloc(&freeThreadZstdContext);
+			assert(idx != FLS_OUT_OF_INDEXES);
+
+			/* another thread may have gotten here first */
+			if (InterlockedCompareExchange((volatile LONG *)&flsZstdIdx, (LONG)idx, (LONG)FLS_OUT_OF_INDEXES) !=
+				(LONG)FLS_OUT_OF_INDEXES)
+				FlsFree(idx);
+		}
+
+		if ((dctx = (ZSTD_DCtx *)FlsGetValue(flsZstdIdx)) == NULL)
+		{
+			if ((dctx = ZSTD_createDCtx()) == NULL)
+				return NULL;
+
+			FlsSetValue(flsZstdIdx, dctx);
+		}
+
+		return dctx;
+	}
+
+	/* decodes bytes [from, from + len) of a zstd extent (a single frame, inline or not) into dest; as with zlib,
+		the part before the range has to be decoded to get to it, but nothing after it is */
+	static int zstdDecompressRange(const unsigned char *compressed, unsigned __int64 cSize, unsigned __int64 from,
+		size_t len, unsigned char *dest)
+	{
+		unsigned char discard[DISCARD_SIZE];
+		unsigned __int64 skip = from;
+		ZSTD_inBuffer in = { compressed, (size_t)cSize, 0 };
+		ZSTD_outBuffer out;
+		size_t result = 1;
+		ZSTD_DCtx *dctx;
+
+		if ((dctx = getThreadZstdContext()) == NULL)
+			return 1;
+
+		ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+		/* a result of zero means the frame is done */
+		while (skip > 0 && result != 0)
+		{
+			out.dst = discard;
+			out.size = (size_t)(skip < DISCARD_SIZE ? skip : DISCARD_SIZE);
+			out.pos = 0;
+
+			if (ZSTD_isError(result = ZSTD_decompressStream(dctx, &out, &in)))
+				return 2;
+			else if (out.pos < out.size && in.pos == in.size && result != 0)
+				return 3; // ran out of input before producing what was asked for
+
+			skip -= out.pos;
+		}
+
+		out.dst = dest;
+		out.size = len;
+		out.pos = 0;
+
+		while (out.pos < out.size && result != 0)
+		{
+			if (ZSTD_isError(result = ZSTD_decompressStream(dctx, &out, &in)))
+				return 2;
+			else if (out.pos < out.size && in.pos == in.size && result != 0)
+				return 3;
 		}
-	
-		return inflateEnd(&zStream);
+
+		/* a frame that ends short of the requested size is followed by zeroes */
+		if (out.pos < out.size)
+			memset(dest + out.pos, 0, out.size - out.pos);
+
+		return 0;
+	}
+#endif
+
+	struct DecompressorCounters
+	{
+		volatile LONGLONG		calls;
+		volatile LONGLONG		bytesIn;
+		volatile LONGLONG		bytesOut;
+		volatile LONGLONG		ticks;
+	};
+
+	const Decompressor lzoDecompressor = { "lzo", &lzoDecompressRange, true };
+	const Decompressor zlibDecompressor = { "zlib", &zlibDecompressRange, false };
+#ifdef WINBTRFS_ZSTD
+	const Decompressor zstdDecompressor = { "zstd", &zstdDecompressRange, false };
+#endif
+
+	const Decompressor *decompressors[256] = { NULL, &zlibDecompressor, &lzoDecompressor,
+#ifdef WINBTRFS_ZSTD
+		&zstdDecompressor,
+#endif
+	};
+	DecompressorCounters decompressorCounters[256];
+	LONGLONG decompressTicksPerSec = 0;
+
+	/* adds or replaces the decoder for a compression type; this must happen before any other threads are
+		started, since lookups take no locks */
+	void registerDecompressor(CompressionType type, const Decompressor *decompressor)
+	{
+		decompressors[type] = decompressor;
+	}
+
+	/* NULL means extents compressed that way can't be read */
+	const Decompressor *getDecompressor(CompressionType type)
+	{
+		return decompressors[type];
+	}
+
+	/* runs the registered decoder for bytes [from, from + len) of an extent, keeping track of how long it
+		took; returns the decoder's own error code, or -1 if there is no decoder for the type */
+	int decompressRange(CompressionType type, const unsigned char *compressed, unsigned __int64 cSize,
+		unsigned __int64 from, size_t len, unsigned char *dest)
+	{
+		const Decompressor *decompressor = decompressors[type];
+		DecompressorCounters *counters = &decompressorCounters[type];
+		LARGE_INTEGER start, end;
+		int result;
+
+		if (decompressor == NULL)
+			return -1;
+
+		QueryPerformanceCounter(&start);
+		result = decompressor->decodeRange(compressed, cSize, from, len, dest);
+		QueryPerformanceCounter(&end);
+
+		InterlockedIncrement64(&counters->calls);
+		InterlockedExchangeAdd64(&counters->bytesIn, (LONGLONG)cSize);
+		InterlockedExchangeAdd64(&counters->bytesOut, (LONGLONG)len);
+		InterlockedExchangeAdd64(&counters->ticks, end.QuadPart - start.QuadPart);
+
+		return result;
+	}
+
+	/* returns false if there is no decoder for the type */
+	bool getDecompressorStats(CompressionType type, DecompressorStats *stats)
+	{
+		const DecompressorCounters *counters = &decompressorCounters[type];
+
+		if (decompressors[type] == NULL)
+			return false;
+
+		if (decompressTicksPerSec == 0)
+		{
+			LARGE_INTEGER freq;
+
+			QueryPerformanceFrequency(&freq);
+			decompressTicksPerSec = freq.QuadPart;
+		}
+
+		stats->name = decompressors[type]->name;
+		stats->calls = (unsigned __int64)counters->calls;
+		stats->bytesIn = (unsigned __int64)counters->bytesIn;
+		stats->bytesOut = (unsigned __int64)counters->bytesOut;
+		stats->microseconds = (unsigned __int64)(counters->ticks * 1000000 / decompressTicksPerSec);
+
+		return true;
 	}
 }
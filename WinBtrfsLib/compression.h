@@ -10,11 +10,40 @@
  * any later version.
  */
 
+#include <cstddef>
+#include "types.h"
+
+#ifndef WINBTRFSLIB_COMPRESSION_H
+#define WINBTRFSLIB_COMPRESSION_H
 
 namespace WinBtrfsLib
 {
-	int lzoDecompress(const unsigned char *compressed, unsigned char *decompressed,
-		unsigned __int64 cSize, unsigned __int64 dSize);
-	int zlibDecompress(const unsigned char *compressed, unsigned char *decompressed,
-		unsigned __int64 cSize, unsigned __int64 dSize);
+	/* decodes bytes [from, from + len) of a compressed extent of cSize bytes into dest, zero-filling whatever
+		lies past the end of the decoded data; returns zero on success */
+	typedef int (*DecodeRangeFunc)(const unsigned char *compressed, unsigned __int64 cSize, unsigned __int64 from,
+		size_t len, unsigned char *dest);
+
+	struct Decompressor
+	{
+		const char				*name;
+		DecodeRangeFunc			decodeRange;
+		bool					seekable;	// can skip to the start of a range without decoding what's before it
+	};
+
+	struct DecompressorStats
+	{
+		const char				*name;
+		unsigned __int64		calls;
+		unsigned __int64		bytesIn;		// compressed bytes handed to the decoder
+		unsigned __int64		bytesOut;		// decoded bytes asked for
+		unsigned __int64		microseconds;	// time spent decoding
+	};
+
+	void registerDecompressor(CompressionType type, const Decompressor *decompressor);
+	const Decompressor *getDecompressor(CompressionType type);
+	int decompressRange(CompressionType type, const unsigned char *compressed, unsigned __int64 cSize,
+		unsigned __int64 from, size_t len, unsigned char *dest);
+	bool getDecompressorStats(CompressionType type, DecompressorStats *stats);
 }
+
+#endif
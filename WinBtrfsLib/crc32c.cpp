@@ -111,15 +111,374 @@ static const unsigned int crc32c_table[256] = {
 		0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
+#include "crc32c.h"
+#include <cstddef>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC32C_HW
+#endif
+
+/* reflected form of the polynomial above */
+#define CRC32C_POLY 0x82F63B78
+
+/* the interleaved hardware path hashes three lanes of this many bytes at a
+ * time, then falls back to three lanes of the short size, then to one lane */
+#define CRC32C_LONG 4096
+#define CRC32C_SHORT 256
+
+typedef unsigned int (*Crc32cFunc)(unsigned int crc, const unsigned char *data, unsigned int length);
+
+static unsigned int crc32cSelect(unsigned int crc, const unsigned char *data, unsigned int length);
+
+static volatile Crc32cFunc crc32cImpl = &crc32cSelect;
+
+/* tables 1..7 for slicing-by-8; table 0 is crc32c_table itself */
+static unsigned int crc32cSlice[7][256];
+
 /*
  * Steps through buffer one byte at at time, calculates reflected
  * crc using table.
  */
 
-unsigned int crc32c(unsigned int crc, const unsigned char *data, unsigned int length)
+static unsigned int crc32cBytewise(unsigned int crc, const unsigned char *data, unsigned int length)
 {
 	while (length--)
 		crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
 	
 	return crc;
 }
+
+static void crc32cInitSlice()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		unsigned int crc = crc32c_table[i];
+		
+		for (int j = 0; j < 7; j++)
+		{
+			crc = crc32c_table[crc & 0xFF] ^ (crc >> 8);
+			crc32cSlice[j][i] = crc;
+		}
+	}
+}
+
+/*
+ * Software fallback: consumes eight bytes per step using eight tables.
+ * Words are assembled byte by byte so this does not care about alignment.
+ */
+
+static unsigned int crc32cSliceBy8(unsigned int crc, const unsigned char *data, unsigned int length)
+{
+	while (length != 0 && ((size_t)data & 7) != 0)
+	{
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		length--;
+	}
+	
+	while (length >= 8)
+	{
+		unsigned int lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24));
+		unsigned int hi = data[4] | (data[5] << 8) | (data[6] << 16) | ((unsigned int)data[7] << 24);
+		
+		crc = crc32cSlice[6][lo & 0xFF] ^ crc32cSlice[5][(lo >> 8) & 0xFF] ^
+			crc32cSlice[4][(lo >> 16) & 0xFF] ^ crc32cSlice[3][lo >> 24] ^
+			crc32cSlice[2][hi & 0xFF] ^ crc32cSlice[1][(hi >> 8) & 0xFF] ^
+			crc32cSlice[0][(hi >> 16) & 0xFF] ^ crc32c_table[hi >> 24];
+		
+		data += 8;
+		length -= 8;
+	}
+	
+	return crc32cBytewise(crc, data, length);
+}
+
+#ifdef CRC32C_HW
+
+/* multipliers for shifting a lane's crc past CRC32C_LONG and CRC32C_SHORT bytes */
+static unsigned int crc32cShiftLong, crc32cShiftShort;
+
+/* returns x^n mod P in reflected form */
+static unsigned int crc32cXPow(unsigned int n)
+{
+	unsigned int r = 0x80000000;
+	
+	while (n--)
+		r = (r >> 1) ^ ((r & 1) ? CRC32C_POLY : 0);
+	
+	return r;
+}
+
+static void crc32cInitShift()
+{
+	/* the carry-less product below carries an extra x^33 (one bit from
+	 * the multiply of two reflected values, 32 from the reduction) */
+	crc32cShiftLong = crc32cXPow(CRC32C_LONG * 8 - 33);
+	crc32cShiftShort = crc32cXPow(CRC32C_SHORT * 8 - 33);
+}
+
+/* advances crc as if 'shift' bytes of zeros had followed it, given the
+ * matching multiplier from crc32cInitShift */
+static inline unsigned int crc32cShift(unsigned int crc, unsigned int mult)
+{
+	__m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(mult), 0);
+	
+#ifdef _M_X64
+	return (unsigned int)_mm_crc32_u64(0, (unsigned __int64)_mm_cvtsi128_si64(prod));
+#else
+	return _mm_crc32_u32(_mm_crc32_u32(0, (unsigned int)_mm_cvtsi128_si32(prod)),
+		(unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(prod, 4)));
+#endif
+}
+
+#ifdef _M_X64
+typedef unsigned __int64 Crc32cWord;
+#define CRC32C_WORD(crc, p) ((unsigned int)_mm_crc32_u64((crc), *(const Crc32cWord *)(p)))
+#else
+typedef unsigned int Crc32cWord;
+#define CRC32C_WORD(crc, p) _mm_crc32_u32((crc), *(const Crc32cWord *)(p))
+#endif
+
+static inline unsigned int crc32cHwTail(unsigned int crc, const unsigned char *data, unsigned int length)
+{
+	while (length >= sizeof(Crc32cWord))
+	{
+		crc = CRC32C_WORD(crc, data);
+		data += sizeof(Crc32cWord);
+		length -= sizeof(Crc32cWord);
+	}
+	
+	while (length--)
+		crc = _mm_crc32_u8(crc, *data++);
+	
+	return crc;
+}
+
+static inline unsigned int crc32cHwHead(unsigned int *crc, const unsigned char **data, unsigned int length)
+{
+	while (length != 0 && ((size_t)*data & (sizeof(Crc32cWord) - 1)) != 0)
+	{
+		*crc = _mm_crc32_u8(*crc, *(*data)++);
+		length--;
+	}
+	
+	return length;
+}
+
+/* SSE4.2 without PCLMUL: a single dependent chain of crc32 instructions */
+static unsigned int crc32cHw(unsigned int crc, const unsigned char *data, unsigned int length)
+{
+	length = crc32cHwHead(&crc, &data, length);
+	
+	return crc32cHwTail(crc, data, length);
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but can issue one per
+ * cycle, so three independent lanes keep the unit busy. The lanes are then
+ * stitched back together by shifting each partial crc past the bytes that
+ * followed it (a PCLMUL multiply) and xoring.
+ */
+
+static unsigned int crc32cHwInterleaved(unsigned int crc, const unsigned char *data, unsigned int length)
+{
+	length = crc32cHwHead(&crc, &data, length);
+	
+	while (length >= 3 * CRC32C_LONG)
+	{
+		unsigned int crc1 = 0, crc2 = 0;
+		const unsigned char *end = data + CRC32C_LONG;
+		
+		do
+		{
+			crc = CRC32C_WORD(crc, data);
+			crc1 = CRC32C_WORD(crc1, data + CRC32C_LONG);
+			crc2 = CRC32C_WORD(crc2, data + 2 * CRC32C_LONG);
+			data += sizeof(Crc32cWord);
+		} while (data < end);
+		
+		crc = crc32cShift(crc, crc32cShiftLong) ^ crc1;
+		crc = crc32cShift(crc, crc32cShiftLong) ^ crc2;
+		
+		data += 2 * CRC32C_LONG;
+		length -= 3 * CRC32C_LONG;
+	}
+	
+	while (length >= 3 * CRC32C_SHORT)
+	{
+		unsigned int crc1 = 0, crc2 = 0;
+		const unsigned char *end = data + CRC32C_SHORT;
+		
+		do
+		{
+			crc = CRC32C_WORD(crc, data);
+			crc1 = CRC32C_WORD(crc1, data + CRC32C_SHORT);
+			crc2 = CRC32C_WORD(crc2, data + 2 * CRC32C_SHORT);
+			data += sizeof(Crc32cWord);
+		} while (data < end);
+		
+		crc = crc32cShift(crc, crc32cShiftShort) ^ crc1;
+		crc = crc32cShift(crc, crc32cShiftShort) ^ crc2;
+		
+		data += 2 * CRC32C_SHORT;
+		length -= 3 * CRC32C_SHORT;
+	}
+	
+	return crc32cHwTail(crc, data, length);
+}
+
+/*
+ * Per-sector checksums are independent, so instead of splitting one buffer
+ * into lanes and stitching them back together, three whole sectors go down
+ * the three lanes at once. Sector sizes are multiples of the word size, so
+ * all three lanes are equally (mis)aligned and share one head.
+ */
+
+static void crc32cHwSectors(const unsigned char *data, unsigned int sectorSize, unsigned int numSectors,
+	unsigned int *out)
+{
+	while (numSectors >= 3)
+	{
+		unsigned int crc0 = ~0U, crc1 = ~0U, crc2 = ~0U;
+		const unsigned char *p = data, *end = data + sectorSize;
+		
+		while (p < end && ((size_t)p & (sizeof(Crc32cWord) - 1)) != 0)
+		{
+			crc0 = _mm_crc32_u8(crc0, p[0]);
+			crc1 = _mm_crc32_u8(crc1, p[sectorSize]);
+			crc2 = _mm_crc32_u8(crc2, p[2 * sectorSize]);
+			p++;
+		}
+		
+		while (end - p >= (ptrdiff_t)sizeof(Crc32cWord))
+		{
+			crc0 = CRC32C_WORD(crc0, p);
+			crc1 = CRC32C_WORD(crc1, p + sectorSize);
+			crc2 = CRC32C_WORD(crc2, p + 2 * sectorSize);
+			p += sizeof(Crc32cWord);
+		}
+		
+		out[0] = ~crc32cHwTail(crc0, p, (unsigned int)(end - p));
+		out[1] = ~crc32cHwTail(crc1, p + sectorSize, (unsigned int)(end - p));
+		out[2] = ~crc32cHwTail(crc2, p + 2 * sectorSize, (unsigned int)(end - p));
+		
+		data += 3 * sectorSize;
+		out += 3;
+		numSectors -= 3;
+	}
+	
+	while (numSectors-- != 0)
+	{
+		*out++ = ~crc32cHw(~0U, data, sectorSize);
+		data += sectorSize;
+	}
+}
+
+/* ECX bit 20 of CPUID leaf 1: SSE4.2; ECX bit 1: PCLMULQDQ */
+static bool crc32cHasSSE42(bool pclmul)
+{
+	int info[4];
+	
+	__cpuid(info, 1);
+	
+	return (info[2] & (1 << 20)) != 0 && (!pclmul || (info[2] & (1 << 1)) != 0);
+}
+#endif
+
+/* first call lands here; picks the best implementation for this CPU */
+static unsigned int crc32cSelect(unsigned int crc, const unsigned char *data, unsigned int length)
+{
+	Crc32cFunc impl;
+	
+#ifdef CRC32C_HW
+	if (crc32cHasSSE42(true))
+	{
+		crc32cInitShift();
+		impl = &crc32cHwInterleaved;
+	}
+	else if (crc32cHasSSE42(false))
+		impl = &crc32cHw;
+	else
+#endif
+	{
+		crc32cInitSlice();
+		impl = &crc32cSliceBy8;
+	}
+	
+	/* racing threads all compute the same tables and pick the same function */
+	crc32cImpl = impl;
+	
+	return impl(crc, data, length);
+}
+
+/*
+ * Pins crc32c and crc32cSectors to one implementation, so that a testbed can
+ * check each against the others; returns false if this CPU can't run it.
+ * CRC32C_AUTO goes back to choosing by CPUID. Not for use while other
+ * threads are checksumming.
+ */
+
+bool crc32cUsePath(Crc32cPath path)
+{
+	switch (path)
+	{
+	case CRC32C_AUTO:
+		crc32cImpl = &crc32cSelect;
+		return true;
+	case CRC32C_BYTEWISE:
+		crc32cImpl = &crc32cBytewise;
+		return true;
+	case CRC32C_SLICE8:
+		crc32cInitSlice();
+		crc32cImpl = &crc32cSliceBy8;
+		return true;
+#ifdef CRC32C_HW
+	case CRC32C_SSE42:
+		if (!crc32cHasSSE42(false))
+			return false;
+		crc32cImpl = &crc32cHw;
+		return true;
+	case CRC32C_SSE42_3WAY:
+		if (!crc32cHasSSE42(true))
+			return false;
+		crc32cInitShift();
+		crc32cImpl = &crc32cHwInterleaved;
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+unsigned int crc32c(unsigned int crc, const unsigned char *data, unsigned int length)
+{
+	return crc32cImpl(crc, data, length);
+}
+
+/*
+ * Computes the finished checksum (inverted in and out, the way btrfs stores
+ * it) of each of numSectors consecutive sectors of data.
+ */
+
+void crc32cSectors(const unsigned char *data, unsigned int sectorSize, unsigned int numSectors, unsigned int *out)
+{
+	/* make sure an implementation has been picked */
+	if (crc32cImpl == &crc32cSelect)
+		crc32c(0, data, 0);
+	
+#ifdef CRC32C_HW
+	if (crc32cImpl == &crc32cHw || crc32cImpl == &crc32cHwInterleaved)
+	{
+		crc32cHwSectors(data, sectorSize, numSectors, out);
+		return;
+	}
+#endif
+	
+	while (numSectors-- != 0)
+	{
+		*out++ = ~crc32cImpl(~0U, data, sectorSize);
+		data += sectorSize;
+	}
+}
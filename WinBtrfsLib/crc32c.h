@@ -1 +1,7 @@
 unsigned int crc32c(unsigned int crc, const unsigned char *data, unsigned int length);
+void crc32cSectors(const unsigned char *data, unsigned int sectorSize, unsigned int numSectors, unsigned int *out);
+
+/* the implementations crc32cUsePath can pin, for the testbeds that check them against each other */
+enum Crc32cPath { CRC32C_AUTO, CRC32C_BYTEWISE, CRC32C_SLICE8, CRC32C_SSE42, CRC32C_SSE42_3WAY };
+
+bool crc32cUsePath(Crc32cPath path);
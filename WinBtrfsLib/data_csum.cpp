@@ -0,0 +1,384 @@
+/* WinBtrfsLib/data_csum.cpp
+ * verification of file data against the checksum tree
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "data_csum.h"
+#include <cassert>
+#include <map>
+#include <vector>
+#include "arena.h"
+#include "btrfs_system.h"
+#include "crc32c.h"
+#include "endian.h"
+#include "roottree_parser.h"
+#include "trace.h"
+#include "tree_search.h"
+
+namespace WinBtrfsLib
+{
+	extern std::vector<BtrfsSuperblock> supers;
+
+	/* the only checksum type there is so far is crc32c, which is four bytes per sector */
+	const unsigned short CSUM_TYPE_CRC32C = 0;
+	const unsigned int CSUM_SIZE = 4;
+
+	/* memory for cached checksums; at 4K sectors, 4 MiB of them covers 4 GiB of data */
+	const unsigned __int64 CSUM_CACHE_BUDGET = 4 * 1024 * 1024;
+
+	/* a stretch of the logical address space as the checksum tree describes it: either one EXTENT_CSUM item,
+		with one checksum per sector, or a gap between two of them, where the data has no checksums at all */
+	struct CsumRange
+	{
+		LogiAddr				start;
+		LogiAddr				end;
+		bool					summed;
+		CsumRange				*prev;	// LRU list links
+		CsumRange				*next;
+		unsigned int			csums	[0x0];	// (end - start) / sectorSize of them if summed
+	};
+
+	/* keyed by start address. the ranges are all true to the tree, which never changes while mounted, so two
+		that overlap (gaps found from either side of the same hole) are redundant but never contradictory */
+	typedef std::map<LogiAddr, CsumRange *> CsumRangeMap;
+
+	/* all three are set once by setupDataCsums, before any other thread is started, and only read after that */
+	bool csumVerify = false;
+	unsigned int csumSectorSize = 0;
+	LogiAddr csumRoot = 0;
+	CRITICAL_SECTION csumLock;
+	CsumRangeMap csumRanges;
+	CsumRange *csumLruHead = NULL, *csumLruTail = NULL;
+	unsigned __int64 csumBytesCached = 0;
+	unsigned __int64 csumHits = 0, csumMisses = 0, csumEvictions = 0;
+	volatile LONGLONG csumBytesVerified = 0, csumUnsummed = 0, csumFailures = 0;
+	volatile LONGLONG csumLookupTicks = 0, csumCrcTicks = 0;
+
+	/* has to come after buildRootIndex, since it looks up the checksum tree's root */
+	void setupDataCsums(bool verify)
+	{
+		const RootInfo *root;
+
+		if (!verify)
+			return;
+
+		if (endian16(supers[0].csumType) != CSUM_TYPE_CRC32C)
+		{
+			printf("setupDataCsums: unknown checksum type %u, data will not be verified!\n",
+				endian16(supers[0].csumType));
+			return;
+		}
+
+		if ((root = findRoot(OBJID_CSUM_TREE)) == NULL)
+		{
+			printf("setupDataCsums: the volume has no checksum tree, data will not be verified!\n");
+			return;
+		}
+
+		InitializeCriticalSection(&csumLock);
+
+		csumRoot = root->addr;
+		csumSectorSize = endian32(supers[0].sectorSize);
+		csumVerify = true;
+	}
+
+	bool dataCsumsEnabled()
+	{
+		return csumVerify;
+	}
+
+	/* csumLock must be held */
+	static void unlinkLRU(CsumRange *range)
+	{
+		if (range->prev != NULL)
+			range->prev->next = range->next;
+		else
+			csumLruHead = range->next;
+
+		if (range->next != NULL)
+			range->next->prev = range->prev;
+		else
+			csumLruTail = range->prev;
+
+		range->prev = range->next = NULL;
+	}
+
+	/* csumLock must be held */
+	static void pushLRU(CsumRange *range)
+	{
+		range->prev = NULL;
+		range->next = csumLruHead;
+		if (csumLruHead != NULL)
+			csumLruHead->prev = range;
+		else
+			csumLruTail = range;
+		csumLruHead = range;
+	}
+
+	static size_t rangeBytes(const CsumRange *range)
+	{
+		return sizeof(CsumRange) + (range->summed ? (size_t)((range->end - range->start) / csumSectorSize) *
+			sizeof(unsigned int) : 0);
+	}
+
+	/* csumLock must be held; returns the cached range covering addr, if there is one */
+	static CsumRange *findRange(LogiAddr addr)
+	{
+		CsumRangeMap::iterator it = csumRanges.upper_bound(addr);
+
+		if (it == csumRanges.begin())
+			return NULL;
+
+		--it;
+
+		if (it->second->end <= addr)
+			return NULL;
+
+		unlinkLRU(it->second);
+		pushLRU(it->second);
+
+		return it->second;
+	}
+
+	/* csumLock must be held; adds a range fresh from the tree, unless another thread got there first, and
+		returns whichever one ended up in the cache. the newest range is never evicted, so it stays valid until
+		the lock is dropped */
+	static CsumRange *insertRange(CsumRange *range)
+	{
+		CsumRangeMap::iterator it = csumRanges.find(range->start);
+
+		if (it != csumRanges.end())
+		{
+			free(range);
+
+			unlinkLRU(it->second);
+			pushLRU(it->second);
+
+			return it->second;
+		}
+
+		csumRanges[range->start] = range;
+		pushLRU(range);
+		csumBytesCached += rangeBytes(range);
+
+		while (csumBytesCached > CSUM_CACHE_BUDGET && csumLruTail != range)
+		{
+			CsumRange *victim = csumLruTail;
+
+			unlinkLRU(victim);
+			csumRanges.erase(victim->start);
+			csumBytesCached -= rangeBytes(victim);
+			csumEvictions++;
+
+			free(victim);
+		}
+
+		return range;
+	}
+
+	/* looks addr up in the checksum tree and returns a new range covering it: the EXTENT_CSUM item it falls in,
+		or the gap it falls in if there isn't one */
+	static CsumRange *loadRange(LogiAddr addr)
+	{
+		LogiAddr gapStart = addr, gapEnd = (LogiAddr)-1;
+		CsumRange *range = NULL;
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+		bool found;
+
+		key.objectID = (BtrfsObjID)endian64(OBJID_EXTENT_CSUM);
+		key.type = TYPE_EXTENT_CSUM;
+		key.offset = endian64(addr);
+
+		/* the last item starting at or before addr is the only one that can cover it; if there's none, the first
+			item after addr ends the gap addr is in */
+		if ((found = searchTreeAtOrBefore(csumRoot, &key, &cursor)) == false)
+		{
+			releaseCursor(&cursor);
+			found = searchTree(csumRoot, &key, &cursor);
+		}
+
+		/* both the item covering addr and the one ending its gap are at most one step away, so this takes that
+			step without the sibling prefetch a scan would start */
+		for ( ; found; found = cursorAdvance(&cursor, false))
+		{
+			const BtrfsItem *item = cursorItem(&cursor);
+			LogiAddr start = endian64(item->key.offset);
+			unsigned int numCsums = cursorDataSize(&cursor) / CSUM_SIZE;
+			LogiAddr end = start + (unsigned __int64)numCsums * csumSectorSize;
+
+			if (endian64(item->key.objectID) != OBJID_EXTENT_CSUM || item->key.type != TYPE_EXTENT_CSUM)
+				break;
+
+			if (start > addr)
+			{
+				gapEnd = start;
+				break;
+			}
+
+			if (end > addr)
+			{
+				const unsigned char *data = cursorData(&cursor);
+
+				range = (CsumRange *)malloc(sizeof(CsumRange) + numCsums * sizeof(unsigned int));
+				assert(range != NULL);
+
+				range->start = start;
+				range->end = end;
+				range->summed = true;
+
+				for (unsigned int i = 0; i < numCsums; i++)
+					range->csums[i] = endian32(*(const unsigned int *)(data + i * CSUM_SIZE));
+
+				break;
+			}
+
+			/* addr is in the gap after this item */
+			gapStart = end;
+		}
+
+		releaseCursor(&cursor);
+
+		if (range == NULL)
+		{
+			range = (CsumRange *)malloc(sizeof(CsumRange));
+			assert(range != NULL);
+
+			range->start = gapStart;
+			range->end = gapEnd;
+			range->summed = false;
+		}
+
+		range->prev = range->next = NULL;
+
+		return range;
+	}
+
+	/* checks each sector of data, which was read from logical address addr, against the checksum tree; returns
+		ERROR_CRC if any of them doesn't match. sectors without checksums pass. addr and len must be sector
+		aligned, which every read of extent data is */
+	DWORD verifyData(LogiAddr addr, unsigned __int64 len, const unsigned char *data)
+	{
+		Arena *scratch = getThreadArena();
+		ArenaScope scope(scratch);
+		unsigned int numSectors = (unsigned int)(len / csumSectorSize), done = 0;
+		unsigned int *expected = (unsigned int *)scratch->allocate(numSectors * sizeof(unsigned int));
+		unsigned int *actual = (unsigned int *)scratch->allocate(numSectors * sizeof(unsigned int));
+		LONGLONG lookupTicks = 0, crcTicks = 0, verified = 0, unsummed = 0;
+		DWORD error = ERROR_SUCCESS;
+		TraceScope traceScope(TRACE_READ, __FUNCTION__);
+
+		assert(csumVerify && addr % csumSectorSize == 0 && len % csumSectorSize == 0);
+
+		/* one range at a time: copy out its checksums for the part of the read it covers, then check that part
+			of the buffer, three sectors abreast */
+		while (done < numSectors)
+		{
+			LogiAddr sectorAddr = addr + (unsigned __int64)done * csumSectorSize;
+			LARGE_INTEGER start, mid, end;
+			unsigned int run;
+			bool summed;
+			CsumRange *range;
+
+			QueryPerformanceCounter(&start);
+
+			EnterCriticalSection(&csumLock);
+
+			if ((range = findRange(sectorAddr)) != NULL)
+				csumHits++;
+			else
+			{
+				csumMisses++;
+
+				LeaveCriticalSection(&csumLock);
+				range = loadRange(sectorAddr);
+				EnterCriticalSection(&csumLock);
+
+				range = insertRange(range);
+			}
+
+			run = (range->end - sectorAddr) / csumSectorSize < numSectors - done ?
+				(unsigned int)((range->end - sectorAddr) / csumSectorSize) : numSectors - done;
+			summed = range->summed;
+
+			if (summed)
+				memcpy(expected + done, range->csums + (sectorAddr - range->start) / csumSectorSize,
+					run * sizeof(unsigned int));
+
+			LeaveCriticalSection(&csumLock);
+
+			QueryPerformanceCounter(&mid);
+
+			if (summed)
+			{
+				crc32cSectors(data + (size_t)done * csumSectorSize, csumSectorSize, run, actual + done);
+
+				for (unsigned int i = done; i < done + run; i++)
+				{
+					if (actual[i] != expected[i])
+					{
+						TRACE(TRACE_READ, TRACE_ERROR, "sector 0x%I64x has checksum 0x%08x, expected 0x%08x!",
+							addr + (unsigned __int64)i * csumSectorSize, actual[i], expected[i]);
+						error = ERROR_CRC;
+					}
+				}
+
+				verified += (LONGLONG)run * csumSectorSize;
+			}
+			else
+				unsummed += run;
+
+			QueryPerformanceCounter(&end);
+
+			lookupTicks += mid.QuadPart - start.QuadPart;
+			crcTicks += end.QuadPart - mid.QuadPart;
+
+			done += run;
+		}
+
+		InterlockedExchangeAdd64(&csumLookupTicks, lookupTicks);
+		InterlockedExchangeAdd64(&csumCrcTicks, crcTicks);
+		InterlockedExchangeAdd64(&csumUnsummed, unsummed);
+
+		if (error == ERROR_SUCCESS)
+			InterlockedExchangeAdd64(&csumBytesVerified, verified);
+		else
+			InterlockedIncrement64(&csumFailures);
+
+		return error;
+	}
+
+	void getDataCsumStats(DataCsumStats *stats)
+	{
+		LARGE_INTEGER freq;
+
+		memset(stats, 0, sizeof(DataCsumStats));
+
+		if (!csumVerify)
+			return;
+
+		QueryPerformanceFrequency(&freq);
+
+		EnterCriticalSection(&csumLock);
+
+		stats->hits = csumHits;
+		stats->misses = csumMisses;
+		stats->evictions = csumEvictions;
+		stats->bytesCached = csumBytesCached;
+
+		LeaveCriticalSection(&csumLock);
+
+		stats->bytesVerified = (unsigned __int64)csumBytesVerified;
+		stats->sectorsUnsummed = (unsigned __int64)csumUnsummed;
+		stats->failures = (unsigned __int64)csumFailures;
+		stats->lookupMicroseconds = (unsigned __int64)(csumLookupTicks * 1000000 / freq.QuadPart);
+		stats->crcMicroseconds = (unsigned __int64)(csumCrcTicks * 1000000 / freq.QuadPart);
+	}
+}
@@ -0,0 +1,40 @@
+/* WinBtrfsLib/data_csum.h
+ * verification of file data against the checksum tree
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <Windows.h>
+#include "types.h"
+
+#ifndef WINBTRFSLIB_DATA_CSUM_H
+#define WINBTRFSLIB_DATA_CSUM_H
+
+namespace WinBtrfsLib
+{
+	struct DataCsumStats
+	{
+		unsigned __int64		bytesVerified;		// data that had a checksum and matched it
+		unsigned __int64		sectorsUnsummed;	// sectors read that have no checksum (nodatasum files)
+		unsigned __int64		failures;			// verifications that found a bad sector
+		unsigned __int64		hits;				// checksum lookups answered by the range cache
+		unsigned __int64		misses;				// lookups that had to go to the tree
+		unsigned __int64		evictions;
+		unsigned __int64		bytesCached;
+		unsigned __int64		lookupMicroseconds;	// time spent finding checksums, cache and tree both
+		unsigned __int64		crcMicroseconds;	// time spent checksumming the data
+	};
+
+	void setupDataCsums(bool verify);
+	bool dataCsumsEnabled();
+	DWORD verifyData(LogiAddr addr, unsigned __int64 len, const unsigned char *data);
+	void getDataCsumStats(DataCsumStats *stats);
+}
+
+#endif
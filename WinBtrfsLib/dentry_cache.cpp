@@ -0,0 +1,115 @@
+/* WinBtrfsLib/dentry_cache.cpp
+ * cache of path component lookups
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "dentry_cache.h"
+#include <cstddef>
+#include <functional>
+
+namespace WinBtrfsLib
+{
+	size_t DentryCache::Traits::hash(const Key &key)
+	{
+		/* the name hash is already a good crc32c; the parent just keeps identical names in different
+			directories apart */
+		return std::hash<unsigned __int64>()(((unsigned __int64)key.parent.objectID * 31 +
+			(unsigned __int64)key.parent.treeID) ^ ((unsigned __int64)key.hash << 32 | key.hash));
+	}
+
+	bool DentryCache::Traits::equal(const Key &a, const Key &b)
+	{
+		return (a.hash == b.hash && a.parent.treeID == b.parent.treeID && a.parent.objectID == b.parent.objectID &&
+			strcmp(a.name, b.name) == 0);
+	}
+
+	/* the budget is a number of entries, however long their names */
+	unsigned __int64 DentryCache::Traits::charge(size_t size)
+	{
+		return 1;
+	}
+
+	DentryCache::DentryCache()
+	{
+		negativeHits = 0;
+	}
+
+	/* zero entries disables the cache entirely */
+	void DentryCache::setup(unsigned __int64 maxEntries)
+	{
+		cache.setup(maxEntries, 0, 0);
+	}
+
+	/* on DENTRY_FOUND, fills in the child's FileID */
+	DentryLookup DentryCache::lookup(const FileID *parent, unsigned int hash, const char *name, FileID *child)
+	{
+		Result result;
+		Key key;
+
+		key.parent = *parent;
+		key.hash = hash;
+		key.name = name;
+
+		if (!cache.copy(key, &result, offsetof(Result, name)))
+			return DENTRY_MISS;
+
+		if (result.negative)
+		{
+			InterlockedIncrement64(&negativeHits);
+			return DENTRY_NEGATIVE;
+		}
+
+		*child = result.child;
+		return DENTRY_FOUND;
+	}
+
+	/* remembers the result of a lookup that went to the tree; a NULL child records that the name doesn't exist */
+	void DentryCache::insert(const FileID *parent, unsigned int hash, const char *name, const FileID *child)
+	{
+		size_t nameLen = strlen(name);
+		Result *result;
+		Key key;
+
+		if (cache.getBudget() == 0)
+			return;
+
+		result = (Result *)cache.allocate(offsetof(Result, name) + nameLen + 1);
+
+		memcpy(result->name, name, nameLen + 1);
+		result->negative = (child == NULL);
+		if (child != NULL)
+			result->child = *child;
+		else
+			memset(&result->child, 0, sizeof(FileID));
+
+		key.parent = *parent;
+		key.hash = hash;
+		key.name = result->name;
+
+		/* another thread may have resolved the same name in the meantime; its answer is just as good, and publish
+			hands that one back instead */
+		cache.release(cache.publish(key, (unsigned char *)result));
+	}
+
+	void DentryCache::getStats(DentryCacheStats *stats)
+	{
+		LRUCacheStats cacheStats;
+
+		/* the cache counts negative hits as hits like any other, and before they're counted here, so reading
+			this first keeps the difference from going negative */
+		stats->negativeHits = negativeHits;
+		cache.getStats(&cacheStats);
+
+		stats->hits = cacheStats.hits - stats->negativeHits;
+		stats->misses = cacheStats.misses;
+		stats->evictions = cacheStats.evictions;
+		stats->entries = cacheStats.entries;
+	}
+}
@@ -0,0 +1,80 @@
+/* WinBtrfsLib/dentry_cache.h
+ * cache of path component lookups
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <Windows.h>
+#include "lru_cache.h"
+#include "types.h"
+
+#ifndef WINBTRFSLIB_DENTRY_CACHE_H
+#define WINBTRFSLIB_DENTRY_CACHE_H
+
+namespace WinBtrfsLib
+{
+	enum DentryLookup
+	{
+		DENTRY_MISS,
+		DENTRY_FOUND,
+		DENTRY_NEGATIVE		// the name is known not to exist in that directory
+	};
+
+	struct DentryCacheStats
+	{
+		unsigned __int64		hits;
+		unsigned __int64		negativeHits;
+		unsigned __int64		misses;
+		unsigned __int64		evictions;
+		unsigned __int64		entries;
+	};
+
+	/* a bounded LRU map from (parent directory, name) to the child's FileID. the volume is read-only, so entries
+		never go stale and a name that wasn't found can be remembered as missing just the same. children that are
+		subvolumes are stored already resolved to the root directory of their own tree. */
+	class DentryCache
+	{
+	public:
+		DentryCache();
+
+		void setup(unsigned __int64 maxEntries);
+		DentryLookup lookup(const FileID *parent, unsigned int hash, const char *name, FileID *child);
+		void insert(const FileID *parent, unsigned int hash, const char *name, const FileID *child);
+		void getStats(DentryCacheStats *stats);
+
+	private:
+		/* name points into the entry that owns the key, or at the caller's string during a lookup */
+		struct Key
+		{
+			FileID					parent;
+			unsigned int			hash;	// the DIR_ITEM name hash, which we already have anyway
+			const char				*name;
+		};
+
+		/* what each cache entry holds; lookups copy out everything but the name */
+		struct Result
+		{
+			FileID					child;
+			bool					negative;
+			char					name	[0x0];
+		};
+
+		struct Traits
+		{
+			static size_t hash(const Key &key);
+			static bool equal(const Key &a, const Key &b);
+			static unsigned __int64 charge(size_t size);
+		};
+
+		LRUCache<Key, Traits> cache;
+		volatile LONGLONG negativeHits;
+	};
+}
+
+#endif
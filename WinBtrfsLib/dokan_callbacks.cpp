@@ -12,14 +12,15 @@
 
 #include "dokan_callbacks.h"
 #include <cassert>
-#include <list>
 #include <vector>
 #include "btrfs_operations.h"
 #include "btrfs_system.h"
-#include "compression.h"
 #include "constants.h"
 #include "endian.h"
 #include "fstree_parser.h"
+#include "open_files.h"
+#include "readahead.h"
+#include "trace.h"
 #include "util.h"
 
 namespace WinBtrfsLib
@@ -28,25 +29,13 @@ namespace WinBtrfsLib
 	extern std::vector<BtrfsSuperblock> supers;
 	extern BtrfsObjID mountedSubvol;
 
-	std::list<FilePkg> openFiles, cleanedUpFiles;
-	HANDLE hBigDokanLock = INVALID_HANDLE_VALUE;
-
-	DWORD setupBigDokanLock()
-	{
-		hBigDokanLock = CreateMutex(NULL, FALSE, NULL);
-
-		if (hBigDokanLock == INVALID_HANDLE_VALUE)
-			return GetLastError();
-		else
-			return ERROR_SUCCESS;
-	}
-
 	int btrfsCreateFileCommon(bool dir, LPCWSTR fileName, DWORD desiredAccess, DWORD shareMode, DWORD creationDisposition,
 		DWORD flagsAndAttributes, PDOKAN_FILE_INFO info)
 	{
 		char fileNameB[MAX_PATH];
-		FileID parentID, *fileID = (FileID *)malloc(sizeof(FileID));
-		FilePkg filePkg;
+		FileID fileID, parentID;
+		FileRecord *record;
+		OpenFile *openFile;
 
 		if (!dir)
 			assert(creationDisposition != CREATE_ALWAYS && creationDisposition != OPEN_ALWAYS);
@@ -56,76 +45,64 @@ namespace WinBtrfsLib
 
 		/* just in case */
 		info->Context = 0x0;
-	
-		if (WaitForSingleObject(hBigDokanLock, 10000) != WAIT_OBJECT_0)
-		{
-			printf("%s: couldn't get ownership of the Big Dokan Lock! [%S]\n",
-				(dir ? "btrfsOpenDirectory" : "brtfsCreateFile"), fileName);
-			return -ERROR_SEM_TIMEOUT; // error code looks sketchy
-		}
 
-		if (getPathID(fileNameB, fileID, &parentID) != 0)
+		if (getPathID(fileNameB, &fileID, &parentID) != 0)
 		{
-			ReleaseMutex(hBigDokanLock);
-			printf("%s: getPathID failed! [%S]\n",
-				(dir ? "btrfsOpenDirectory" : "brtfsCreateFile"), fileName);
+			TRACE(TRACE_DOKAN, TRACE_DEBUG, "getPathID failed! [%S]", fileName);
 			return -ERROR_FILE_NOT_FOUND;
 		}
 
-		int result2;
-		if ((result2 = parseFSTree(fileID->treeID, FSOP_GET_FILE_PKG, &fileID->objectID, NULL, NULL, &filePkg, NULL)) != 0)
+		/* if another handle already has this inode open, its record can be shared as-is; for a file with
+			several hard links, the name and parent are those of whichever link was opened first */
+		if ((record = acquireFileRecord(&fileID)) == NULL)
 		{
-			ReleaseMutex(hBigDokanLock);
-			printf("%s: parseFSTree with FSOP_GET_FILE_PKG returned %d! [%S]\n",
-				(dir ? "btrfsOpenDirectory" : "brtfsCreateFile"), result2, fileName);
-			return -ERROR_FILE_NOT_FOUND;
-		}
-	
-		ReleaseMutex(hBigDokanLock);
+			record = allocateFileRecord();
 
-		/* populate the parent object ID */
-		memcpy(&filePkg.parentID, &parentID, sizeof(FileID));
+			int result2;
+			if ((result2 = parseFSTree(fileID.treeID, FSOP_GET_FILE_PKG, &fileID.objectID, NULL, NULL,
+				&record->filePkg, NULL)) != 0)
+			{
+				discardFileRecord(record);
+				TRACE(TRACE_DOKAN, TRACE_ERROR, "parseFSTree with FSOP_GET_FILE_PKG returned %d! [%S]", result2,
+					fileName);
+				return -ERROR_FILE_NOT_FOUND;
+			}
 
-		/* populate the parent inode */
-		int result3;
-		if ((result3 = parseFSTree(filePkg.parentID.treeID, FSOP_GET_INODE, &filePkg.parentID.objectID,
-			NULL, NULL, &filePkg.parentInode, NULL)) != 0)
-		{
-			ReleaseMutex(hBigDokanLock);
-			printf("%s: parseFSTreewith FSOP_GET_INODE returned %d! [%S]\n",
-				(dir ? "btrfsOpenDirectory" : "brtfsCreateFile"), result3, fileName);
-			return -ERROR_FILE_NOT_FOUND;
-		}
+			/* populate the parent object ID */
+			memcpy(&record->filePkg.parentID, &parentID, sizeof(FileID));
 
-		std::list<FilePkg>::iterator it = openFiles.begin(), end = openFiles.end();
-		for ( ; it != end; ++it)
-		{
-			/* there should not be any duplicate records in this array! */
-			//assert(it->objectID != objectID);
-			/* actually, that's a *terrible* assumption. for now, we'll allow dupes under the knowledge that they will
-				contain exactly the same information, so it doesn't matter which one gets cleared up later. this should
-				be totally cleared up when we move over to a multimap container instead of the current linked list. */
-		
-			/* sort the list in ascending treeID/objectID order */
-			if (it->fileID.treeID > fileID->treeID ||
-				(it->fileID.treeID == fileID->treeID && it->fileID.objectID > fileID->objectID))
-				break;
+			/* populate the parent inode */
+			int result3;
+			if ((result3 = parseFSTree(parentID.treeID, FSOP_GET_INODE, &parentID.objectID,
+				NULL, NULL, &record->filePkg.parentInode, NULL)) != 0)
+			{
+				discardFileRecord(record);
+				TRACE(TRACE_DOKAN, TRACE_ERROR, "parseFSTree with FSOP_GET_INODE returned %d! [%S]", result3,
+					fileName);
+				return -ERROR_FILE_NOT_FOUND;
+			}
+
+			record = publishFileRecord(record);
 		}
 
-		openFiles.insert(it, filePkg);
+		openFile = new OpenFile;
+		openFile->record = record;
+		openFile->nextOffset = 0;
+		openFile->raWindow = 0;
+		openFile->raEnd = 0;
 
-		info->Context = (unsigned __int64)fileID;
+		info->Context = (unsigned __int64)openFile;
 
-		if (!info->IsDirectory && (filePkg.inode.stMode & S_IFDIR))
+		if (!info->IsDirectory && (record->filePkg.inode.stMode & S_IFDIR))
 			info->IsDirectory = TRUE;
 
 		if (!dir)
 		{
 			/* need to respect the desired access level, and lock the file based on shareMode */
-			printf("btrfsCreateFile: TOOD: handle desiredAccess and shareMode\n");
+			TRACE(TRACE_DOKAN, TRACE_DEBUG, "TODO: handle desiredAccess and shareMode");
 		}
 	
-		printf("%s: OK [%S]\n", (dir ? "btrfsOpenDirectory" : "brtfsCreateFile"), fileName);
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK [%S]", fileName);
 		return ERROR_SUCCESS;
 	}
 
@@ -138,78 +115,139 @@ namespace WinBtrfsLib
 	int DOKAN_CALLBACK btrfsCreateFile(LPCWSTR fileName, DWORD desiredAccess, DWORD shareMode, DWORD creationDisposition,
 		DWORD flagsAndAttributes, PDOKAN_FILE_INFO info)
 	{
+		TraceScope traceScope(TRACE_DOKAN, __FUNCTION__);
+
 		return btrfsCreateFileCommon(false, fileName, desiredAccess, shareMode,
 			creationDisposition, flagsAndAttributes, info);
 	}
 
 	int DOKAN_CALLBACK btrfsOpenDirectory(LPCWSTR fileName, PDOKAN_FILE_INFO info)
 	{
+		TraceScope traceScope(TRACE_DOKAN, __FUNCTION__);
+
 		return btrfsCreateFileCommon(true, fileName, 0, 0, 0, 0, info);
 	}
 
 	int DOKAN_CALLBACK btrfsCreateDirectory(LPCWSTR fileName, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsCreateDirectory: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 	
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsCleanup(LPCWSTR fileName, PDOKAN_FILE_INFO info)
 	{
-		FileID *fileID = (FileID *)info->Context;
+		/* reads may still arrive after this, so the handle's record stays around until btrfsCloseFile */
 	
-		std::list<FilePkg>::iterator it = openFiles.begin(), end = openFiles.end();
-		for ( ; it != end; ++it)
-		{
-			if (it->fileID.treeID == fileID->treeID && it->fileID.objectID == fileID->objectID)
-				break;
-		}
-
-		/* we should always be able to find an entry in openFiles */
-		assert(it != end);
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK [%S]", fileName);
+		return ERROR_SUCCESS;
+	}
 
-		FilePkg filePkg = *it;
-		openFiles.erase(it);
+	int DOKAN_CALLBACK btrfsCloseFile(LPCWSTR fileName, PDOKAN_FILE_INFO info)
+	{
+		OpenFile *openFile = (OpenFile *)info->Context;
 
-		it = cleanedUpFiles.begin(), end = cleanedUpFiles.end();
-		for ( ; it != end; ++it)
-		{
-			if (it->fileID.treeID == fileID->treeID && it->fileID.objectID == fileID->objectID)
-				break;
-		}
-	
-		/* insert the element such that the list is sorted in ascending object ID order */
-		cleanedUpFiles.insert(it, filePkg);
+		releaseFileRecord(openFile->record);
+		delete openFile;
 	
-		printf("btrfsCleanup: OK [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK [%S]", fileName);
 		return ERROR_SUCCESS;
 	}
 
-	int DOKAN_CALLBACK btrfsCloseFile(LPCWSTR fileName, PDOKAN_FILE_INFO info)
+	/* copies len bytes, starting from byte 'from' of the given piece of a file, into dest; sequential says
+		whether the handle is being read front to back, in which case the rest of the extent is wanted soon */
+	static int readExtent(const ExtentMapping *mapping, unsigned __int64 from, size_t len, unsigned char *dest,
+		bool sequential)
 	{
-		FileID *fileID = (FileID *)info->Context;
-	
-		std::list<FilePkg>::iterator it = cleanedUpFiles.begin(), end = cleanedUpFiles.end();
-		for ( ; it != end; ++it)
+		TraceScope traceScope(TRACE_READ, __FUNCTION__);
+
+		switch (mapping->kind)
 		{
-			if (it->fileID.treeID == fileID->treeID && it->fileID.objectID == fileID->objectID)
-				break;
+		case EXTENT_HOLE:
+		case EXTENT_PREALLOC:
+			memset(dest, 0, len);
+			return ERROR_SUCCESS;
+		case EXTENT_INLINE:
+			/* inline data past the end of the item reads as zeroes */
+			if (from < mapping->inlineSize)
+			{
+				size_t avail = (size_t)(mapping->inlineSize - from);
+
+				memcpy(dest, mapping->inlineData + from, (len < avail ? len : avail));
+				if (len > avail)
+					memset(dest + avail, 0, len - avail);
+			}
+			else
+				memset(dest, 0, len);
+			return ERROR_SUCCESS;
 		}
 
-		/* we should always be able to find an entry in openFiles */
-		assert(it != end);
+		/* this file extent may only refer to part of the (decoded) disk extent */
+		from += mapping->decodedOffset;
+
+		if (mapping->compression == COMPRESSION_NONE && !sequential)
+		{
+			/* a random read only reads what it covers, straight into the caller's buffer */
+			DWORD error = readExtentDirect(mapping, from, len, dest);
+
+			if (error != ERROR_SUCCESS)
+			{
+				TRACE(TRACE_READ, TRACE_ERROR, "couldn't read the extent at 0x%I64x!", mapping->diskAddr);
+				return error;
+			}
+		}
+		else if (mapping->compression == COMPRESSION_NONE)
+		{
+			/* go through the cache a chunk at a time, since readahead may already have brought these in */
+			while (len > 0)
+			{
+				unsigned __int64 chunkOffset = from - from % EXTENT_CHUNK_SIZE;
+				size_t size, skip = (size_t)(from - chunkOffset), piece;
+				DWORD error;
+				unsigned char *chunk = loadExtentChunk(mapping, chunkOffset, &size, &error);
 
-		/* free this stuff on the heap */
-		size_t numExtents = it->numExtents;
-		for (size_t i = 0; i < numExtents; i++)
-			free(it->extents[i].data);
-		free(it->extents);
+				if (chunk == NULL)
+				{
+					TRACE(TRACE_READ, TRACE_ERROR, "couldn't read the extent at 0x%I64x!", mapping->diskAddr);
+					return error;
+				}
 
-		cleanedUpFiles.erase(it);
+				piece = (len < size - skip ? len : size - skip);
+				memcpy(dest, chunk + skip, piece);
+				releaseExtent(chunk);
+
+				from += piece;
+				dest += piece;
+				len -= piece;
+			}
+		}
+		else if (!sequential)
+		{
+			/* a random read only decodes as much of the extent as it covers */
+			DWORD error = readExtentRange(mapping, from, len, dest);
+
+			if (error != ERROR_SUCCESS)
+			{
+				TRACE(TRACE_READ, TRACE_ERROR, "couldn't decode the extent at 0x%I64x!", mapping->diskAddr);
+				return error;
+			}
+		}
+		else
+		{
+			/* compressed extents are decoded whole and cached, so sequential readers only pay for this once */
+			DWORD error;
+			unsigned char *decompressed = loadExtent(mapping, &error);
+
+			if (decompressed == NULL)
+			{
+				TRACE(TRACE_READ, TRACE_ERROR, "couldn't decode the extent at 0x%I64x!", mapping->diskAddr);
+				return error;
+			}
+
+			memcpy(dest, decompressed + from, len);
+			releaseExtent(decompressed);
+		}
 
-		free(fileID);
-	
-		printf("btrfsCloseFile: OK [%s]\n", fileName);
 		return ERROR_SUCCESS;
 	}
 
@@ -217,283 +255,122 @@ namespace WinBtrfsLib
 	int DOKAN_CALLBACK btrfsReadFile(LPCWSTR fileName, LPVOID buffer, DWORD numberOfBytesToRead, LPDWORD numberOfBytesRead,
 		LONGLONG offset, PDOKAN_FILE_INFO info)
 	{
-		FileID *fileID = (FileID *)info->Context;
-		FilePkg *filePkg;
-	
-		/* Big Dokan Lock not needed here */
+		OpenFile *openFile = (OpenFile *)info->Context;
+		const FilePkg *filePkg = &openFile->record->filePkg;
+		unsigned __int64 fileSize = endian64(filePkg->inode.stSize);
+		TraceScope traceScope(TRACE_DOKAN, __FUNCTION__);
 
-		std::list<FilePkg>::iterator it = openFiles.begin(), end = openFiles.end();
-		for ( ; it != end; ++it)
+		/* we'll read from this, so to be safe we'll set it first */
+		*numberOfBytesRead = 0;
+
+		/* this idiotic fix courtesy of WordPad */
+		if ((unsigned __int64)offset >= fileSize)
 		{
-			if (it->fileID.treeID == fileID->treeID && it->fileID.objectID == fileID->objectID)
-				break;
+			TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK [%S]", fileName);
+			return ERROR_SUCCESS;
 		}
 
-		if (it == end)
+		const ExtentMap *extentMap = getExtentMap(openFile->record);
+		if (extentMap == NULL)
 		{
-			it = cleanedUpFiles.begin(), end = cleanedUpFiles.end();
-			for ( ; it != end; ++it)
-			{
-				if (it->fileID.treeID == fileID->treeID && it->fileID.objectID == fileID->objectID)
-					break;
-			}
-
-			/* failing to find the element is NOT an option */
-			assert(it != end);
+			TRACE(TRACE_DOKAN, TRACE_ERROR, "couldn't build the extent map! [%S]", fileName);
+			return -ERROR_READ_FAULT;
 		}
 
-		filePkg = &(*it);
-
-		size_t numExtents = filePkg->numExtents;
-		KeyedItem *extents = filePkg->extents;
+		/* if the moronic application requested more data than the file contains,
+			report a smaller read size to correct them */
+		unsigned __int64 readBegin = offset, readEnd = offset + numberOfBytesToRead;
+		if (readEnd > fileSize)
+			readEnd = fileSize;
 
-		/* zero out the areas that don't get read in */
-		memset(buffer, 0, numberOfBytesToRead);
+		/* get the I/O for what comes after this read going before doing this one */
+		noteRead(openFile, readBegin, readEnd - readBegin, fileSize);
 
-		/* we'll read from this, so to be safe we'll set it first */
-		*numberOfBytesRead = 0;
+		bool sequential = (openFile->raWindow != 0);
+		unsigned __int64 pos = readBegin;
 
-		unsigned __int64 readBegin = offset, readEnd = offset + numberOfBytesToRead;
-	
-		if (readBegin < filePkg->inode.stSize)
+		for (size_t i = findExtent(extentMap, readBegin); i < extentMap->numExtents && pos < readEnd; i++)
 		{
-			for (size_t i = 0; i < numExtents; i++)
-			{
-				BtrfsExtentData *extentData = (BtrfsExtentData *)extents[i].data;
-
-				/* does the requested range include the first byte of this extent? */
-				bool a = (endian64(extents[i].key.offset) >= offset &&
-					endian64(extents[i].key.offset) < offset + numberOfBytesToRead);
-				/* does the requested range include the last byte of this extent? */
-				bool b = (endian64(extents[i].key.offset) + endian64(extentData->n) - 1 >= offset &&
-					endian64(extents[i].key.offset) + endian64(extentData->n) - 1 < offset + numberOfBytesToRead);
-			
-				/* does the requested range start inside this extent? */
-				bool first = !a && b;
-				/* does the requested range end inside this extent? */
-				bool last = a && !b;
-				/* does the requested range take up the entirety of this extent? */
-				bool span = a && b;
-				/* does the requested range fit entirely within this extent? */
-				bool within = (offset >= endian64(extents[i].key.offset) &&
-					offset + numberOfBytesToRead <= endian64(extents[i].key.offset) + endian64(extentData->n));
-
-				if (first || last || span || within)
-				{
-					assert(extentData->encryption == ENCRYPTION_NONE);
-					assert(extentData->otherEncoding == ENCODING_NONE);
-				
-					if (extentData->compression <= COMPRESSION_LZO)
-					{
-						BtrfsExtentDataNonInline *nonInlinePart = NULL;
-						unsigned char *compressed, *decompressed;
-						size_t from, len;
-						bool skipCopy = false;
-
-						if (extentData->type == FILEDATA_INLINE)
-							decompressed = extentData->inlineData;
-						else
-						{
-							nonInlinePart = (BtrfsExtentDataNonInline *)extentData->inlineData;
-
-							/* an address of zero indicates a sparse extent (i.e. all zeroes) */
-							if (endian64(nonInlinePart->extAddr) == 0)
-								skipCopy = true;
-							else
-							{
-								printf("btrfsReadFile: warning: assuming first device!\n");
-							
-								compressed = (unsigned char *)malloc(endian64(nonInlinePart->extSize));
-
-								DWORD result = readLogical(endian64(nonInlinePart->extAddr),
-									endian64(nonInlinePart->extSize), compressed);
-								assert(result == 0);
-
-								switch (extentData->compression)
-								{
-								case COMPRESSION_NONE:
-									/* transitive property: data is already decompressed! */
-									decompressed = compressed;
-									break;
-								case COMPRESSION_ZLIB:
-									decompressed = (unsigned char *)malloc(endian64(nonInlinePart->bytesInFile));
-								
-									if (zlibDecompress(compressed, decompressed, endian64(nonInlinePart->extSize),
-										endian64(nonInlinePart->bytesInFile)) != 0)
-									{
-										printf("btrfsReadFile: zlib decompression failed!\n");
-										free(compressed);
-										free(decompressed);
-										return PLA_E_CABAPI_FAILURE; // appopriate error code?
-									}
-								
-									free(compressed);
-									break;
-								case COMPRESSION_LZO:
-									decompressed = (unsigned char *)malloc(endian64(nonInlinePart->bytesInFile));
-								
-									if (lzoDecompress(compressed, decompressed, endian64(nonInlinePart->extSize),
-										endian64(nonInlinePart->bytesInFile)) != 0)
-									{
-										printf("btrfsReadFile: lzo decompression failed!\n");
-										free(compressed);
-										free(decompressed);
-										return PLA_E_CABAPI_FAILURE; // appopriate error code?
-									}
-								
-									free(compressed);
-									break;
-								}
-							}
-						}
-
-						if (span)
-						{
-							from = 0;
-							len = extentData->n;
-						}
-						else if (within)
-						{
-							from = offset - endian64(extents[i].key.offset);
-							len = numberOfBytesToRead;
-						}
-						else if (first)
-						{
-							from = offset - endian64(extents[i].key.offset);
-							len = extentData->n - (offset - endian64(extents[i].key.offset));
-						}
-						else if (last)
-						{
-							from = 0;
-							len = (offset + numberOfBytesToRead) - endian64(extents[i].key.offset);
-						}
-
-						if (!skipCopy)
-						{
-							memcpy((char *)buffer + *numberOfBytesRead, decompressed + from, len);
-
-							if (extentData->type == FILEDATA_INLINE)
-								*numberOfBytesRead = numberOfBytesToRead - len;
-							else
-								free(decompressed);
-						}
-					
-						numberOfBytesToRead -= len;
-						*numberOfBytesRead += len;
-						offset += len;
-
-						/* that was the last extent (this assumes correct ordering of extents by offset) */
-						if (last || within)
-							break;
-					}
-					else
-					{
-						printf("btrfsReadFile: data is compressed with an unsupported algorithm!\n");
-						return ERROR_UNSUPPORTED_COMPRESSION;
-					}
-				}
-			}
+			const ExtentMapping *mapping = &extentMap->extents[i];
+			unsigned __int64 pieceEnd = mapping->fileOffset + mapping->length;
+
+			if (pieceEnd <= pos)
+				continue;
 
-			/* if the moronic application requested more data than the file contains,
-				report a smaller read size to correct them */
-			if (readEnd > filePkg->inode.stSize)
-				*numberOfBytesRead -= readEnd - filePkg->inode.stSize;
+			size_t len = (size_t)((pieceEnd < readEnd ? pieceEnd : readEnd) - pos);
+
+			int result = readExtent(mapping, pos - mapping->fileOffset, len, (unsigned char *)buffer + (pos - readBegin),
+				sequential);
+			if (result != ERROR_SUCCESS)
+				return result;
+
+			pos += len;
 		}
-		else
-			/* this idiotic fix courtesy of WordPad */
-			*numberOfBytesRead = 0;
 
-		printf("btrfsReadFile: OK [%s]\n", fileName);
+		/* anything the extents didn't cover (e.g. past the end of an inline extent) is zeroes */
+		if (pos < readEnd)
+			memset((unsigned char *)buffer + (pos - readBegin), 0, (size_t)(readEnd - pos));
+
+		*numberOfBytesRead = (DWORD)(readEnd - readBegin);
+
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK [%S]", fileName);
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsWriteFile(LPCWSTR fileName, LPCVOID buffer, DWORD numberOfBytesToWrite, LPDWORD numberOfBytesWritten,
 		LONGLONG offset, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsWriteFile: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsFlushFileBuffers(LPCWSTR fileName, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsFlushFileBuffers: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsGetFileInformation(LPCWSTR fileName, LPBY_HANDLE_FILE_INFORMATION buffer, PDOKAN_FILE_INFO info)
 	{
-		FileID *fileID = (FileID *)info->Context;
-	
-		/* Big Dokan Lock not needed here */
-
-		std::list<FilePkg>::iterator it = openFiles.begin(), end = openFiles.end();
-		for ( ; it != end; ++it)
-		{
-			if (it->fileID.treeID == fileID->treeID && it->fileID.objectID == fileID->objectID)
-				break;
-		}
-
-		/* failing to find the element is NOT an option */
-		assert(it != end);
+		OpenFile *openFile = (OpenFile *)info->Context;
+		TraceScope traceScope(TRACE_DOKAN, __FUNCTION__);
 
-		convertMetadata(&(*it), buffer, false);
+		convertMetadata(&openFile->record->filePkg, buffer, false);
 	
-		printf("btrfsGetFileInformation: OK [%S]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK [%S]", fileName);
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsFindFiles(LPCWSTR pathName, PFillFindData pFillFindData, PDOKAN_FILE_INFO info)
 	{
 		char pathNameB[MAX_PATH];
-		FileID *fileID = (FileID *)info->Context;
-		FilePkg *filePkg;
+		OpenFile *openFile = (OpenFile *)info->Context;
+		FilePkg *filePkg = &openFile->record->filePkg;
 		DirList dirList;
 		WIN32_FIND_DATAW findData;
 		bool root;
+		TraceScope traceScope(TRACE_DOKAN, __FUNCTION__);
 
 		size_t result = wcstombs(pathNameB, pathName, MAX_PATH);
 		assert (result == wcslen(pathName));
 
-		std::list<FilePkg>::iterator it = openFiles.begin(), end = openFiles.end();
-		for ( ; it != end; ++it)
+		/* return ERROR_DIRECTORY (267) if attempting to dirlist a file; this is what NTFS does */
+		if (!(filePkg->inode.stMode & S_IFDIR))
 		{
-			if (it->fileID.treeID == fileID->treeID && it->fileID.objectID == fileID->objectID)
-			{
-				/* return ERROR_DIRECTORY (267) if attempting to dirlist a file; this is what NTFS does */
-				if (!(it->inode.stMode & S_IFDIR))
-				{
-					printf("btrfsFindFiles: expected a dir but was given a file! [%S]\n", pathName);
-					return -ERROR_DIRECTORY; // for some reason, ERROR_FILE_NOT_FOUND is reported to FindFirstFile
-				}
-
-				break;
-			}
-		}
-
-		/* failing to find the element is NOT an option */
-		assert(it != end);
-
-		filePkg = &(*it);
-
-		if (WaitForSingleObject(hBigDokanLock, 10000) != WAIT_OBJECT_0)
-		{
-			printf("btrfsFindFiles: couldn't get ownership of the Big Dokan Lock! [%S]\n", pathName);
-			return -ERROR_SEM_TIMEOUT; // error code looks sketchy
+			TRACE(TRACE_DOKAN, TRACE_WARNING, "expected a dir but was given a file! [%S]", pathName);
+			return -ERROR_DIRECTORY; // for some reason, ERROR_FILE_NOT_FOUND is reported to FindFirstFile
 		}
 
 		root = (strcmp(pathNameB, "\\") == 0);
 
 		int result2;
-		if ((result2 = parseFSTree(fileID->treeID, FSOP_DIR_LIST, filePkg, &root, NULL, &dirList, NULL)) != 0)
+		if ((result2 = parseFSTree(filePkg->fileID.treeID, FSOP_DIR_LIST, filePkg, &root, NULL, &dirList, NULL)) != 0)
 		{
-			ReleaseMutex(hBigDokanLock);
-			printf("btrfsFindFiles: parseFSTree with FSOP_DIR_LIST returned %d! [%S]\n", result2, pathName);
+			TRACE(TRACE_DOKAN, TRACE_ERROR, "parseFSTree with FSOP_DIR_LIST returned %d! [%S]", result2, pathName);
 			return -ERROR_PATH_NOT_FOUND; // probably not an adequate error code
 		}
-	
-		ReleaseMutex(hBigDokanLock);
 
 		for (size_t i = 0; i < dirList.numEntries; i++)
 		{
@@ -505,13 +382,13 @@ namespace WinBtrfsLib
 	
 		free(dirList.entries);
 	
-		printf("btrfsFindFiles: OK [%S]\n", pathName);
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK [%S]", pathName);
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsSetFileAttributes(LPCWSTR fileName, DWORD fileAttributes, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsSetFileAttributes: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
@@ -519,7 +396,7 @@ namespace WinBtrfsLib
 	int DOKAN_CALLBACK btrfsSetFileTime(LPCWSTR fileName, CONST FILETIME *creationTime, CONST FILETIME *lastAccessTime,
 		CONST FILETIME *lastWriteTime, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsSetFileTime: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
@@ -534,7 +411,7 @@ namespace WinBtrfsLib
 	// file in Close.
 	int DOKAN_CALLBACK btrfsDeleteFile(LPCWSTR fileName, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsDeleteFile: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
@@ -549,42 +426,42 @@ namespace WinBtrfsLib
 	// file in Close.
 	int DOKAN_CALLBACK btrfsDeleteDirectory(LPCWSTR fileName, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsDeleteDirectory: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsMoveFile(LPCWSTR existingFileName, LPCWSTR newFileName, BOOL replaceExisting, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsMoveFile: SHOULD NEVER BE CALLED!! [%s -> %s]\n", existingFileName, newFileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S -> %S]", existingFileName, newFileName);
 
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsSetEndOfFile(LPCWSTR fileName, LONGLONG length, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsSetEndOfFile: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsSetAllocationSize(LPCWSTR fileName, LONGLONG length, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsSetAllocationSize: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsLockFile(LPCWSTR fileName, LONGLONG byteOffset, LONGLONG length, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsLockFile: unimplemented! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "unimplemented! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsUnlockFile(LPCWSTR fileName, LONGLONG byteOffset, LONGLONG length, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsUnlockFile: unimplemented! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "unimplemented! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
@@ -594,8 +471,6 @@ namespace WinBtrfsLib
 	{
 		ULONGLONG free, total;
 
-		/* Big Dokan Lock not needed here */
-
 		total = endian64(supers[0].totalBytes);
 		free =  total - endian64(supers[0].bytesUsed);
 	
@@ -603,7 +478,7 @@ namespace WinBtrfsLib
 		*totalNumberOfBytes = total;
 		*totalNumberOfFreeBytes = free;
 	
-		printf("btrfsGetDiskFreeSpace: OK\n");
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK");
 		return ERROR_SUCCESS;
 	}
 
@@ -613,12 +488,10 @@ namespace WinBtrfsLib
 	{
 		CHAR labelS[MAX_PATH + 1];
 	
-		/* Big Dokan Lock not needed here */
-
 		/* switch to strcpy_s & mbstowcs_s; this currently causes pointers to go bad,
 			which presumably indicates some sort of vulnerability in the present code that
 			the *_s functions are systematically preventing by padding with 0xfefefefe etc. */
-		printf("btrfsGetVolumeInformation: TODO: use secure string functions (1/2)\n");
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "TODO: use secure string functions (1/2)");
 
 		strcpy(labelS, supers[0].label);
 		mbstowcs(volumeNameBuffer, labelS, volumeNameSize);
@@ -632,10 +505,10 @@ namespace WinBtrfsLib
 		/* change these flags as features are added: e.g. extended metadata, compression, rw support, ... */
 		*fileSystemFlags = FILE_CASE_PRESERVED_NAMES | FILE_CASE_SENSITIVE_SEARCH | FILE_READ_ONLY_VOLUME;
 	
-		printf("btrfsGetVolumeInformation: TODO: use secure string functions (2/2)\n");
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "TODO: use secure string functions (2/2)");
 		wcscpy(fileSystemNameBuffer, L"Btrfs");
 	
-		printf("btrfsGetVolumeInformation: OK\n");
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK");
 		return ERROR_SUCCESS;
 	}
 
@@ -643,14 +516,14 @@ namespace WinBtrfsLib
 	{
 		/* nothing to do */
 	
-		printf("btrfsUnmount: OK\n");
+		TRACE(TRACE_DOKAN, TRACE_DEBUG, "OK");
 		return ERROR_SUCCESS;
 	}
 
 	int DOKAN_CALLBACK btrfsGetFileSecurity(LPCWSTR fileName, PSECURITY_INFORMATION secInfo, PSECURITY_DESCRIPTOR secDesc,
 		ULONG secDescLen, PULONG lengthNeeded, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsGetFileSecurity: unimplemented! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "unimplemented! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
@@ -658,7 +531,7 @@ namespace WinBtrfsLib
 	int DOKAN_CALLBACK btrfsSetFileSecurity(LPCWSTR fileName, PSECURITY_INFORMATION secInfo, PSECURITY_DESCRIPTOR secDesc,
 		ULONG secDescLen, PDOKAN_FILE_INFO info)
 	{
-		printf("btrfsSetFileSecurity: SHOULD NEVER BE CALLED!! [%s]\n", fileName);
+		TRACE(TRACE_DOKAN, TRACE_WARNING, "SHOULD NEVER BE CALLED!! [%S]", fileName);
 
 		return ERROR_SUCCESS;
 	}
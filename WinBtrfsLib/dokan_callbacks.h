@@ -15,7 +15,7 @@
 
 namespace WinBtrfsLib
 {
-	DWORD setupBigDokanLock();
+	void setupOpenFiles();
 	int DOKAN_CALLBACK btrfsCreateFile(LPCWSTR fileName, DWORD desiredAccess, DWORD shareMode, DWORD creationDisposition,
 		DWORD flagsAndAttributes, PDOKAN_FILE_INFO info);
 	int DOKAN_CALLBACK btrfsOpenDirectory(LPCWSTR fileName, PDOKAN_FILE_INFO info);
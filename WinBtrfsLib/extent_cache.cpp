@@ -0,0 +1,81 @@
+/* WinBtrfsLib/extent_cache.cpp
+ * decoded file extent cache
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "extent_cache.h"
+#include <functional>
+
+namespace WinBtrfsLib
+{
+	/* evicted full-sized chunks kept around for reuse (4 MiB worth) */
+	const size_t EXTENT_POOL_IDLE = 32;
+
+	size_t ExtentCache::Traits::hash(const ExtentCacheKey &key)
+	{
+		return std::hash<unsigned __int64>()(key.addr ^ (key.offset << 1) ^ key.compression);
+	}
+
+	bool ExtentCache::Traits::equal(const ExtentCacheKey &a, const ExtentCacheKey &b)
+	{
+		return (a.addr == b.addr && a.offset == b.offset && a.compression == b.compression);
+	}
+
+	unsigned __int64 ExtentCache::Traits::charge(size_t size)
+	{
+		return size;
+	}
+
+	void ExtentCache::setup(unsigned __int64 budget)
+	{
+		/* sequential reads of big files are all full chunks, and evict about one per miss once the cache fills */
+		cache.setup(budget, EXTENT_CHUNK_SIZE, EXTENT_POOL_IDLE);
+	}
+
+	/* returns pinned decoded data (and its size) if the key is cached, NULL otherwise */
+	unsigned char *ExtentCache::acquire(const ExtentCacheKey *key, size_t *size)
+	{
+		return cache.acquire(*key, size);
+	}
+
+	unsigned char *ExtentCache::allocate(size_t size)
+	{
+		return cache.allocate(size);
+	}
+
+	unsigned char *ExtentCache::publish(const ExtentCacheKey *key, unsigned char *block)
+	{
+		return cache.publish(*key, block);
+	}
+
+	void ExtentCache::release(unsigned char *block)
+	{
+		cache.release(block);
+	}
+
+	void ExtentCache::discard(unsigned char *block)
+	{
+		cache.discard(block);
+	}
+
+	void ExtentCache::getStats(ExtentCacheStats *stats)
+	{
+		LRUCacheStats cacheStats;
+
+		cache.getStats(&cacheStats);
+
+		stats->hits = cacheStats.hits;
+		stats->misses = cacheStats.misses;
+		stats->evictions = cacheStats.evictions;
+		stats->bytesCached = cacheStats.charged;
+		stats->bufferAllocs = cacheStats.bufferAllocs;
+		stats->bufferReuses = cacheStats.bufferReuses;
+	}
+}
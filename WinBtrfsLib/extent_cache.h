@@ -0,0 +1,69 @@
+/* WinBtrfsLib/extent_cache.h
+ * decoded file extent cache
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <Windows.h>
+#include "lru_cache.h"
+#include "types.h"
+
+#ifndef WINBTRFSLIB_EXTENT_CACHE_H
+#define WINBTRFSLIB_EXTENT_CACHE_H
+
+namespace WinBtrfsLib
+{
+	/* uncompressed extents can be huge, so they're cached in aligned pieces of this size instead of whole */
+	const size_t EXTENT_CHUNK_SIZE = 128 * 1024;
+
+	/* identifies a run of decoded file data: the disk extent it came from, how that extent is encoded, and
+		where the run starts within the decoded extent (always zero for whole compressed extents) */
+	struct ExtentCacheKey
+	{
+		LogiAddr				addr;
+		unsigned __int64		offset;
+		CompressionType			compression;
+	};
+
+	struct ExtentCacheStats
+	{
+		unsigned __int64		hits;
+		unsigned __int64		misses;
+		unsigned __int64		evictions;
+		unsigned __int64		bytesCached;
+		unsigned __int64		bufferAllocs;	// full-sized entries that had to come from the heap
+		unsigned __int64		bufferReuses;	// full-sized entries recycled from evicted ones
+	};
+
+	/* a bounded cache of decoded extent data, shared by every open file; unlike node cache entries, these vary
+		in size, and only full-sized chunks are recycled */
+	class ExtentCache
+	{
+	public:
+		void setup(unsigned __int64 budget);
+		unsigned char *acquire(const ExtentCacheKey *key, size_t *size);
+		unsigned char *allocate(size_t size);
+		unsigned char *publish(const ExtentCacheKey *key, unsigned char *block);
+		void release(unsigned char *block);
+		void discard(unsigned char *block);
+		void getStats(ExtentCacheStats *stats);
+
+	private:
+		struct Traits
+		{
+			static size_t hash(const ExtentCacheKey &key);
+			static bool equal(const ExtentCacheKey &a, const ExtentCacheKey &b);
+			static unsigned __int64 charge(size_t size);
+		};
+
+		LRUCache<ExtentCacheKey, Traits> cache;
+	};
+}
+
+#endif
@@ -12,24 +12,442 @@
 
 #include "fstree_parser.h"
 #include <cassert>
+#include <algorithm>
 #include <cstdio>
+#include <vector>
 #include "btrfs_system.h"
+#include "compression.h"
 #include "constants.h"
 #include "endian.h"
+#include "node_view.h"
+#include "trace.h"
+#include "tree_search.h"
 #include "util.h"
 
 namespace WinBtrfsLib
 {
+	int fsNameToID(BtrfsObjID tree, BtrfsObjID parentID, unsigned int hash, const char *name,
+		BtrfsObjID *childID, bool *isSubvolume)
+	{
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+		int returnCode = 1;
+
+		key.objectID = (BtrfsObjID)endian64(parentID);
+		key.type = TYPE_DIR_ITEM;
+		key.offset = endian64(hash);
+
+		/* DIR_ITEMs are keyed by name hash, so there is at most one item to look at */
+		if (searchTree(getTreeRootAddr(tree), &key, &cursor) && compareKeys(&cursorItem(&cursor)->key, &key) == 0)
+		{
+			size_t nameLen = strlen(name);
+
+			/* more than one name can share a hash, so look through all of them */
+			for (DirItemChain chain(cursorData(&cursor), cursorDataSize(&cursor)); !chain.done(); chain.next())
+			{
+				if (chain.nameLen() == nameLen && strncmp(chain.name(), name, nameLen) == 0)
+				{
+					const BtrfsDirItem *dirItem = chain.get();
+
+					/* these are the only EXPECTED child types; others shouldn't probably appear */
+					assert(dirItem->child.type == TYPE_INODE_ITEM || dirItem->child.type == TYPE_ROOT_ITEM);
+				
+					/* found a match */
+					*childID = (BtrfsObjID)endian64(dirItem->child.objectID);
+					*isSubvolume = (dirItem->child.type == TYPE_ROOT_ITEM);
+
+					returnCode = 0;
+					break;
+				}
+			}
+		}
+
+		releaseCursor(&cursor);
+
+		return returnCode;
+	}
+
+	int fsGetInode(BtrfsObjID tree, BtrfsObjID objectID, BtrfsInodeItem *inode)
+	{
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+		int returnCode = 1;
+
+		key.objectID = (BtrfsObjID)endian64(objectID);
+		key.type = TYPE_INODE_ITEM;
+		key.offset = 0;
+
+		if (searchTree(getTreeRootAddr(tree), &key, &cursor) && compareKeys(&cursorItem(&cursor)->key, &key) == 0)
+		{
+			assert(cursorDataSize(&cursor) >= sizeof(BtrfsInodeItem));
+			memcpy(inode, cursorData(&cursor), sizeof(BtrfsInodeItem));
+
+			returnCode = 0;
+		}
+
+		releaseCursor(&cursor);
+
+		return returnCode;
+	}
+
+	int fsGetFilePkg(BtrfsObjID tree, BtrfsObjID objectID, FilePkg *filePkg)
+	{
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+		int returnCode = 1;
+
+		filePkg->fileID.treeID = tree;
+		filePkg->fileID.objectID = objectID;
+
+		key.objectID = (BtrfsObjID)endian64(objectID);
+		key.type = TYPE_INODE_ITEM;
+		key.offset = 0;
+
+		if (searchTree(getTreeRootAddr(tree), &key, &cursor) && compareKeys(&cursorItem(&cursor)->key, &key) == 0)
+		{
+			/* the package outlives the cursor's pin on the leaf, so this one has to be a copy */
+			assert(cursorDataSize(&cursor) >= sizeof(BtrfsInodeItem));
+			memcpy(&filePkg->inode, cursorData(&cursor), sizeof(BtrfsInodeItem));
+
+			if (objectID == OBJID_ROOT_DIR)
+			{
+				/* for the special case of the root dir, this stuff wouldn't get filled in by any other means */
+				strcpy(filePkg->name, "ROOT_DIR");
+				memset(&filePkg->parentID, 0, sizeof(FileID));
+
+				returnCode = 0;
+			}
+			else if (cursorNext(&cursor)) // the INODE_REFs sort right after the INODE_ITEM
+			{
+				const BtrfsItem *item = cursorItem(&cursor);
+
+				if (endian64(item->key.objectID) == objectID && item->key.type == TYPE_INODE_REF)
+				{
+					const BtrfsInodeRef *inodeRef = (const BtrfsInodeRef *)cursorData(&cursor);
+
+					assert(cursorDataSize(&cursor) >= sizeof(BtrfsInodeRef) + endian16(inodeRef->nameLen));
+					size_t nameLen = (endian16(inodeRef->nameLen) <= 255 ? endian16(inodeRef->nameLen) : 255); // limit to 255
+
+					/* a file with several hard links gets the name of the first one */
+					memcpy(filePkg->name, inodeRef->name, nameLen);
+					filePkg->name[nameLen] = 0;
+
+					returnCode = 0;
+				}
+			}
+		}
+
+		releaseCursor(&cursor);
+
+		if (returnCode == 0)
+		{
+			if (filePkg->name[0] == '.' && strcmp(filePkg->name, ".") != 0 && strcmp(filePkg->name, "..") != 0)
+				filePkg->hidden = true;
+			else
+				filePkg->hidden = false;
+		}
+
+		return returnCode;
+	}
+
+	int fsGetExtentMap(BtrfsObjID tree, BtrfsObjID objectID, unsigned __int64 fileSize, ExtentMap *extentMap)
+	{
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+		std::vector<ExtentMapping> mappings;
+		std::vector<unsigned char> inlineBytes;
+		ExtentMapping mapping;
+		unsigned __int64 end = 0;
+		unsigned char *inlineBase;
+
+		key.objectID = (BtrfsObjID)endian64(objectID);
+		key.type = TYPE_EXTENT_DATA;
+		key.offset = 0;
+
+		/* a file's EXTENT_DATA items are contiguous and sorted by file offset, so one pass collects them all */
+		if (searchTree(getTreeRootAddr(tree), &key, &cursor))
+		{
+			do
+			{
+				const BtrfsItem *item = cursorItem(&cursor);
+
+				if (endian64(item->key.objectID) != objectID || item->key.type != TYPE_EXTENT_DATA)
+					break;
+
+				ExtentDataView view(cursorData(&cursor), cursorDataSize(&cursor));
+				const BtrfsExtentData *extentData = view.header();
+
+				assert(extentData->encryption == ENCRYPTION_NONE);
+				assert(extentData->otherEncoding == ENCODING_NONE);
+
+				memset(&mapping, 0, sizeof(ExtentMapping));
+				mapping.fileOffset = endian64(item->key.offset);
+				mapping.compression = (CompressionType)extentData->compression;
+				mapping.decodedSize = endian64(extentData->n);
+
+				if (view.isInline())
+				{
+					size_t inlineOffset = inlineBytes.size();
+
+					mapping.kind = EXTENT_INLINE;
+					mapping.length = endian64(extentData->n);
+
+					/* stash the data for now; it gets its final home alongside the mappings at the end */
+					mapping.inlineData = (unsigned char *)inlineOffset;
+
+					if (mapping.compression == COMPRESSION_NONE)
+					{
+						mapping.inlineSize = view.inlineSize();
+						inlineBytes.insert(inlineBytes.end(), view.inlineData(), view.inlineData() + view.inlineSize());
+					}
+					else
+					{
+						/* compressed inline data is decoded once, here, so that reads never have to; for an
+							inline extent, n is the decoded size */
+						mapping.inlineSize = (size_t)endian64(extentData->n);
+						mapping.compression = COMPRESSION_NONE;
+						inlineBytes.resize(inlineOffset + mapping.inlineSize);
+
+						if (mapping.inlineSize > 0 && decompressRange((CompressionType)extentData->compression,
+							view.inlineData(), view.inlineSize(), 0, mapping.inlineSize, &inlineBytes[inlineOffset]) != 0)
+						{
+							TRACE(TRACE_READ, TRACE_ERROR, "couldn't decode the inline extent at 0x%I64x of inode 0x%I64x!",
+								mapping.fileOffset, objectID);
+
+							releaseCursor(&cursor);
+							return 1;
+						}
+					}
+				}
+				else
+				{
+					const BtrfsExtentDataNonInline *nonInlinePart = view.diskExtent();
+
+					/* an address of zero indicates a sparse extent (i.e. all zeroes) */
+					if (extentData->type == FILEDATA_PREALLOC)
+						mapping.kind = EXTENT_PREALLOC;
+					else if (endian64(nonInlinePart->extAddr) == 0)
+						mapping.kind = EXTENT_HOLE;
+					else
+						mapping.kind = EXTENT_REGULAR;
+
+					mapping.length = endian64(nonInlinePart->bytesInFile);
+					mapping.diskAddr = endian64(nonInlinePart->extAddr);
+					mapping.diskSize = endian64(nonInlinePart->extSize);
+					mapping.decodedOffset = endian64(nonInlinePart->offset);
+				}
+
+				/* a gap between items is an implicit hole */
+				if (mapping.fileOffset > end)
+				{
+					ExtentMapping hole;
+
+					memset(&hole, 0, sizeof(ExtentMapping));
+					hole.fileOffset = end;
+					hole.length = mapping.fileOffset - end;
+					hole.kind = EXTENT_HOLE;
+
+					mappings.push_back(hole);
+				}
+
+				mappings.push_back(mapping);
+				end = mapping.fileOffset + mapping.length;
+			} while (cursorNext(&cursor));
+		}
+
+		releaseCursor(&cursor);
+
+		if (end < fileSize)
+		{
+			memset(&mapping, 0, sizeof(ExtentMapping));
+			mapping.fileOffset = end;
+			mapping.length = fileSize - end;
+			mapping.kind = EXTENT_HOLE;
+
+			mappings.push_back(mapping);
+		}
+
+		/* the map outlives the leaves it came from, so it's copied out, but into one allocation: the mappings
+			first, then the data of any inline extents */
+		extentMap->numExtents = mappings.size();
+		extentMap->extents = (ExtentMapping *)malloc(mappings.size() * sizeof(ExtentMapping) + inlineBytes.size());
+		inlineBase = (unsigned char *)(extentMap->extents + mappings.size());
+
+		if (!mappings.empty())
+			memcpy(extentMap->extents, &mappings[0], mappings.size() * sizeof(ExtentMapping));
+		if (!inlineBytes.empty())
+			memcpy(inlineBase, &inlineBytes[0], inlineBytes.size());
+
+		for (size_t i = 0; i < extentMap->numExtents; i++)
+		{
+			if (extentMap->extents[i].kind == EXTENT_INLINE)
+				extentMap->extents[i].inlineData = inlineBase + (size_t)extentMap->extents[i].inlineData;
+		}
+
+		return 0;
+	}
+
+	/* sorts the indices of a directory's entries by object ID so their inodes can be fetched in key order */
+	struct DirEntryOrder
+	{
+		const FilePkg *entries;
+
+		bool operator()(size_t a, size_t b) const
+		{
+			return entries[a].fileID.objectID < entries[b].fileID.objectID;
+		}
+	};
+
+	int fsDirList(BtrfsObjID tree, const FilePkg *filePkg, bool root, DirList *dirList)
+	{
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+		LogiAddr rootAddr = getTreeRootAddr(tree);
+		size_t first = (root ? 0 : 2), capacity = 64;
+		std::vector<size_t> order;
+		int returnCode = 0;
+
+		dirList->numEntries = 0;
+		dirList->entries = (FilePkg *)malloc(capacity * sizeof(FilePkg));
+
+		if (!root)
+		{
+			/* add '.' to the list */
+			memcpy(&dirList->entries[0], filePkg, sizeof(FilePkg));
+			strcpy(dirList->entries[0].name, ".");
+
+			/* add '..' to the list */
+			memcpy(&dirList->entries[1].fileID, &filePkg->parentID, sizeof(FileID));
+			memcpy(&dirList->entries[1].inode, &filePkg->parentInode, sizeof(BtrfsInodeItem));
+			strcpy(dirList->entries[1].name, "..");
+			dirList->entries[1].hidden = false;
+
+			dirList->numEntries = 2;
+		}
+
+		/* every child has exactly one DIR_INDEX, and they're all contiguous in the tree right after the
+			directory's own items, so one range scan picks up the whole directory */
+		key.objectID = (BtrfsObjID)endian64(filePkg->fileID.objectID);
+		key.type = TYPE_DIR_INDEX;
+		key.offset = 0;
+
+		if (searchTree(rootAddr, &key, &cursor))
+		{
+			do
+			{
+				const BtrfsItem *item = cursorItem(&cursor);
+				const BtrfsDirIndex *dirIndex;
+				FilePkg *entry;
+				size_t nameLen;
+
+				if (endian64(item->key.objectID) != filePkg->fileID.objectID || item->key.type != TYPE_DIR_INDEX)
+					break;
+
+				/* unlike DIR_ITEMs, a DIR_INDEX only ever holds the one entry */
+				DirItemChain chain(cursorData(&cursor), cursorDataSize(&cursor));
+				assert(!chain.done());
+				dirIndex = chain.get();
+
+				assert(dirIndex->child.type == TYPE_INODE_ITEM || dirIndex->child.type == TYPE_ROOT_ITEM);
+
+				if (dirList->numEntries == capacity)
+				{
+					capacity *= 2;
+					dirList->entries = (FilePkg *)realloc(dirList->entries, capacity * sizeof(FilePkg));
+				}
+
+				entry = &dirList->entries[dirList->numEntries];
+
+				if (dirIndex->child.type == TYPE_INODE_ITEM)
+				{
+					entry->fileID.treeID = tree;
+					entry->fileID.objectID = (BtrfsObjID)endian64(dirIndex->child.objectID);
+				}
+				else
+				{
+					entry->fileID.treeID = (BtrfsObjID)endian64(dirIndex->child.objectID);
+					entry->fileID.objectID = OBJID_ROOT_DIR;
+				}
+
+				entry->parentID = filePkg->fileID;
+
+				nameLen = (endian16(dirIndex->n) <= 255 ? endian16(dirIndex->n) : 255); // limit to 255
+				memcpy(entry->name, dirIndex->namePlusData, nameLen);
+				entry->name[nameLen] = 0;
+
+				entry->hidden = (entry->name[0] == '.');
+
+				dirList->numEntries++;
+			}
+			while (cursorNext(&cursor));
+		}
+
+		releaseCursor(&cursor);
+
+		/* subvolume roots live in other trees and have to be looked up one by one; everything else gets
+			fetched in object ID order with a single cursor, so each leaf is visited at most once */
+		for (size_t i = first; i < dirList->numEntries; i++)
+		{
+			if (dirList->entries[i].fileID.treeID == tree)
+				order.push_back(i);
+			else if (fsGetInode(dirList->entries[i].fileID.treeID, OBJID_ROOT_DIR, &dirList->entries[i].inode) != 0)
+				returnCode = 1;
+		}
+
+		if (!order.empty())
+		{
+			DirEntryOrder compare = { dirList->entries };
+
+			std::sort(order.begin(), order.end(), compare);
+
+			memset(&cursor, 0, sizeof(TreeCursor));
+
+			for (size_t i = 0; i < order.size() && returnCode == 0; i++)
+			{
+				FilePkg *entry = &dirList->entries[order[i]];
+
+				key.objectID = (BtrfsObjID)endian64(entry->fileID.objectID);
+				key.type = TYPE_INODE_ITEM;
+				key.offset = 0;
+
+				/* hard links to the same inode sort next to each other and don't move the cursor */
+				if (cursorSeek(rootAddr, &key, &cursor) && compareKeys(&cursorItem(&cursor)->key, &key) == 0)
+				{
+					assert(cursorDataSize(&cursor) >= sizeof(BtrfsInodeItem));
+					memcpy(&entry->inode, cursorData(&cursor), sizeof(BtrfsInodeItem));
+				}
+				else
+					returnCode = 1;
+			}
+
+			releaseCursor(&cursor);
+		}
+
+		if (returnCode != 0)
+		{
+			free(dirList->entries);
+			dirList->entries = NULL;
+			dirList->numEntries = 0;
+		}
+
+		return returnCode;
+	}
+
 	void parseFSTreeRec(LogiAddr addr, BtrfsObjID tree, FSOperation operation, void *input0, void *input1, void *input2,
 		void *output0, void *output1, int *returnCode, bool *shortCircuit)
 	{
-		unsigned char *nodeBlock, *nodePtr;
+		unsigned char *nodeBlock;
 		BtrfsHeader *header;
-		BtrfsItem *item;
 
 		nodeBlock = loadNode(addr, &header);
-	
-		nodePtr = nodeBlock + sizeof(BtrfsHeader);
+
+		/* loadNode has already reported it; the walk carries on without this subtree */
+		if (nodeBlock == NULL)
+		{
+			if (operation == FSOP_DUMP_TREE)
+				printf("\n[Node] addr = 0x%I64x is unreadable\n", addr);
+			return;
+		}
 
 		if (operation == FSOP_DUMP_TREE)
 			printf("\n[Node] tree = 0x%I64x addr = 0x%I64x level = 0x%02x nrItems = 0x%08x\n", endian64(header->tree),
@@ -37,57 +455,22 @@ namespace WinBtrfsLib
 
 		if (header->level == 0) // leaf node
 		{
-			for (unsigned int i = 0; i < endian32(header->nrItems); i++)
+			LeafView leaf(nodeBlock);
+
+			for (unsigned int i = 0; i < leaf.size(); i++)
 			{
-				item = (BtrfsItem *)nodePtr;
+				const BtrfsItem *item = leaf.item(i);
 
-				if (operation == FSOP_NAME_TO_ID)
+				if (operation == FSOP_DUMP_TREE)
 				{
-					const BtrfsObjID *parentID = (const BtrfsObjID *)input0;
-					const unsigned int *hash = (const unsigned int *)input1;
-					const char *name = (const char *)input2;
-					BtrfsObjID *childID = (BtrfsObjID *)output0;
-					bool *isSubvolume = (bool *)output1;
-				
-					if (item->key.type == TYPE_DIR_ITEM && endian64(item->key.objectID) == *parentID &&
-						(unsigned int)(endian64(item->key.offset)) == *hash)
-					{
-						BtrfsDirItem *dirItem = (BtrfsDirItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset)),
-							*firstDirItem = dirItem;
+					static const char childTypeStrs[9][10] = { "unknown", "file", "directory", "char", "block",
+						"FIFO", "socket", "symlink", "xattr" };
 
-						while (true)
-						{
-							if (endian16(dirItem->n) == strlen(name) && strncmp(dirItem->namePlusData, name, endian16(dirItem->n)) == 0)
-							{
-								/* these are the only EXPECTED child types; others shouldn't probably appear */
-								assert(dirItem->child.type == TYPE_INODE_ITEM || dirItem->child.type == TYPE_ROOT_ITEM);
-							
-								/* found a match */
-								*childID = dirItem->child.objectID;
-								*isSubvolume = (dirItem->child.type == TYPE_ROOT_ITEM);
-
-								*returnCode = 0;
-								*shortCircuit = true;
-								break;
-							}
-						
-							/* advance to the next DIR_ITEM if there are more */
-							if (endian32(item->size) > ((char *)dirItem - (char *)firstDirItem) + sizeof(BtrfsDirItem) +
-								endian16(dirItem->m) + endian16(dirItem->n))
-								dirItem = (BtrfsDirItem *)((unsigned char *)dirItem + sizeof(BtrfsDirItem) +
-									endian16(dirItem->m) + endian16(dirItem->n));
-							else
-								break;
-						}
-					}
-				}
-				else if (operation == FSOP_DUMP_TREE)
-				{
 					switch (item->key.type)
 					{
 					case TYPE_INODE_ITEM:
 					{
-						BtrfsInodeItem *inodeItem = (BtrfsInodeItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
+						const BtrfsInodeItem *inodeItem = leaf.data<BtrfsInodeItem>(i);
 						char mode[11];
 					
 						stModeToStr(inodeItem->stMode, mode);
@@ -98,115 +481,61 @@ namespace WinBtrfsLib
 					}
 					case TYPE_INODE_REF:
 					{
-						BtrfsInodeRef *inodeRef = (BtrfsInodeRef *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-						size_t len = endian16(inodeRef->nameLen);
-						char *name = new char[len + 1];
+						const BtrfsInodeRef *inodeRef = leaf.data<BtrfsInodeRef>(i);
 
-						memcpy(name, inodeRef->name, len);
-						name[len] = 0;
-
-						printf("  [%02x] INODE_REF 0x%I64x -> '%s' parent: 0x%I64x\n", i, endian64(item->key.objectID), name,
-							endian64(item->key.offset));
-
-						delete[] name;
+						printf("  [%02x] INODE_REF 0x%I64x -> '%.*s' parent: 0x%I64x\n", i, endian64(item->key.objectID),
+							(int)endian16(inodeRef->nameLen), inodeRef->name, endian64(item->key.offset));
 						break;
 					}
 					case TYPE_XATTR_ITEM:
-					{
-						BtrfsDirItem *dirItem = (BtrfsDirItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset)),
-							*firstDirItem = dirItem;
-						static const char childTypeStrs[9][10] = { "unknown", "file", "directory", "char", "block",
-							"FIFO", "socket", "symlink", "xattr" };
-
-						while (true)
+						for (DirItemChain chain(leaf.rawData(i), leaf.dataSize(i)); !chain.done(); chain.next())
 						{
-							size_t len = endian16(dirItem->n);
-							char *name = new char[len + 1];
-
-							memcpy(name, dirItem->namePlusData, len);
-							name[len] = 0;
-
-							if (dirItem == firstDirItem)
+							if (chain.first())
 								printf("  [%02x] ", i);
 							else
 								printf("       ");
-							printf("XATTR_ITEM 0x%I64x -> '%s' hash: 0x%08I64x\n"
+							printf("XATTR_ITEM 0x%I64x -> '%.*s' hash: 0x%08I64x\n"
 								"                type: %s data: 0x%x bytes\n",
-								endian64(item->key.objectID), name, endian64(item->key.offset),
-								childTypeStrs[dirItem->childType], endian16(dirItem->m));
-						
-							delete[] name;
-						
-							/* advance to the next XATTR_ITEM if there are more */
-							if (endian32(item->size) > ((char *)dirItem - (char *)firstDirItem) + sizeof(BtrfsDirItem) +
-								endian16(dirItem->m) + endian16(dirItem->n))
-								dirItem = (BtrfsDirItem *)((unsigned char *)dirItem + sizeof(BtrfsDirItem) +
-									endian16(dirItem->m) + endian16(dirItem->n));
-							else
-								break;
+								endian64(item->key.objectID), (int)chain.nameLen(), chain.name(), endian64(item->key.offset),
+								childTypeStrs[chain.get()->childType], endian16(chain.get()->m));
 						}
-					
 						break;
-					}
 					case TYPE_DIR_ITEM:
-					{
-						BtrfsDirItem *dirItem = (BtrfsDirItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset)),
-							*firstDirItem = dirItem;
-						static const char childTypeStrs[9][10] = { "unknown", "file", "directory", "char", "block",
-							"FIFO", "socket", "symlink", "xattr" };
-
-						while (true)
+						for (DirItemChain chain(leaf.rawData(i), leaf.dataSize(i)); !chain.done(); chain.next())
 						{
-							size_t len = endian16(dirItem->n);
-							char *name = new char[len + 1];
+							const BtrfsDirItem *dirItem = chain.get();
 
-							memcpy(name, dirItem->namePlusData, len);
-							name[len] = 0;
-
-							if (dirItem == firstDirItem)
+							if (chain.first())
 								printf("  [%02x] ", i);
 							else
 								printf("       ");
 							printf("DIR_ITEM parent: 0x%I64x hash: 0x%08I64x\n"
-								"                child: 0x%I64x -> '%s' type: %s%s\n",
+								"                child: 0x%I64x -> '%.*s' type: %s%s\n",
 								endian64(item->key.objectID), endian64(item->key.offset),
-								endian64(dirItem->child.objectID), name, childTypeStrs[dirItem->childType],
+								endian64(dirItem->child.objectID), (int)chain.nameLen(), chain.name(),
+								childTypeStrs[dirItem->childType],
 								(dirItem->child.type == TYPE_ROOT_ITEM ? " (subvolume)" : ""));
-						
-							delete[] name;
-						
-							/* advance to the next DIR_ITEM if there are more */
-							if (endian32(item->size) > ((char *)dirItem - (char *)firstDirItem) + sizeof(BtrfsDirItem) +
-								endian16(dirItem->m) + endian16(dirItem->n))
-							{
-								dirItem = (BtrfsDirItem *)((unsigned char *)dirItem + sizeof(BtrfsDirItem) +
-									endian16(dirItem->m) + endian16(dirItem->n));
-							}
-							else
-								break;
 						}
-					
 						break;
-					}
 					case TYPE_DIR_INDEX:
 						printf("  [%02x] DIR_INDEX 0x%I64x = idx 0x%I64x\n", i, endian64(item->key.objectID),
 							endian64(item->key.offset));
 						break;
 					case TYPE_EXTENT_DATA:
 					{
-						BtrfsExtentData *extentData = (BtrfsExtentData *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
+						ExtentDataView view(leaf.rawData(i), leaf.dataSize(i));
+						const BtrfsExtentData *extentData = view.header();
 						static const char fdTypeStrs[4][9] = { "inline", "regular", "prealloc", "unknown" },
-							compStrs[4][8] = { "none", "zlib", "lzo", "unknown" };
+							compStrs[5][8] = { "none", "zlib", "lzo", "zstd", "unknown" };
 
 						printf("  [%02x] EXTENT_DATA 0x%I64x offset: 0x%I64x size: 0x%I64x\n"
 							"                   type: %s compression: %s\n", i,
 							endian64(item->key.objectID), endian64(item->key.offset), endian64(extentData->n),
-							fdTypeStrs[extentData->type], compStrs[(extentData->compression <= COMPRESSION_LZO ?
-							extentData->compression : 3)]);
-						if (extentData->type != FILEDATA_INLINE)
+							fdTypeStrs[(extentData->type <= FILEDATA_PREALLOC ? extentData->type : 3)],
+							compStrs[(extentData->compression <= COMPRESSION_ZSTD ? extentData->compression : 4)]);
+						if (!view.isInline())
 						{
-							BtrfsExtentDataNonInline *nonInlinePart =(BtrfsExtentDataNonInline *)(nodeBlock +
-								sizeof(BtrfsHeader) + endian32(item->offset) + sizeof(BtrfsExtentData));
+							const BtrfsExtentDataNonInline *nonInlinePart = view.diskExtent();
 
 							printf("                   addr: 0x%I64x size: 0x%I64x offset: 0x%I64x\n",
 								endian64(nonInlinePart->extAddr), endian64(nonInlinePart->extSize),
@@ -220,182 +549,22 @@ namespace WinBtrfsLib
 						break;
 					}
 				}
-				else if (operation == FSOP_GET_FILE_PKG)
-				{
-					const BtrfsObjID *objectID = (const BtrfsObjID *)input0;
-					FilePkg *filePkg = (FilePkg *)output0;
-				
-					/* it's safe to jump out once we pass the object ID in question */
-					if (item->key.objectID > *objectID)
-					{
-						*shortCircuit = true;
-						break;
-					}
-
-					if (item->key.type == TYPE_INODE_ITEM && endian64(item->key.objectID) == *objectID) // inode
-					{
-						BtrfsInodeItem *inodeItem = (BtrfsInodeItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-					
-						memcpy(&(filePkg->inode), inodeItem, sizeof(BtrfsInodeItem));
-					
-						*returnCode &= ~0x1; // clear bit 0
-
-						if (inodeItem->stMode & S_IFDIR)
-							*returnCode &= ~0x4; // clear bit 2; we don't need extent info for dirs
-					}
-					else if (item->key.type == TYPE_DIR_ITEM) // name
-					{
-						BtrfsDirItem *dirItem = (BtrfsDirItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset)),
-							*firstDirItem = dirItem;
-					
-						while (true)
-						{
-							if (endian64(dirItem->child.objectID) == *objectID)
-							{
-								memcpy(filePkg->name, dirItem->namePlusData,
-									(endian16(dirItem->n) <= 255 ? endian16(dirItem->n) : 255)); // limit to 255
-								filePkg->name[endian16(dirItem->n)] = 0;
-							
-								*returnCode &= ~0x2; // clear bit 1
-							}
-						
-							/* advance to the next DIR_ITEM if there are more */
-							if (endian32(item->size) > ((char *)dirItem - (char *)firstDirItem) + sizeof(BtrfsDirItem) +
-								endian16(dirItem->m) + endian16(dirItem->n))
-							{
-								dirItem = (BtrfsDirItem *)((unsigned char *)dirItem + sizeof(BtrfsDirItem) +
-									endian16(dirItem->m) + endian16(dirItem->n));
-							}
-							else
-								break;
-						}
-					}
-					else if (item->key.type == TYPE_EXTENT_DATA && item->key.objectID == *objectID) // extent information
-					{
-						BtrfsExtentData *extentData = (BtrfsExtentData *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-
-						filePkg->extents = (KeyedItem *)realloc(filePkg->extents,
-							(filePkg->numExtents + 1) * sizeof(KeyedItem));
-						filePkg->extents[filePkg->numExtents].data = (BtrfsExtentData *)malloc(endian32(item->size));
-
-						memcpy(&(filePkg->extents[filePkg->numExtents].key), &item->key, sizeof(BtrfsDiskKey));
-						memcpy(filePkg->extents[filePkg->numExtents].data, extentData, endian32(item->size));
-
-						filePkg->numExtents++;
-					}
-				}
-				else if (operation == FSOP_DIR_LIST)
-				{
-					const FilePkg *filePkg = (const FilePkg *)input0;
-					const bool *root = (const bool *)input1;
-					DirList *dirList = (DirList *)output0;
-				
-					if (item->key.type == TYPE_INODE_ITEM) // inode
-					{
-						BtrfsInodeItem *inodeItem = (BtrfsInodeItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-
-						for (int j = (*root ? 0 : 2); j < dirList->numEntries; j++) // try to find a matching entry, skip '.' and '..'
-						{
-							if (tree == dirList->entries[j].fileID.treeID &&
-								endian64(item->key.objectID) == dirList->entries[j].fileID.objectID)
-							{
-								memcpy(&(dirList->entries[j].inode), inodeItem, sizeof(BtrfsInodeItem));
-
-								(*returnCode)--;
-							
-								/* don't break out of the loop: there may be multiple entries that need
-									the same inode loaded in (hard links, for example) */
-							}
-						}
-					}
-					else if (item->key.type == TYPE_DIR_ITEM) // allocate, ID, parent, name
-					{
-						BtrfsDirItem *dirItem = (BtrfsDirItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset)),
-							*firstDirItem = dirItem;
-					
-						while (true)
-						{
-							if (endian64(item->key.objectID) == filePkg->fileID.objectID)
-							{
-								if (dirList->entries == NULL)
-									dirList->entries = (FilePkg *)malloc(sizeof(FilePkg));
-								else
-									dirList->entries = (FilePkg *)realloc(dirList->entries, sizeof(FilePkg) * (dirList->numEntries + 1));
-
-								assert(dirItem->child.type == TYPE_INODE_ITEM || dirItem->child.type == TYPE_ROOT_ITEM);
-
-								if (dirItem->child.type == TYPE_INODE_ITEM)
-								{
-									dirList->entries[dirList->numEntries].fileID.treeID = tree;
-									dirList->entries[dirList->numEntries].fileID.objectID = (BtrfsObjID)endian64(dirItem->child.objectID);
-								}
-								else
-								{
-									dirList->entries[dirList->numEntries].fileID.treeID = (BtrfsObjID)endian64(dirItem->child.objectID);
-									dirList->entries[dirList->numEntries].fileID.objectID = OBJID_ROOT_DIR;
-								}
-
-								dirList->entries[dirList->numEntries].parentID.treeID = tree;
-								dirList->entries[dirList->numEntries].parentID.objectID = (BtrfsObjID)endian64(item->key.objectID);
-
-								memcpy(dirList->entries[dirList->numEntries].name, dirItem->namePlusData,
-									(endian16(dirItem->n) <= 255 ? endian16(dirItem->n) : 255)); // limit to 255
-								dirList->entries[dirList->numEntries].name[endian16(dirItem->n)] = 0;
-
-								dirList->numEntries++;
-							
-								(*returnCode)++;
-							}
-						
-							/* advance to the next DIR_ITEM if there are more */
-							if (endian32(item->size) > ((char *)dirItem - (char *)firstDirItem) + sizeof(BtrfsDirItem) +
-								endian16(dirItem->m) + endian16(dirItem->n))
-								dirItem = (BtrfsDirItem *)((unsigned char *)dirItem + sizeof(BtrfsDirItem) +
-									endian16(dirItem->m) + endian16(dirItem->n));
-							else
-								break;
-						}
-					}
-				}
-				else if (operation == FSOP_GET_INODE)
-				{
-					const BtrfsObjID *objectID = (const BtrfsObjID *)input0;
-					BtrfsInodeItem *inode = (BtrfsInodeItem *)output0;
-				
-					/* abort once we pass the object ID in question */
-					if (item->key.objectID > *objectID)
-					{
-						*shortCircuit = true;
-						break;
-					}
-
-					if (item->key.type == TYPE_INODE_ITEM && endian64(item->key.objectID) == *objectID) // inode
-					{
-						BtrfsInodeItem *inodeItem = (BtrfsInodeItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-					
-						memcpy(inode, inodeItem, sizeof(BtrfsInodeItem));
-					
-						*returnCode = 0;
-						*shortCircuit = true;
-						break;
-					}
-				}
 				else
 					printf("parseFSTreeRec: unknown operation (0x%02x)!\n", operation);
 
 				if (*shortCircuit)
 					break;
-
-				nodePtr += sizeof(BtrfsItem);
 			}
 		}
 		else // non-leaf node
 		{
+			KeyPtrView keyPtrs(nodeBlock);
+
 			if (operation == FSOP_DUMP_TREE)
 			{
-				for (unsigned int i = 0; i < endian32(header->nrItems); i++)
+				for (unsigned int i = 0; i < keyPtrs.size(); i++)
 				{
-					BtrfsKeyPtr *keyPtr = (BtrfsKeyPtr *)(nodePtr + (sizeof(BtrfsKeyPtr) * i));
+					const BtrfsKeyPtr *keyPtr = keyPtrs.keyPtr(i);
 
 					printf("  [%02x] {%I64x|%I64x} KeyPtr: block 0x%016I64x generation 0x%016I64x\n",
 						i, endian64(keyPtr->key.objectID), endian64(keyPtr->key.offset),
@@ -403,138 +572,54 @@ namespace WinBtrfsLib
 				}
 			}
 
-			for (unsigned int i = 0; i < endian32(header->nrItems); i++)
-			{
-				BtrfsKeyPtr *keyPtr = (BtrfsKeyPtr *)nodePtr;
+			/* every child is going to be visited, so read them all in one batch first */
+			prefetchChildren(nodeBlock);
 
+			for (unsigned int i = 0; i < keyPtrs.size(); i++)
+			{
 				/* recurse down one level of the tree */
-				parseFSTreeRec(endian64(keyPtr->blockNum), tree, operation, input0, input1, input2,
+				parseFSTreeRec(endian64(keyPtrs.keyPtr(i)->blockNum), tree, operation, input0, input1, input2,
 					output0, output1, returnCode, shortCircuit);
 
 				if (*shortCircuit)
 					break;
-
-				nodePtr += sizeof(BtrfsKeyPtr);
 			}
 		}
 
-		free(nodeBlock);
+		releaseNode(nodeBlock);
 	}
 
 	int parseFSTree(BtrfsObjID tree, FSOperation operation, void *input0, void *input1, void *input2, void *output0, void *output1)
 	{
 		int returnCode;
 		bool shortCircuit = false;
+
+		/* these search straight down to the items they need instead of walking the whole tree */
+		if (operation == FSOP_NAME_TO_ID)
+			return fsNameToID(tree, *((const BtrfsObjID *)input0), *((const unsigned int *)input1),
+				(const char *)input2, (BtrfsObjID *)output0, (bool *)output1);
+		else if (operation == FSOP_GET_INODE)
+			return fsGetInode(tree, *((const BtrfsObjID *)input0), (BtrfsInodeItem *)output0);
+		else if (operation == FSOP_GET_FILE_PKG)
+			return fsGetFilePkg(tree, *((const BtrfsObjID *)input0), (FilePkg *)output0);
+		else if (operation == FSOP_GET_EXTENT_MAP)
+			return fsGetExtentMap(tree, *((const BtrfsObjID *)input0), *((const unsigned __int64 *)input1),
+				(ExtentMap *)output0);
+		else if (operation == FSOP_DIR_LIST)
+			return fsDirList(tree, (const FilePkg *)input0, *((const bool *)input1), (DirList *)output0);
 	
 		switch (operation)
 		{
 		case FSOP_DUMP_TREE:		// always succeeds
-		case FSOP_DIR_LIST:			// begins at zero for other reasons
 			returnCode = 0;
 			break;
-		case FSOP_GET_FILE_PKG:
-			returnCode = 0x1; // always need the inode
-			if (*((BtrfsObjID *)input0) != OBJID_ROOT_DIR)
-				returnCode |= 0x2; // needs name for all except the root dir
-			break;
 		default:
 			returnCode = 0x1; // 1 bit = 1 part MUST be fulfilled
 		}
 	
-		/* pre tasks */
-		if (operation == FSOP_GET_FILE_PKG)
-		{
-			const BtrfsObjID *objectID = (const BtrfsObjID *)input0;
-			FilePkg *filePkg = (FilePkg *)output0;
-
-			filePkg->fileID.treeID = tree;
-			filePkg->fileID.objectID = *objectID;
-
-			filePkg->numExtents = 0;
-			filePkg->extents = (KeyedItem *)malloc(0);
-
-			/* for the special case of the root dir, this stuff wouldn't get filled in by any other means */
-			if (*objectID == OBJID_ROOT_DIR)
-			{
-				strcpy(filePkg->name, "ROOT_DIR");
-				memset(&filePkg->parentID, 0, sizeof(FileID));
-			}
-		}
-		else if (operation == FSOP_DIR_LIST)
-		{
-			const FilePkg *filePkg = (const FilePkg *)input0;
-			const bool *root = (const bool *)input1;
-			DirList *dirList = (DirList *)output0;
-
-			if (!(*root))
-			{
-				dirList->numEntries = 2;
-				dirList->entries = (FilePkg *)malloc(2 * sizeof(FilePkg));
-
-				/* add '.' to the list */
-				memcpy(&dirList->entries[0], filePkg, sizeof(FilePkg));
-				strcpy(dirList->entries[0].name, ".");
-
-				/* add '..' to the list */
-				memcpy(&dirList->entries[1].fileID, &filePkg->parentID, sizeof(FileID));
-				memcpy(&dirList->entries[1].inode, &filePkg->parentInode, sizeof(BtrfsInodeItem));
-				strcpy(dirList->entries[1].name, "..");
-				dirList->entries[1].hidden = false;
-			}
-			else
-			{
-				dirList->numEntries = 0;
-				dirList->entries = NULL;
-			}
-		}
-
 		parseFSTreeRec(getTreeRootAddr(tree), tree, operation, input0, input1, input2, output0, output1,
 			&returnCode, &shortCircuit);
 
-		if (operation == FSOP_GET_FILE_PKG)
-		{
-			FilePkg *filePkg = (FilePkg *)output0;
-
-			if (returnCode == 0)
-			{
-				if (filePkg->name[0] == '.' && strcmp(filePkg->name, ".") != 0 && strcmp(filePkg->name, "..") != 0)
-					filePkg->hidden = true;
-				else
-					filePkg->hidden = false;
-			}
-		}
-		else if (operation == FSOP_DIR_LIST)
-		{
-			const bool *root = (const bool *)input1;
-			DirList *dirList = (DirList *)output0;
-
-			for (size_t i = (*root ? 0 : 2); i < dirList->numEntries; i++) // skip '.' and '..'
-			{
-				if (dirList->entries[i].fileID.treeID != tree)
-				{
-					BtrfsObjID rootID = OBJID_ROOT_DIR;
-				
-					parseFSTree(dirList->entries[i].fileID.treeID, FSOP_GET_INODE, &rootID, NULL, NULL,
-						&dirList->entries[i].inode, NULL);
-					returnCode--;
-				}
-			}
-
-			if (returnCode == 0)
-			{
-				/* skip the first two items (. and ..) if this is the volume root */
-				for (size_t i = (*root ? 0 : 2); i < dirList->numEntries; i++)
-				{
-					if (dirList->entries[i].name[0] == '.')
-						dirList->entries[i].hidden = true;
-					else
-						dirList->entries[i].hidden = false;
-				}
-			}
-			else
-				free(dirList->entries);
-		}
-
 		return returnCode;
 	}
 }
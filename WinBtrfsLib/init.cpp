@@ -14,11 +14,15 @@
 #include <cstdio>
 #include <vector>
 #include <boost/detail/endian.hpp>
+#include "btrfs_operations.h"
 #include "btrfs_system.h"
 #include "chunktree_parser.h"
+#include "data_csum.h"
 #include "dokan_callbacks.h"
 #include "fstree_parser.h"
+#include "readahead.h"
 #include "roottree_parser.h"
+#include "trace.h"
 #include "util.h"
 #include "WinBtrfsLib.h"
 
@@ -54,13 +58,41 @@ namespace WinBtrfsLib
 
 	extern VolumeInfo volumeInfo;
 	extern BtrfsObjID mountedSubvol;
+	extern std::vector<BlockReader *> blockReaders;
 
 	std::vector<const wchar_t *> *devicePaths;
+	HANDLE dumpDone = NULL;
+
+	/* the dumps read every node of the chunk, root and FS trees, so unless they're all that was asked for, they
+		run in the background instead of holding up the mount */
+	static DWORD WINAPI dumpTrees(LPVOID param)
+	{
+		parseChunkTree(CTOP_DUMP_TREE);
+		parseRootTree(RTOP_DUMP_TREE, NULL, NULL);
+		parseFSTree(OBJID_FS_TREE, FSOP_DUMP_TREE, NULL, NULL, NULL, NULL, NULL);
+		parseRootTree(RTOP_DUMP_SUBVOLS, NULL, NULL);
+
+		/* aesthetic line break */
+		printf("\n");
+
+		if (dumpDone != NULL)
+			SetEvent(dumpDone);
+
+		return 0;
+	}
 
 	void init()
 	{
+		LARGE_INTEGER freq, start, ready;
+		unsigned __int64 deviceReads = 0;
+		unsigned int rootTreeNodes;
 		DWORD error;
 
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&start);
+
+		setupTrace(volumeInfo.traceFile, (TraceLevel)volumeInfo.traceLevel);
+
 #ifndef BOOST_DETAIL_ENDIAN_HPP
 #error You need to include <boost/detail/endian.hpp>!
 #endif
@@ -72,12 +104,7 @@ namespace WinBtrfsLib
 
 		allocateBlockReaders();
 
-		if ((error = setupBigDokanLock()) != 0)
-		{
-			printf("firstTasks: failed to setup the Big Dokan Lock! (GetLastError: %d)\n", error);
-
-			exit(1);
-		}
+		setupOpenFiles();
 
 		if ((error = loadSBs(!volumeInfo.noDump)) != 0)
 		{
@@ -91,28 +118,26 @@ namespace WinBtrfsLib
 			exit(1);
 		}
 
-		loadSBChunks(!volumeInfo.noDump);
-
-		if (!volumeInfo.noDump) parseChunkTree(CTOP_DUMP_TREE);
-		parseChunkTree(CTOP_LOAD);
+		setupNodeCache(volumeInfo.nodeCacheSize);
+		setupExtentCache(volumeInfo.extentCacheSize);
+		setupReadahead(volumeInfo.extentCacheSize);
+		setupDentryCache(volumeInfo.dentryCacheSize);
 
-		if (!volumeInfo.noDump) parseRootTree(RTOP_DUMP_TREE, NULL, NULL);
+		/* only the system chunks are mapped up front; the rest of the chunk tree is read as it's needed */
+		loadSBChunks(!volumeInfo.noDump);
+		buildChunkMap();
 
-		if (!volumeInfo.noDump)
-		{
-			parseFSTree(OBJID_FS_TREE, FSOP_DUMP_TREE, NULL, NULL, NULL, NULL, NULL);
-			parseRootTree(RTOP_DUMP_SUBVOLS, NULL, NULL);
-		}
+		/* every tree lookup from here on goes through this, so it's built before anything else looks; it reads
+			the whole root tree, which grows with the number of snapshots */
+		rootTreeNodes = buildRootIndex();
+		setupDataCsums(volumeInfo.verifyData);
 
 		if (volumeInfo.dumpOnly)
 		{
+			dumpTrees(NULL);
 			cleanUp();
 			exit(0);
 		}
-	
-		/* aesthetic line break */
-		if (!volumeInfo.noDump)
-			printf("\n");
 
 		if (!volumeInfo.useSubvolID && !volumeInfo.useSubvolName)
 		{
@@ -167,11 +192,32 @@ namespace WinBtrfsLib
 
 			mountedSubvol = (volumeInfo.subvolID == (BtrfsObjID)0 ? OBJID_FS_TREE : volumeInfo.subvolID);
 		}
+
+		if (!volumeInfo.noDump)
+		{
+			dumpDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+			if (!QueueUserWorkItem(&dumpTrees, NULL, WT_EXECUTELONGFUNCTION))
+				dumpTrees(NULL);
+		}
+
+		QueryPerformanceCounter(&ready);
+
+		for (size_t i = 0; i < blockReaders.size(); i++)
+		{
+			BlockReaderStats readerStats;
+
+			blockReaders[i]->getStats(&readerStats);
+			deviceReads += readerStats.reads;
+		}
+
+		printf("firstTasks: ready to mount after %I64u ms and %I64u device reads (root tree: %u nodes)\n",
+			(unsigned __int64)((ready.QuadPart - start.QuadPart) * 1000 / freq.QuadPart), deviceReads, rootTreeNodes);
 		
 		PDOKAN_OPTIONS dokanOptions = (PDOKAN_OPTIONS)malloc(sizeof(DOKAN_OPTIONS));
 
 		dokanOptions->Version = 600;
-		dokanOptions->ThreadCount = 1;			// eventually set this to zero or a user-definable count
+		dokanOptions->ThreadCount = volumeInfo.threadCount;
 		dokanOptions->Options = 0;				// look into this later
 		dokanOptions->GlobalContext = 0;		// use this later if necessary
 		dokanOptions->MountPoint = volumeInfo.mountPoint;
@@ -179,6 +225,10 @@ namespace WinBtrfsLib
 		int dokanResult = DokanMain(dokanOptions, &btrfsOperations);
 		free(dokanOptions);
 
+		/* a dump still going would be reading from devices that cleanUp is about to close */
+		if (dumpDone != NULL)
+			WaitForSingleObject(dumpDone, INFINITE);
+
 		cleanUp();
 		dokanError(dokanResult);
 
@@ -0,0 +1,428 @@
+/* WinBtrfsLib/lru_cache.h
+ * sharded LRU cache of pinned buffers
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <Windows.h>
+#include "buffer_pool.h"
+
+#ifndef WINBTRFSLIB_LRU_CACHE_H
+#define WINBTRFSLIB_LRU_CACHE_H
+
+namespace WinBtrfsLib
+{
+	struct LRUCacheStats
+	{
+		unsigned __int64		hits;
+		unsigned __int64		misses;
+		unsigned __int64		evictions;
+		unsigned __int64		charged;		// what's cached, in whatever units the traits charge in
+		unsigned __int64		entries;
+		unsigned __int64		bufferAllocs;	// pooled-size buffers that had to come from the heap
+		unsigned __int64		bufferReuses;	// pooled-size buffers recycled from evicted entries
+	};
+
+	/* a bounded cache of variable-sized buffers, split into independently locked shards so that lookups from
+		different threads rarely contend. buffers handed out are pinned until they are released; only unpinned
+		entries are on the LRU list, so pinned ones can push a shard over budget for a while. Traits supplies:
+			static size_t hash(const Key &key);
+			static bool equal(const Key &a, const Key &b);
+			static unsigned __int64 charge(size_t size);	// what an entry of this size counts against the budget */
+	template <class Key, class Traits>
+	class LRUCache
+	{
+	public:
+		LRUCache();
+		~LRUCache();
+
+		void setup(unsigned __int64 budget, size_t pooledSize, size_t poolIdle);
+		unsigned __int64 getBudget();
+		unsigned char *acquire(const Key &key, size_t *size);
+		bool contains(const Key &key);
+		bool copy(const Key &key, void *dest, size_t len);
+		unsigned char *allocate(size_t size);
+		unsigned char *publish(const Key &key, unsigned char *block);
+		void release(unsigned char *block);
+		void discard(unsigned char *block);
+		void getStats(LRUCacheStats *stats);
+
+	private:
+		struct Entry
+		{
+			Key						key;
+			size_t					size;
+			unsigned int			refs;		// number of outstanding pins
+			Entry					*prev;		// LRU list links; only unpinned entries are on the list
+			Entry					*next;
+			unsigned char			block		[0x0];
+		};
+
+		struct MapHash
+		{
+			size_t operator()(const Key &key) const { return Traits::hash(key); }
+		};
+
+		struct MapEqual
+		{
+			bool operator()(const Key &a, const Key &b) const { return Traits::equal(a, b); }
+		};
+
+		typedef std::unordered_map<Key, Entry *, MapHash, MapEqual> EntryMap;
+
+		struct Shard
+		{
+			CRITICAL_SECTION		lock;
+			EntryMap				entries;
+			Entry					*lruHead;	// most recently released
+			Entry					*lruTail;	// next to be evicted
+			unsigned __int64		charged;
+			unsigned __int64		hits;
+			unsigned __int64		misses;
+			unsigned __int64		evictions;
+		};
+
+		static const unsigned int NUM_SHARDS = 16;	// getShard takes the top 4 bits for this
+
+		Shard *getShard(const Key &key);
+		Entry *getEntry(unsigned char *block);
+		void unlinkLRU(Shard *shard, Entry *entry);
+		void pushLRU(Shard *shard, Entry *entry);
+		void pin(Shard *shard, Entry *entry);
+		void trim(Shard *shard);
+		void freeEntry(Entry *entry);
+
+		Shard shards[NUM_SHARDS];
+		unsigned __int64 shardBudget;
+		size_t pooledSize;
+		BufferPool pool;	// for entries of pooledSize only; anything else is malloc'd to size
+	};
+
+	template <class Key, class Traits>
+	LRUCache<Key, Traits>::LRUCache()
+	{
+		shardBudget = 0;
+		pooledSize = 0;
+
+		for (unsigned int i = 0; i < NUM_SHARDS; i++)
+		{
+			InitializeCriticalSection(&shards[i].lock);
+			shards[i].lruHead = shards[i].lruTail = NULL;
+			shards[i].charged = shards[i].hits = shards[i].misses = shards[i].evictions = 0;
+		}
+	}
+
+	template <class Key, class Traits>
+	LRUCache<Key, Traits>::~LRUCache()
+	{
+		for (unsigned int i = 0; i < NUM_SHARDS; i++)
+		{
+			/* anything still pinned at this point has been leaked by its owner; free it regardless */
+			typename EntryMap::iterator it = shards[i].entries.begin(), end = shards[i].entries.end();
+			for ( ; it != end; ++it)
+				freeEntry(it->second);
+
+			DeleteCriticalSection(&shards[i].lock);
+		}
+	}
+
+	/* buffers of pooledSize are recycled through a pool holding up to poolIdle of them; a pooledSize of zero
+		leaves everything to the heap */
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::setup(unsigned __int64 budget, size_t pooledSize, size_t poolIdle)
+	{
+		shardBudget = budget / NUM_SHARDS;
+		this->pooledSize = pooledSize;
+
+		if (pooledSize != 0)
+			pool.setup(sizeof(Entry) + pooledSize, poolIdle);
+	}
+
+	/* the budget as it was actually split up, in the traits' units */
+	template <class Key, class Traits>
+	unsigned __int64 LRUCache<Key, Traits>::getBudget()
+	{
+		return shardBudget * NUM_SHARDS;
+	}
+
+	template <class Key, class Traits>
+	typename LRUCache<Key, Traits>::Shard *LRUCache<Key, Traits>::getShard(const Key &key)
+	{
+		/* the shard comes from the top bits of the hash times a large odd constant, so it depends on every bit of
+			the hash; block addresses in particular share their low bits, and a plain mod would leave most shards
+			empty */
+		return &shards[(unsigned __int64)Traits::hash(key) * 0x9e3779b97f4a7c15ULL >> 60];
+	}
+
+	template <class Key, class Traits>
+	typename LRUCache<Key, Traits>::Entry *LRUCache<Key, Traits>::getEntry(unsigned char *block)
+	{
+		return (Entry *)(block - offsetof(Entry, block));
+	}
+
+	/* shard lock must be held */
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::unlinkLRU(Shard *shard, Entry *entry)
+	{
+		if (entry->prev != NULL)
+			entry->prev->next = entry->next;
+		else
+			shard->lruHead = entry->next;
+
+		if (entry->next != NULL)
+			entry->next->prev = entry->prev;
+		else
+			shard->lruTail = entry->prev;
+
+		entry->prev = entry->next = NULL;
+	}
+
+	/* shard lock must be held; most recently used goes at the head */
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::pushLRU(Shard *shard, Entry *entry)
+	{
+		entry->prev = NULL;
+		entry->next = shard->lruHead;
+		if (shard->lruHead != NULL)
+			shard->lruHead->prev = entry;
+		else
+			shard->lruTail = entry;
+		shard->lruHead = entry;
+	}
+
+	/* shard lock must be held */
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::pin(Shard *shard, Entry *entry)
+	{
+		if (entry->refs++ == 0)
+			unlinkLRU(shard, entry);
+	}
+
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::freeEntry(Entry *entry)
+	{
+		if (pooledSize != 0 && entry->size == pooledSize)
+			pool.put(entry);
+		else
+			free(entry);
+	}
+
+	/* shard lock must be held */
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::trim(Shard *shard)
+	{
+		while (shard->charged > shardBudget && shard->lruTail != NULL)
+		{
+			Entry *victim = shard->lruTail;
+
+			unlinkLRU(shard, victim);
+			shard->entries.erase(victim->key);
+			shard->charged -= Traits::charge(victim->size);
+			shard->evictions++;
+
+			freeEntry(victim);
+		}
+	}
+
+	/* returns a pinned buffer (and its size, if size isn't NULL) if the key is cached, NULL otherwise */
+	template <class Key, class Traits>
+	unsigned char *LRUCache<Key, Traits>::acquire(const Key &key, size_t *size)
+	{
+		Shard *shard = getShard(key);
+		unsigned char *block = NULL;
+
+		EnterCriticalSection(&shard->lock);
+
+		typename EntryMap::iterator it = shard->entries.find(key);
+		if (it != shard->entries.end())
+		{
+			Entry *entry = it->second;
+
+			pin(shard, entry);
+
+			block = entry->block;
+			if (size != NULL)
+				*size = entry->size;
+			shard->hits++;
+		}
+		else
+			shard->misses++;
+
+		LeaveCriticalSection(&shard->lock);
+
+		return block;
+	}
+
+	/* checks for a key without pinning it or counting toward the hit rate; only good as a hint */
+	template <class Key, class Traits>
+	bool LRUCache<Key, Traits>::contains(const Key &key)
+	{
+		Shard *shard = getShard(key);
+		bool found;
+
+		EnterCriticalSection(&shard->lock);
+
+		found = (shard->entries.find(key) != shard->entries.end());
+
+		LeaveCriticalSection(&shard->lock);
+
+		return found;
+	}
+
+	/* copies the first len bytes of a cached buffer to dest and counts it as used, all under one lock and without
+		pinning it; for small entries, where that's cheaper than acquire and release. returns false on a miss */
+	template <class Key, class Traits>
+	bool LRUCache<Key, Traits>::copy(const Key &key, void *dest, size_t len)
+	{
+		Shard *shard = getShard(key);
+		bool found = false;
+
+		EnterCriticalSection(&shard->lock);
+
+		typename EntryMap::iterator it = shard->entries.find(key);
+		if (it != shard->entries.end())
+		{
+			Entry *entry = it->second;
+
+			assert(len <= entry->size);
+			memcpy(dest, entry->block, len);
+
+			/* pinned entries aren't on the list; they go back to its head when they're released anyway */
+			if (entry->refs == 0)
+			{
+				unlinkLRU(shard, entry);
+				pushLRU(shard, entry);
+			}
+
+			found = true;
+			shard->hits++;
+		}
+		else
+			shard->misses++;
+
+		LeaveCriticalSection(&shard->lock);
+
+		return found;
+	}
+
+	/* returns an unpublished buffer of the given size; either publish or discard it */
+	template <class Key, class Traits>
+	unsigned char *LRUCache<Key, Traits>::allocate(size_t size)
+	{
+		Entry *entry;
+
+		if (pooledSize != 0 && size == pooledSize)
+			entry = (Entry *)pool.get();
+		else
+		{
+			entry = (Entry *)malloc(sizeof(Entry) + size);
+			assert(entry != NULL);
+		}
+
+		entry->size = size;
+		entry->refs = 1;
+		entry->prev = entry->next = NULL;
+
+		return entry->block;
+	}
+
+	/* inserts a freshly filled buffer and returns it pinned; if another thread published the same key in the
+		meantime, the given buffer is freed and the existing one is returned instead */
+	template <class Key, class Traits>
+	unsigned char *LRUCache<Key, Traits>::publish(const Key &key, unsigned char *block)
+	{
+		Shard *shard = getShard(key);
+		Entry *entry = getEntry(block);
+
+		entry->key = key;
+
+		EnterCriticalSection(&shard->lock);
+
+		typename EntryMap::iterator it = shard->entries.find(key);
+		if (it != shard->entries.end())
+		{
+			Entry *existing = it->second;
+
+			pin(shard, existing);
+
+			LeaveCriticalSection(&shard->lock);
+
+			freeEntry(entry);
+			return existing->block;
+		}
+
+		shard->entries[key] = entry;
+		shard->charged += Traits::charge(entry->size);
+
+		LeaveCriticalSection(&shard->lock);
+
+		return block;
+	}
+
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::release(unsigned char *block)
+	{
+		Entry *entry = getEntry(block);
+		Shard *shard = getShard(entry->key);
+
+		EnterCriticalSection(&shard->lock);
+
+		assert(entry->refs > 0);
+
+		if (--entry->refs == 0)
+		{
+			pushLRU(shard, entry);
+			trim(shard);
+		}
+
+		LeaveCriticalSection(&shard->lock);
+	}
+
+	/* frees a buffer from allocate that was never published */
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::discard(unsigned char *block)
+	{
+		freeEntry(getEntry(block));
+	}
+
+	template <class Key, class Traits>
+	void LRUCache<Key, Traits>::getStats(LRUCacheStats *stats)
+	{
+		memset(stats, 0, sizeof(LRUCacheStats));
+
+		for (unsigned int i = 0; i < NUM_SHARDS; i++)
+		{
+			EnterCriticalSection(&shards[i].lock);
+
+			stats->hits += shards[i].hits;
+			stats->misses += shards[i].misses;
+			stats->evictions += shards[i].evictions;
+			stats->charged += shards[i].charged;
+			stats->entries += shards[i].entries.size();
+
+			LeaveCriticalSection(&shards[i].lock);
+		}
+
+		if (pooledSize != 0)
+		{
+			BufferPoolStats poolStats;
+
+			pool.getStats(&poolStats);
+			stats->bufferAllocs = poolStats.heapAllocs;
+			stats->bufferReuses = poolStats.reuses;
+		}
+	}
+}
+
+#endif
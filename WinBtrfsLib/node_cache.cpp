@@ -0,0 +1,98 @@
+/* WinBtrfsLib/node_cache.cpp
+ * metadata node cache
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "node_cache.h"
+#include <functional>
+
+namespace WinBtrfsLib
+{
+	/* evicted entries kept around for reuse; every miss in a full cache evicts about one, so this only needs
+		to soak up bursts like prefetch batches */
+	const size_t NODE_POOL_IDLE = 64;
+
+	size_t NodeCache::Traits::hash(const LogiAddr &addr)
+	{
+		return std::hash<unsigned __int64>()(addr);
+	}
+
+	bool NodeCache::Traits::equal(const LogiAddr &a, const LogiAddr &b)
+	{
+		return (a == b);
+	}
+
+	unsigned __int64 NodeCache::Traits::charge(size_t size)
+	{
+		return size;
+	}
+
+	NodeCache::NodeCache()
+	{
+		nodeSize = 0;
+	}
+
+	void NodeCache::setup(unsigned int nodeSize, unsigned __int64 budget)
+	{
+		this->nodeSize = nodeSize;
+
+		cache.setup(budget, nodeSize, NODE_POOL_IDLE);
+	}
+
+	bool NodeCache::contains(LogiAddr addr)
+	{
+		return cache.contains(addr);
+	}
+
+	/* roughly how many nodes fit in the cache at once */
+	unsigned int NodeCache::capacity()
+	{
+		return (nodeSize != 0 ? (unsigned int)(cache.getBudget() / nodeSize) : 0);
+	}
+
+	unsigned char *NodeCache::acquire(LogiAddr addr)
+	{
+		return cache.acquire(addr, NULL);
+	}
+
+	unsigned char *NodeCache::allocate()
+	{
+		return cache.allocate(nodeSize);
+	}
+
+	unsigned char *NodeCache::publish(LogiAddr addr, unsigned char *block)
+	{
+		return cache.publish(addr, block);
+	}
+
+	void NodeCache::release(unsigned char *block)
+	{
+		cache.release(block);
+	}
+
+	void NodeCache::discard(unsigned char *block)
+	{
+		cache.discard(block);
+	}
+
+	void NodeCache::getStats(NodeCacheStats *stats)
+	{
+		LRUCacheStats cacheStats;
+
+		cache.getStats(&cacheStats);
+
+		stats->hits = cacheStats.hits;
+		stats->misses = cacheStats.misses;
+		stats->evictions = cacheStats.evictions;
+		stats->bytesCached = cacheStats.charged;
+		stats->bufferAllocs = cacheStats.bufferAllocs;
+		stats->bufferReuses = cacheStats.bufferReuses;
+	}
+}
@@ -0,0 +1,62 @@
+/* WinBtrfsLib/node_cache.h
+ * metadata node cache
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <Windows.h>
+#include "lru_cache.h"
+#include "types.h"
+
+#ifndef WINBTRFSLIB_NODE_CACHE_H
+#define WINBTRFSLIB_NODE_CACHE_H
+
+namespace WinBtrfsLib
+{
+	struct NodeCacheStats
+	{
+		unsigned __int64		hits;
+		unsigned __int64		misses;
+		unsigned __int64		evictions;
+		unsigned __int64		bytesCached;
+		unsigned __int64		bufferAllocs;	// entries that had to come from the heap
+		unsigned __int64		bufferReuses;	// entries recycled from evicted ones
+	};
+
+	/* a bounded cache of verified tree nodes, all of one size; node buffers handed out are pinned until they
+		are released */
+	class NodeCache
+	{
+	public:
+		NodeCache();
+
+		void setup(unsigned int nodeSize, unsigned __int64 budget);
+		unsigned char *acquire(LogiAddr addr);
+		bool contains(LogiAddr addr);
+		unsigned int capacity();
+		unsigned char *allocate();
+		unsigned char *publish(LogiAddr addr, unsigned char *block);
+		void release(unsigned char *block);
+		void discard(unsigned char *block);
+		void getStats(NodeCacheStats *stats);
+
+	private:
+		struct Traits
+		{
+			static size_t hash(const LogiAddr &addr);
+			static bool equal(const LogiAddr &a, const LogiAddr &b);
+			static unsigned __int64 charge(size_t size);
+		};
+
+		LRUCache<LogiAddr, Traits> cache;
+		unsigned int nodeSize;
+	};
+}
+
+#endif
@@ -0,0 +1,131 @@
+/* WinBtrfsLib/node_view.cpp
+ * bounds-checked views of the items inside node buffers
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "node_view.h"
+#include <cstdio>
+#include <cstdlib>
+#include "tree_search.h"
+
+namespace WinBtrfsLib
+{
+	/* the entries of a DIR_ITEM, DIR_INDEX or XATTR_ITEM have to fill it exactly */
+	static bool checkDirItems(const unsigned char *data, unsigned int size)
+	{
+		const unsigned char *pos = data, *end = data + size;
+
+		while (pos != end)
+		{
+			const BtrfsDirItem *dirItem = (const BtrfsDirItem *)pos;
+
+			if ((size_t)(end - pos) < sizeof(BtrfsDirItem) ||
+				(size_t)(end - pos) < sizeof(BtrfsDirItem) + endian16(dirItem->m) + endian16(dirItem->n))
+				return false;
+
+			pos += sizeof(BtrfsDirItem) + endian16(dirItem->m) + endian16(dirItem->n);
+		}
+
+		return true;
+	}
+
+	/* an INODE_REF holds one entry per hard link in the same directory, and they have to fill it exactly too */
+	static bool checkInodeRefs(const unsigned char *data, unsigned int size)
+	{
+		const unsigned char *pos = data, *end = data + size;
+
+		if (size == 0)
+			return false;
+
+		while (pos != end)
+		{
+			const BtrfsInodeRef *inodeRef = (const BtrfsInodeRef *)pos;
+
+			if ((size_t)(end - pos) < sizeof(BtrfsInodeRef) ||
+				(size_t)(end - pos) < sizeof(BtrfsInodeRef) + endian16(inodeRef->nameLen))
+				return false;
+
+			pos += sizeof(BtrfsInodeRef) + endian16(inodeRef->nameLen);
+		}
+
+		return true;
+	}
+
+	/* whether an item's data is big enough for everything the parsers read out of an item of its type */
+	static bool checkItemData(unsigned char type, const unsigned char *data, unsigned int size)
+	{
+		switch (type)
+		{
+		case TYPE_INODE_ITEM:
+			return size >= sizeof(BtrfsInodeItem);
+		case TYPE_INODE_REF:
+			return checkInodeRefs(data, size);
+		case TYPE_DIR_ITEM:
+		case TYPE_DIR_INDEX:
+		case TYPE_XATTR_ITEM:
+			return checkDirItems(data, size);
+		case TYPE_EXTENT_DATA:
+			return (size >= sizeof(BtrfsExtentData) && (((const BtrfsExtentData *)data)->type == FILEDATA_INLINE ||
+				size >= sizeof(BtrfsExtentData) + sizeof(BtrfsExtentDataNonInline)));
+		case TYPE_ROOT_ITEM:
+			return size >= sizeof(BtrfsRootItem);
+		case TYPE_ROOT_BACKREF:
+		case TYPE_ROOT_REF:
+			return (size >= sizeof(BtrfsRootRef) &&
+				size >= sizeof(BtrfsRootRef) + endian16(((const BtrfsRootRef *)data)->n));
+		case TYPE_DEV_ITEM:
+			return size >= sizeof(BtrfsDevItem);
+		case TYPE_CHUNK_ITEM:
+			return (size >= sizeof(BtrfsChunkItem) && size >= sizeof(BtrfsChunkItem) +
+				endian16(((const BtrfsChunkItem *)data)->numStripes) * sizeof(BtrfsChunkItemStripe));
+		default:
+			return true;
+		}
+	}
+
+	/* checks a node that has passed its checksum for everything the views count on: a sane level, an item
+		count that fits, and items whose data lies within the node and is big enough for its type. a node can
+		pass its checksum and still fail this if whatever wrote it was broken */
+	bool checkNode(const unsigned char *nodeBlock, unsigned int nodeSize)
+	{
+		const BtrfsHeader *header = (const BtrfsHeader *)nodeBlock;
+		unsigned int numItems = endian32(header->nrItems), areaSize = nodeSize - (unsigned int)sizeof(BtrfsHeader);
+
+		if (header->level >= MAX_TREE_LEVELS)
+			return false;
+
+		/* an internal node with no children would leave a search nowhere to go */
+		if (header->level != 0)
+			return (numItems != 0 && numItems <= areaSize / sizeof(BtrfsKeyPtr));
+
+		if (numItems > areaSize / sizeof(BtrfsItem))
+			return false;
+
+		for (unsigned int i = 0; i < numItems; i++)
+		{
+			const BtrfsItem *item = (const BtrfsItem *)(nodeBlock + sizeof(BtrfsHeader)) + i;
+			unsigned int offset = endian32(item->offset), size = endian32(item->size);
+
+			if (offset > areaSize || size > areaSize - offset ||
+				!checkItemData(item->key.type, nodeBlock + sizeof(BtrfsHeader) + offset, size))
+				return false;
+		}
+
+		return true;
+	}
+
+	void nodeCheckFailed(const char *expr, const char *file, int line)
+	{
+		printf("node check failed: %s (%s:%d)\n", expr, file, line);
+		fflush(stdout);
+
+		abort();
+	}
+}
@@ -0,0 +1,227 @@
+/* WinBtrfsLib/node_view.h
+ * bounds-checked views of the items inside node buffers
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "btrfs_system.h"
+#include "endian.h"
+#include "types.h"
+
+#ifndef WINBTRFSLIB_NODE_VIEW_H
+#define WINBTRFSLIB_NODE_VIEW_H
+
+/* like assert, but kept in release builds; a failure ends the process rather than let it read past the node */
+#define NODE_CHECK(expr) ((expr) ? (void)0 : WinBtrfsLib::nodeCheckFailed(#expr, __FILE__, __LINE__))
+
+namespace WinBtrfsLib
+{
+	bool checkNode(const unsigned char *nodeBlock, unsigned int nodeSize);
+	void nodeCheckFailed(const char *expr, const char *file, int line);
+
+	/* everything these views hand out points straight into the node buffer they were made from, so it's only good
+		for as long as that node stays pinned; copy out whatever has to live longer than that. loadNode runs
+		checkNode on every node before caching it, so a node whose items don't fit in it, or are too small for
+		what they claim to be, fails to load instead of reaching a view. the NODE_CHECKs below then only trip if
+		a caller asks for something the node doesn't have */
+
+	/* the items of a leaf node */
+	class LeafView
+	{
+	public:
+		explicit LeafView(const unsigned char *nodeBlock)
+			: nodeBlock(nodeBlock), numItems(endian32(((const BtrfsHeader *)nodeBlock)->nrItems)),
+			areaSize(getNodeSize() - (unsigned int)sizeof(BtrfsHeader))
+		{
+			NODE_CHECK(((const BtrfsHeader *)nodeBlock)->level == 0);
+			NODE_CHECK(numItems <= areaSize / sizeof(BtrfsItem));
+		}
+
+		unsigned int size() const
+		{
+			return numItems;
+		}
+
+		const BtrfsItem *item(unsigned int i) const
+		{
+			NODE_CHECK(i < numItems);
+
+			return (const BtrfsItem *)(nodeBlock + sizeof(BtrfsHeader)) + i;
+		}
+
+		/* the item's data, however big it is (possibly nothing) */
+		const unsigned char *rawData(unsigned int i) const
+		{
+			const BtrfsItem *it = item(i);
+			unsigned int offset = endian32(it->offset), size = endian32(it->size);
+
+			NODE_CHECK(offset <= areaSize && size <= areaSize - offset);
+
+			return nodeBlock + sizeof(BtrfsHeader) + offset;
+		}
+
+		unsigned int dataSize(unsigned int i) const
+		{
+			return endian32(item(i)->size);
+		}
+
+		/* the item's data as a T, which the item must be big enough to hold */
+		template <typename T>
+		const T *data(unsigned int i) const
+		{
+			NODE_CHECK(dataSize(i) >= sizeof(T));
+
+			return (const T *)rawData(i);
+		}
+
+	private:
+		const unsigned char		*nodeBlock;
+		unsigned int			numItems;
+		unsigned int			areaSize;	// everything after the header
+	};
+
+	/* the key pointers of an internal node */
+	class KeyPtrView
+	{
+	public:
+		explicit KeyPtrView(const unsigned char *nodeBlock)
+			: nodeBlock(nodeBlock), numPtrs(endian32(((const BtrfsHeader *)nodeBlock)->nrItems))
+		{
+			NODE_CHECK(((const BtrfsHeader *)nodeBlock)->level != 0);
+			NODE_CHECK(numPtrs <= (getNodeSize() - sizeof(BtrfsHeader)) / sizeof(BtrfsKeyPtr));
+		}
+
+		unsigned int size() const
+		{
+			return numPtrs;
+		}
+
+		const BtrfsKeyPtr *keyPtr(unsigned int i) const
+		{
+			NODE_CHECK(i < numPtrs);
+
+			return (const BtrfsKeyPtr *)(nodeBlock + sizeof(BtrfsHeader)) + i;
+		}
+
+	private:
+		const unsigned char		*nodeBlock;
+		unsigned int			numPtrs;
+	};
+
+	/* the entries packed into one DIR_ITEM, DIR_INDEX or XATTR_ITEM; more than one only happens when names
+		collide on the same hash. use it like: for (DirItemChain c(data, size); !c.done(); c.next()) */
+	class DirItemChain
+	{
+	public:
+		DirItemChain(const unsigned char *data, unsigned int size)
+			: pos(data), end(data + size), isFirst(true)
+		{
+			check();
+		}
+
+		bool done() const
+		{
+			return pos == end;
+		}
+
+		bool first() const
+		{
+			return isFirst;
+		}
+
+		const BtrfsDirItem *get() const
+		{
+			return (const BtrfsDirItem *)pos;
+		}
+
+		const char *name() const
+		{
+			return get()->namePlusData;
+		}
+
+		unsigned short nameLen() const
+		{
+			return endian16(get()->n);
+		}
+
+		void next()
+		{
+			pos += entryLen();
+			isFirst = false;
+			check();
+		}
+
+	private:
+		size_t entryLen() const
+		{
+			return sizeof(BtrfsDirItem) + endian16(get()->m) + endian16(get()->n);
+		}
+
+		/* an entry hanging off the end of the item means the item is corrupt */
+		void check() const
+		{
+			NODE_CHECK(pos == end ||
+				((size_t)(end - pos) >= sizeof(BtrfsDirItem) && entryLen() <= (size_t)(end - pos)));
+		}
+
+		const unsigned char		*pos;
+		const unsigned char		*end;
+		bool					isFirst;
+	};
+
+	/* an EXTENT_DATA item: the common header, followed by either the file data itself or a disk extent reference */
+	class ExtentDataView
+	{
+	public:
+		ExtentDataView(const unsigned char *data, unsigned int size)
+			: extentData((const BtrfsExtentData *)data), size(size)
+		{
+			NODE_CHECK(size >= sizeof(BtrfsExtentData));
+			NODE_CHECK(extentData->type == FILEDATA_INLINE ||
+				size >= sizeof(BtrfsExtentData) + sizeof(BtrfsExtentDataNonInline));
+		}
+
+		const BtrfsExtentData *header() const
+		{
+			return extentData;
+		}
+
+		bool isInline() const
+		{
+			return extentData->type == FILEDATA_INLINE;
+		}
+
+		const unsigned char *inlineData() const
+		{
+			NODE_CHECK(isInline());
+
+			return extentData->inlineData;
+		}
+
+		size_t inlineSize() const
+		{
+			NODE_CHECK(isInline());
+
+			return size - sizeof(BtrfsExtentData);
+		}
+
+		const BtrfsExtentDataNonInline *diskExtent() const
+		{
+			NODE_CHECK(!isInline());
+
+			return (const BtrfsExtentDataNonInline *)extentData->inlineData;
+		}
+
+	private:
+		const BtrfsExtentData	*extentData;
+		unsigned int			size;
+	};
+}
+
+#endif
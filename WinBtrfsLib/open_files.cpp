@@ -0,0 +1,205 @@
+/* WinBtrfsLib/open_files.cpp
+ * table of open files
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "open_files.h"
+#include <cassert>
+#include <unordered_map>
+#include <Windows.h>
+#include "endian.h"
+#include "fstree_parser.h"
+
+namespace WinBtrfsLib
+{
+	struct FileIDHash
+	{
+		size_t operator()(const FileID &fileID) const
+		{
+			/* object IDs are dense within a tree, so they do most of the work */
+			return std::hash<unsigned __int64>()((unsigned __int64)fileID.objectID * 31 +
+				(unsigned __int64)fileID.treeID);
+		}
+	};
+
+	struct FileIDEqual
+	{
+		bool operator()(const FileID &a, const FileID &b) const
+		{
+			return (a.treeID == b.treeID && a.objectID == b.objectID);
+		}
+	};
+
+	/* only CreateFile and CloseFile touch the table; reads go straight through the handle's record pointer */
+	std::unordered_map<FileID, FileRecord *, FileIDHash, FileIDEqual> fileRecords;
+	CRITICAL_SECTION fileRecordsLock;
+
+	void setupOpenFiles()
+	{
+		InitializeCriticalSection(&fileRecordsLock);
+	}
+
+	/* returns the record for this inode with a reference held on it, or NULL if no handle has it open */
+	FileRecord *acquireFileRecord(const FileID *fileID)
+	{
+		FileRecord *record = NULL;
+
+		EnterCriticalSection(&fileRecordsLock);
+
+		std::unordered_map<FileID, FileRecord *, FileIDHash, FileIDEqual>::iterator it = fileRecords.find(*fileID);
+		if (it != fileRecords.end())
+		{
+			record = it->second;
+			record->refs++;
+		}
+
+		LeaveCriticalSection(&fileRecordsLock);
+
+		return record;
+	}
+
+	FileRecord *allocateFileRecord()
+	{
+		FileRecord *record = new FileRecord;
+
+		record->extentMap = NULL;
+		record->refs = 1;
+
+		return record;
+	}
+
+	/* makes a filled-in record visible to other opens; if another thread published the same inode first,
+		the new record is thrown away and the existing one is returned (with a reference) instead */
+	FileRecord *publishFileRecord(FileRecord *record)
+	{
+		FileRecord *existing = NULL;
+
+		EnterCriticalSection(&fileRecordsLock);
+
+		std::pair<std::unordered_map<FileID, FileRecord *, FileIDHash, FileIDEqual>::iterator, bool> result =
+			fileRecords.insert(std::make_pair(record->filePkg.fileID, record));
+		if (!result.second)
+		{
+			existing = result.first->second;
+			existing->refs++;
+		}
+
+		LeaveCriticalSection(&fileRecordsLock);
+
+		if (existing != NULL)
+		{
+			discardFileRecord(record);
+			return existing;
+		}
+
+		return record;
+	}
+
+	/* takes another reference on a record the caller already holds one on */
+	void retainFileRecord(FileRecord *record)
+	{
+		EnterCriticalSection(&fileRecordsLock);
+
+		assert(record->refs > 0);
+		record->refs++;
+
+		LeaveCriticalSection(&fileRecordsLock);
+	}
+
+	void releaseFileRecord(FileRecord *record)
+	{
+		bool last;
+
+		EnterCriticalSection(&fileRecordsLock);
+
+		assert(record->refs > 0);
+
+		if ((last = (--record->refs == 0)))
+			fileRecords.erase(record->filePkg.fileID);
+
+		LeaveCriticalSection(&fileRecordsLock);
+
+		if (last)
+			discardFileRecord(record);
+	}
+
+	static void freeExtentMap(ExtentMap *extentMap)
+	{
+		/* inline data lives in the same allocation as the mappings */
+		free(extentMap->extents);
+
+		delete extentMap;
+	}
+
+	/* frees a record that is not (or no longer) in the table */
+	void discardFileRecord(FileRecord *record)
+	{
+		if (record->extentMap != NULL)
+			freeExtentMap(record->extentMap);
+
+		delete record;
+	}
+
+	/* builds the file's extent map on first use; if two readers race, one map wins and the other is thrown away */
+	const ExtentMap *getExtentMap(FileRecord *record)
+	{
+		ExtentMap *extentMap = record->extentMap;
+
+		if (extentMap != NULL)
+			return extentMap;
+
+		unsigned __int64 fileSize = endian64(record->filePkg.inode.stSize);
+
+		extentMap = new ExtentMap;
+
+		if (parseFSTree(record->filePkg.fileID.treeID, FSOP_GET_EXTENT_MAP, &record->filePkg.fileID.objectID,
+			&fileSize, NULL, extentMap, NULL) != 0)
+		{
+			delete extentMap;
+			return NULL;
+		}
+
+		ExtentMap *existing = (ExtentMap *)InterlockedCompareExchangePointer((PVOID volatile *)&record->extentMap,
+			extentMap, NULL);
+		if (existing != NULL)
+		{
+			freeExtentMap(extentMap);
+			return existing;
+		}
+
+		return extentMap;
+	}
+
+	/* returns the index of the piece containing offset, or numExtents if offset is past the last piece */
+	size_t findExtent(const ExtentMap *extentMap, unsigned __int64 offset)
+	{
+		size_t lo = 0, hi = extentMap->numExtents;
+
+		/* find the first piece that starts after offset; the one before it is the one we want */
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (extentMap->extents[mid].fileOffset <= offset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == 0)
+			return extentMap->numExtents;
+
+		const ExtentMapping *mapping = &extentMap->extents[lo - 1];
+		if (offset >= mapping->fileOffset + mapping->length)
+			return extentMap->numExtents;
+
+		return lo - 1;
+	}
+}
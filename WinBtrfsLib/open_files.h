@@ -0,0 +1,51 @@
+/* WinBtrfsLib/open_files.h
+ * table of open files
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "types.h"
+
+#ifndef WINBTRFSLIB_OPEN_FILES_H
+#define WINBTRFSLIB_OPEN_FILES_H
+
+namespace WinBtrfsLib
+{
+	/* everything we know about one inode; shared by every handle open on it and never modified once published,
+		except that the extent map is filled in (once) by the first read */
+	struct FileRecord
+	{
+		FilePkg					filePkg;
+		ExtentMap * volatile	extentMap;	// NULL until first needed; use getExtentMap
+		unsigned int			refs;		// number of handles; protected by the table lock
+	};
+
+	/* one per handle, stored in DOKAN_FILE_INFO::Context from CreateFile until CloseFile */
+	struct OpenFile
+	{
+		FileRecord				*record;
+
+		/* readahead state; only ever a hint, so concurrent reads on one handle may race on it harmlessly */
+		unsigned __int64		nextOffset;		// where the next read would start if access is sequential
+		unsigned __int64		raWindow;		// current readahead window in bytes; zero if access looks random
+		unsigned __int64		raEnd;			// file offset up to which readahead has been issued
+	};
+
+	void setupOpenFiles();
+	FileRecord *acquireFileRecord(const FileID *fileID);
+	FileRecord *allocateFileRecord();
+	FileRecord *publishFileRecord(FileRecord *record);
+	void retainFileRecord(FileRecord *record);
+	void releaseFileRecord(FileRecord *record);
+	void discardFileRecord(FileRecord *record);
+	const ExtentMap *getExtentMap(FileRecord *record);
+	size_t findExtent(const ExtentMap *extentMap, unsigned __int64 offset);
+}
+
+#endif
@@ -0,0 +1,223 @@
+/* WinBtrfsLib/readahead.cpp
+ * sequential read detection and asynchronous prefetch
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "readahead.h"
+#include <Windows.h>
+#include "btrfs_system.h"
+#include "buffer_pool.h"
+
+namespace WinBtrfsLib
+{
+	/* the window starts at twice the first sequential read, but no less than one extent cache chunk, and doubles on
+		every sequential read after that, up to the maximum */
+	const unsigned __int64 RA_MIN_WINDOW = EXTENT_CHUNK_SIZE;
+	const unsigned __int64 RA_MAX_WINDOW = 8 * 1024 * 1024;
+
+	/* beyond this many queued prefetches, the disks are busy enough already */
+	const LONG RA_MAX_JOBS = 16;
+
+	struct ReadaheadJob
+	{
+		FileRecord				*record;	// holds a reference until the job is done
+		unsigned __int64		start;
+		unsigned __int64		end;
+	};
+
+	BufferPool raJobPool;
+	unsigned __int64 raMaxWindow = 0;
+	volatile LONG raJobs = 0, raStopping = 0;
+	HANDLE raIdle = NULL;	// set by whichever job brings raJobs back to zero
+	volatile LONGLONG raRequests = 0, raSkipped = 0, raBytes = 0;
+
+	/* prefetched data has to fit in the extent cache alongside whatever the readers are using, so the window
+		is capped at a fraction of it; a cache too small for even the minimum window turns readahead off */
+	void setupReadahead(unsigned __int64 extentCacheBudget)
+	{
+		raMaxWindow = extentCacheBudget / 8;
+
+		if (raMaxWindow > RA_MAX_WINDOW)
+			raMaxWindow = RA_MAX_WINDOW;
+		else if (raMaxWindow < RA_MIN_WINDOW)
+			raMaxWindow = 0;
+
+		/* there are never more jobs than this around at once, so after warming up none are malloc'd */
+		raJobPool.setup(sizeof(ReadaheadJob), RA_MAX_JOBS);
+
+		raIdle = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	static void finishJob()
+	{
+		if (InterlockedDecrement(&raJobs) == 0 && raIdle != NULL)
+			SetEvent(raIdle);
+	}
+
+	/* pulls every extent overlapping the job's range into the extent cache; compressed extents are decoded
+		whole, uncompressed ones only chunk by chunk */
+	static DWORD WINAPI readaheadWorker(LPVOID param)
+	{
+		ReadaheadJob *job = (ReadaheadJob *)param;
+		const ExtentMap *extentMap = getExtentMap(job->record);
+
+		if (extentMap != NULL)
+		{
+			for (size_t i = findExtent(extentMap, job->start); i < extentMap->numExtents; i++)
+			{
+				const ExtentMapping *mapping = &extentMap->extents[i];
+				unsigned char *data;
+				DWORD error;
+
+				if (mapping->fileOffset >= job->end)
+					break;
+
+				if (mapping->kind != EXTENT_REGULAR)
+					continue;
+
+				if (mapping->compression != COMPRESSION_NONE)
+				{
+					if ((data = loadExtent(mapping, &error)) != NULL)
+						releaseExtent(data);
+				}
+				else
+				{
+					unsigned __int64 pieceEnd = mapping->fileOffset + mapping->length;
+					unsigned __int64 from = (job->start > mapping->fileOffset ? job->start : mapping->fileOffset) -
+						mapping->fileOffset + mapping->decodedOffset;
+					unsigned __int64 to = (job->end < pieceEnd ? job->end : pieceEnd) - mapping->fileOffset +
+						mapping->decodedOffset;
+
+					for (unsigned __int64 chunkOffset = from - from % EXTENT_CHUNK_SIZE;
+						chunkOffset < to && chunkOffset < mapping->diskSize; chunkOffset += EXTENT_CHUNK_SIZE)
+					{
+						size_t size;
+
+						/* a failed prefetch isn't an error; the reader will hit it for real and report it */
+						if ((data = loadExtentChunk(mapping, chunkOffset, &size, &error)) == NULL)
+							break;
+
+						releaseExtent(data);
+					}
+				}
+			}
+		}
+
+		releaseFileRecord(job->record);
+		raJobPool.put(job);
+
+		/* nothing of the job's may be touched after this; cleanUp could be tearing everything down already */
+		finishJob();
+
+		return 0;
+	}
+
+	/* called at the start of every read on a handle; if the handle is being read sequentially, grows its
+		window and makes sure the data up to one window past this read is on its way into the cache */
+	void noteRead(OpenFile *openFile, unsigned __int64 offset, unsigned __int64 len, unsigned __int64 fileSize)
+	{
+		unsigned __int64 readEnd = offset + len, start, target;
+		ReadaheadJob *job;
+
+		if (raMaxWindow == 0 || raStopping)
+			return;
+
+		if (offset == openFile->nextOffset)
+		{
+			/* start out at a couple of reads' worth, so large requests see a benefit immediately */
+			if (openFile->raWindow == 0)
+				openFile->raWindow = (2 * len > RA_MIN_WINDOW ? 2 * len : RA_MIN_WINDOW);
+			else
+				openFile->raWindow *= 2;
+
+			if (openFile->raWindow > raMaxWindow)
+				openFile->raWindow = raMaxWindow;
+		}
+		else
+		{
+			openFile->raWindow = 0;
+			openFile->raEnd = 0;
+		}
+
+		openFile->nextOffset = readEnd;
+
+		if (openFile->raWindow == 0)
+			return;
+
+		/* don't queue another job until the reader has eaten into the first half of what's already coming */
+		if (openFile->raEnd >= readEnd + openFile->raWindow / 2)
+			return;
+
+		start = (openFile->raEnd > readEnd ? openFile->raEnd : readEnd);
+		target = (readEnd + openFile->raWindow < fileSize ? readEnd + openFile->raWindow : fileSize);
+
+		if (start >= target)
+			return;
+
+		LONG jobs = InterlockedIncrement(&raJobs);
+
+		/* stopReadahead may have read raJobs before it went up, in which case it's counting on this seeing the
+			flag */
+		if (raStopping)
+		{
+			finishJob();
+			return;
+		}
+
+		if (jobs > RA_MAX_JOBS)
+		{
+			finishJob();
+			InterlockedIncrement64(&raSkipped);
+			return;
+		}
+
+		job = (ReadaheadJob *)raJobPool.get();
+		job->record = openFile->record;
+		job->start = start;
+		job->end = target;
+
+		retainFileRecord(job->record);
+
+		if (!QueueUserWorkItem(&readaheadWorker, job, WT_EXECUTEDEFAULT))
+		{
+			releaseFileRecord(job->record);
+			raJobPool.put(job);
+			finishJob();
+			return;
+		}
+
+		openFile->raEnd = target;
+
+		InterlockedIncrement64(&raRequests);
+		InterlockedExchangeAdd64(&raBytes, (LONGLONG)(target - start));
+	}
+
+	/* queues nothing more, and returns once every job already queued is done; the caches, devices and file
+		records those jobs use can only be torn down after this */
+	void stopReadahead()
+	{
+		InterlockedExchange(&raStopping, 1);
+
+		while (raJobs != 0)
+			WaitForSingleObject(raIdle, INFINITE);
+	}
+
+	void getReadaheadStats(ReadaheadStats *stats)
+	{
+		stats->requests = (unsigned __int64)raRequests;
+		stats->skipped = (unsigned __int64)raSkipped;
+		stats->bytes = (unsigned __int64)raBytes;
+
+		BufferPoolStats poolStats;
+
+		raJobPool.getStats(&poolStats);
+		stats->jobAllocs = poolStats.heapAllocs;
+	}
+}
@@ -0,0 +1,34 @@
+/* WinBtrfsLib/readahead.h
+ * sequential read detection and asynchronous prefetch
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "open_files.h"
+
+#ifndef WINBTRFSLIB_READAHEAD_H
+#define WINBTRFSLIB_READAHEAD_H
+
+namespace WinBtrfsLib
+{
+	struct ReadaheadStats
+	{
+		unsigned __int64		requests;	// prefetches queued
+		unsigned __int64		skipped;	// prefetches dropped because too many were already in flight
+		unsigned __int64		bytes;		// file bytes covered by queued prefetches
+		unsigned __int64		jobAllocs;	// job records that had to be malloc'd
+	};
+
+	void setupReadahead(unsigned __int64 extentCacheBudget);
+	void noteRead(OpenFile *openFile, unsigned __int64 offset, unsigned __int64 len, unsigned __int64 fileSize);
+	void stopReadahead();
+	void getReadaheadStats(ReadaheadStats *stats);
+}
+
+#endif
@@ -12,10 +12,15 @@
 
 #include "roottree_parser.h"
 #include <cassert>
+#include <unordered_map>
 #include <vector>
+#include "arena.h"
 #include "btrfs_system.h"
+#include "crc32c.h"
 #include "endian.h"
 #include "fstree_parser.h"
+#include "node_view.h"
+#include "tree_search.h"
 #include "util.h"
 
 namespace WinBtrfsLib
@@ -23,19 +28,72 @@ namespace WinBtrfsLib
 	extern std::vector<BtrfsSuperblock> supers;
 	extern BtrfsObjID mountedSubvol;
 
+	struct NameHash
+	{
+		size_t operator()(const char *name) const
+		{
+			return crc32c((unsigned int)~0, (const unsigned char *)name, (unsigned int)strlen(name));
+		}
+	};
+
+	struct NameEqual
+	{
+		bool operator()(const char *a, const char *b) const
+		{
+			return strcmp(a, b) == 0;
+		}
+	};
+
+	typedef std::unordered_map<unsigned __int64, RootInfo> RootIndex;
+	typedef std::unordered_map<const char *, BtrfsObjID, NameHash, NameEqual> SubvolNames;
+
+	/* every tree's ROOT_ITEM and every subvolume's name, read once at mount; the volume is read-only, so after
+		that they never change and lookups don't need a lock */
+	RootIndex rootIndex;
+	SubvolNames subvolNames;
+	Arena rootNameArena(4096);
+
+	/* fills the index; must happen before any other threads are started. this reads every node of the root tree,
+		which holds a ROOT_ITEM, ROOT_REF and ROOT_BACKREF for every subvolume and snapshot, so a volume with
+		thousands of snapshots pays for hundreds of nodes here; returns how many there were, for the mount-time
+		report */
+	unsigned int buildRootIndex()
+	{
+		unsigned int nodes = 0;
+
+		parseRootTree(RTOP_BUILD_INDEX, NULL, &nodes);
+
+		return nodes;
+	}
+
+	/* returns NULL if the tree has no ROOT_ITEM */
+	const RootInfo *findRoot(BtrfsObjID tree)
+	{
+		RootIndex::const_iterator it = rootIndex.find((unsigned __int64)tree);
+
+		return (it != rootIndex.end() ? &it->second : NULL);
+	}
+
 	void parseRootTreeRec(LogiAddr addr, RTOperation operation, void *input0, void *output0,
 		int *returnCode, bool *shortCircuit)
 	{
-		unsigned char *nodeBlock, *nodePtr;
+		unsigned char *nodeBlock;
 		BtrfsHeader *header;
-		BtrfsItem *item;
-		KeyedItem kItem;
 
 		nodeBlock = loadNode(addr, &header);
 
+		/* loadNode has already reported it; the walk carries on without this subtree */
+		if (nodeBlock == NULL)
+		{
+			if (operation == RTOP_DUMP_TREE)
+				printf("\n[Node] addr = 0x%I64x is unreadable\n", addr);
+			return;
+		}
+
 		assert(header->tree == OBJID_ROOT_TREE);
-	
-		nodePtr = nodeBlock + sizeof(BtrfsHeader);
+
+		if (operation == RTOP_BUILD_INDEX)
+			(*(unsigned int *)output0)++;
 
 		if (operation == RTOP_DUMP_TREE)
 			printf("\n[Node] tree = 0x%I64x addr = 0x%I64x level = 0x%02x nrItems = 0x%08x\n", endian64(header->tree),
@@ -43,17 +101,19 @@ namespace WinBtrfsLib
 
 		if (header->level == 0) // leaf node
 		{
-			for (unsigned int i = 0; i < endian32(header->nrItems); i++)
+			LeafView leaf(nodeBlock);
+
+			for (unsigned int i = 0; i < leaf.size(); i++)
 			{
-				item = (BtrfsItem *)nodePtr;
-			
+				const BtrfsItem *item = leaf.item(i);
+
 				if (operation == RTOP_DUMP_TREE)
 				{
 					switch (item->key.type)
 					{
 					case TYPE_INODE_ITEM:
 					{
-						BtrfsInodeItem *inodeItem = (BtrfsInodeItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
+						const BtrfsInodeItem *inodeItem = leaf.data<BtrfsInodeItem>(i);
 						char mode[11];
 					
 						stModeToStr(inodeItem->stMode, mode);
@@ -64,55 +124,30 @@ namespace WinBtrfsLib
 					}
 					case TYPE_INODE_REF:
 					{
-						BtrfsInodeRef *inodeRef = (BtrfsInodeRef *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-						size_t len = endian16(inodeRef->nameLen);
-						char *name = new char[len + 1];
-
-						memcpy(name, inodeRef->name, len);
-						name[len] = 0;
+						const BtrfsInodeRef *inodeRef = leaf.data<BtrfsInodeRef>(i);
 
-						printf("  [%02x] INODE_REF 0x%I64x -> '%s' parent: 0x%I64x\n", i, endian64(item->key.objectID), name,
-							endian64(item->key.offset));
-
-						delete[] name;
+						printf("  [%02x] INODE_REF 0x%I64x -> '%.*s' parent: 0x%I64x\n", i, endian64(item->key.objectID),
+							(int)endian16(inodeRef->nameLen), inodeRef->name, endian64(item->key.offset));
 						break;
 					}
 					case TYPE_DIR_ITEM:
 					{
-						BtrfsDirItem *dirItem = (BtrfsDirItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset)),
-							*firstDirItem = dirItem;
-
-						while (true)
+						for (DirItemChain chain(leaf.rawData(i), leaf.dataSize(i)); !chain.done(); chain.next())
 						{
-							size_t len = endian16(dirItem->n);
-							char *name = new char[len + 1];
-
-							memcpy(name, dirItem->namePlusData, len);
-							name[len] = 0;
-
-							if (dirItem == firstDirItem)
+							if (chain.first())
 								printf("  [%02x] ", i);
 							else
 								printf("       ");
-							printf("DIR_ITEM parent: 0x%I64x hash: 0x%08I64x child: 0x%I64x -> '%s'\n",
-								endian64(item->key.objectID), endian64(item->key.offset), endian64(dirItem->child.objectID), name);
-						
-							delete[] name;
-						
-							/* advance to the next DIR_ITEM if there are more */
-							if (endian32(item->size) > ((char *)dirItem - (char *)firstDirItem) + sizeof(BtrfsDirItem) +
-								endian16(dirItem->m) + endian16(dirItem->n))
-								dirItem = (BtrfsDirItem *)((unsigned char *)dirItem + sizeof(BtrfsDirItem) +
-									endian16(dirItem->m) + endian16(dirItem->n));
-							else
-								break;
+							printf("DIR_ITEM parent: 0x%I64x hash: 0x%08I64x child: 0x%I64x -> '%.*s'\n",
+								endian64(item->key.objectID), endian64(item->key.offset),
+								endian64(chain.get()->child.objectID), (int)chain.nameLen(), chain.name());
 						}
 
 						break;
 					}
 					case TYPE_ROOT_ITEM:
 					{
-						BtrfsRootItem *rootItem = (BtrfsRootItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
+						const BtrfsRootItem *rootItem = leaf.data<BtrfsRootItem>(i);
 
 						printf("  [%02x] ROOT_ITEM 0x%I64x -> 0x%I64x\n", i, endian64(item->key.objectID),
 							endian64(rootItem->rootNodeBlockNum));
@@ -120,32 +155,19 @@ namespace WinBtrfsLib
 					}
 					case TYPE_ROOT_BACKREF:
 					{
-						BtrfsRootBackref *rootBackref = (BtrfsRootBackref *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-						size_t len = endian16(rootBackref->n);
-						char *name = new char[len + 1];
-
-						memcpy(name, rootBackref->name, len);
-						name[len] = 0;
+						const BtrfsRootBackref *rootBackref = leaf.data<BtrfsRootBackref>(i);
 					
-						printf("  [%02x] ROOT_BACKREF subtree: 0x%I64x -> '%s' tree: 0x%I64x\n", i,
-							endian64(item->key.objectID), name, endian64(item->key.offset));
-
-						delete[] name;
+						printf("  [%02x] ROOT_BACKREF subtree: 0x%I64x -> '%.*s' tree: 0x%I64x\n", i,
+							endian64(item->key.objectID), (int)endian16(rootBackref->n), rootBackref->name,
+							endian64(item->key.offset));
 						break;
 					}
 					case TYPE_ROOT_REF:
 					{
-						BtrfsRootRef *rootRef = (BtrfsRootRef *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-						size_t len = endian16(rootRef->n);
-						char *name = new char[len + 1];
-
-						memcpy(name, rootRef->name, len);
-						name[len] = 0;
+						const BtrfsRootRef *rootRef = leaf.data<BtrfsRootRef>(i);
 					
-						printf("  [%02x] ROOT_REF tree: 0x%I64x subtree: 0x%I64x -> '%s'\n", i,
-							endian64(item->key.objectID), endian64(item->key.offset), name);
-
-						delete[] name;
+						printf("  [%02x] ROOT_REF tree: 0x%I64x subtree: 0x%I64x -> '%.*s'\n", i,
+							endian64(item->key.objectID), endian64(item->key.offset), (int)endian16(rootRef->n), rootRef->name);
 						break;
 					}
 					default:
@@ -154,67 +176,41 @@ namespace WinBtrfsLib
 						break;
 					}
 				}
-				else if (operation == RTOP_DEFAULT_SUBVOL)
+				else if (operation == RTOP_BUILD_INDEX)
 				{
-					if (item->key.type == TYPE_DIR_ITEM && endian64(item->key.objectID) == supers[0].rootDirObjectID)
+					if (item->key.type == TYPE_ROOT_ITEM)
 					{
-						BtrfsDirItem *dirItem = (BtrfsDirItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-					
-						mountedSubvol = (BtrfsObjID)endian64(dirItem->child.objectID);
+						const BtrfsRootItem *rootItem = leaf.data<BtrfsRootItem>(i);
+						RootInfo info;
 
-						*returnCode = 0;
-						*shortCircuit = true;
-					}
-				}
-				else if (operation == RTOP_GET_SUBVOL_ID)
-				{
-					const char *name = (const char *)input0;
-					BtrfsObjID *subvolID = (BtrfsObjID *)output0;
-
-					if (item->key.type == TYPE_ROOT_BACKREF)
-					{
-						BtrfsRootBackref *rootBackref = (BtrfsRootBackref *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
-					
-						/* ideally, we would go back up the tree at this point and see if the chain of ROOT_REFs/ROOT_BACKREFs
-							leads back to the FS tree; however, this is awkward, and currently, subtrees appear to only occur
-							in the case of subvolumes, so it currently seems safe to assume that ANY subtree will be a valid subvolume.
-							it's conceivable that in the future, other ROOT_REF'd subtrees might exist for other things,
-							but for now, this solution seems fine */
-					
-						if (strlen(name) == endian16(rootBackref->n) && strncmp(name, rootBackref->name, endian16(rootBackref->n)) == 0)
-						{
-							*subvolID = (BtrfsObjID)endian64(item->key.objectID);
+						info.addr = endian64(rootItem->rootNodeBlockNum);
+						info.level = rootItem->rootLevel;
+						info.generation = endian64(rootItem->expectedGeneration);
+						info.subvol = false;
 
-							*returnCode = 0;
-							*shortCircuit = true;
-						}
+						/* the first ROOT_ITEM for a tree is the one the keyed lookups always found */
+						rootIndex.insert(std::make_pair(endian64(item->key.objectID), info));
 					}
-				}
-				else if (operation == RTOP_SUBVOL_EXISTS)
-				{
-					const BtrfsObjID *subvolID = (const BtrfsObjID *)input0;
-					bool *exists = (bool *)output0;
-
-					if (item->key.type == TYPE_ROOT_BACKREF && endian64(item->key.offset) == *subvolID)
+					else if (item->key.type == TYPE_ROOT_BACKREF)
 					{
-						*exists = true;
+						const BtrfsRootBackref *rootBackref = leaf.data<BtrfsRootBackref>(i);
+						unsigned short nameLen = endian16(rootBackref->n);
+						char *name;
 
-						*shortCircuit = true;
-					}
-				}
-				else if (operation == RTOP_GET_ADDR)
-				{
-					const BtrfsObjID *treeID = (const BtrfsObjID *)input0;
-					LogiAddr *rootAddr = (unsigned __int64 *)output0;
+						assert(leaf.dataSize(i) >= sizeof(BtrfsRootBackref) + nameLen);
 
-					if (item->key.type == TYPE_ROOT_ITEM && endian64(item->key.objectID) == *treeID)
-					{
-						BtrfsRootItem *rootItem = (BtrfsRootItem *)(nodeBlock + sizeof(BtrfsHeader) + endian32(item->offset));
+						/* a tree's ROOT_ITEM sorts before its backrefs, so it's already in the index */
+						RootIndex::iterator it = rootIndex.find(endian64(item->key.objectID));
+						if (it != rootIndex.end())
+							it->second.subvol = true;
 
-						*rootAddr = endian64(rootItem->rootNodeBlockNum);
+						name = (char *)rootNameArena.allocate(nameLen + 1);
+						memcpy(name, rootBackref->name, nameLen);
+						name[nameLen] = '\0';
 
-						*returnCode = 0;
-						*shortCircuit = true;
+						/* two subvolumes in different directories can share a name; the first one wins, as it did
+							when this was a scan */
+						subvolNames.insert(std::make_pair(name, (BtrfsObjID)endian64(item->key.objectID)));
 					}
 				}
 				else if (operation == RTOP_DUMP_SUBVOLS)
@@ -230,17 +226,17 @@ namespace WinBtrfsLib
 
 				if (*shortCircuit)
 					break;
-
-				nodePtr += sizeof(BtrfsItem);
 			}
 		}
 		else // non-leaf node
 		{
+			KeyPtrView keyPtrs(nodeBlock);
+
 			if (operation == RTOP_DUMP_TREE)
 			{
-				for (unsigned int i = 0; i < endian32(header->nrItems); i++)
+				for (unsigned int i = 0; i < keyPtrs.size(); i++)
 				{
-					BtrfsKeyPtr *keyPtr = (BtrfsKeyPtr *)(nodePtr + (sizeof(BtrfsKeyPtr) * i));
+					const BtrfsKeyPtr *keyPtr = keyPtrs.keyPtr(i);
 
 					printf("  [%02x] {%I64x|%I64x} KeyPtr: block 0x%016I64x generation 0x%016I64x\n",
 						i, endian64(keyPtr->key.objectID), endian64(keyPtr->key.offset),
@@ -248,22 +244,116 @@ namespace WinBtrfsLib
 				}
 			}
 
-			for (unsigned int i = 0; i < endian32(header->nrItems); i++)
-			{
-				BtrfsKeyPtr *keyPtr = (BtrfsKeyPtr *)nodePtr;
+			/* these visit every child, so read them all in one batch first; this is one batch per internal node,
+				not one read per node, but the whole tree still gets read */
+			if (operation == RTOP_DUMP_TREE || operation == RTOP_DUMP_SUBVOLS || operation == RTOP_BUILD_INDEX)
+				prefetchChildren(nodeBlock);
 
+			for (unsigned int i = 0; i < keyPtrs.size(); i++)
+			{
 				/* recurse down one level of the tree */
-				parseRootTreeRec(endian64(keyPtr->blockNum), operation, input0, output0,
+				parseRootTreeRec(endian64(keyPtrs.keyPtr(i)->blockNum), operation, input0, output0,
 					returnCode, shortCircuit);
 
 				if (*shortCircuit)
 					break;
+			}
+		}
+
+		releaseNode(nodeBlock);
+	}
+
+	/* answers the lookups that the index covers */
+	int lookupRootIndex(RTOperation operation, void *input0, void *output0)
+	{
+		switch (operation)
+		{
+		case RTOP_GET_SUBVOL_ID:
+		{
+			const char *name = (const char *)input0;
+			BtrfsObjID *subvolID = (BtrfsObjID *)output0;
+
+			/* ideally, we would go back up the tree at this point and see if the chain of ROOT_REFs/ROOT_BACKREFs
+				leads back to the FS tree; however, this is awkward, and currently, subtrees appear to only occur
+				in the case of subvolumes, so it currently seems safe to assume that ANY subtree will be a valid subvolume.
+				it's conceivable that in the future, other ROOT_REF'd subtrees might exist for other things,
+				but for now, this solution seems fine */
+			SubvolNames::const_iterator it = subvolNames.find(name);
+			if (it == subvolNames.end())
+				return 0x1;
+
+			*subvolID = it->second;
+			return 0;
+		}
+		case RTOP_SUBVOL_EXISTS:
+		{
+			const BtrfsObjID *subvolID = (const BtrfsObjID *)input0;
+			bool *exists = (bool *)output0;
+
+			/* the top-level tree (ID 0 is shorthand for it) has no backref; every other subvolume does, until
+				it's deleted */
+			if (*subvolID == (BtrfsObjID)0 || *subvolID == OBJID_FS_TREE)
+				*exists = (findRoot(OBJID_FS_TREE) != NULL);
+			else
+				*exists = (findRoot(*subvolID) != NULL && findRoot(*subvolID)->subvol);
+
+			return 0;
+		}
+		case RTOP_GET_ADDR:
+		{
+			const RootInfo *root = findRoot(*(const BtrfsObjID *)input0);
+
+			if (root == NULL)
+				return 0x1;
+
+			*(LogiAddr *)output0 = root->addr;
+			return 0;
+		}
+		default:
+			printf("lookupRootIndex: unknown operation (0x%02x)!\n", operation);
+			return 0x1;
+		}
+	}
+
+	/* the default subvolume is found by key, which only needs the nodes on the path down to it */
+	int searchRootTree(RTOperation operation, void *input0, void *output0)
+	{
+		LogiAddr rootAddr = endian64(supers[0].rtRoot);
+		TreeCursor cursor;
+		BtrfsDiskKey key;
+		int returnCode = 0x1;
+
+		memset(&cursor, 0, sizeof(TreeCursor));
+
+		switch (operation)
+		{
+		case RTOP_DEFAULT_SUBVOL:
+		{
+			/* the first DIR_ITEM of the root tree's directory names the default subvolume */
+			key.objectID = (BtrfsObjID)endian64(supers[0].rootDirObjectID);
+			key.type = TYPE_DIR_ITEM;
+			key.offset = 0;
+
+			if (searchTree(rootAddr, &key, &cursor) && cursorItem(&cursor)->key.objectID == key.objectID &&
+				cursorItem(&cursor)->key.type == TYPE_DIR_ITEM)
+			{
+				DirItemChain chain(cursorData(&cursor), cursorDataSize(&cursor));
 
-				nodePtr += sizeof(BtrfsKeyPtr);
+				if (!chain.done())
+				{
+					mountedSubvol = (BtrfsObjID)endian64(chain.get()->child.objectID);
+					returnCode = 0;
+				}
 			}
+			break;
 		}
+		default:
+			printf("searchRootTree: unknown operation (0x%02x)!\n", operation);
+		}
+
+		releaseCursor(&cursor);
 
-		free(nodeBlock);
+		return returnCode;
 	}
 
 	int parseRootTree(RTOperation operation, void *input0, void *output0)
@@ -273,22 +363,20 @@ namespace WinBtrfsLib
 	
 		switch (operation)
 		{
+		case RTOP_DEFAULT_SUBVOL:
+			return searchRootTree(operation, input0, output0);
+		case RTOP_GET_SUBVOL_ID:
+		case RTOP_SUBVOL_EXISTS:
+		case RTOP_GET_ADDR:
+			return lookupRootIndex(operation, input0, output0);
 		case RTOP_DUMP_TREE:		// always succeeds
-		case RTOP_SUBVOL_EXISTS:	// always succeeds
 		case RTOP_DUMP_SUBVOLS:		// always succeeds
+		case RTOP_BUILD_INDEX:		// always succeeds
 			returnCode = 0;
 			break;
 		default:
 			returnCode = 0x1;	// 1 bit = 1 part MUST be fulfilled
 		}
-
-		if (operation == RTOP_SUBVOL_EXISTS)
-		{
-			bool *exists = (bool *)output0;
-
-			/* default to nonexistence */
-			*exists = false;
-		}
 	
 		parseRootTreeRec(endian64(supers[0].rtRoot), operation, input0, output0,
 			&returnCode, &shortCircuit);
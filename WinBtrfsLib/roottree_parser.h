@@ -12,7 +12,23 @@
 
 #include "types.h"
 
+#ifndef WINBTRFSLIB_ROOTTREE_PARSER_H
+#define WINBTRFSLIB_ROOTTREE_PARSER_H
+
 namespace WinBtrfsLib
 {
+	/* where a tree's root node is, according to its ROOT_ITEM */
+	struct RootInfo
+	{
+		LogiAddr				addr;
+		unsigned char			level;
+		unsigned __int64		generation;
+		bool					subvol;		// has a ROOT_BACKREF, i.e. some other tree links to it
+	};
+
+	unsigned int buildRootIndex();
+	const RootInfo *findRoot(BtrfsObjID tree);
 	int parseRootTree(RTOperation operation, void *input0, void *output0);
 }
+
+#endif
@@ -0,0 +1,678 @@
+/* WinBtrfsLib/trace.cpp
+ * leveled per-thread tracing with a background drain
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "trace.h"
+#include <cassert>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+namespace WinBtrfsLib
+{
+	/* a power of two, so the ring positions can wrap freely; at 256 bytes a record, 256 KiB per thread */
+	const unsigned int TRACE_RING_SIZE = 1024;
+	const unsigned int TRACE_MAX_ARGS = 8;
+	const size_t TRACE_STRING_SIZE = 160;
+
+	/* the longest message the drain will format; anything past it is cut off */
+	const size_t TRACE_MESSAGE_SIZE = 512;
+
+	/* how often the drain wakes up; a ring fills only if its thread traces faster than this drains it */
+	const DWORD TRACE_DRAIN_INTERVAL = 100;
+
+	/* the message isn't formatted until the drain gets to it, so the record keeps the format, which TRACE
+		only ever passes as a literal, and the raw arguments. strings can't be kept by pointer, since they're
+		usually gone by then, so they're copied into strings and their arguments hold offsets into it */
+	struct TraceRecord
+	{
+		LONGLONG				ticks;		// QueryPerformanceCounter
+		const char				*name;
+		const char				*format;	// NULL for a span's begin and end
+		unsigned char			category;
+		unsigned char			level;
+		char					phase;
+		unsigned char			numArgs;
+		unsigned __int64		args		[TRACE_MAX_ARGS];
+		char					strings		[TRACE_STRING_SIZE];
+	};
+
+	/* how a conversion's argument is passed, which is all the capture and the formatting need to agree on */
+	enum TraceArgType
+	{
+		TRACE_ARG_INT,
+		TRACE_ARG_INT64,
+		TRACE_ARG_DOUBLE,
+		TRACE_ARG_POINTER,
+		TRACE_ARG_STRING,
+		TRACE_ARG_WSTRING,
+		TRACE_ARG_BAD		// something this doesn't understand; the rest of the format is left as it is
+	};
+
+	struct TraceConversion
+	{
+		const char				*start;		// the '%'
+		const char				*end;		// just past the conversion character
+		int						numStars;	// '*' widths and precisions, each an int argument ahead of the value
+		TraceArgType			type;
+	};
+
+	/* written only by its own thread and read only by the drain, so the two positions are all the
+		synchronization there is: a record is filled in before head moves past it, and isn't reused until
+		tail has. once the thread exits, the drain empties the ring one last time and frees it */
+	struct TraceRing
+	{
+		volatile unsigned int	head;		// next record the thread will write
+		volatile unsigned int	tail;		// next record the drain will read
+		DWORD					threadID;
+		volatile LONGLONG		dropped;
+		volatile LONG			retired;	// the thread has exited, so head won't move again
+		TraceRing				*next;		// threads push at the front; only the drain unlinks
+		TraceRecord				records		[TRACE_RING_SIZE];
+	};
+
+	const char *const traceCategoryNames[] = { "dokan", "read", "disk", "meta" };
+
+	volatile LONG traceThreshold = TRACE_WARNING;
+	TraceLevel traceConsoleLevel = TRACE_WARNING;
+	volatile bool traceDraining = false;
+	TraceRing *volatile traceRings = NULL;
+	volatile DWORD flsTraceRingIdx = FLS_OUT_OF_INDEXES;
+	volatile LONGLONG traceThreads = 0;
+	unsigned __int64 traceEvents = 0, traceDropped = 0;
+	LONGLONG traceStartTicks = 0;
+	DWORD traceProcessID = 0;
+	double traceTicksPerMicrosecond = 0.0;
+	HANDLE traceThread = NULL, traceStop = NULL;
+	FILE *traceFile = NULL;
+	bool traceFirstEvent = true;
+
+	/* MSVC's __FUNCTION__ includes the namespace */
+	static const char *shortName(const char *name)
+	{
+		const char *colon = strrchr(name, ':');
+
+		return (colon != NULL ? colon + 1 : name);
+	}
+
+	/* the drain can't free a ring that may still have records in it, so this only hands it over */
+	static void WINAPI retireThreadRing(PVOID ring)
+	{
+		InterlockedExchange(&((TraceRing *)ring)->retired, 1);
+	}
+
+	/* thread pool threads trace too, and they come and go over a long mount, so the ring is in fiber local
+		storage rather than TLS: its destructor callback retires it when the thread exits */
+	static TraceRing *getThreadRing()
+	{
+		TraceRing *ring;
+
+		if (flsTraceRingIdx == FLS_OUT_OF_INDEXES)
+		{
+			DWORD idx = FlsAlloc(&retireThreadRing);
+			assert(idx != FLS_OUT_OF_INDEXES);
+
+			/* another thread may have gotten here first */
+			if (InterlockedCompareExchange((volatile LONG *)&flsTraceRingIdx, (LONG)idx, (LONG)FLS_OUT_OF_INDEXES) !=
+				(LONG)FLS_OUT_OF_INDEXES)
+				FlsFree(idx);
+		}
+
+		if ((ring = (TraceRing *)FlsGetValue(flsTraceRingIdx)) == NULL)
+		{
+			ring = (TraceRing *)malloc(sizeof(TraceRing));
+			assert(ring != NULL);
+
+			ring->head = ring->tail = 0;
+			ring->threadID = GetCurrentThreadId();
+			ring->dropped = 0;
+			ring->retired = 0;
+
+			/* the drain may be walking the list right now, so the ring has to be complete before it's linked in */
+			do
+				ring->next = traceRings;
+			while (InterlockedCompareExchangePointer((PVOID volatile *)&traceRings, ring, ring->next) != ring->next);
+
+			InterlockedIncrement64(&traceThreads);
+
+			FlsSetValue(flsTraceRingIdx, ring);
+		}
+
+		return ring;
+	}
+
+	/* finds the next conversion in format, skipping over "%%"; returns false at the end of the string */
+	static bool nextConversion(const char *format, TraceConversion *conv)
+	{
+		const char *p = format;
+
+		while ((p = strchr(p, '%')) != NULL && p[1] == '%')
+			p += 2;
+
+		if (p == NULL)
+			return false;
+
+		conv->start = p++;
+		conv->numStars = 0;
+
+		for ( ; *p != '\0' && strchr("-+ #0123456789.*", *p) != NULL; p++)
+		{
+			if (*p == '*')
+				conv->numStars++;
+		}
+
+		bool is64 = false, isLong = false;
+
+		if (p[0] == 'I' && p[1] == '6' && p[2] == '4')
+		{
+			is64 = true;
+			p += 3;
+		}
+		else if (p[0] == 'l' && p[1] == 'l')
+		{
+			is64 = true;
+			p += 2;
+		}
+		else if (*p == 'I' || *p == 'z')
+		{
+			is64 = (sizeof(size_t) == 8);
+			p++;
+		}
+		else if (*p == 'l')
+		{
+			is64 = (sizeof(long) == 8);
+			isLong = true;
+			p++;
+		}
+		else if (*p == 'h')
+		{
+			/* promoted to int anyway */
+			p += (p[1] == 'h' ? 2 : 1);
+		}
+
+		switch (*p)
+		{
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+		case 'C':
+			conv->type = (is64 ? TRACE_ARG_INT64 : TRACE_ARG_INT);
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			conv->type = TRACE_ARG_DOUBLE;
+			break;
+		case 'p':
+			conv->type = TRACE_ARG_POINTER;
+			break;
+		case 's':
+			conv->type = (isLong ? TRACE_ARG_WSTRING : TRACE_ARG_STRING);
+			break;
+		case 'S':
+			conv->type = TRACE_ARG_WSTRING;
+			break;
+		default:
+			conv->type = TRACE_ARG_BAD;
+			break;
+		}
+
+		conv->end = (*p != '\0' ? p + 1 : p);
+
+		return true;
+	}
+
+	/* copies a string argument into the record, cutting it short if the rest of strings won't hold it; returns
+		its offset there */
+	static size_t captureString(TraceRecord *record, size_t *used, const void *str, bool wide)
+	{
+		size_t charSize = (wide ? sizeof(wchar_t) : 1);
+		size_t offset = (*used + charSize - 1) / charSize * charSize, room, len = 0;
+
+		if (offset + charSize > TRACE_STRING_SIZE)
+		{
+			/* every record has a terminator at the very end to fall back on */
+			return TRACE_STRING_SIZE - sizeof(wchar_t);
+		}
+
+		room = (TRACE_STRING_SIZE - offset) / charSize - 1;
+
+		if (str == NULL)
+			str = (wide ? (const void *)L"(null)" : (const void *)"(null)");
+
+		if (wide)
+		{
+			const wchar_t *src = (const wchar_t *)str;
+			wchar_t *dest = (wchar_t *)(record->strings + offset);
+
+			for ( ; len < room && src[len] != L'\0'; len++)
+				dest[len] = src[len];
+
+			dest[len] = L'\0';
+		}
+		else
+		{
+			const char *src = (const char *)str;
+			char *dest = record->strings + offset;
+
+			for ( ; len < room && src[len] != '\0'; len++)
+				dest[len] = src[len];
+
+			dest[len] = '\0';
+		}
+
+		*used = offset + (len + 1) * charSize;
+
+		return offset;
+	}
+
+	/* takes the arguments off the list as format says to, without formatting any of them */
+	static void captureArgs(TraceRecord *record, const char *format, va_list args)
+	{
+		const char *p = format;
+		TraceConversion conv;
+		size_t used = 0;
+
+		record->numArgs = 0;
+		memset(record->strings + TRACE_STRING_SIZE - sizeof(wchar_t), 0, sizeof(wchar_t));
+
+		while (nextConversion(p, &conv) && conv.type != TRACE_ARG_BAD &&
+			record->numArgs + conv.numStars < TRACE_MAX_ARGS)
+		{
+			unsigned __int64 *arg = &record->args[record->numArgs];
+
+			for (int i = 0; i < conv.numStars; i++)
+				*arg++ = (unsigned __int64)(__int64)va_arg(args, int);
+
+			switch (conv.type)
+			{
+			case TRACE_ARG_INT:
+				*arg = va_arg(args, unsigned int);
+				break;
+			case TRACE_ARG_INT64:
+				*arg = va_arg(args, unsigned __int64);
+				break;
+			case TRACE_ARG_DOUBLE:
+			{
+				double value = va_arg(args, double);
+
+				memcpy(arg, &value, sizeof(value));
+				break;
+			}
+			case TRACE_ARG_POINTER:
+				*arg = (unsigned __int64)(size_t)va_arg(args, void *);
+				break;
+			case TRACE_ARG_STRING:
+				*arg = captureString(record, &used, va_arg(args, const char *), false);
+				break;
+			case TRACE_ARG_WSTRING:
+				*arg = captureString(record, &used, va_arg(args, const wchar_t *), true);
+				break;
+			}
+
+			record->numArgs += (unsigned char)(conv.numStars + 1);
+			p = conv.end;
+		}
+	}
+
+	/* the drain's half of traceWrite: the message, formatted one conversion at a time from the arguments it kept.
+		a conversion it couldn't keep the arguments for is left in as it was written */
+	static void formatMessage(const TraceRecord *record, char *message)
+	{
+		const char *p = record->format;
+		char *out = message, *outEnd = message + TRACE_MESSAGE_SIZE - 1;
+		unsigned int argIdx = 0;
+		TraceConversion conv;
+
+		while (out < outEnd && nextConversion(p, &conv))
+		{
+			char spec[32], *specOut = spec;
+			int written;
+
+			if (conv.type == TRACE_ARG_BAD || argIdx + conv.numStars >= record->numArgs ||
+				(size_t)(conv.end - conv.start) + 11 * conv.numStars >= sizeof(spec))
+				break;
+
+			/* the text before the conversion, with "%%" turned into '%' the way printf would */
+			for (const char *lit = p; lit < conv.start && out < outEnd; lit++)
+			{
+				*out++ = *lit;
+
+				if (*lit == '%')
+					lit++;
+			}
+
+			/* the '*'s become the numbers they stood for */
+			for (const char *c = conv.start; c < conv.end; c++)
+			{
+				if (*c == '*')
+					specOut += sprintf(specOut, "%d", (int)record->args[argIdx++]);
+				else
+					*specOut++ = *c;
+			}
+
+			*specOut = '\0';
+
+			unsigned __int64 arg = record->args[argIdx++];
+			size_t room = outEnd - out;
+
+			switch (conv.type)
+			{
+			case TRACE_ARG_INT:
+				written = _snprintf(out, room, spec, (unsigned int)arg);
+				break;
+			case TRACE_ARG_INT64:
+				written = _snprintf(out, room, spec, arg);
+				break;
+			case TRACE_ARG_DOUBLE:
+			{
+				double value;
+
+				memcpy(&value, &arg, sizeof(value));
+				written = _snprintf(out, room, spec, value);
+				break;
+			}
+			case TRACE_ARG_POINTER:
+				written = _snprintf(out, room, spec, (void *)(size_t)arg);
+				break;
+			case TRACE_ARG_STRING:
+				written = _snprintf(out, room, spec, record->strings + arg);
+				break;
+			default:
+				written = _snprintf(out, room, spec, (const wchar_t *)(record->strings + arg));
+				break;
+			}
+
+			/* _snprintf returns -1 and doesn't terminate if the output didn't fit; either way, the message is full */
+			out = (written < 0 || (size_t)written >= room ? outEnd : out + written);
+			p = conv.end;
+		}
+
+		/* whatever is left, which is plain text unless something above gave up early */
+		for ( ; *p != '\0' && out < outEnd; p++)
+		{
+			*out++ = *p;
+
+			if (*p == '%' && p[1] == '%')
+				p++;
+		}
+
+		*out = '\0';
+	}
+
+	static void writeJSONString(const char *str)
+	{
+		for ( ; *str != '\0'; str++)
+		{
+			if (*str == '"' || *str == '\\')
+				fprintf(traceFile, "\\%c", *str);
+			else if ((unsigned char)*str < 0x20)
+				fprintf(traceFile, "\\u%04x", (unsigned int)(unsigned char)*str);
+			else
+				fputc(*str, traceFile);
+		}
+	}
+
+	/* only ever called by the drain, or by stopTrace once the drain is gone */
+	static void emit(const TraceRing *ring, const TraceRecord *record)
+	{
+		const char *name = shortName(record->name);
+		char message[TRACE_MESSAGE_SIZE];
+
+		if (record->format != NULL)
+			formatMessage(record, message);
+		else
+			message[0] = '\0';
+
+		if (record->phase == TRACE_INSTANT && record->level <= traceConsoleLevel)
+			printf("%s: %s\n", name, message);
+
+		if (traceFile != NULL)
+		{
+			fprintf(traceFile, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u",
+				(traceFirstEvent ? "" : ",\n"), name, traceCategoryNames[record->category], record->phase,
+				(double)(record->ticks - traceStartTicks) / traceTicksPerMicrosecond,
+				(unsigned int)traceProcessID, (unsigned int)ring->threadID);
+
+			/* instant events are drawn across just their own thread */
+			if (record->phase == TRACE_INSTANT)
+				fprintf(traceFile, ",\"s\":\"t\"");
+
+			if (message[0] != '\0')
+			{
+				fprintf(traceFile, ",\"args\":{\"msg\":\"");
+				writeJSONString(message);
+				fprintf(traceFile, "\"}");
+			}
+
+			fprintf(traceFile, "}");
+			traceFirstEvent = false;
+		}
+
+		traceEvents++;
+	}
+
+	/* takes a retired ring out of the list, returning false if that has to wait for the next pass. threads only
+		ever change traceRings itself, so a ring further down can be unlinked from its predecessor directly, but
+		one at the front needs a compare-exchange against a thread pushing a new ring */
+	static bool unlinkRing(TraceRing *prev, TraceRing *ring)
+	{
+		if (prev != NULL)
+		{
+			prev->next = ring->next;
+			return true;
+		}
+
+		return InterlockedCompareExchangePointer((PVOID volatile *)&traceRings, ring->next, ring) == ring;
+	}
+
+	/* empties every ring, and frees the ones whose threads have exited; records from one thread come out in
+		order, but threads aren't interleaved with each other, which the trace viewer sorts out by timestamp
+		anyway */
+	static void drainRings()
+	{
+		TraceRing *prev = NULL, *next;
+
+		for (TraceRing *ring = traceRings; ring != NULL; ring = next)
+		{
+			/* checked before head is read, since only a retired ring's head is known not to move again */
+			bool retired = (ring->retired != 0);
+			unsigned int head, tail;
+
+			MemoryBarrier();
+			head = ring->head;
+
+			/* don't read any record before seeing that it's been published */
+			MemoryBarrier();
+
+			for (tail = ring->tail; tail != head; tail++)
+				emit(ring, &ring->records[tail % TRACE_RING_SIZE]);
+
+			/* don't let the thread reuse any record before it's been read */
+			MemoryBarrier();
+
+			ring->tail = tail;
+			next = ring->next;
+
+			if (retired && unlinkRing(prev, ring))
+			{
+				traceDropped += (unsigned __int64)ring->dropped;
+				free(ring);
+			}
+			else
+				prev = ring;
+		}
+
+		if (traceFile != NULL)
+			fflush(traceFile);
+	}
+
+	static DWORD WINAPI traceDrainer(LPVOID param)
+	{
+		while (WaitForSingleObject(traceStop, TRACE_DRAIN_INTERVAL) == WAIT_TIMEOUT)
+			drainRings();
+
+		return 0;
+	}
+
+	/* messages at or below level are traced; warnings and errors always go to the console as well, and with no
+		trace file, everything traced does. path may be NULL */
+	void setupTrace(const char *path, TraceLevel level)
+	{
+		LARGE_INTEGER freq, now;
+
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&now);
+
+		traceStartTicks = now.QuadPart;
+		traceProcessID = GetCurrentProcessId();
+		traceTicksPerMicrosecond = (double)freq.QuadPart / 1000000.0;
+
+		if (path != NULL)
+		{
+			if ((traceFile = fopen(path, "w")) != NULL)
+				fprintf(traceFile, "[\n");
+			else
+				printf("setupTrace: couldn't open '%s' for writing; tracing to the console only!\n", path);
+		}
+
+		traceConsoleLevel = (traceFile == NULL || level < TRACE_WARNING ? level : TRACE_WARNING);
+
+		traceStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+		assert(traceStop != NULL);
+
+		if ((traceThread = CreateThread(NULL, 0, &traceDrainer, NULL, 0, NULL)) == NULL)
+		{
+			printf("setupTrace: couldn't start the drain thread; tracing to the console only!\n");
+
+			CloseHandle(traceStop);
+			traceStop = NULL;
+
+			if (traceFile != NULL)
+			{
+				fclose(traceFile);
+				traceFile = NULL;
+			}
+
+			traceConsoleLevel = level;
+		}
+		else
+			traceDraining = true;
+
+		traceThreshold = level;
+	}
+
+	/* drains whatever is left and closes the trace file; anything traced after this goes straight to the
+		console */
+	void stopTrace()
+	{
+		if (!traceDraining)
+			return;
+
+		traceDraining = false;
+
+		SetEvent(traceStop);
+		WaitForSingleObject(traceThread, INFINITE);
+
+		CloseHandle(traceThread);
+		CloseHandle(traceStop);
+		traceThread = traceStop = NULL;
+
+		drainRings();
+
+		/* rings that were freed along the way had their drops counted then */
+		for (TraceRing *ring = traceRings; ring != NULL; ring = ring->next)
+			traceDropped += (unsigned __int64)ring->dropped;
+
+		if (traceFile != NULL)
+		{
+			fprintf(traceFile, "\n]\n");
+			fclose(traceFile);
+			traceFile = NULL;
+		}
+	}
+
+	void traceWrite(TraceCategory category, TraceLevel level, TracePhase phase, const char *name,
+		const char *format, ...)
+	{
+		LARGE_INTEGER now;
+		TraceRecord *record;
+		TraceRing *ring;
+		va_list args;
+
+		/* with nothing draining the rings, a message would sit there forever */
+		if (!traceDraining)
+		{
+			if (phase == TRACE_INSTANT && level <= traceConsoleLevel)
+			{
+				printf("%s: ", shortName(name));
+
+				va_start(args, format);
+				vprintf(format, args);
+				va_end(args);
+
+				printf("\n");
+			}
+
+			return;
+		}
+
+		ring = getThreadRing();
+
+		/* rather than wait on the drain, lose the record */
+		if (ring->head - ring->tail >= TRACE_RING_SIZE)
+		{
+			InterlockedIncrement64(&ring->dropped);
+			return;
+		}
+
+		QueryPerformanceCounter(&now);
+
+		record = &ring->records[ring->head % TRACE_RING_SIZE];
+		record->ticks = now.QuadPart;
+		record->name = name;
+		record->category = (unsigned char)category;
+		record->level = (unsigned char)level;
+		record->phase = (char)phase;
+		record->format = format;
+
+		/* formatting costs more than everything else here put together, so it's left to the drain */
+		if (format != NULL)
+		{
+			va_start(args, format);
+			captureArgs(record, format, args);
+			va_end(args);
+		}
+		else
+			record->numArgs = 0;
+
+		/* the drain mustn't see the new head before the record behind it */
+		MemoryBarrier();
+
+		ring->head = ring->head + 1;
+	}
+
+	/* only final after stopTrace */
+	void getTraceStats(TraceStats *stats)
+	{
+		stats->events = traceEvents;
+		stats->dropped = traceDropped;
+		stats->threads = (unsigned __int64)traceThreads;
+	}
+}
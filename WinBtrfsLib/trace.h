@@ -0,0 +1,105 @@
+/* WinBtrfsLib/trace.h
+ * leveled per-thread tracing with a background drain
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <Windows.h>
+
+#ifndef WINBTRFSLIB_TRACE_H
+#define WINBTRFSLIB_TRACE_H
+
+/* one bit per TraceCategory; a category left out of the mask compiles down to nothing, arguments and all
+	(e.g. /DTRACE_CATEGORIES=0x3 keeps only the Dokan callbacks and file data) */
+#ifndef TRACE_CATEGORIES
+#define TRACE_CATEGORIES 0xffffffff
+#endif
+
+/* records a printf-style message from the current function; the arguments are only evaluated if the category is
+	compiled in and the level is wanted. the message is formatted later by the drain, so the format has to be a
+	literal; only the first 8 arguments are kept, and %s and %S strings are copied, cut short if they're long */
+#define TRACE(category, level, ...) \
+	do \
+	{ \
+		if (WinBtrfsLib::traceWanted((category), (level))) \
+			WinBtrfsLib::traceWrite((category), (level), WinBtrfsLib::TRACE_INSTANT, __FUNCTION__, __VA_ARGS__); \
+	} while (0)
+
+namespace WinBtrfsLib
+{
+	enum TraceCategory
+	{
+		TRACE_DOKAN = 0,	// the Dokan callbacks themselves
+		TRACE_READ,			// file data: extents, decompression and checksums
+		TRACE_DISK,			// reads from the devices
+		TRACE_META			// metadata: nodes, trees and inodes
+	};
+
+	enum TraceLevel
+	{
+		TRACE_ERROR = 0,
+		TRACE_WARNING,
+		TRACE_INFO,			// phase timings
+		TRACE_DEBUG			// per-request chatter
+	};
+
+	/* these are the Chrome trace event phases */
+	enum TracePhase
+	{
+		TRACE_INSTANT = 'i',
+		TRACE_BEGIN = 'B',
+		TRACE_END = 'E'
+	};
+
+	struct TraceStats
+	{
+		unsigned __int64		events;		// records drained to the console or the trace file
+		unsigned __int64		dropped;	// records lost because a thread's ring was full
+		unsigned __int64		threads;	// threads that have traced anything
+	};
+
+	extern volatile LONG traceThreshold;
+
+	inline bool traceWanted(TraceCategory category, TraceLevel level)
+	{
+		return ((TRACE_CATEGORIES >> category) & 1) != 0 && (LONG)level <= traceThreshold;
+	}
+
+	void setupTrace(const char *path, TraceLevel level);
+	void stopTrace();
+	void traceWrite(TraceCategory category, TraceLevel level, TracePhase phase, const char *name,
+		const char *format, ...);
+	void getTraceStats(TraceStats *stats);
+
+	/* marks a phase of a request, from construction to destruction, as a span in the trace file. name has to
+		be a string that outlives the trace, like a literal or __FUNCTION__ */
+	class TraceScope
+	{
+	public:
+		TraceScope(TraceCategory category, const char *name)
+			: category(category), name(name), active(traceWanted(category, TRACE_INFO))
+		{
+			if (active)
+				traceWrite(category, TRACE_INFO, TRACE_BEGIN, name, NULL);
+		}
+
+		~TraceScope()
+		{
+			if (active)
+				traceWrite(category, TRACE_INFO, TRACE_END, name, NULL);
+		}
+
+	private:
+		TraceCategory			category;
+		const char				*name;
+		bool					active;
+	};
+}
+
+#endif
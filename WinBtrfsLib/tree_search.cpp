@@ -0,0 +1,322 @@
+/* WinBtrfsLib/tree_search.cpp
+ * keyed B-tree search and iteration
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "tree_search.h"
+#include <cassert>
+#include "btrfs_system.h"
+#include "endian.h"
+#include "node_view.h"
+
+namespace WinBtrfsLib
+{
+	/* orders keys the same way Btrfs sorts them on disk: by object ID, then type, then offset */
+	int compareKeys(const BtrfsDiskKey *a, const BtrfsDiskKey *b)
+	{
+		if (endian64(a->objectID) != endian64(b->objectID))
+			return (endian64(a->objectID) < endian64(b->objectID) ? -1 : 1);
+
+		if (a->type != b->type)
+			return (a->type < b->type ? -1 : 1);
+
+		if (endian64(a->offset) != endian64(b->offset))
+			return (endian64(a->offset) < endian64(b->offset) ? -1 : 1);
+
+		return 0;
+	}
+
+	/* index of the last key pointer whose key is <= the search key (or 0 if they're all greater) */
+	unsigned int searchInternal(const unsigned char *nodeBlock, unsigned int nrItems, const BtrfsDiskKey *key)
+	{
+		const BtrfsKeyPtr *keyPtrs = (const BtrfsKeyPtr *)(nodeBlock + sizeof(BtrfsHeader));
+		unsigned int lo = 0, hi = nrItems;
+
+		while (hi - lo > 1)
+		{
+			unsigned int mid = lo + (hi - lo) / 2;
+
+			if (compareKeys(&keyPtrs[mid].key, key) <= 0)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		return lo;
+	}
+
+	/* index of the first item whose key is >= the search key (or nrItems if they're all less) */
+	unsigned int searchLeaf(const unsigned char *nodeBlock, unsigned int nrItems, const BtrfsDiskKey *key)
+	{
+		const BtrfsItem *items = (const BtrfsItem *)(nodeBlock + sizeof(BtrfsHeader));
+		unsigned int lo = 0, hi = nrItems;
+
+		while (lo < hi)
+		{
+			unsigned int mid = lo + (hi - lo) / 2;
+
+			if (compareKeys(&items[mid].key, key) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return lo;
+	}
+
+	unsigned int nodeNrItems(const unsigned char *nodeBlock)
+	{
+		return endian32(((const BtrfsHeader *)nodeBlock)->nrItems);
+	}
+
+	/* loads the leftmost path beneath the key pointer at cursor->slots[level]; returns false if a node on it
+		couldn't be loaded */
+	bool descendLeftmost(TreeCursor *cursor, int level)
+	{
+		for ( ; level > 0; level--)
+		{
+			const BtrfsKeyPtr *keyPtr = (const BtrfsKeyPtr *)(cursor->nodes[level] + sizeof(BtrfsHeader)) +
+				cursor->slots[level];
+			BtrfsHeader *header;
+
+			if (cursor->nodes[level - 1] != NULL)
+				releaseNode(cursor->nodes[level - 1]);
+
+			cursor->nodes[level - 1] = loadNode(endian64(keyPtr->blockNum), &header);
+			cursor->slots[level - 1] = 0;
+
+			/* a child at the wrong level would be read as the wrong kind of node */
+			if (cursor->nodes[level - 1] == NULL || header->level != level - 1)
+				return false;
+		}
+
+		return true;
+	}
+
+	/* walks from the root down to the one leaf that could contain the key, leaving the cursor on that path with
+		the leaf slot unset; returns false, with the cursor invalid, if a node on the path couldn't be loaded */
+	bool descendToLeaf(LogiAddr rootAddr, const BtrfsDiskKey *key, TreeCursor *cursor)
+	{
+		BtrfsHeader *header;
+		unsigned char *nodeBlock = loadNode(rootAddr, &header);
+		int level;
+
+		memset(cursor, 0, sizeof(TreeCursor));
+
+		if (nodeBlock == NULL)
+			return false;
+
+		level = header->level;
+		assert(level < MAX_TREE_LEVELS);
+
+		cursor->numLevels = level + 1;
+		cursor->nodes[level] = nodeBlock;
+
+		/* binary search each internal node for the one child that could contain the key */
+		for ( ; level > 0; level--)
+		{
+			cursor->slots[level] = searchInternal(cursor->nodes[level], nodeNrItems(cursor->nodes[level]), key);
+
+			const BtrfsKeyPtr *keyPtr = (const BtrfsKeyPtr *)(cursor->nodes[level] + sizeof(BtrfsHeader)) +
+				cursor->slots[level];
+
+			cursor->nodes[level - 1] = loadNode(endian64(keyPtr->blockNum), &header);
+
+			/* a child at the wrong level would be read as the wrong kind of node */
+			if (cursor->nodes[level - 1] == NULL || header->level != level - 1)
+				return false;
+		}
+
+		return true;
+	}
+
+	/* positions the cursor at the first item whose key is >= the given key; returns false (and leaves the
+		cursor invalid) if there is no such item, or if a node on the way to it couldn't be read. the cursor must
+		be released either way. */
+	bool searchTree(LogiAddr rootAddr, const BtrfsDiskKey *key, TreeCursor *cursor)
+	{
+		if (!descendToLeaf(rootAddr, key, cursor))
+			return false;
+
+		cursor->slots[0] = searchLeaf(cursor->nodes[0], nodeNrItems(cursor->nodes[0]), key);
+		cursor->valid = true;
+
+		/* the key may be greater than everything in this leaf, in which case the answer is in the next one */
+		if (cursor->slots[0] >= nodeNrItems(cursor->nodes[0]))
+		{
+			cursor->slots[0]--; // cursorAdvance will increment it again
+			if (nodeNrItems(cursor->nodes[0]) == 0)
+				cursor->valid = false;
+			else
+				return cursorAdvance(cursor, false);
+		}
+
+		return cursor->valid;
+	}
+
+	/* positions the cursor at the last item whose key is <= the given key, for items that cover a range
+		starting at their key; returns false (and leaves the cursor invalid) if every key in the tree is greater,
+		or if a node on the way couldn't be read. the cursor must be released either way. */
+	bool searchTreeAtOrBefore(LogiAddr rootAddr, const BtrfsDiskKey *key, TreeCursor *cursor)
+	{
+		unsigned int nrItems, slot;
+
+		if (!descendToLeaf(rootAddr, key, cursor))
+			return false;
+
+		nrItems = nodeNrItems(cursor->nodes[0]);
+		slot = searchLeaf(cursor->nodes[0], nrItems, key);
+
+		/* the leaf was picked by the last key pointer <= the key, so its first item is <= the key too, unless
+			there was no such key pointer and the leftmost leaf was taken for lack of one */
+		if (slot < nrItems && compareKeys(&((const BtrfsItem *)(cursor->nodes[0] + sizeof(BtrfsHeader)))[slot].key,
+			key) == 0)
+			cursor->valid = true;
+		else if (slot > 0)
+		{
+			slot--;
+			cursor->valid = true;
+		}
+
+		cursor->slots[0] = slot;
+
+		return cursor->valid;
+	}
+
+	/* how many leaves ahead of a scanning cursor to read in the background */
+	const unsigned int SCAN_PREFETCH_LEAVES = 8;
+
+	/* called when a cursor steps onto a new leaf; once less than half of the leaves queued for it last time
+		are left ahead of it, queues the next few siblings under the same parent */
+	void prefetchSiblings(TreeCursor *cursor)
+	{
+		const unsigned char *parent;
+		const BtrfsKeyPtr *keyPtrs;
+		LogiAddr addrs[SCAN_PREFETCH_LEAVES];
+		unsigned int slot, nrItems, start, numAddrs = 0;
+
+		if (cursor->numLevels < 2)
+			return;
+
+		parent = cursor->nodes[1];
+		keyPtrs = (const BtrfsKeyPtr *)(parent + sizeof(BtrfsHeader));
+		slot = cursor->slots[1];
+		nrItems = nodeNrItems(parent);
+
+		if (parent != cursor->prefetchParent)
+		{
+			cursor->prefetchParent = parent;
+			cursor->prefetchedTo = slot + 1;
+		}
+
+		if (cursor->prefetchedTo > slot + SCAN_PREFETCH_LEAVES / 2)
+			return;
+
+		start = (cursor->prefetchedTo > slot + 1 ? cursor->prefetchedTo : slot + 1);
+
+		for (unsigned int i = start; i < nrItems && i < slot + 1 + SCAN_PREFETCH_LEAVES; i++)
+			addrs[numAddrs++] = endian64(keyPtrs[i].blockNum);
+
+		cursor->prefetchedTo = start + numAddrs;
+
+		prefetchNodesAsync(addrs, numAddrs);
+	}
+
+	/* steps to the next item, prefetching the leaves ahead only if the cursor is scanning rather than finishing
+		a point lookup whose key sorted after everything in its leaf */
+	bool cursorAdvance(TreeCursor *cursor, bool scanning)
+	{
+		if (!cursor->valid)
+			return false;
+
+		if (++cursor->slots[0] < nodeNrItems(cursor->nodes[0]))
+			return true;
+
+		/* climb until some ancestor has a sibling to the right, then go down its leftmost path */
+		for (int level = 1; level < cursor->numLevels; level++)
+		{
+			if (++cursor->slots[level] < nodeNrItems(cursor->nodes[level]))
+			{
+				/* an unreadable node ends the iteration the same way the end of the tree does */
+				if (!descendLeftmost(cursor, level))
+					break;
+				if (scanning)
+					prefetchSiblings(cursor);
+				return true;
+			}
+		}
+
+		cursor->valid = false;
+		return false;
+	}
+
+	/* advances to the next item in key order; returns false at the end of the tree */
+	bool cursorNext(TreeCursor *cursor)
+	{
+		return cursorAdvance(cursor, true);
+	}
+
+	/* moves the cursor forward to the first item whose key is >= the given key, like searchTree, but stays in the
+		current leaf when the key falls within it; this makes a run of seeks to ascending keys touch each leaf
+		only once. the cursor must either have come from searchTree (valid or not) or be zero-filled */
+	bool cursorSeek(LogiAddr rootAddr, const BtrfsDiskKey *key, TreeCursor *cursor)
+	{
+		if (cursor->valid)
+		{
+			unsigned int nrItems = nodeNrItems(cursor->nodes[0]);
+			const BtrfsItem *items = (const BtrfsItem *)(cursor->nodes[0] + sizeof(BtrfsHeader));
+
+			/* seeks never go backwards */
+			if (compareKeys(&items[cursor->slots[0]].key, key) >= 0)
+				return true;
+
+			if (compareKeys(&items[nrItems - 1].key, key) >= 0)
+			{
+				cursor->slots[0] = searchLeaf(cursor->nodes[0], nrItems, key);
+				return true;
+			}
+		}
+
+		releaseCursor(cursor);
+
+		return searchTree(rootAddr, key, cursor);
+	}
+
+	/* the item under the cursor and its data point into the pinned leaf, so they're good until the cursor moves */
+	const BtrfsItem *cursorItem(const TreeCursor *cursor)
+	{
+		assert(cursor->valid);
+
+		return LeafView(cursor->nodes[0]).item(cursor->slots[0]);
+	}
+
+	const unsigned char *cursorData(const TreeCursor *cursor)
+	{
+		assert(cursor->valid);
+
+		return LeafView(cursor->nodes[0]).rawData(cursor->slots[0]);
+	}
+
+	unsigned int cursorDataSize(const TreeCursor *cursor)
+	{
+		return endian32(cursorItem(cursor)->size);
+	}
+
+	void releaseCursor(TreeCursor *cursor)
+	{
+		for (int level = 0; level < cursor->numLevels; level++)
+		{
+			if (cursor->nodes[level] != NULL)
+				releaseNode(cursor->nodes[level]);
+		}
+
+		memset(cursor, 0, sizeof(TreeCursor));
+	}
+}
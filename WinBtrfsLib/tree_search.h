@@ -0,0 +1,47 @@
+/* WinBtrfsLib/tree_search.h
+ * keyed B-tree search and iteration
+ *
+ * WinBtrfs
+ * Copyright (c) 2011 Justin Gottula
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include "types.h"
+
+#ifndef WINBTRFSLIB_TREE_SEARCH_H
+#define WINBTRFSLIB_TREE_SEARCH_H
+
+namespace WinBtrfsLib
+{
+	/* Btrfs never builds trees deeper than this */
+	const int MAX_TREE_LEVELS = 8;
+
+	/* a position within a tree; every node on the path from the root to the current leaf stays pinned in the
+		node cache until the cursor is released */
+	struct TreeCursor
+	{
+		unsigned char			*nodes[MAX_TREE_LEVELS];	// [0] is the leaf
+		unsigned int			slots[MAX_TREE_LEVELS];
+		int						numLevels;
+		bool					valid;						// false once iteration runs off the end of the tree
+		const unsigned char		*prefetchParent;			// the leaves' parent when siblings were last prefetched
+		unsigned int			prefetchedTo;				// slot in that parent up to which they were
+	};
+
+	int compareKeys(const BtrfsDiskKey *a, const BtrfsDiskKey *b);
+	bool searchTree(LogiAddr rootAddr, const BtrfsDiskKey *key, TreeCursor *cursor);
+	bool searchTreeAtOrBefore(LogiAddr rootAddr, const BtrfsDiskKey *key, TreeCursor *cursor);
+	bool cursorNext(TreeCursor *cursor);
+	bool cursorAdvance(TreeCursor *cursor, bool scanning);
+	bool cursorSeek(LogiAddr rootAddr, const BtrfsDiskKey *key, TreeCursor *cursor);
+	const BtrfsItem *cursorItem(const TreeCursor *cursor);
+	const unsigned char *cursorData(const TreeCursor *cursor);
+	unsigned int cursorDataSize(const TreeCursor *cursor);
+	void releaseCursor(TreeCursor *cursor);
+}
+
+#endif
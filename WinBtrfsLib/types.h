@@ -13,8 +13,9 @@
 #ifndef WINBTRFSLIB_TYPES_H
 #define WINBTRFSLIB_TYPES_H
 
-/* pack structs the way they are on the disk */
-#pragma pack(1)
+/* pack structs the way they are on the disk; only the ones in here, though, since headers included after this
+	one (zlib's, for instance) have to lay their structs out the same way their own code does */
+#pragma pack(push, 1)
 
 namespace WinBtrfsLib
 {
@@ -88,7 +89,8 @@ namespace WinBtrfsLib
 	{
 		COMPRESSION_NONE = 0,
 		COMPRESSION_ZLIB = 1,
-		COMPRESSION_LZO = 2
+		COMPRESSION_LZO = 2,
+		COMPRESSION_ZSTD = 3
 	};
 
 	enum EncryptionType : unsigned char
@@ -104,7 +106,6 @@ namespace WinBtrfsLib
 	/* chunk tree operations */
 	enum CTOperation
 	{
-		CTOP_LOAD,
 		CTOP_DUMP_TREE
 	};
 
@@ -116,7 +117,8 @@ namespace WinBtrfsLib
 		RTOP_GET_SUBVOL_ID,
 		RTOP_SUBVOL_EXISTS,
 		RTOP_GET_ADDR,
-		RTOP_DUMP_SUBVOLS
+		RTOP_DUMP_SUBVOLS,
+		RTOP_BUILD_INDEX
 	};
 
 	/* FS tree operations */
@@ -126,7 +128,17 @@ namespace WinBtrfsLib
 		FSOP_DUMP_TREE,
 		FSOP_GET_FILE_PKG,
 		FSOP_DIR_LIST,
-		FSOP_GET_INODE
+		FSOP_GET_INODE,
+		FSOP_GET_EXTENT_MAP
+	};
+
+	/* what an ExtentMapping refers to */
+	enum ExtentKind : unsigned char
+	{
+		EXTENT_HOLE,			// no extent item, or a sparse extent: reads as zeroes
+		EXTENT_PREALLOC,		// allocated but never written: also reads as zeroes
+		EXTENT_INLINE,
+		EXTENT_REGULAR
 	};
 
 	/* ALL multibyte integers in Btrfs_____ structs WILL ALWAYS be little-endian!
@@ -376,8 +388,6 @@ namespace WinBtrfsLib
 		FileID					parentID;		// unused in dirlist functions
 		BtrfsInodeItem			inode;
 		BtrfsInodeItem			parentInode;	// unused in dirlist functions
-		size_t					numExtents;		// unused in dirlist functions
-		KeyedItem				*extents;		// unused in dirlist functions
 		char					name[256];
 		bool					hidden;
 	};
@@ -392,11 +402,41 @@ namespace WinBtrfsLib
 	{
 		unsigned __int64		offset;
 		unsigned __int64		len;
-		BtrfsChunkItem			chunkItem;
+		const BtrfsChunkItem	*chunkItem;		// borrowed from the chunk map; never free this
+	};
+
+	struct ChunkMapping
+	{
+		unsigned __int64		logiStart;
+		unsigned __int64		size;
+		const BtrfsChunkItem	*chunkItem;
 	};
 
 	typedef unsigned __int64 LogiAddr;
 
+	/* one contiguous piece of a file */
+	struct ExtentMapping
+	{
+		unsigned __int64		fileOffset;
+		unsigned __int64		length;			// bytes of the file covered by this piece
+		ExtentKind				kind;
+		CompressionType			compression;
+		unsigned __int64		decodedSize;	// size of the whole extent once decompressed
+		LogiAddr				diskAddr;		// regular only: where the (possibly compressed) extent lives
+		unsigned __int64		diskSize;		// regular only
+		unsigned __int64		decodedOffset;	// regular only: where this piece starts within the decoded extent
+		unsigned char			*inlineData;	// inline only: a (decoded) copy of the item's data, kept after the mappings
+		size_t					inlineSize;		// inline only
+	};
+
+	/* all of a file's extents sorted by offset, with holes filled in so that the pieces cover the file
+		from zero to its size without gaps */
+	struct ExtentMap
+	{
+		size_t					numExtents;
+		ExtentMapping			*extents;
+	};
+
 	/* size checks for on-disk types and structs */
 	static_assert(sizeof(BtrfsObjID) == sizeof(unsigned __int64), "BtrfsObjID has an unexpected size!");
 	static_assert(sizeof(BtrfsItemType) == sizeof(unsigned char), "BtrfsItemType has an unexpected size!");
@@ -426,4 +466,6 @@ namespace WinBtrfsLib
 	static_assert(sizeof(BtrfsSuperblock) == 0x1000, "BtrfsSuperblock has an unexpected size!");
 }
 
+#pragma pack(pop)
+
 #endif
@@ -17,6 +17,7 @@
 #include <dokan.h>
 #include "constants.h"
 #include "endian.h"
+#include "trace.h"
 
 namespace WinBtrfsLib
 {
@@ -39,7 +40,7 @@ namespace WinBtrfsLib
 		PWIN32_FIND_DATAW dirListData = (PWIN32_FIND_DATAW)output;
 
 		/* FILE_ATTRIBUTE_COMPRESSED, FILE_ATTRIBUTE_SPARSE_FILE, FILE_ATTRIBUTE_REPARSE_POINT (maybe) */
-		printf("convertMetadata: TODO: handle more attributes\n");
+		TRACE(TRACE_META, TRACE_DEBUG, "TODO: handle more attributes");
 
 		if (!dirList)
 		{
@@ -106,7 +107,7 @@ namespace WinBtrfsLib
 
 			/* reimplement the file index values so they are unique values among the currently-open[/cleanedup] files.
 				don't know quite how to do this yet, but treeID+objectID is 128 bits, definitely will not work for a 64-bit value. */
-			printf("convertMetadata: TODO: properly set file index values\n");
+			TRACE(TRACE_META, TRACE_DEBUG, "TODO: properly set file index values");
 			fileInfo->nFileIndexHigh = 0/*(DWORD)(endian64(it->objectID) << 32)*/;
 			fileInfo->nFileIndexLow = 0/*(DWORD)endian64(it->objectID)*/;
 		}